@@ -0,0 +1,563 @@
+#include "aot.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <dlfcn.h>
+#include <unistd.h>
+
+#include "compiler.hpp"
+#include "mapped_file.hpp"
+#include "token_cache.hpp"
+#include "util.hpp"
+#include "version.hpp"
+
+// Set by the build to the compiler and include flags the executable was built
+// with; FUNLANG_CXX overrides the compiler at run time.
+#ifndef FUNLANG_AOT_CXX
+#define FUNLANG_AOT_CXX "c++"
+#endif
+#ifndef FUNLANG_AOT_FLAGS
+#define FUNLANG_AOT_FLAGS ""
+#endif
+// likewise set to a hash of the headers generated code includes
+#ifndef FUNLANG_AOT_FINGERPRINT
+#define FUNLANG_AOT_FINGERPRINT ""
+#endif
+
+static constexpr uint32_t aot_format_version = 13;
+
+uint64_t
+aot_code_hash(const function_proto* proto)
+{
+    uint32_t shape[] = { (uint32_t)proto->arity,
+                         (uint32_t)proto->num_regs,
+                         (uint32_t)proto->constants.size(),
+                         (uint32_t)proto->protos.size() };
+    uint64_t hash = fnv1a64(reinterpret_cast<const char*>(shape), sizeof shape);
+    return fnv1a64(reinterpret_cast<const char*>(proto->code.data()),
+                   proto->code.size() * sizeof(instr),
+                   hash);
+}
+
+// top level function first, then the nested ones depth first
+static void
+collect_protos(function_proto* proto, std::vector<function_proto*>& out)
+{
+    out.push_back(proto);
+    for (function_proto* child : proto->protos) {
+        collect_protos(child, out);
+    }
+}
+
+// * Loading
+
+aot_module::aot_module(void* handle, const aot_entry* entries, size_t count)
+  : handle(handle)
+  , entries(entries)
+  , count(count)
+  , next(0)
+{
+}
+
+aot_module::~aot_module()
+{
+    dlclose(handle);
+}
+
+bool
+aot_module::attach(jit_compiler& jit, function_proto* proto)
+{
+    std::vector<function_proto*> protos;
+    collect_protos(proto, protos);
+
+    if (next + protos.size() > count) {
+        return false;
+    }
+    for (size_t n = 0; n < protos.size(); ++n) {
+        if (entries[next + n].code_hash != aot_code_hash(protos[n])) {
+            return false;
+        }
+    }
+    for (size_t n = 0; n < protos.size(); ++n) {
+        jit.install(protos[n], entries[next + n].fn);
+    }
+    next += protos.size();
+    return true;
+}
+
+// * Translation
+
+namespace {
+
+struct translator
+{
+    std::ostream& out;
+    const function_proto* proto;
+    std::string name;
+
+    void label(size_t pc) { out << "L" << pc << ":\n"; }
+
+    void line(const std::string& text) { out << "    " << text << "\n"; }
+
+    // instructions that may throw record where they are first
+    void mark(size_t pc) { line("*at = " + std::to_string(pc) + ";"); }
+
+    static std::string reg(int r) { return "R[" + std::to_string(r) + "]"; }
+
+    static std::string site(int n)
+    {
+        return "proto->sites[" + std::to_string(n) + "]";
+    }
+
+    void jump(size_t target, int offset, const std::string& indent)
+    {
+        if (offset < 0) {
+            line(indent + "aot_safepoint(vm);");
+        }
+        line(indent + "goto L" + std::to_string(target) + ";");
+    }
+
+    void arithmetic(size_t pc, instr i, const char* fn)
+    {
+        mark(pc);
+        line(reg(instr_a(i)) + " = " + fn + "(vm, " + reg(instr_b(i)) + ", " +
+             reg(instr_c(i)) + ");");
+    }
+
+    void predicate(size_t pc, instr i, const char* fn)
+    {
+        mark(pc);
+        line(reg(instr_a(i)) + " = value::boolean(" + fn + "(" +
+             reg(instr_b(i)) + ", " + reg(instr_c(i)) + "));");
+    }
+
+    // compare and jump on the result; the jump is the instruction after
+    void fused(size_t pc, instr i, const char* fn, bool jump_if)
+    {
+        instr second = proto->code[pc + 1];
+        int offset = instr_sbx(second);
+        mark(pc);
+        line("{");
+        line("    bool result = " + std::string(fn) + "(" + reg(instr_b(i)) +
+             ", " + reg(instr_c(i)) + ");");
+        line("    " + reg(instr_a(i)) + " = value::boolean(result);");
+        line(std::string("    if (") + (jump_if ? "" : "!") + "result) {");
+        jump(pc + 2 + offset, offset, "        ");
+        line("    }");
+        line("}");
+        line("goto L" + std::to_string(pc + 2) + ";");
+    }
+
+    void conditional(size_t pc, instr i, bool jump_if)
+    {
+        int offset = instr_sbx(i);
+        line(std::string("if (") + (jump_if ? "" : "!") + reg(instr_a(i)) +
+             ".truthy()) {");
+        jump(pc + 1 + offset, offset, "    ");
+        line("}");
+    }
+
+    void instruction(size_t pc)
+    {
+        instr i = proto->code[pc];
+        std::string ra = reg(instr_a(i));
+        switch (instr_op(i)) {
+            case op_move:
+                line(ra + " = " + reg(instr_b(i)) + ";");
+                break;
+            case op_loadk:
+                line(ra + " = K[" + std::to_string(instr_bx(i)) + "];");
+                break;
+            case op_loadi:
+                line(ra + " = value::fixnum(" + std::to_string(instr_sbx(i)) +
+                     ");");
+                break;
+            case op_loadnil:
+                line(ra + " = value::nil();");
+                break;
+            case op_loadtrue:
+                line(ra + " = value::boolean(true);");
+                break;
+            case op_loadfalse:
+                line(ra + " = value::boolean(false);");
+                break;
+            case op_getglobal:
+                mark(pc);
+                line(ra + " = aot_getglobal(K[" + std::to_string(instr_bx(i)) +
+                     "]);");
+                break;
+            case op_setglobal:
+                line("K[" + std::to_string(instr_bx(i)) +
+                     "].as<global_obj>()->item = " + ra + ";");
+                break;
+            case op_add:
+            case op_add_ii:
+            case op_add_dd:
+            case op_add_ss:
+                arithmetic(pc, i, "aot_add");
+                break;
+            case op_sub:
+            case op_sub_ii:
+            case op_sub_dd:
+                arithmetic(pc, i, "aot_sub");
+                break;
+            case op_mul:
+            case op_mul_ii:
+            case op_mul_dd:
+                arithmetic(pc, i, "aot_mul");
+                break;
+            case op_div:
+            case op_div_dd:
+                arithmetic(pc, i, "aot_div");
+                break;
+            case op_neg:
+                mark(pc);
+                line(ra + " = value_neg(vm.heap, " + reg(instr_b(i)) + ");");
+                break;
+            case op_eq:
+            case op_eq_ii:
+                predicate(pc, i, "aot_eq");
+                break;
+            case op_lt:
+            case op_lt_ii:
+            case op_lt_dd:
+                predicate(pc, i, "aot_lt");
+                break;
+            case op_le:
+            case op_le_ii:
+            case op_le_dd:
+                predicate(pc, i, "aot_le");
+                break;
+            case op_lnot:
+                line(ra + " = value::boolean(!" + reg(instr_b(i)) +
+                     ".truthy());");
+                break;
+            case op_check:
+                mark(pc);
+                line(ra + " = checked(" + reg(instr_b(i)) + ", " +
+                     std::to_string(instr_c(i)) + ");");
+                break;
+            case op_jmp:
+                jump(pc + 1 + instr_sbx(i), instr_sbx(i), "");
+                break;
+            case op_jmpif:
+                conditional(pc, i, true);
+                break;
+            case op_jmpifnot:
+                conditional(pc, i, false);
+                break;
+            case op_closure:
+                line(ra + " = aot_closure(vm, proto, " +
+                     std::to_string(instr_bx(i)) + ", R);");
+                break;
+            case op_getcap:
+                line(ra + " = vm.frames.back().closure->captures()[" +
+                     std::to_string(instr_b(i)) + "];");
+                break;
+            case op_box:
+                line(ra + " = aot_box(vm, " + reg(instr_b(i)) + ");");
+                break;
+            case op_getbox:
+                line(ra + " = " + reg(instr_b(i)) + ".as<box_obj>()->item;");
+                break;
+            case op_setbox:
+                line(ra + ".as<box_obj>()->item = " + reg(instr_b(i)) + ";");
+                break;
+            case op_getfield:
+                mark(pc);
+                line(ra + " = get_field(" + site(instr_c(i)) + ", " +
+                     reg(instr_b(i)) + ");");
+                break;
+            case op_setfield:
+                mark(pc);
+                line("set_field(" + site(instr_c(i)) + ", " + ra + ", " +
+                     reg(instr_b(i)) + ");");
+                break;
+            case op_getmethod:
+                mark(pc);
+                line(ra + " = get_method(" + site(instr_c(i)) + ", " +
+                     reg(instr_b(i)) + ");");
+                break;
+            case op_vec:
+            case op_map:
+            case op_set:
+                mark(pc);
+                line(ra + " = aot_" + opcode_names[instr_op(i)] + "(vm, R + " +
+                     std::to_string(instr_b(i)) + ", " +
+                     std::to_string(instr_c(i)) + ");");
+                break;
+            case op_lt_jmpif:
+                fused(pc, i, "aot_lt", true);
+                break;
+            case op_lt_jmpifnot:
+                fused(pc, i, "aot_lt", false);
+                break;
+            case op_le_jmpif:
+                fused(pc, i, "aot_le", true);
+                break;
+            case op_le_jmpifnot:
+                fused(pc, i, "aot_le", false);
+                break;
+            case op_eq_jmpif:
+                fused(pc, i, "aot_eq", true);
+                break;
+            case op_eq_jmpifnot:
+                fused(pc, i, "aot_eq", false);
+                break;
+            case op_move_call:
+                // the call after it exits
+                line(ra + " = " + reg(instr_b(i)) + ";");
+                break;
+            default:
+                // calls and returns run in the interpreter
+                line("return " + std::to_string(pc) + "u << 1;");
+                break;
+        }
+    }
+
+    void function()
+    {
+        size_t size = proto->code.size();
+        out << "// " << (proto->name.empty() ? "fn" : proto->name) << "\n"
+            << "static uint32_t\n"
+            << name
+            << "(vm& vm, function_proto* proto, value* R, uint32_t pc, "
+               "uint32_t* at)\n"
+            << "{\n";
+        line("const value* K = proto->constants.data();");
+        line("(void)K;");
+        line("switch (pc) {");
+        for (size_t pc = 0; pc <= size; ++pc) {
+            line("    case " + std::to_string(pc) + ": goto L" +
+                 std::to_string(pc) + ";");
+        }
+        line("    default: return pc << 1;");
+        line("}");
+        for (size_t pc = 0; pc < size; ++pc) {
+            label(pc);
+            instruction(pc);
+        }
+        label(size);
+        line("return " + std::to_string(size) + "u << 1;");
+        out << "}\n\n";
+    }
+};
+
+} // namespace
+
+void
+aot_translate(const std::string& name,
+              const std::string& source,
+              const aot_options& options,
+              std::ostream& out)
+{
+    // compiling needs a vm for prototypes and constants, but nothing runs
+    arena strings;
+    vm machine;
+    source_map lines{ name, source };
+    std::vector<function_proto*> protos;
+    parser reader{ &strings, lex_cached(nullptr, &strings, source) };
+    compiler comp{ &machine, &lines };
+    comp.optimize = options.optimize;
+    comp.superinstructions = options.superinstructions;
+    try {
+        while (form* f = reader.read()) {
+            collect_protos(comp.compile_toplevel(f), protos);
+        }
+    } catch (parse_error& e) {
+        // compile errors name their line already, the reader stopped at or
+        // just past the token it could not read
+        long filepos = 0;
+        if (!reader.tokens.empty()) {
+            size_t at = std::min(reader.pos, reader.tokens.size());
+            filepos = reader.tokens[at > 0 ? at - 1 : 0].filepos;
+        }
+        throw parse_error(name + ":" + std::to_string(lines.line_of(filepos)) +
+                          ": " + e.what());
+    }
+
+    out << "// compiled from " << name << " by funlang " << FUNLANG_VERSION
+        << ", do not edit\n\n"
+        << "#include \"aot.hpp\"\n\n";
+
+    for (size_t n = 0; n < protos.size(); ++n) {
+        translator{ out, protos[n], "f" + std::to_string(n) }.function();
+    }
+
+    out << "extern \"C\" const aot_entry funlang_aot_entries[] = {\n";
+    for (size_t n = 0; n < protos.size(); ++n) {
+        char hash[32];
+        snprintf(hash,
+                 sizeof hash,
+                 "0x%016llxull",
+                 (unsigned long long)aot_code_hash(protos[n]));
+        out << "    { " << hash << ", f" << n << " },\n";
+    }
+    // keeps the array non-empty
+    out << "    { 0, nullptr }\n"
+        << "};\n\n"
+        << "extern \"C\" const size_t funlang_aot_count = " << protos.size()
+        << ";\n";
+}
+
+// * Building
+
+static uint64_t
+module_key(const std::string& source, const aot_options& options)
+{
+    const char* version = FUNLANG_VERSION;
+    uint64_t seed = fnv1a64(version, strlen(version));
+    // the build's headers, so one changing them needs no version bump
+    const char* build = FUNLANG_AOT_FINGERPRINT;
+    seed = fnv1a64(build, strlen(build), seed);
+    uint32_t settings[] = { aot_format_version,
+                            options.optimize,
+                            options.superinstructions };
+    seed = fnv1a64(
+      reinterpret_cast<const char*>(settings), sizeof settings, seed);
+    return fnv1a64(source.data(), source.size(), seed);
+}
+
+static std::string
+shell_quote(const std::string& text)
+{
+    std::string quoted = "'";
+    for (char c : text) {
+        if (c == '\'') {
+            quoted += "'\\''";
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "'";
+}
+
+static bool
+build_module(const std::string& path,
+             const std::string& name,
+             const std::string& source,
+             const aot_options& options,
+             std::string& error)
+{
+    std::ostringstream code;
+    aot_translate(name, source, options, code);
+
+    std::string tmp_path = path + ".tmp." + std::to_string(getpid());
+    std::string source_path = tmp_path + ".cpp";
+    {
+        std::ofstream file{ source_path };
+        file << code.str();
+        if (!file) {
+            error = "could not write " + source_path;
+            return false;
+        }
+    }
+
+    const char* cxx = getenv("FUNLANG_CXX");
+    std::string command = std::string(cxx ? cxx : FUNLANG_AOT_CXX) +
+                          " -O2 -fPIC -shared " FUNLANG_AOT_FLAGS " -o " +
+                          shell_quote(tmp_path) + " " +
+                          shell_quote(source_path);
+    int status = std::system(command.c_str());
+    unlink(source_path.c_str());
+
+    if (status != 0) {
+        unlink(tmp_path.c_str());
+        error = "building " + name + " failed";
+        return false;
+    }
+    if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        error = "could not write " + path;
+        return false;
+    }
+    return true;
+}
+
+std::unique_ptr<aot_module>
+aot_load(const std::string& directory,
+         const std::string& name,
+         const std::string& source,
+         const aot_options& options,
+         std::string& error)
+{
+    if (directory.empty() || !make_directories(directory)) {
+        error = "no cache directory to build " + name + " in";
+        return nullptr;
+    }
+
+    char file_name[32];
+    snprintf(file_name,
+             sizeof file_name,
+             "%016llx.so",
+             (unsigned long long)module_key(source, options));
+    std::string path = directory + "/" + file_name;
+
+    if (access(path.c_str(), R_OK) != 0 &&
+        !build_module(path, name, source, options, error)) {
+        return nullptr;
+    }
+
+    void* handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        error = dlerror();
+        return nullptr;
+    }
+    auto entries =
+      static_cast<const aot_entry*>(dlsym(handle, "funlang_aot_entries"));
+    auto count = static_cast<const size_t*>(dlsym(handle, "funlang_aot_count"));
+    if (!entries || !count) {
+        dlclose(handle);
+        error = path + " is not a funlang module";
+        return nullptr;
+    }
+    return std::unique_ptr<aot_module>(
+      new aot_module(handle, entries, *count));
+}
+
+// * Runtime for generated code
+
+void
+aot_unbound(value cell)
+{
+    throw vm_error("undefined symbol " + cell.as<global_obj>()->name);
+}
+
+value
+aot_closure(vm& vm, function_proto* proto, int index, const value* R)
+{
+    return value::obj(vm.make_closure(
+      proto->protos[index], R, vm.frames.back().closure));
+}
+
+value
+aot_vec(vm& vm, const value* items, int count)
+{
+    return vm.heap.make_vector(
+      value_vec::from_range(&runtime_allocator, items, items + count));
+}
+
+value
+aot_map(vm& vm, const value* pairs, int count)
+{
+    value_map::tmap entries{ value_map{ &runtime_allocator } };
+    for (int j = 0; j < count; ++j) {
+        entries.assoc(pairs[2 * j], pairs[2 * j + 1]);
+    }
+    return vm.heap.make_map(entries.to_persistent());
+}
+
+value
+aot_set(vm& vm, const value* items, int count)
+{
+    value_set::tset members{ value_set{ &runtime_allocator } };
+    for (int j = 0; j < count; ++j) {
+        members.conj(items[j]);
+    }
+    return vm.heap.make_set(members.to_persistent());
+}
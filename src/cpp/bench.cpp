@@ -0,0 +1,99 @@
+#include "bench.hpp"
+
+#include <chrono>
+#include <iomanip>
+
+#include "interpreter.hpp"
+
+struct benchmark
+{
+    const char* name;
+    const char* source;
+};
+
+static const benchmark benchmarks[] = {
+    { "empty-loop", "(let [i 0] (while (< i 1000000) (set! i (+ i 1))))" },
+    { "int-sum",
+      "(let [i 0 s 0]"
+      "  (while (< i 1000000) (set! s (+ s i)) (set! i (+ i 1)))"
+      "  s)" },
+    { "decimal-sum",
+      "(let [i 0 s 0.0]"
+      "  (while (< i 1000000) (set! s (+ s 0.5)) (set! i (+ i 1)))"
+      "  s)" },
+    { "calls",
+      "(defn bench-id [x] x)"
+      "(let [i 0] (while (< i 1000000) (bench-id i) (set! i (+ i 1))))" },
+    { "fib",
+      "(defn fib [n] (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))"
+      "(fib 25)" },
+    { "vector-conj",
+      "(let [v [] i 0]"
+      "  (while (< i 100000) (set! v (conj v i)) (set! i (+ i 1)))"
+      "  (count v))" },
+};
+
+static constexpr int timed_runs = 3;
+
+// best wall time of a few runs, in milliseconds
+static double
+best_time(const benchmark& bench, bool jit)
+{
+    using clock = std::chrono::steady_clock;
+
+    double best_ms = 0;
+    for (int run = 0; run < timed_runs; ++run) {
+        interpreter timed{ false };
+        timed.machine.jit.enabled = timed.machine.jit.enabled && jit;
+        auto start = clock::now();
+        timed.eval(bench.name, bench.source);
+        double ms =
+          std::chrono::duration<double, std::milli>(clock::now() - start)
+            .count();
+        if (run == 0 || ms < best_ms) {
+            best_ms = ms;
+        }
+    }
+    return best_ms;
+}
+
+int
+run_benchmarks(std::ostream& out)
+{
+    out << std::left << std::setw(14) << "benchmark" << std::right
+        << std::setw(12) << "unfused" << std::setw(12) << "instrs"
+        << std::setw(10) << "ms" << std::setw(10) << "ns/instr"
+        << std::setw(10) << "Minstr/s" << std::setw(10) << "jit ms" << "\n";
+
+    for (auto& bench : benchmarks) {
+        try {
+            // profiled runs to count instructions with and without
+            // superinstructions, then timed runs in the interpreter alone and
+            // with the jit
+            interpreter unfused{ false };
+            unfused.superinstructions = false;
+            unfused.machine.profiling = true;
+            unfused.eval(bench.name, bench.source);
+
+            interpreter counting{ false };
+            counting.machine.profiling = true;
+            counting.eval(bench.name, bench.source);
+            uint64_t executed = counting.machine.profile.executed;
+
+            double interpreted_ms = best_time(bench, false);
+            double jit_ms = best_time(bench, true);
+
+            double ns_per_instr = interpreted_ms * 1e6 / executed;
+            out << std::left << std::setw(14) << bench.name << std::right
+                << std::setw(12) << unfused.machine.profile.executed
+                << std::setw(12) << executed << std::fixed
+                << std::setprecision(2) << std::setw(10) << interpreted_ms
+                << std::setw(10) << ns_per_instr << std::setw(10)
+                << 1e3 / ns_per_instr << std::setw(10) << jit_ms << "\n";
+        } catch (std::exception& e) {
+            out << bench.name << ": " << e.what() << "\n";
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,897 @@
+#include "vm.hpp"
+
+#include <cmath>
+#include <sstream>
+
+// * Helpers
+
+[[noreturn]] static void
+type_error(const char* fn, const char* expected, value got)
+{
+    throw vm_error(std::string(fn) + ": expected " + expected + ", got " +
+                   type_name(got));
+}
+
+static int64_t
+expect_int(const char* fn, value v)
+{
+    if (!v.is_int()) {
+        type_error(fn, "int", v);
+    }
+    return v.as_int();
+}
+
+static value
+expect_number(const char* fn, value v)
+{
+    if (!v.is_number()) {
+        type_error(fn, "number", v);
+    }
+    return v;
+}
+
+static value
+make_vector(vm& vm, const std::vector<value>& items)
+{
+    return vm.heap.make_vector(value_vec::from_range(
+      &runtime_allocator, items.data(), items.data() + items.size()));
+}
+
+static value
+make_list(vm& vm, const value* items, size_t count)
+{
+    value_list out{ &runtime_allocator };
+    for (size_t i = count; i > 0; --i) {
+        out = out.conj(items[i - 1]);
+    }
+    return vm.heap.make_list(out);
+}
+
+// Collects the items of anything sequential. Map entries come out as
+// [key value] vectors, which are pushed to guard since nothing else holds
+// them.
+static std::vector<value>
+seq_items(vm& vm, root_guard& guard, const char* fn, value coll)
+{
+    std::vector<value> items;
+    if (coll.is_nil()) {
+        return items;
+    }
+    if (coll.is_object(o_vector)) {
+        const value_vec& v = coll.as<vector_obj>()->items;
+        items.assign(v.begin(), v.end());
+    } else if (coll.is_object(o_list)) {
+        const value_list& l = coll.as<list_obj>()->items;
+        items.assign(l.begin(), l.end());
+    } else if (coll.is_object(o_set)) {
+        const value_set& s = coll.as<set_obj>()->items;
+        items.assign(s.begin(), s.end());
+    } else if (coll.is_object(o_map)) {
+        for (const auto& entry : coll.as<map_obj>()->entries) {
+            value pair = make_vector(vm, { entry.key, entry.val });
+            guard.push(pair);
+            items.push_back(pair);
+        }
+    } else if (coll.is_object(o_sorted_map)) {
+        for (const auto& entry : coll.as<sorted_map_obj>()->entries) {
+            value pair = make_vector(vm, { entry.key, entry.val });
+            guard.push(pair);
+            items.push_back(pair);
+        }
+    } else if (coll.is_object(o_string)) {
+        for (char c : coll.as<string_obj>()->str) {
+            items.push_back(value::character(c));
+        }
+    } else {
+        type_error(fn, "a collection", coll);
+    }
+    return items;
+}
+
+// * Output
+
+static value
+builtin_print(vm& vm, value* args, int argc)
+{
+    for (int i = 0; i < argc; ++i) {
+        if (i > 0) {
+            std::cout << " ";
+        }
+        print_value(std::cout, args[i], false);
+    }
+    return value::nil();
+}
+
+static value
+builtin_println(vm& vm, value* args, int argc)
+{
+    builtin_print(vm, args, argc);
+    std::cout << "\n";
+    return value::nil();
+}
+
+static value
+builtin_str(vm& vm, value* args, int argc)
+{
+    std::ostringstream out;
+    for (int i = 0; i < argc; ++i) {
+        if (!args[i].is_nil()) {
+            print_value(out, args[i], false);
+        }
+    }
+    return vm.heap.make_string(out.str());
+}
+
+// * Arithmetic
+
+static value
+builtin_add(vm& vm, value* args, int argc)
+{
+    value result = value::fixnum(0);
+    for (int i = 0; i < argc; ++i) {
+        result = value_add(vm.heap, result, args[i]);
+    }
+    return result;
+}
+
+static value
+builtin_mul(vm& vm, value* args, int argc)
+{
+    value result = value::fixnum(1);
+    for (int i = 0; i < argc; ++i) {
+        result = value_mul(vm.heap, result, args[i]);
+    }
+    return result;
+}
+
+static value
+builtin_sub(vm& vm, value* args, int argc)
+{
+    if (argc == 1) {
+        return value_neg(vm.heap, args[0]);
+    }
+    value result = args[0];
+    for (int i = 1; i < argc; ++i) {
+        result = value_sub(vm.heap, result, args[i]);
+    }
+    return result;
+}
+
+static value
+builtin_div(vm& vm, value* args, int argc)
+{
+    if (argc == 1) {
+        return value_div(vm.heap, value::fixnum(1), args[0]);
+    }
+    value result = args[0];
+    for (int i = 1; i < argc; ++i) {
+        result = value_div(vm.heap, result, args[i]);
+    }
+    return result;
+}
+
+static value
+builtin_inc(vm& vm, value* args, int argc)
+{
+    return value_add(vm.heap, args[0], value::fixnum(1));
+}
+
+static value
+builtin_dec(vm& vm, value* args, int argc)
+{
+    return value_sub(vm.heap, args[0], value::fixnum(1));
+}
+
+static value
+builtin_quot(vm& vm, value* args, int argc)
+{
+    int64_t a = expect_int("quot", args[0]);
+    int64_t b = expect_int("quot", args[1]);
+    if (b == 0) {
+        throw vm_error("divide by zero");
+    }
+    if (a == INT64_MIN && b == -1) {
+        throw vm_error("integer overflow");
+    }
+    return vm.heap.make_int(a / b);
+}
+
+static value
+builtin_mod(vm& vm, value* args, int argc)
+{
+    int64_t a = expect_int("mod", args[0]);
+    int64_t b = expect_int("mod", args[1]);
+    if (b == 0) {
+        throw vm_error("divide by zero");
+    }
+    // a % -1 traps for the smallest int
+    int64_t m = b == -1 ? 0 : a % b;
+    if (m != 0 && ((m < 0) != (b < 0))) {
+        m += b;
+    }
+    return vm.heap.make_int(m);
+}
+
+static value
+builtin_abs(vm& vm, value* args, int argc)
+{
+    value v = expect_number("abs", args[0]);
+    if (compare_values(v, value::fixnum(0)) < 0) {
+        return value_neg(vm.heap, v);
+    }
+    return v;
+}
+
+static value
+builtin_min(vm& vm, value* args, int argc)
+{
+    value result = args[0];
+    for (int i = 1; i < argc; ++i) {
+        if (compare_values(args[i], result) < 0) {
+            result = args[i];
+        }
+    }
+    return result;
+}
+
+static value
+builtin_max(vm& vm, value* args, int argc)
+{
+    value result = args[0];
+    for (int i = 1; i < argc; ++i) {
+        if (compare_values(args[i], result) > 0) {
+            result = args[i];
+        }
+    }
+    return result;
+}
+
+// * Comparison
+
+template<typename Pred>
+static value
+compare_chain(value* args, int argc, Pred pred)
+{
+    for (int i = 0; i + 1 < argc; ++i) {
+        if (!pred(compare_values(args[i], args[i + 1]))) {
+            return value::boolean(false);
+        }
+    }
+    return value::boolean(true);
+}
+
+static value
+builtin_lt(vm& vm, value* args, int argc)
+{
+    return compare_chain(args, argc, [](int c) { return c < 0; });
+}
+
+static value
+builtin_gt(vm& vm, value* args, int argc)
+{
+    return compare_chain(args, argc, [](int c) { return c > 0; });
+}
+
+static value
+builtin_le(vm& vm, value* args, int argc)
+{
+    return compare_chain(args, argc, [](int c) { return c <= 0; });
+}
+
+static value
+builtin_ge(vm& vm, value* args, int argc)
+{
+    return compare_chain(args, argc, [](int c) { return c >= 0; });
+}
+
+static value
+builtin_eq(vm& vm, value* args, int argc)
+{
+    for (int i = 0; i + 1 < argc; ++i) {
+        if (!values_equal(args[i], args[i + 1])) {
+            return value::boolean(false);
+        }
+    }
+    return value::boolean(true);
+}
+
+static value
+builtin_not_eq(vm& vm, value* args, int argc)
+{
+    return value::boolean(!builtin_eq(vm, args, argc).as_bool());
+}
+
+static value
+builtin_not(vm& vm, value* args, int argc)
+{
+    return value::boolean(!args[0].truthy());
+}
+
+static value
+builtin_type(vm& vm, value* args, int argc)
+{
+    return vm.heap.intern_keyword(type_name(args[0]));
+}
+
+// (struct-type name [:field ...] :method fn ...), what defstruct compiles to
+static value
+builtin_struct_type(vm& vm, value* args, int argc)
+{
+    if (!args[0].is_object(o_string)) {
+        type_error("struct-type", "a string", args[0]);
+    }
+    if (!args[1].is_object(o_vector)) {
+        type_error("struct-type", "a vector of keywords", args[1]);
+    }
+    if (argc % 2 != 0) {
+        throw vm_error("struct-type: methods come in keyword fn pairs");
+    }
+
+    auto shape = vm.heap.make<shape_obj>(args[0].as<string_obj>()->str);
+    const value_vec& fields = args[1].as<vector_obj>()->items;
+    for (value field : fields) {
+        if (!field.is_object(o_keyword)) {
+            type_error("struct-type", "a keyword", field);
+        }
+        const std::string& name = field.as<keyword_obj>()->name;
+        if (shape->field_index(name) >= 0) {
+            throw vm_error("struct-type: duplicate field " + name);
+        }
+        shape->fields.push_back(name);
+    }
+    for (int i = 2; i < argc; i += 2) {
+        if (!args[i].is_object(o_keyword)) {
+            type_error("struct-type", "a keyword", args[i]);
+        }
+        if (!args[i + 1].is_object(o_closure) &&
+            !args[i + 1].is_object(o_native)) {
+            type_error("struct-type", "a function", args[i + 1]);
+        }
+        shape->method_names.push_back(args[i].as<keyword_obj>()->name);
+        shape->methods.push_back(args[i + 1]);
+    }
+    return value::obj(shape);
+}
+
+// * Collections
+
+static value
+builtin_count(vm& vm, value* args, int argc)
+{
+    value coll = args[0];
+    if (coll.is_nil()) {
+        return value::fixnum(0);
+    } else if (coll.is_object(o_vector)) {
+        return value::fixnum(coll.as<vector_obj>()->items.count);
+    } else if (coll.is_object(o_list)) {
+        return value::fixnum(coll.as<list_obj>()->items.count);
+    } else if (coll.is_object(o_map)) {
+        return value::fixnum(coll.as<map_obj>()->count());
+    } else if (coll.is_object(o_set)) {
+        return value::fixnum(coll.as<set_obj>()->items.count);
+    } else if (coll.is_object(o_sorted_map)) {
+        return value::fixnum(coll.as<sorted_map_obj>()->count());
+    } else if (coll.is_object(o_string)) {
+        return value::fixnum(coll.as<string_obj>()->str.size());
+    }
+    type_error("count", "a collection", coll);
+}
+
+static value
+builtin_empty(vm& vm, value* args, int argc)
+{
+    return value::boolean(builtin_count(vm, args, argc).as_int() == 0);
+}
+
+static value
+conj_one(vm& vm, value coll, value item)
+{
+    if (coll.is_nil()) {
+        return make_list(vm, &item, 1);
+    } else if (coll.is_object(o_vector)) {
+        return vm.heap.make_vector(coll.as<vector_obj>()->items.conj(item));
+    } else if (coll.is_object(o_list)) {
+        return vm.heap.make_list(coll.as<list_obj>()->items.conj(item));
+    } else if (coll.is_object(o_set)) {
+        return set_conj(vm.heap, coll.as<set_obj>(), item);
+    } else if (coll.is_object(o_map) || coll.is_object(o_sorted_map)) {
+        if (!item.is_object(o_vector) ||
+            item.as<vector_obj>()->items.count != 2) {
+            type_error("conj", "a [key value] vector", item);
+        }
+        const value_vec& pair = item.as<vector_obj>()->items;
+        if (coll.is_object(o_sorted_map)) {
+            return vm.heap.make_sorted_map(
+              coll.as<sorted_map_obj>()->entries.assoc(pair.nth(0),
+                                                       pair.nth(1)));
+        }
+        return map_assoc(vm.heap, coll.as<map_obj>(), pair.nth(0), pair.nth(1));
+    }
+    type_error("conj", "a collection", coll);
+}
+
+static value
+builtin_conj(vm& vm, value* args, int argc)
+{
+    value result = args[0];
+    for (int i = 1; i < argc; ++i) {
+        result = conj_one(vm, result, args[i]);
+    }
+    return result;
+}
+
+static value
+builtin_nth(vm& vm, value* args, int argc)
+{
+    value coll = args[0];
+    int64_t index = expect_int("nth", args[1]);
+    value not_found = argc > 2 ? args[2] : value::nil();
+
+    if (coll.is_object(o_vector)) {
+        const value_vec& items = coll.as<vector_obj>()->items;
+        if (index >= 0 && (size_t)index < items.count) {
+            return items.nth(index);
+        }
+    } else if (coll.is_object(o_list)) {
+        auto n = coll.as<list_obj>()->items.first.get();
+        for (int64_t i = 0; n && i < index; ++i) {
+            n = n->rest.get();
+        }
+        if (index >= 0 && n) {
+            return n->item;
+        }
+    } else if (coll.is_object(o_string)) {
+        const std::string& str = coll.as<string_obj>()->str;
+        if (index >= 0 && (size_t)index < str.size()) {
+            return value::character(str[index]);
+        }
+    } else if (!coll.is_nil()) {
+        type_error("nth", "a vector, list or string", coll);
+    }
+
+    if (argc > 2) {
+        return not_found;
+    }
+    throw vm_error("nth: index " + std::to_string(index) + " out of bounds");
+}
+
+static value
+builtin_get(vm& vm, value* args, int argc)
+{
+    value coll = args[0];
+    value key = args[1];
+    value not_found = argc > 2 ? args[2] : value::nil();
+
+    if (coll.is_object(o_map)) {
+        return map_get(coll.as<map_obj>(), key, not_found);
+    } else if (coll.is_object(o_sorted_map)) {
+        return coll.as<sorted_map_obj>()->entries.get(key, not_found);
+    } else if (coll.is_object(o_set)) {
+        return set_contains(coll.as<set_obj>(), key) ? key : not_found;
+    } else if (coll.is_object(o_vector)) {
+        const value_vec& items = coll.as<vector_obj>()->items;
+        if (key.is_int() && key.as_int() >= 0 &&
+            (size_t)key.as_int() < items.count) {
+            return items.nth(key.as_int());
+        }
+    } else if (coll.is_object(o_instance) && key.is_object(o_keyword)) {
+        auto instance = coll.as<instance_obj>();
+        int index =
+          instance->shape->field_index(key.as<keyword_obj>()->name);
+        if (index >= 0) {
+            return instance->slots()[index];
+        }
+    }
+    return not_found;
+}
+
+static value
+builtin_contains(vm& vm, value* args, int argc)
+{
+    value coll = args[0];
+    value key = args[1];
+    if (coll.is_object(o_map)) {
+        return value::boolean(coll.as<map_obj>()->entries.contains(key));
+    } else if (coll.is_object(o_sorted_map)) {
+        return value::boolean(
+          coll.as<sorted_map_obj>()->entries.contains(key));
+    } else if (coll.is_object(o_set)) {
+        return value::boolean(set_contains(coll.as<set_obj>(), key));
+    } else if (coll.is_object(o_vector)) {
+        return value::boolean(
+          key.is_int() && key.as_int() >= 0 &&
+          (size_t)key.as_int() < coll.as<vector_obj>()->items.count);
+    } else if (coll.is_nil()) {
+        return value::boolean(false);
+    }
+    type_error("contains?", "a map, set or vector", coll);
+}
+
+static value
+builtin_assoc(vm& vm, value* args, int argc)
+{
+    if (argc % 2 == 0) {
+        throw vm_error("assoc: expected keys and values in pairs");
+    }
+
+    value result = args[0];
+    for (int i = 1; i < argc; i += 2) {
+        if (result.is_nil()) {
+            result = vm.heap.make_map(value_map{ &runtime_allocator });
+        }
+        if (result.is_object(o_map)) {
+            result =
+              map_assoc(vm.heap, result.as<map_obj>(), args[i], args[i + 1]);
+        } else if (result.is_object(o_sorted_map)) {
+            result = vm.heap.make_sorted_map(
+              result.as<sorted_map_obj>()->entries.assoc(args[i], args[i + 1]));
+        } else if (result.is_object(o_vector)) {
+            int64_t index = expect_int("assoc", args[i]);
+            const value_vec& items = result.as<vector_obj>()->items;
+            if (index < 0 || (size_t)index > items.count) {
+                throw vm_error("assoc: index " + std::to_string(index) +
+                               " out of bounds");
+            }
+            auto updated = items.assoc(index, args[i + 1]);
+            if (!updated) {
+                throw vm_error("assoc: index " + std::to_string(index) +
+                               " out of bounds");
+            }
+            result = vm.heap.make_vector(*updated);
+        } else {
+            type_error("assoc", "a map or vector", result);
+        }
+    }
+    return result;
+}
+
+static value
+builtin_dissoc(vm& vm, value* args, int argc)
+{
+    value result = args[0];
+    for (int i = 1; i < argc; ++i) {
+        if (result.is_nil()) {
+            return result;
+        } else if (result.is_object(o_map)) {
+            map_obj* map = result.as<map_obj>();
+            value_map entries = map->entries.dissoc(args[i]);
+            if (entries.count != map->count()) {
+                result = vm.heap.make_map(entries);
+            }
+        } else if (result.is_object(o_sorted_map)) {
+            sorted_map_obj* map = result.as<sorted_map_obj>();
+            value_sorted_map entries = map->entries.dissoc(args[i]);
+            if (entries.count != map->count()) {
+                result = vm.heap.make_sorted_map(entries);
+            }
+        } else {
+            type_error("dissoc", "a map", result);
+        }
+    }
+    return result;
+}
+
+static value
+builtin_first(vm& vm, value* args, int argc)
+{
+    value coll = args[0];
+    if (coll.is_object(o_list)) {
+        auto first = coll.as<list_obj>()->items.first.get();
+        return first ? first->item : value::nil();
+    }
+    if (coll.is_object(o_vector)) {
+        const value_vec& items = coll.as<vector_obj>()->items;
+        return items.count > 0 ? items.nth(0) : value::nil();
+    }
+    root_guard guard{ vm };
+    auto items = seq_items(vm, guard, "first", coll);
+    return items.empty() ? value::nil() : items[0];
+}
+
+static value
+builtin_rest(vm& vm, value* args, int argc)
+{
+    value coll = args[0];
+    if (coll.is_object(o_list)) {
+        return vm.heap.make_list(coll.as<list_obj>()->items.pop());
+    }
+    root_guard guard{ vm };
+    auto items = seq_items(vm, guard, "rest", coll);
+    if (items.empty()) {
+        return make_list(vm, nullptr, 0);
+    }
+    return make_list(vm, items.data() + 1, items.size() - 1);
+}
+
+static value
+builtin_cons(vm& vm, value* args, int argc)
+{
+    value coll = args[1];
+    if (coll.is_object(o_list)) {
+        return vm.heap.make_list(coll.as<list_obj>()->items.conj(args[0]));
+    }
+    root_guard guard{ vm };
+    auto items = seq_items(vm, guard, "cons", coll);
+    items.insert(items.begin(), args[0]);
+    return make_list(vm, items.data(), items.size());
+}
+
+static value
+builtin_pop(vm& vm, value* args, int argc)
+{
+    value coll = args[0];
+    if (coll.is_object(o_vector)) {
+        const value_vec& items = coll.as<vector_obj>()->items;
+        if (items.count == 0) {
+            throw vm_error("pop: vector is empty");
+        }
+        return vm.heap.make_vector(items.pop());
+    }
+    if (coll.is_object(o_list)) {
+        const value_list& items = coll.as<list_obj>()->items;
+        if (items.count == 0) {
+            throw vm_error("pop: list is empty");
+        }
+        return vm.heap.make_list(items.pop());
+    }
+    type_error("pop", "a vector or list", coll);
+}
+
+static value
+builtin_subvec(vm& vm, value* args, int argc)
+{
+    value coll = args[0];
+    if (!coll.is_object(o_vector)) {
+        type_error("subvec", "a vector", coll);
+    }
+    const value_vec& items = coll.as<vector_obj>()->items;
+    int64_t start = expect_int("subvec", args[1]);
+    int64_t end = argc > 2 ? expect_int("subvec", args[2]) : items.count;
+    if (start < 0 || end < start || (size_t)end > items.count) {
+        throw vm_error("subvec: range " + std::to_string(start) + " to " +
+                       std::to_string(end) + " out of bounds");
+    }
+    return vm.heap.make_vector(items.slice(start, end));
+}
+
+// Vectors are joined as they are; anything else is collected into one
+// first.
+static value
+builtin_concat(vm& vm, value* args, int argc)
+{
+    root_guard guard{ vm };
+    value_vec out{ &runtime_allocator };
+    for (int i = 0; i < argc; ++i) {
+        if (args[i].is_object(o_vector)) {
+            out = out.concat(args[i].as<vector_obj>()->items);
+            continue;
+        }
+        auto items = seq_items(vm, guard, "concat", args[i]);
+        out = out.concat(value_vec::from_range(
+          &runtime_allocator, items.data(), items.data() + items.size()));
+    }
+    return vm.heap.make_vector(out);
+}
+
+static value
+builtin_list(vm& vm, value* args, int argc)
+{
+    return make_list(vm, args, argc);
+}
+
+static value
+builtin_vector(vm& vm, value* args, int argc)
+{
+    return make_vector(vm, std::vector<value>(args, args + argc));
+}
+
+static value
+builtin_hash_map(vm& vm, value* args, int argc)
+{
+    if (argc % 2 != 0) {
+        throw vm_error("hash-map: expected keys and values in pairs");
+    }
+    value_map::tmap entries{ value_map{ &runtime_allocator } };
+    for (int i = 0; i < argc; i += 2) {
+        entries.assoc(args[i], args[i + 1]);
+    }
+    return vm.heap.make_map(entries.to_persistent());
+}
+
+// keys are ordered with compare_values, so they must all be comparable
+static value
+builtin_sorted_map(vm& vm, value* args, int argc)
+{
+    if (argc % 2 != 0) {
+        throw vm_error("sorted-map: expected keys and values in pairs");
+    }
+    value_sorted_map::tsorted_map entries{ value_sorted_map{
+      &runtime_allocator } };
+    for (int i = 0; i < argc; i += 2) {
+        entries.assoc(args[i], args[i + 1]);
+    }
+    return vm.heap.make_sorted_map(entries.to_persistent());
+}
+
+// The [key value] entries of a sorted map whose keys are at least start
+// and, when end is given, less than end, as a vector.
+static value
+builtin_subseq(vm& vm, value* args, int argc)
+{
+    value coll = args[0];
+    if (!coll.is_object(o_sorted_map)) {
+        type_error("subseq", "a sorted map", coll);
+    }
+    const value_sorted_map& entries = coll.as<sorted_map_obj>()->entries;
+    root_guard guard{ vm };
+    std::vector<value> items;
+    for (auto it = entries.lower_bound(args[1]); it != entries.end(); ++it) {
+        if (argc > 2 && compare_values(it->key, args[2]) >= 0) {
+            break;
+        }
+        value pair = make_vector(vm, { it->key, it->val });
+        guard.push(pair);
+        items.push_back(pair);
+    }
+    return make_vector(vm, items);
+}
+
+static value
+builtin_hash_set(vm& vm, value* args, int argc)
+{
+    value_set::tset items{ value_set{ &runtime_allocator } };
+    for (int i = 0; i < argc; ++i) {
+        items.conj(args[i]);
+    }
+    return vm.heap.make_set(items.to_persistent());
+}
+
+static value
+builtin_range(vm& vm, value* args, int argc)
+{
+    int64_t start = 0, end, step = 1;
+    if (argc == 1) {
+        end = expect_int("range", args[0]);
+    } else {
+        start = expect_int("range", args[0]);
+        end = expect_int("range", args[1]);
+        if (argc > 2) {
+            step = expect_int("range", args[2]);
+        }
+    }
+    if (step == 0) {
+        throw vm_error("range: step can not be zero");
+    }
+
+    size_t count = 0;
+    if (step > 0 ? start < end : start > end) {
+        uint64_t span = step > 0 ? (uint64_t)end - (uint64_t)start
+                                 : (uint64_t)start - (uint64_t)end;
+        uint64_t stride = step > 0 ? (uint64_t)step : -(uint64_t)step;
+        count = (span - 1) / stride + 1;
+    }
+    return vm.heap.make_vector(
+      value_vec::from_sized(&runtime_allocator, count, [&](size_t n) {
+          return vm.heap.make_int(start + (int64_t)n * step);
+      }));
+}
+
+// * Higher order functions
+//
+// These call back into the vm, which may collect garbage; every value they
+// create along the way is rooted until it is returned.
+
+static value
+builtin_map(vm& vm, value* args, int argc)
+{
+    root_guard guard{ vm };
+    value fn = args[0];
+    auto items = seq_items(vm, guard, "map", args[1]);
+
+    std::vector<value> out;
+    out.reserve(items.size());
+    for (value item : items) {
+        value result = vm.call(fn, 1, &item);
+        guard.push(result);
+        out.push_back(result);
+    }
+    return make_vector(vm, out);
+}
+
+static value
+builtin_filter(vm& vm, value* args, int argc)
+{
+    root_guard guard{ vm };
+    value fn = args[0];
+    auto items = seq_items(vm, guard, "filter", args[1]);
+
+    std::vector<value> out;
+    for (value item : items) {
+        if (vm.call(fn, 1, &item).truthy()) {
+            out.push_back(item);
+        }
+    }
+    return make_vector(vm, out);
+}
+
+static value
+builtin_reduce(vm& vm, value* args, int argc)
+{
+    root_guard guard{ vm };
+    value fn = args[0];
+    auto items = seq_items(vm, guard, "reduce", args[argc - 1]);
+
+    size_t start = 0;
+    value acc;
+    if (argc == 3) {
+        acc = args[1];
+    } else if (items.empty()) {
+        return vm.call(fn, 0, nullptr);
+    } else {
+        acc = items[0];
+        start = 1;
+    }
+
+    for (size_t i = start; i < items.size(); ++i) {
+        value pair[2] = { acc, items[i] };
+        acc = vm.call(fn, 2, pair);
+        guard.push(acc);
+    }
+    return acc;
+}
+
+void
+install_builtins(vm& vm)
+{
+    vm.define_native("print", builtin_print, 0, -1);
+    vm.define_native("println", builtin_println, 0, -1);
+    vm.define_native("str", builtin_str, 0, -1);
+
+    vm.define_native("+", builtin_add, 0, -1);
+    vm.define_native("-", builtin_sub, 1, -1);
+    vm.define_native("*", builtin_mul, 0, -1);
+    vm.define_native("/", builtin_div, 1, -1);
+    vm.define_native("inc", builtin_inc, 1, 1);
+    vm.define_native("dec", builtin_dec, 1, 1);
+    vm.define_native("quot", builtin_quot, 2, 2);
+    vm.define_native("mod", builtin_mod, 2, 2);
+    vm.define_native("abs", builtin_abs, 1, 1);
+    vm.define_native("min", builtin_min, 1, -1);
+    vm.define_native("max", builtin_max, 1, -1);
+
+    vm.define_native("<", builtin_lt, 1, -1);
+    vm.define_native(">", builtin_gt, 1, -1);
+    vm.define_native("<=", builtin_le, 1, -1);
+    vm.define_native(">=", builtin_ge, 1, -1);
+    vm.define_native("=", builtin_eq, 1, -1);
+    vm.define_native("not=", builtin_not_eq, 1, -1);
+    vm.define_native("not", builtin_not, 1, 1);
+    vm.define_native("type", builtin_type, 1, 1);
+    vm.define_native("struct-type", builtin_struct_type, 2, -1);
+
+    vm.define_native("count", builtin_count, 1, 1);
+    vm.define_native("empty?", builtin_empty, 1, 1);
+    vm.define_native("conj", builtin_conj, 1, -1);
+    vm.define_native("nth", builtin_nth, 2, 3);
+    vm.define_native("get", builtin_get, 2, 3);
+    vm.define_native("contains?", builtin_contains, 2, 2);
+    vm.define_native("assoc", builtin_assoc, 3, -1);
+    vm.define_native("dissoc", builtin_dissoc, 1, -1);
+    vm.define_native("first", builtin_first, 1, 1);
+    vm.define_native("rest", builtin_rest, 1, 1);
+    vm.define_native("cons", builtin_cons, 2, 2);
+    vm.define_native("pop", builtin_pop, 1, 1);
+    vm.define_native("subvec", builtin_subvec, 2, 3);
+    vm.define_native("concat", builtin_concat, 0, -1);
+    vm.define_native("list", builtin_list, 0, -1);
+    vm.define_native("vector", builtin_vector, 0, -1);
+    vm.define_native("hash-map", builtin_hash_map, 0, -1);
+    vm.define_native("hash-set", builtin_hash_set, 0, -1);
+    vm.define_native("sorted-map", builtin_sorted_map, 0, -1);
+    vm.define_native("subseq", builtin_subseq, 2, 3);
+    vm.define_native("range", builtin_range, 1, 3);
+
+    vm.define_native("map", builtin_map, 2, 2);
+    vm.define_native("filter", builtin_filter, 2, 2);
+    vm.define_native("reduce", builtin_reduce, 2, 3);
+}
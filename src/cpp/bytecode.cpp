@@ -0,0 +1,160 @@
+#include "bytecode.hpp"
+
+#include <iomanip>
+
+const char* const opcode_names[op_count] = {
+#define FUNLANG_OPCODE_NAME(name, format) #name,
+    FUNLANG_OPCODES(FUNLANG_OPCODE_NAME)
+#undef FUNLANG_OPCODE_NAME
+};
+
+const operand_format opcode_formats[op_count] = {
+#define FUNLANG_OPCODE_FORMAT(name, format) format,
+    FUNLANG_OPCODES(FUNLANG_OPCODE_FORMAT)
+#undef FUNLANG_OPCODE_FORMAT
+};
+
+void
+disassemble_instr(std::ostream& stream, const function_proto* proto, size_t pc)
+{
+    instr i = proto->code[pc];
+    opcode op = instr_op(i);
+
+    stream << std::setw(5) << pc << " " << std::setw(4) << proto->line_at(pc)
+           << "  " << std::left << std::setw(12) << opcode_names[op]
+           << std::right;
+
+    switch (opcode_formats[op]) {
+        case fmt_a:
+            stream << instr_a(i);
+            break;
+        case fmt_ab:
+            stream << instr_a(i) << " " << instr_b(i);
+            break;
+        case fmt_abc:
+            stream << instr_a(i) << " " << instr_b(i) << " " << instr_c(i);
+            if ((op == op_getfield || op == op_setfield ||
+                 op == op_getmethod) &&
+                (size_t)instr_c(i) < proto->sites.size()) {
+                stream << "\t; ." << proto->sites[instr_c(i)].name;
+            }
+            break;
+        case fmt_abx:
+            stream << instr_a(i) << " " << instr_bx(i);
+            if (op != op_closure && (size_t)instr_bx(i) < proto->constants.size()) {
+                stream << "\t; " << proto->constants[instr_bx(i)];
+            }
+            break;
+        case fmt_asbx:
+            stream << instr_a(i) << " " << instr_sbx(i);
+            if (op != op_loadi) {
+                stream << "\t; to " << pc + 1 + instr_sbx(i);
+            }
+            break;
+        case fmt_sbx:
+            stream << instr_sbx(i) << "\t; to " << pc + 1 + instr_sbx(i);
+            break;
+    }
+    stream << "\n";
+}
+
+void
+disassemble(std::ostream& stream, const function_proto* proto)
+{
+    stream << "fn " << (proto->name.empty() ? "<anonymous>" : proto->name)
+           << " (arity " << proto->arity << ", " << proto->num_regs
+           << " registers, " << proto->constants.size() << " constants)\n";
+
+    for (size_t pc = 0; pc < proto->code.size(); ++pc) {
+        disassemble_instr(stream, proto, pc);
+    }
+
+    for (auto child : proto->protos) {
+        stream << "\n";
+        disassemble(stream, child);
+    }
+}
+
+void
+mark_tail_calls(function_proto* proto)
+{
+    auto& code = proto->code;
+    for (size_t pc = 0; pc < code.size(); ++pc) {
+        if (instr_op(code[pc]) != op_call) {
+            continue;
+        }
+        // follow the result; a few steps cover the moves and jumps the
+        // compiler puts between a call in tail position and the return
+        int result = instr_a(code[pc]);
+        size_t at = pc + 1;
+        for (int steps = 0; steps < 8 && at < code.size(); ++steps) {
+            instr i = code[at];
+            if (instr_op(i) == op_move && instr_b(i) == result) {
+                result = instr_a(i);
+                ++at;
+            } else if (instr_op(i) == op_jmp) {
+                at += 1 + instr_sbx(i);
+            } else {
+                if (instr_op(i) == op_ret && instr_a(i) == result) {
+                    code[pc] = (code[pc] & ~(instr)0xff) | op_tailcall;
+                }
+                break;
+            }
+        }
+    }
+}
+
+// the superinstruction for first followed by second, or op_count
+static opcode
+fused_op(instr first, instr second)
+{
+    opcode op = instr_op(second);
+    switch (instr_op(first)) {
+        // fused comparisons test for fixnums and decimals themselves, so
+        // ones the optimizer already specialized fuse the same way
+        case op_lt:
+        case op_lt_ii:
+        case op_lt_dd:
+        case op_le:
+        case op_le_ii:
+        case op_le_dd:
+        case op_eq:
+        case op_eq_ii: {
+            // the branch has to test the comparison's result
+            if ((op != op_jmpif && op != op_jmpifnot) ||
+                instr_a(first) != instr_a(second)) {
+                return op_count;
+            }
+            bool taken_if = op == op_jmpif;
+            switch (instr_op(first)) {
+                case op_lt:
+                case op_lt_ii:
+                case op_lt_dd:
+                    return taken_if ? op_lt_jmpif : op_lt_jmpifnot;
+                case op_le:
+                case op_le_ii:
+                case op_le_dd:
+                    return taken_if ? op_le_jmpif : op_le_jmpifnot;
+                default:
+                    return taken_if ? op_eq_jmpif : op_eq_jmpifnot;
+            }
+        }
+        case op_move:
+            return op == op_call ? op_move_call : op_count;
+        default:
+            return op_count;
+    }
+}
+
+void
+fuse_superinstructions(function_proto* proto)
+{
+    auto& code = proto->code;
+    for (size_t pc = 0; pc + 1 < code.size(); ++pc) {
+        opcode fused = fused_op(code[pc], code[pc + 1]);
+        if (fused != op_count) {
+            code[pc] = (code[pc] & ~(instr)0xff) | fused;
+            ++pc;
+        }
+    }
+}
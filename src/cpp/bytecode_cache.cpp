@@ -0,0 +1,641 @@
+#include "bytecode_cache.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+#include "mapped_file.hpp"
+#include "util.hpp"
+#include "version.hpp"
+#include "vm.hpp"
+
+bytecode_cache::bytecode_cache(std::string directory)
+  : directory(directory)
+  , enabled(!directory.empty())
+{
+}
+
+uint64_t
+bytecode_cache::key_for(const std::string& source, uint32_t settings) const
+{
+    const char* version = FUNLANG_VERSION;
+    uint64_t seed = fnv1a64(version, strlen(version));
+    uint32_t format[] = { format_version, settings };
+    seed = fnv1a64(reinterpret_cast<const char*>(format), sizeof format, seed);
+    return fnv1a64(source.data(), source.size(), seed);
+}
+
+std::string
+bytecode_cache::path_for(uint64_t key) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.flbc", (unsigned long long)key);
+    return directory + "/" + name;
+}
+
+// * Writing
+
+void
+bytecode_cache::writer::add(const function_proto* proto)
+{
+    toplevel.push_back(add_function(proto));
+}
+
+uint32_t
+bytecode_cache::writer::add_function(const function_proto* proto)
+{
+    uint32_t index = functions.size();
+    functions.emplace_back();
+
+    function_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.name = add_string(proto->name);
+    rec.arity = proto->arity;
+    rec.num_regs = proto->num_regs;
+
+    rec.code_first = code.size();
+    rec.code_count = proto->code.size();
+    code.insert(code.end(), proto->code.begin(), proto->code.end());
+    for (size_t pc = 0; pc < proto->code.size(); ++pc) {
+        lines.push_back(proto->line_at(pc));
+    }
+
+    std::vector<uint32_t> pool;
+    for (value constant : proto->constants) {
+        pool.push_back(add_constant(constant));
+    }
+    rec.constant_first = items.size();
+    rec.constant_count = pool.size();
+    items.insert(items.end(), pool.begin(), pool.end());
+
+    rec.capture_first = captures.size();
+    rec.capture_count = proto->captures.size();
+    for (const capture_source& source : proto->captures) {
+        captures.push_back(source.index |
+                           (source.from_capture ? capture_from_enclosing : 0));
+    }
+
+    // caches start out empty wherever the code is loaded
+    rec.site_first = sites.size();
+    rec.site_count = proto->sites.size();
+    for (const access_site& site : proto->sites) {
+        sites.push_back(add_string(site.name));
+    }
+
+    // nested functions go right after this one, their indices after those of
+    // the functions before
+    std::vector<uint32_t> nested;
+    for (const function_proto* child : proto->protos) {
+        nested.push_back(add_function(child));
+    }
+    rec.child_first = children.size();
+    rec.child_count = nested.size();
+    children.insert(children.end(), nested.begin(), nested.end());
+
+    functions[index] = rec;
+    return index;
+}
+
+uint32_t
+bytecode_cache::writer::add_constant(value v)
+{
+    constant_record rec;
+    memset(&rec, 0, sizeof(rec));
+
+    std::vector<uint32_t> members;
+    auto add_items = [&](const value_vec& items) {
+        for (value item : items) {
+            members.push_back(add_constant(item));
+        }
+    };
+
+    if (!v.is_object()) {
+        rec.kind = k_immediate;
+        rec.payload = v.bits;
+    } else {
+        switch (v.as_object()->type) {
+            case o_int:
+                rec.kind = k_int;
+                rec.payload = v.as<int_obj>()->num;
+                break;
+            case o_ratio:
+                rec.kind = k_ratio;
+                rec.payload = (uint32_t)v.as<ratio_obj>()->num.counter;
+                rec.count = v.as<ratio_obj>()->num.divider;
+                break;
+            case o_string:
+                rec.kind = k_string;
+                rec.payload = add_string(v.as<string_obj>()->str);
+                break;
+            case o_keyword:
+                rec.kind = k_keyword;
+                rec.payload = add_string(v.as<keyword_obj>()->name);
+                break;
+            case o_global:
+                rec.kind = k_global;
+                rec.payload = add_string(v.as<global_obj>()->name);
+                break;
+            case o_vector:
+                rec.kind = k_vector;
+                add_items(v.as<vector_obj>()->items);
+                break;
+            case o_map:
+                rec.kind = k_map;
+                for (const auto& entry : v.as<map_obj>()->entries) {
+                    members.push_back(add_constant(entry.key));
+                    members.push_back(add_constant(entry.val));
+                }
+                break;
+            case o_set:
+                rec.kind = k_set;
+                for (value item : v.as<set_obj>()->items) {
+                    members.push_back(add_constant(item));
+                }
+                break;
+            case o_list:
+                rec.kind = k_list;
+                for (value item : v.as<list_obj>()->items) {
+                    members.push_back(add_constant(item));
+                }
+                break;
+            default:
+                failed = true;
+                break;
+        }
+    }
+
+    if (rec.kind >= k_vector) {
+        rec.payload = items.size();
+        rec.count = members.size();
+        items.insert(items.end(), members.begin(), members.end());
+    }
+
+    constants.push_back(rec);
+    return constants.size() - 1;
+}
+
+uint32_t
+bytecode_cache::writer::add_string(const std::string& str)
+{
+    auto found = interned.find(str);
+    if (found == interned.end()) {
+        found = interned.emplace(str, strings.size()).first;
+        strings.append(str);
+        strings.push_back('\0');
+    }
+    return found->second;
+}
+
+template<typename T>
+static void
+append_section(std::string& out, const std::vector<T>& items)
+{
+    out.append(reinterpret_cast<const char*>(items.data()),
+               items.size() * sizeof(T));
+    out.resize((out.size() + 7) & ~(size_t)7, '\0');
+}
+
+bool
+bytecode_cache::store(const std::string& source,
+                      uint32_t settings,
+                      const writer& module)
+{
+    if (!enabled || module.failed || !make_directories(directory)) {
+        return false;
+    }
+
+    module_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = magic;
+    header.format_version = format_version;
+    header.key = key_for(source, settings);
+    header.source_size = source.size();
+    header.toplevel_count = module.toplevel.size();
+    header.function_count = module.functions.size();
+    header.child_count = module.children.size();
+    header.capture_count = module.captures.size();
+    header.site_count = module.sites.size();
+    header.constant_count = module.constants.size();
+    header.item_count = module.items.size();
+    header.code_count = module.code.size();
+    header.string_bytes = module.strings.size();
+
+    std::string out;
+    out.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    append_section(out, module.toplevel);
+    append_section(out, module.functions);
+    append_section(out, module.children);
+    append_section(out, module.captures);
+    append_section(out, module.sites);
+    append_section(out, module.constants);
+    append_section(out, module.items);
+    append_section(out, module.code);
+    append_section(out, module.lines);
+    out.append(module.strings);
+
+    return write_file_atomic(path_for(header.key), out.data(), out.size());
+}
+
+// * Loading
+
+namespace {
+
+// Hands out the sections of a mapped module in order, checking each fits.
+struct section_reader
+{
+    const char* pos;
+    const char* end;
+
+    template<typename T>
+    const T* take(size_t count)
+    {
+        size_t size = count * sizeof(T);
+        size_t padded = (size + 7) & ~(size_t)7;
+        if (count > (size_t)(end - pos) / sizeof(T) ||
+            padded > (size_t)(end - pos)) {
+            return nullptr;
+        }
+        const T* items = reinterpret_cast<const T*>(pos);
+        pos += padded;
+        return items;
+    }
+};
+
+// Whether every operand of a function's code stays inside the function: its
+// registers, constants, children, captures and sites, and jumps and fall
+// through inside its code. The vm checks none of these as it runs.
+bool
+code_fits(const instr* code,
+          uint32_t count,
+          uint32_t regs,
+          uint32_t constants,
+          uint32_t children,
+          uint32_t captures,
+          uint32_t sites)
+{
+    auto jump_fits = [&](uint32_t pc, instr i) {
+        int64_t target = (int64_t)pc + 1 + instr_sbx(i);
+        return target >= 0 && target < count;
+    };
+    for (uint32_t pc = 0; pc < count; ++pc) {
+        instr i = code[pc];
+        opcode op = instr_op(i);
+        if (op >= op_count) {
+            return false;
+        }
+        uint32_t a = instr_a(i);
+        uint32_t b = instr_b(i);
+        uint32_t c = instr_c(i);
+        uint32_t bx = instr_bx(i);
+        bool fits = true;
+        switch (op) {
+            case op_jmp:
+                fits = jump_fits(pc, i);
+                break;
+            case op_jmpif:
+            case op_jmpifnot:
+                fits = a < regs && jump_fits(pc, i);
+                break;
+            case op_loadi:
+            case op_loadnil:
+            case op_loadtrue:
+            case op_loadfalse:
+            case op_ret:
+            case op_getglobal:
+            case op_setglobal:
+                fits = a < regs;
+                break;
+            case op_loadk:
+                fits = a < regs && bx < constants;
+                break;
+            case op_closure:
+                fits = a < regs && bx < children;
+                break;
+            case op_getcap:
+                fits = a < regs && b < captures;
+                break;
+            case op_check:
+                fits = a < regs && b < regs && c < checked_type_count;
+                break;
+            case op_call:
+            case op_tailcall:
+                fits = a + b < regs;
+                break;
+            case op_getfield:
+            case op_setfield:
+            case op_getmethod:
+                fits = a < regs && b < regs && c < sites;
+                break;
+            case op_vec:
+            case op_set:
+                fits = a < regs && b + c <= regs;
+                break;
+            case op_map:
+                fits = a < regs && b + 2 * c <= regs;
+                break;
+            case op_move_call:
+                // the call after it runs as part of it
+                fits = a < regs && b < regs && pc + 1 < count &&
+                       instr_op(code[pc + 1]) == op_call;
+                break;
+            case op_lt_jmpif:
+            case op_lt_jmpifnot:
+            case op_le_jmpif:
+            case op_le_jmpifnot:
+            case op_eq_jmpif:
+            case op_eq_jmpifnot:
+                // so does the jump after it, checked as one of its own
+                fits = a < regs && b < regs && c < regs && pc + 1 < count &&
+                       (instr_op(code[pc + 1]) == op_jmpif ||
+                        instr_op(code[pc + 1]) == op_jmpifnot);
+                break;
+            default:
+                switch (opcode_formats[op]) {
+                    case fmt_ab:
+                        fits = a < regs && b < regs;
+                        break;
+                    case fmt_abc:
+                        fits = a < regs && b < regs && c < regs;
+                        break;
+                    default:
+                        fits = false;
+                        break;
+                }
+                break;
+        }
+        // nothing may run off the end of the code
+        bool falls_through =
+          op != op_jmp && op != op_ret && op != op_tailcall;
+        if (!fits || (falls_through && pc + 1 >= count)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+bool
+bytecode_cache::load(const std::string& name,
+                     const std::string& source,
+                     uint32_t settings,
+                     vm& machine,
+                     std::vector<function_proto*>& toplevel)
+{
+    if (!enabled) {
+        return false;
+    }
+
+    uint64_t key = key_for(source, settings);
+
+    mapped_file file;
+    if (!file.open(path_for(key)) || file.size() < sizeof(module_header)) {
+        return false;
+    }
+
+    const module_header* header =
+      reinterpret_cast<const module_header*>(file.data());
+    if (header->magic != magic || header->format_version != format_version ||
+        header->key != key || header->source_size != source.size()) {
+        return false;
+    }
+
+    section_reader reader{ file.data() + sizeof(*header),
+                           file.data() + file.size() };
+    auto forms = reader.take<uint32_t>(header->toplevel_count);
+    auto functions = reader.take<function_record>(header->function_count);
+    auto children = reader.take<uint32_t>(header->child_count);
+    auto captures = reader.take<uint32_t>(header->capture_count);
+    auto sites = reader.take<uint32_t>(header->site_count);
+    auto records = reader.take<constant_record>(header->constant_count);
+    auto items = reader.take<uint32_t>(header->item_count);
+    auto code = reader.take<instr>(header->code_count);
+    auto lines = reader.take<int32_t>(header->code_count);
+    const char* strings = reader.pos;
+    if (!forms || !functions || !children || !captures || !sites ||
+        !records || !items || !code || !lines ||
+        (uint64_t)(reader.end - strings) != header->string_bytes) {
+        return false;
+    }
+
+    auto string_at = [&](uint64_t offset, const char*& str) {
+        if (offset >= header->string_bytes) {
+            return false;
+        }
+        str = strings + offset;
+        return memchr(str, '\0', header->string_bytes - offset) != nullptr;
+    };
+    auto run_fits = [](uint64_t first, uint64_t count, uint64_t size) {
+        return first <= size && count <= size - first;
+    };
+
+    // constants, each collection's items come before it
+    std::vector<value> pool;
+    pool.reserve(header->constant_count);
+    gc_heap& heap = machine.heap;
+    for (uint32_t n = 0; n < header->constant_count; ++n) {
+        const constant_record& rec = records[n];
+        const char* str;
+        value v;
+
+        if (rec.kind >= k_vector) {
+            if (!run_fits(rec.payload, rec.count, header->item_count)) {
+                return false;
+            }
+            for (uint32_t k = 0; k < rec.count; ++k) {
+                if (items[rec.payload + k] >= n) {
+                    return false;
+                }
+            }
+        }
+        auto item = [&](uint32_t k) { return pool[items[rec.payload + k]]; };
+
+        switch (rec.kind) {
+            case k_immediate:
+                v = value::from_bits(rec.payload);
+                if (v.is_object() || v.bits == value::unbound_bits) {
+                    return false;
+                }
+                break;
+            case k_int:
+                v = heap.make_int(rec.payload);
+                break;
+            case k_ratio: {
+                // only a ratio as make_ratio leaves it: a divider above 1 and
+                // parts with no common factor, which it gives back unchanged
+                int32_t counter = rec.payload;
+                int32_t divider = rec.count;
+                if (rec.payload > UINT32_MAX || divider <= 1) {
+                    return false;
+                }
+                v = make_ratio(heap, counter, divider);
+                if (!v.is_object(o_ratio) ||
+                    v.as<ratio_obj>()->num.counter != counter ||
+                    v.as<ratio_obj>()->num.divider != divider) {
+                    return false;
+                }
+            } break;
+            case k_string:
+                if (!string_at(rec.payload, str)) {
+                    return false;
+                }
+                v = heap.make_string(str);
+                break;
+            case k_keyword:
+                if (!string_at(rec.payload, str)) {
+                    return false;
+                }
+                v = heap.intern_keyword(str);
+                break;
+            case k_global:
+                if (!string_at(rec.payload, str)) {
+                    return false;
+                }
+                v = value::obj(machine.global(str));
+                break;
+            case k_vector: {
+                v = heap.make_vector(value_vec::from_sized(
+                  &runtime_allocator, rec.count, item));
+            } break;
+            case k_list: {
+                value_list list{ &runtime_allocator };
+                for (uint32_t k = rec.count; k > 0; --k) {
+                    list = list.conj(item(k - 1));
+                }
+                v = heap.make_list(list);
+            } break;
+            case k_map: {
+                value_map::tmap entries{ value_map{ &runtime_allocator } };
+                for (uint32_t k = 0; k + 1 < rec.count; k += 2) {
+                    entries.assoc(item(k), item(k + 1));
+                }
+                v = heap.make_map(entries.to_persistent());
+            } break;
+            case k_set: {
+                value_set::tset members{ value_set{ &runtime_allocator } };
+                for (uint32_t k = 0; k < rec.count; ++k) {
+                    members.conj(item(k));
+                }
+                v = heap.make_set(members.to_persistent());
+            } break;
+            default:
+                return false;
+        }
+        pool.push_back(v);
+    }
+
+    // check every function before creating any
+    for (uint32_t n = 0; n < header->function_count; ++n) {
+        const function_record& rec = functions[n];
+        const char* str;
+        if (!string_at(rec.name, str) ||
+            !run_fits(rec.code_first, rec.code_count, header->code_count) ||
+            !run_fits(
+              rec.constant_first, rec.constant_count, header->item_count) ||
+            !run_fits(rec.child_first, rec.child_count, header->child_count) ||
+            !run_fits(
+              rec.capture_first, rec.capture_count, header->capture_count) ||
+            !run_fits(rec.site_first, rec.site_count, header->site_count) ||
+            rec.num_regs < 1 || rec.num_regs > max_registers ||
+            rec.arity < 0 || rec.arity > rec.num_regs) {
+            return false;
+        }
+        for (uint32_t k = 0; k < rec.constant_count; ++k) {
+            if (items[rec.constant_first + k] >= header->constant_count) {
+                return false;
+            }
+        }
+        // globals are written through the cell, so that has to be one
+        for (uint32_t pc = 0; pc < rec.code_count; ++pc) {
+            instr i = code[rec.code_first + pc];
+            if (instr_op(i) == op_getglobal || instr_op(i) == op_setglobal) {
+                uint32_t k = instr_bx(i);
+                if (k >= rec.constant_count ||
+                    !pool[items[rec.constant_first + k]].is_object(o_global)) {
+                    return false;
+                }
+            }
+        }
+        if (!code_fits(code + rec.code_first,
+                       rec.code_count,
+                       rec.num_regs,
+                       rec.constant_count,
+                       rec.child_count,
+                       rec.capture_count,
+                       rec.site_count)) {
+            return false;
+        }
+        for (uint32_t k = 0; k < rec.site_count; ++k) {
+            if (!string_at(sites[rec.site_first + k], str)) {
+                return false;
+            }
+        }
+        for (uint32_t k = 0; k < rec.child_count; ++k) {
+            if (children[rec.child_first + k] >= header->function_count) {
+                return false;
+            }
+        }
+    }
+    // captures come from registers or captures of the enclosing function
+    for (uint32_t n = 0; n < header->function_count; ++n) {
+        const function_record& rec = functions[n];
+        for (uint32_t k = 0; k < rec.child_count; ++k) {
+            const function_record& child =
+              functions[children[rec.child_first + k]];
+            for (uint32_t c = 0; c < child.capture_count; ++c) {
+                uint32_t source = captures[child.capture_first + c];
+                uint32_t index = source & ~capture_from_enclosing;
+                uint32_t limit = source & capture_from_enclosing
+                                   ? rec.capture_count
+                                   : (uint32_t)rec.num_regs;
+                if (source >= 2 * capture_from_enclosing || index >= limit) {
+                    return false;
+                }
+            }
+        }
+    }
+    for (uint32_t n = 0; n < header->toplevel_count; ++n) {
+        if (forms[n] >= header->function_count ||
+            functions[forms[n]].capture_count != 0) {
+            return false;
+        }
+    }
+
+    std::vector<function_proto*> protos;
+    for (uint32_t n = 0; n < header->function_count; ++n) {
+        const function_record& rec = functions[n];
+        function_proto* proto = machine.new_proto();
+        proto->name = strings + rec.name;
+        proto->source_name = name;
+        proto->arity = rec.arity;
+        proto->num_regs = rec.num_regs;
+        proto->code.assign(code + rec.code_first,
+                           code + rec.code_first + rec.code_count);
+        proto->lines.assign(lines + rec.code_first,
+                            lines + rec.code_first + rec.code_count);
+        for (uint32_t k = 0; k < rec.constant_count; ++k) {
+            proto->constants.push_back(pool[items[rec.constant_first + k]]);
+        }
+        for (uint32_t k = 0; k < rec.capture_count; ++k) {
+            uint32_t source = captures[rec.capture_first + k];
+            proto->captures.push_back({ (source & capture_from_enclosing) != 0,
+                                        (uint8_t)source });
+        }
+        for (uint32_t k = 0; k < rec.site_count; ++k) {
+            proto->sites.push_back(
+              { strings + sites[rec.site_first + k], {} });
+        }
+        protos.push_back(proto);
+    }
+    for (uint32_t n = 0; n < header->function_count; ++n) {
+        const function_record& rec = functions[n];
+        for (uint32_t k = 0; k < rec.child_count; ++k) {
+            protos[n]->protos.push_back(protos[children[rec.child_first + k]]);
+        }
+    }
+
+    toplevel.clear();
+    for (uint32_t n = 0; n < header->toplevel_count; ++n) {
+        toplevel.push_back(protos[forms[n]]);
+    }
+    return true;
+}
@@ -0,0 +1,1431 @@
+#include "compiler.hpp"
+#include "ir.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+
+// destination for expressions whose value is not used
+static constexpr int no_reg = -1;
+
+compiler::compiler(vm* vm, const source_map* source)
+  : _vm(vm)
+  , _source(source)
+  , optimize(true)
+  , ir_dump(nullptr)
+  , superinstructions(true)
+  , fs(nullptr)
+  , cur_pos(0)
+{
+}
+
+function_proto*
+compiler::compile_toplevel(form* f)
+{
+    func_state top{ _vm->new_proto(), nullptr, {}, 0, {} };
+    top.proto->name = "toplevel";
+    top.proto->source_name = _source ? _source->name : "";
+    fs = &top;
+    cur_pos = f->filepos;
+
+    try {
+        int result = alloc_reg();
+        expr(f, result);
+        emit(encode_abc(op_ret, result, 0, 0));
+        if (optimize) {
+            optimize_proto(top.proto, ir_dump);
+        }
+        if (superinstructions) {
+            fuse_superinstructions(top.proto);
+        }
+    } catch (...) {
+        fs = nullptr;
+        throw;
+    }
+
+    fs = nullptr;
+    return top.proto;
+}
+
+void
+compiler::error(const std::string& message)
+{
+    std::ostringstream msg;
+    if (_source) {
+        msg << _source->name << ":" << line() << ": ";
+    }
+    msg << message;
+    throw compile_error(msg.str());
+}
+
+int
+compiler::line() const
+{
+    return _source ? _source->line_of(cur_pos) : 0;
+}
+
+// * Emitting code
+
+size_t
+compiler::emit(instr i)
+{
+    fs->proto->code.push_back(i);
+    fs->proto->lines.push_back(line());
+    return fs->proto->code.size() - 1;
+}
+
+size_t
+compiler::emit_jump(opcode op, int a)
+{
+    return emit(encode_asbx(op, a, 0));
+}
+
+void
+compiler::patch_jump(size_t at)
+{
+    auto& code = fs->proto->code;
+    long offset = code.size() - (at + 1);
+    if (offset > max_bx - sbx_bias) {
+        error("jump too far");
+    }
+    code[at] = encode_asbx(instr_op(code[at]), instr_a(code[at]), offset);
+}
+
+void
+compiler::emit_loop(size_t target)
+{
+    long offset = (long)target - (long)(fs->proto->code.size() + 1);
+    if (offset < -sbx_bias) {
+        error("loop body too large");
+    }
+    emit(encode_asbx(op_jmp, 0, offset));
+}
+
+void
+compiler::emit_move(int dest, int src)
+{
+    if (dest != src && dest != no_reg) {
+        emit(encode_abc(op_move, dest, src, 0));
+    }
+}
+
+// * Registers and constants
+
+int
+compiler::alloc_reg()
+{
+    int reg = fs->free_reg++;
+    if (fs->free_reg > max_registers) {
+        error("function needs too many registers");
+    }
+    fs->proto->num_regs = std::max(fs->proto->num_regs, fs->free_reg);
+    return reg;
+}
+
+void
+compiler::free_to(int reg)
+{
+    fs->free_reg = reg;
+}
+
+int
+compiler::active_local_regs() const
+{
+    return fs->locals.empty() ? 0 : fs->locals.back().reg + 1;
+}
+
+size_t
+compiler::constant_hasher::operator()(value v) const
+{
+    return value_hash(v);
+}
+
+bool
+compiler::same_constant::operator()(value a, value b) const
+{
+    if (a.is_decimal() && b.is_decimal()) {
+        return a.bits == b.bits;
+    }
+    return values_equal(a, b);
+}
+
+static bool
+is_collection(value v)
+{
+    return v.is_object(o_vector) || v.is_object(o_list) ||
+           v.is_object(o_map) || v.is_object(o_set) ||
+           v.is_object(o_sorted_map);
+}
+
+int
+compiler::add_constant(value v)
+{
+    auto& constants = fs->proto->constants;
+    bool pooled = !is_collection(v);
+    if (pooled) {
+        auto found = fs->constant_index.find(v);
+        if (found != fs->constant_index.end()) {
+            return found->second;
+        }
+    }
+    if (constants.size() > (size_t)max_bx) {
+        error("too many constants in one function");
+    }
+    if (pooled) {
+        fs->constant_index.emplace(v, constants.size());
+    }
+    constants.push_back(v);
+    return constants.size() - 1;
+}
+
+int
+compiler::global_constant(const std::string& name)
+{
+    return add_constant(value::obj(_vm->global(name)));
+}
+
+// Calls to these compile to instructions or fold to constants wherever the
+// name is not bound locally, so a global of the same name would only be seen
+// by callers passing the function around.
+static const char* const inline_operators[] = { "+", "-", "*",  "/",  "=",
+                                                "<", "<=", ">", ">=", "not" };
+
+int
+compiler::global_target(const std::string& name)
+{
+    for (const char* op : inline_operators) {
+        if (name == op) {
+            error("can not redefine builtin operator " + name);
+        }
+    }
+    return global_constant(name);
+}
+
+const compiler::local*
+compiler::find_local(const std::string& name, func_state* state) const
+{
+    for (auto it = state->locals.rbegin(); it != state->locals.rend(); ++it) {
+        if (it->name == name) {
+            return &*it;
+        }
+    }
+    return nullptr;
+}
+
+compiler::variable
+compiler::resolve(const std::string& name, func_state* state)
+{
+    if (const local* l = find_local(name, state)) {
+        return { variable::local, l->reg, l->boxed, l->hint };
+    }
+    for (size_t n = 0; n < state->captures.size(); ++n) {
+        auto& cap = state->captures[n];
+        if (cap.name == name) {
+            return { variable::capture, (int)n, cap.boxed, cap.hint };
+        }
+    }
+    if (!state->parent) {
+        return { variable::global, 0, false, hint_none };
+    }
+
+    variable outer = resolve(name, state->parent);
+    if (outer.kind == variable::global) {
+        return outer;
+    }
+    if (state->captures.size() > 0xff) {
+        error("function captures too many variables");
+    }
+    state->captures.push_back({ name, outer.boxed, outer.hint });
+    state->proto->captures.push_back(
+      { outer.kind == variable::capture, (uint8_t)outer.index });
+    return { variable::capture,
+             (int)state->captures.size() - 1,
+             outer.boxed,
+             outer.hint };
+}
+
+bool
+compiler::bound_locally(const std::string& name) const
+{
+    for (func_state* state = fs; state; state = state->parent) {
+        if (find_local(name, state)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<std::string>
+compiler::path(const std::string& name) const
+{
+    std::vector<std::string> parts;
+    if (name.find('.') == std::string::npos || bound_locally(name)) {
+        return parts;
+    }
+    size_t start = 0;
+    for (;;) {
+        size_t dot = name.find('.', start);
+        std::string part = name.substr(start, dot - start);
+        if (part.empty()) {
+            parts.clear();
+            return parts;
+        }
+        parts.push_back(part);
+        if (dot == std::string::npos) {
+            return parts;
+        }
+        start = dot + 1;
+    }
+}
+
+int
+compiler::add_site(const std::string& name)
+{
+    auto& sites = fs->proto->sites;
+    if (sites.size() > 0xff) {
+        error("too many field accesses in one function");
+    }
+    sites.push_back({ name, {} });
+    return sites.size() - 1;
+}
+
+void
+compiler::declare(const std::string& name,
+                  int reg,
+                  bool boxed,
+                  type_hint hint)
+{
+    emit_check(reg, hint);
+    if (boxed) {
+        emit(encode_abc(op_box, reg, reg, 0));
+    }
+    fs->locals.push_back({ name, reg, boxed, hint, false, {} });
+}
+
+void
+compiler::emit_check(int reg, type_hint hint)
+{
+    if (hint != hint_none) {
+        checked_type type = hint == hint_int ? checked_int : checked_decimal;
+        emit(encode_abc(op_check, reg, reg, type));
+    }
+}
+
+// How a scope uses a name. Shadowing is not tracked, so this errs on the side
+// of boxing and not lifting.
+struct name_use
+{
+    // referred to inside a nested function
+    bool captured = false;
+    bool assigned = false;
+    // used other than as the head of a call with the given number of
+    // arguments
+    bool escapes = false;
+};
+
+// the variable a symbol reads, the first part of a field path
+static std::string
+symbol_root(form* f)
+{
+    std::string name = f->str();
+    size_t dot = name.find('.');
+    return dot == 0 || dot == std::string::npos ? name : name.substr(0, dot);
+}
+
+static void
+scan_uses(form* f,
+          const std::string& name,
+          size_t arity,
+          bool in_fn,
+          name_use& use)
+{
+    if (f->type == f_symbol) {
+        if (f->str() == name || symbol_root(f) == name) {
+            use.captured = use.captured || in_fn;
+            use.escapes = true;
+        }
+        return;
+    }
+
+    size_t first = 0;
+    if (f->type == f_list && !f->items.empty()) {
+        form* head = f->items[0];
+        if (head->type == f_symbol && head->str() == name) {
+            use.captured = use.captured || in_fn;
+            use.escapes =
+              use.escapes || in_fn || f->items.size() - 1 != arity;
+            first = 1;
+        } else if (head->is_symbol("set!") && f->items.size() == 3 &&
+                   f->items[1]->type == f_symbol &&
+                   f->items[1]->str() == name) {
+            use.assigned = true;
+        } else if (head->is_symbol("fn") || head->is_symbol("defn")) {
+            in_fn = true;
+        }
+    }
+    for (size_t i = first; i < f->items.size(); ++i) {
+        scan_uses(f->items[i], name, arity, in_fn, use);
+    }
+}
+
+static name_use
+scan_scope(const std::vector<form*>& scope,
+           const std::string& name,
+           size_t arity = 0)
+{
+    name_use use;
+    for (form* f : scope) {
+        scan_uses(f, name, arity, false, use);
+    }
+    return use;
+}
+
+static void
+collect_symbols(form* f, std::vector<std::string>& names)
+{
+    if (f->type == f_symbol) {
+        for (std::string name : { f->str(), symbol_root(f) }) {
+            if (std::find(names.begin(), names.end(), name) == names.end()) {
+                names.push_back(name);
+            }
+        }
+        return;
+    }
+    for (form* item : f->items) {
+        collect_symbols(item, names);
+    }
+}
+
+// * Expressions
+
+void
+compiler::expr(form* f, int dest)
+{
+    long saved_pos = cur_pos;
+    cur_pos = f->filepos;
+
+    if (dest == no_reg && f->type != f_list) {
+        // atoms have no effects, literals are built for nothing
+        if (f->type == f_vector || f->type == f_map || f->type == f_set) {
+            int save = fs->free_reg;
+            expr(f, alloc_reg());
+            free_to(save);
+        }
+        cur_pos = saved_pos;
+        return;
+    }
+
+    value constant;
+    if (constant_value(f, constant)) {
+        emit_constant(dest, constant);
+        cur_pos = saved_pos;
+        return;
+    }
+
+    switch (f->type) {
+        case f_symbol:
+            symbol(f, dest);
+            break;
+        case f_list:
+            list(f, dest);
+            break;
+        case f_vector:
+            literal_seq(f, dest, op_vec);
+            break;
+        case f_map:
+            literal_seq(f, dest, op_map);
+            break;
+        case f_set:
+            literal_seq(f, dest, op_set);
+            break;
+        default:
+            error("unexpected form");
+    }
+
+    cur_pos = saved_pos;
+}
+
+// * Constant folding
+//
+// Literals, collection literals made only of constants and operator forms
+// over constants are evaluated while compiling, with the same runtime
+// functions the instructions would call, and become a single load. Forms
+// whose evaluation fails, such as (/ 1 0), are left for the vm to report.
+
+void
+compiler::emit_constant(int dest, value v)
+{
+    if (dest == no_reg) {
+        return;
+    }
+    if (v.is_nil()) {
+        emit(encode_abc(op_loadnil, dest, 0, 0));
+    } else if (v.is_bool()) {
+        emit(encode_abc(v.as_bool() ? op_loadtrue : op_loadfalse, dest, 0, 0));
+    } else if (v.is_fixnum() && v.as_fixnum() >= -sbx_bias &&
+               v.as_fixnum() <= max_bx - sbx_bias) {
+        emit(encode_asbx(op_loadi, dest, v.as_fixnum()));
+    } else {
+        emit(encode_abx(op_loadk, dest, add_constant(v)));
+    }
+}
+
+bool
+compiler::constant_value(form* f, value& out)
+{
+    gc_heap& heap = _vm->heap;
+
+    switch (f->type) {
+        case f_nil:
+            out = value::nil();
+            return true;
+        case f_true:
+            out = value::boolean(true);
+            return true;
+        case f_false:
+            out = value::boolean(false);
+            return true;
+        case f_integer:
+            out = heap.make_int(f->data_int);
+            return true;
+        case f_decimal:
+            out = value::decimal(f->data_decimal);
+            return true;
+        case f_ratio:
+            out = make_ratio(heap, f->data_rat.counter, f->data_rat.divider);
+            return true;
+        case f_chr:
+            out = value::character(f->data_char);
+            return true;
+        case f_str:
+            out = heap.make_string(f->str());
+            return true;
+        case f_keyword:
+            out = heap.intern_keyword(f->str());
+            return true;
+        case f_symbol:
+            return false;
+        case f_list:
+            if (f->items.empty()) {
+                out = heap.make_list(value_list{ &runtime_allocator });
+                return true;
+            }
+            return fold_operator(f, out);
+        case f_vector:
+        case f_map:
+        case f_set:
+            break;
+    }
+
+    std::vector<value> items;
+    for (form* item : f->items) {
+        value v;
+        if (!constant_value(item, v)) {
+            return false;
+        }
+        items.push_back(v);
+    }
+
+    if (f->type == f_vector) {
+        out = heap.make_vector(value_vec::from_range(
+          &runtime_allocator, items.data(), items.data() + items.size()));
+    } else if (f->type == f_map) {
+        value_map::tmap entries{ value_map{ &runtime_allocator } };
+        for (size_t i = 0; i + 1 < items.size(); i += 2) {
+            entries.assoc(items[i], items[i + 1]);
+        }
+        out = heap.make_map(entries.to_persistent());
+    } else {
+        value_set::tset members{ value_set{ &runtime_allocator } };
+        for (value v : items) {
+            members.conj(v);
+        }
+        out = heap.make_set(members.to_persistent());
+    }
+    return true;
+}
+
+bool
+compiler::fold_operator(form* f, value& out)
+{
+    form* head = f->items[0];
+    if (head->type != f_symbol || bound_locally(head->str())) {
+        return false;
+    }
+
+    static const char* foldable[] = { "+", "-", "*",  "/",  "=",   "<",  "<=",
+                                      ">", ">=", "not", "and", "or" };
+    bool known = false;
+    for (const char* name : foldable) {
+        known = known || head->is_symbol(name);
+    }
+    if (!known) {
+        return false;
+    }
+
+    std::vector<value> args;
+    for (size_t i = 1; i < f->items.size(); ++i) {
+        value v;
+        if (!constant_value(f->items[i], v)) {
+            return false;
+        }
+        args.push_back(v);
+    }
+
+    gc_heap& heap = _vm->heap;
+    size_t argc = args.size();
+
+    try {
+        if (head->is_symbol("+") || head->is_symbol("*")) {
+            bool add = head->is_symbol("+");
+            out = argc > 0 ? args[0] : value::fixnum(add ? 0 : 1);
+            for (size_t i = 1; i < argc; ++i) {
+                out = add ? value_add(heap, out, args[i])
+                          : value_mul(heap, out, args[i]);
+            }
+            return true;
+        }
+        if (head->is_symbol("-") || head->is_symbol("/")) {
+            bool sub = head->is_symbol("-");
+            if (argc == 0) {
+                return false;
+            }
+            if (argc == 1) {
+                out = sub ? value_neg(heap, args[0])
+                          : value_div(heap, value::fixnum(1), args[0]);
+                return true;
+            }
+            out = args[0];
+            for (size_t i = 1; i < argc; ++i) {
+                out = sub ? value_sub(heap, out, args[i])
+                          : value_div(heap, out, args[i]);
+            }
+            return true;
+        }
+        if (head->is_symbol("not")) {
+            if (argc != 1) {
+                return false;
+            }
+            out = value::boolean(!args[0].truthy());
+            return true;
+        }
+        if (head->is_symbol("and") || head->is_symbol("or")) {
+            bool is_and = head->is_symbol("and");
+            out = is_and ? value::boolean(true) : value::nil();
+            for (value v : args) {
+                out = v;
+                if (v.truthy() != is_and) {
+                    break;
+                }
+            }
+            return true;
+        }
+
+        // comparisons fold for two arguments, like they compile
+        if (argc != 2) {
+            return false;
+        }
+        if (head->is_symbol("=")) {
+            out = value::boolean(values_equal(args[0], args[1]));
+        } else {
+            int order = compare_values(args[0], args[1]);
+            out = value::boolean(
+              head->is_symbol("<")    ? order < 0
+              : head->is_symbol("<=") ? order <= 0
+              : head->is_symbol(">")  ? order > 0
+                                      : order >= 0);
+        }
+        return true;
+    } catch (vm_error&) {
+        return false;
+    }
+}
+
+int
+compiler::expr_any(form* f)
+{
+    if (f->type == f_symbol) {
+        variable v = resolve(f->str(), fs);
+        if (v.kind == variable::local && !v.boxed) {
+            return v.index;
+        }
+    }
+    int reg = alloc_reg();
+    expr(f, reg);
+    return reg;
+}
+
+void
+compiler::body(const std::vector<form*>& forms, size_t first, int dest)
+{
+    if (first >= forms.size()) {
+        if (dest != no_reg) {
+            emit(encode_abc(op_loadnil, dest, 0, 0));
+        }
+        return;
+    }
+    for (size_t i = first; i + 1 < forms.size(); ++i) {
+        int save = fs->free_reg;
+        expr(forms[i], no_reg);
+        free_to(save);
+    }
+    expr(forms.back(), dest);
+}
+
+void
+compiler::symbol(form* f, int dest)
+{
+    auto parts = path(f->str());
+    if (!parts.empty()) {
+        path_ref(parts, parts.size(), dest);
+    } else {
+        variable_ref(f->str(), dest);
+    }
+}
+
+void
+compiler::variable_ref(const std::string& name, int dest)
+{
+    variable v = resolve(name, fs);
+
+    switch (v.kind) {
+        case variable::local:
+            if (v.boxed) {
+                emit(encode_abc(op_getbox, dest, v.index, 0));
+            } else {
+                emit_move(dest, v.index);
+            }
+            break;
+        case variable::capture:
+            emit(encode_abc(op_getcap, dest, v.index, 0));
+            if (v.boxed) {
+                emit(encode_abc(op_getbox, dest, dest, 0));
+            }
+            break;
+        case variable::global:
+            emit(encode_abx(op_getglobal, dest, global_constant(name)));
+            break;
+    }
+}
+
+void
+compiler::path_ref(const std::vector<std::string>& parts,
+                   size_t count,
+                   int dest)
+{
+    variable_ref(parts[0], dest);
+    for (size_t i = 1; i < count; ++i) {
+        emit(encode_abc(op_getfield, dest, dest, add_site(parts[i])));
+    }
+}
+
+void
+compiler::literal_seq(form* f, int dest, opcode op)
+{
+    size_t count = f->items.size();
+    size_t elements = op == op_map ? count / 2 : count;
+    if (elements > 0xff || count > (size_t)(max_registers / 2)) {
+        error("literal has too many elements");
+    }
+
+    int save = fs->free_reg;
+    int first = fs->free_reg;
+    for (form* item : f->items) {
+        expr(item, alloc_reg());
+    }
+    emit(encode_abc(op, dest, first, elements));
+    free_to(save);
+}
+
+void
+compiler::list(form* f, int dest)
+{
+    if (f->items.empty()) {
+        if (dest != no_reg) {
+            value empty =
+              _vm->heap.make_list(value_list{ &runtime_allocator });
+            emit(encode_abx(op_loadk, dest, add_constant(empty)));
+        }
+        return;
+    }
+
+    form* head = f->items[0];
+    if (head->type == f_symbol && !bound_locally(head->str())) {
+        if (head->is_symbol("def")) {
+            return def(f, dest);
+        } else if (head->is_symbol("defn")) {
+            return defn(f, dest);
+        } else if (head->is_symbol("defstruct")) {
+            return defstruct(f, dest);
+        } else if (head->is_symbol("let")) {
+            return let(f, dest);
+        } else if (head->is_symbol("fn")) {
+            if (dest != no_reg) {
+                fn(f, dest, "");
+            }
+            return;
+        } else if (head->is_symbol("if")) {
+            return if_(f, dest);
+        } else if (head->is_symbol("do")) {
+            return do_(f, dest);
+        } else if (head->is_symbol("while")) {
+            return while_(f, dest);
+        } else if (head->is_symbol("set!")) {
+            return set(f, dest);
+        } else if (head->is_symbol("and")) {
+            return logic(f, dest, true);
+        } else if (head->is_symbol("or")) {
+            return logic(f, dest, false);
+        }
+
+        int save = fs->free_reg;
+        int target = dest == no_reg ? alloc_reg() : dest;
+        bool handled = builtin_op(f, target);
+        free_to(save);
+        if (handled) {
+            return;
+        }
+    }
+
+    call(f, dest);
+}
+
+void
+compiler::call(form* f, int dest)
+{
+    // a lambda lifted function gets its free variables after the arguments
+    std::vector<free_var> lifted;
+    // a method call passes the instance first
+    std::vector<std::string> method;
+    if (f->items[0]->type == f_symbol) {
+        const local* callee = find_local(f->items[0]->str(), fs);
+        if (callee && callee->lifted_fn) {
+            lifted = callee->lifted;
+        }
+        method = path(f->items[0]->str());
+    }
+
+    size_t argc = f->items.size() - 1 + lifted.size() + !method.empty();
+    if (argc > 0xff) {
+        error("too many arguments in call");
+    }
+
+    // an expression temporary on top of the stack can hold the callee
+    bool reuse = dest != no_reg && dest == fs->free_reg - 1 &&
+                 dest >= active_local_regs();
+    int base = reuse ? dest : alloc_reg();
+
+    if (method.empty()) {
+        expr(f->items[0], base);
+    } else {
+        int self = alloc_reg();
+        path_ref(method, method.size() - 1, self);
+        cur_pos = f->filepos;
+        emit(encode_abc(op_getmethod, base, self, add_site(method.back())));
+    }
+    for (size_t i = 1; i < f->items.size(); ++i) {
+        expr(f->items[i], alloc_reg());
+    }
+    for (auto& var : lifted) {
+        // boxes are passed as they are
+        int reg = alloc_reg();
+        if (var.source.kind == variable::local) {
+            emit_move(reg, var.source.index);
+        } else {
+            emit(encode_abc(op_getcap, reg, var.source.index, 0));
+        }
+    }
+
+    cur_pos = f->filepos;
+    emit(encode_abc(op_call, base, argc, 0));
+
+    if (reuse) {
+        free_to(base + 1);
+    } else {
+        emit_move(dest, base);
+        free_to(base);
+    }
+}
+
+// Arithmetic and comparison on known operator names compile to instructions
+// instead of calls. Returns false for shapes that have to go through the
+// variadic builtin.
+bool
+compiler::builtin_op(form* f, int dest)
+{
+    form* head = f->items[0];
+    size_t argc = f->items.size() - 1;
+    auto arg = [&](size_t n) { return f->items[n + 1]; };
+
+    struct binop
+    {
+        const char* name;
+        opcode op;
+        bool swap;
+    };
+    static const binop arith_ops[] = { { "+", op_add, false },
+                                       { "-", op_sub, false },
+                                       { "*", op_mul, false },
+                                       { "/", op_div, false } };
+    static const binop compare_ops[] = { { "=", op_eq, false },
+                                         { "<", op_lt, false },
+                                         { "<=", op_le, false },
+                                         { ">", op_lt, true },
+                                         { ">=", op_le, true } };
+
+    int save = fs->free_reg;
+
+    for (auto& op : arith_ops) {
+        if (!head->is_symbol(op.name)) {
+            continue;
+        }
+
+        if (argc == 0) {
+            if (op.op == op_sub || op.op == op_div) {
+                return false;
+            }
+            emit(encode_asbx(op_loadi, dest, op.op == op_mul ? 1 : 0));
+            return true;
+        }
+
+        if (argc == 1) {
+            if (op.op == op_sub) {
+                int r = expr_any(arg(0));
+                emit(encode_abc(op_neg, dest, r, 0));
+            } else if (op.op == op_div) {
+                int one = alloc_reg();
+                emit(encode_asbx(op_loadi, one, 1));
+                int r = expr_any(arg(0));
+                emit(encode_abc(op_div, dest, one, r));
+            } else {
+                expr(arg(0), dest);
+            }
+            free_to(save);
+            return true;
+        }
+
+        int rb = expr_any(arg(0));
+        int rc = expr_any(arg(1));
+        emit(encode_abc(op.op, dest, rb, rc));
+        free_to(save);
+
+        for (size_t n = 2; n < argc; ++n) {
+            int r = expr_any(arg(n));
+            emit(encode_abc(op.op, dest, dest, r));
+            free_to(save);
+        }
+        return true;
+    }
+
+    for (auto& op : compare_ops) {
+        if (!head->is_symbol(op.name)) {
+            continue;
+        }
+        if (argc != 2) {
+            return false;
+        }
+        int rb = expr_any(arg(0));
+        int rc = expr_any(arg(1));
+        if (op.swap) {
+            std::swap(rb, rc);
+        }
+        emit(encode_abc(op.op, dest, rb, rc));
+        free_to(save);
+        return true;
+    }
+
+    if (head->is_symbol("not") && argc == 1) {
+        int r = expr_any(arg(0));
+        emit(encode_abc(op_lnot, dest, r, 0));
+        free_to(save);
+        return true;
+    }
+
+    return false;
+}
+
+// * Special forms
+
+static bool
+is_fn_form(form* f)
+{
+    return f->type == f_list && !f->items.empty() &&
+           f->items[0]->is_symbol("fn");
+}
+
+void
+compiler::def(form* f, int dest)
+{
+    if (f->items.size() < 2 || f->items.size() > 3 ||
+        f->items[1]->type != f_symbol) {
+        error("def expects a symbol and a value");
+    }
+
+    if (f->items[1]->hint != hint_none) {
+        error("type hints only apply to locals");
+    }
+
+    std::string name = f->items[1]->str();
+    int save = fs->free_reg;
+    int reg;
+
+    if (f->items.size() == 2) {
+        reg = alloc_reg();
+        emit(encode_abc(op_loadnil, reg, 0, 0));
+    } else if (is_fn_form(f->items[2])) {
+        reg = alloc_reg();
+        fn(f->items[2], reg, name);
+    } else {
+        reg = expr_any(f->items[2]);
+    }
+
+    emit(encode_abx(op_setglobal, reg, global_target(name)));
+    emit_move(dest, reg);
+    free_to(save);
+}
+
+void
+compiler::defn(form* f, int dest)
+{
+    if (f->items.size() < 3 || f->items[1]->type != f_symbol) {
+        error("defn expects a name, parameters and a body");
+    }
+
+    // (defn name [params] body...) is (def name (fn name [params] body...))
+    std::string name = f->items[1]->str();
+    int save = fs->free_reg;
+    int reg = alloc_reg();
+
+    form fn_form{ f_list, f->filepos };
+    fn_form.items.push_back(f->items[0]);
+    fn_form.items.insert(
+      fn_form.items.end(), f->items.begin() + 2, f->items.end());
+    fn(&fn_form, reg, name);
+
+    emit(encode_abx(op_setglobal, reg, global_target(name)));
+    emit_move(dest, reg);
+    free_to(save);
+}
+
+// (defstruct name [fields...] (method [params] body...)...) defines name as
+// (struct-type "name" [:fields...] :method (fn [this params] body...) ...)
+void
+compiler::defstruct(form* f, int dest)
+{
+    if (f->items.size() < 3 || f->items[1]->type != f_symbol ||
+        f->items[2]->type != f_vector) {
+        error("defstruct expects a name and a vector of fields");
+    }
+
+    std::string name = f->items[1]->str();
+    gc_heap& heap = _vm->heap;
+
+    value_vec::tvec fields{ &runtime_allocator };
+    for (form* field : f->items[2]->items) {
+        if (field->type != f_symbol ||
+            field->str().find('.') != std::string::npos) {
+            error("struct fields must be symbols without dots");
+        }
+        fields.conj(heap.intern_keyword(field->str()));
+    }
+    if (2 + 2 * (f->items.size() - 3) > 0xff) {
+        error("too many methods in defstruct");
+    }
+
+    int save = fs->free_reg;
+    int base = alloc_reg();
+    emit(encode_abx(op_getglobal, base, global_constant("struct-type")));
+    emit_constant(alloc_reg(), heap.make_string(name));
+    emit_constant(alloc_reg(), heap.make_vector(fields.to_persistent()));
+
+    static char this_name[] = "this";
+    form this_param{ f_symbol, f->filepos };
+    this_param.data_str = { sizeof this_name - 1, this_name };
+    for (size_t i = 3; i < f->items.size(); ++i) {
+        form* method = f->items[i];
+        if (method->type != f_list || method->items.size() < 2 ||
+            method->items[0]->type != f_symbol ||
+            method->items[1]->type != f_vector) {
+            error("defstruct methods are (name [params] body...)");
+        }
+        std::string method_name = method->items[0]->str();
+        emit_constant(alloc_reg(), heap.intern_keyword(method_name));
+
+        // (fn [this params...] body...)
+        form params{ f_vector, method->items[1]->filepos };
+        params.items.push_back(&this_param);
+        params.items.insert(params.items.end(),
+                            method->items[1]->items.begin(),
+                            method->items[1]->items.end());
+        form fn_form{ f_list, method->filepos };
+        fn_form.items.push_back(method->items[0]);
+        fn_form.items.push_back(&params);
+        fn_form.items.insert(
+          fn_form.items.end(), method->items.begin() + 2, method->items.end());
+        fn(&fn_form, alloc_reg(), name + "." + method_name);
+    }
+
+    cur_pos = f->filepos;
+    emit(encode_abc(op_call, base, fs->free_reg - base - 1, 0));
+    emit(encode_abx(op_setglobal, base, global_target(name)));
+    emit_move(dest, base);
+    free_to(save);
+}
+
+void
+compiler::let(form* f, int dest)
+{
+    if (f->items.size() < 2 || f->items[1]->type != f_vector ||
+        f->items[1]->items.size() % 2 != 0) {
+        error("let expects a vector of bindings");
+    }
+
+    int save = fs->free_reg;
+    size_t nlocals = fs->locals.size();
+
+    auto& bindings = f->items[1]->items;
+    for (size_t i = 0; i < bindings.size(); i += 2) {
+        if (bindings[i]->type != f_symbol) {
+            error("let can only bind symbols");
+        }
+        std::string name = bindings[i]->str();
+
+        // what the binding is visible to
+        std::vector<form*> scope;
+        for (size_t j = i + 3; j < bindings.size(); j += 2) {
+            scope.push_back(bindings[j]);
+        }
+        scope.insert(scope.end(), f->items.begin() + 2, f->items.end());
+
+        int reg = alloc_reg();
+        std::vector<free_var> lifted;
+        if (is_fn_form(bindings[i + 1]) &&
+            lift(bindings[i + 1], name, scope, lifted)) {
+            fn(bindings[i + 1], reg, "", &lifted);
+            declare(name, reg, false, bindings[i]->hint);
+            fs->locals.back().lifted_fn = true;
+            fs->locals.back().lifted = std::move(lifted);
+            continue;
+        }
+
+        expr(bindings[i + 1], reg);
+        name_use use = scan_scope(scope, name);
+        declare(name, reg, use.captured && use.assigned, bindings[i]->hint);
+    }
+
+    body(f->items, 2, dest);
+
+    fs->locals.resize(nlocals);
+    free_to(save);
+}
+
+// the parameter vector of a fn form, nullptr if it has none
+static form*
+fn_params(form* f)
+{
+    size_t params_at =
+      f->items.size() > 1 && f->items[1]->type == f_symbol ? 2 : 1;
+    if (f->items.size() <= params_at ||
+        f->items[params_at]->type != f_vector) {
+        return nullptr;
+    }
+    return f->items[params_at];
+}
+
+// Decides whether a function bound to a local in scope can be lambda lifted
+// and finds what it would need passed: it can when the local is only ever
+// called, with as many arguments as the function takes, and never from
+// another function, so no closure of it can outlive the frame defining it.
+bool
+compiler::lift(form* fn_form,
+               const std::string& name,
+               const std::vector<form*>& scope,
+               std::vector<free_var>& lifted)
+{
+    form* params = fn_params(fn_form);
+    if (!params) {
+        return false;
+    }
+    std::vector<std::string> param_names;
+    for (form* param : params->items) {
+        if (param->type != f_symbol) {
+            return false;
+        }
+        param_names.push_back(param->str());
+    }
+
+    name_use use = scan_scope(scope, name, param_names.size());
+    if (use.captured || use.assigned || use.escapes) {
+        return false;
+    }
+
+    std::vector<std::string> names;
+    for (size_t i = 1; i < fn_form->items.size(); ++i) {
+        collect_symbols(fn_form->items[i], names);
+    }
+    for (auto& free : names) {
+        if (std::find(param_names.begin(), param_names.end(), free) ==
+              param_names.end() &&
+            bound_locally(free)) {
+            lifted.push_back({ free, resolve(free, fs) });
+        }
+    }
+    if (param_names.size() + lifted.size() > (size_t)max_registers / 2) {
+        lifted.clear();
+        return false;
+    }
+    return true;
+}
+
+void
+compiler::fn(form* f,
+             int dest,
+             const std::string& name,
+             const std::vector<free_var>* lifted)
+{
+    size_t params_at = 1;
+    std::string fn_name = name;
+    if (f->items.size() > 1 && f->items[1]->type == f_symbol) {
+        fn_name = f->items[1]->str();
+        params_at = 2;
+    }
+    if (f->items.size() <= params_at ||
+        f->items[params_at]->type != f_vector) {
+        error("fn expects a parameter vector");
+    }
+
+    auto& params = f->items[params_at]->items;
+    std::vector<form*> scope(f->items.begin() + params_at + 1, f->items.end());
+
+    func_state child{ _vm->new_proto(), fs, {}, 0, {} };
+    child.proto->name = fn_name;
+    child.proto->source_name = _source ? _source->name : "";
+    child.proto->arity = params.size() + (lifted ? lifted->size() : 0);
+
+    fs = &child;
+    try {
+        std::vector<bool> boxed;
+        for (form* param : params) {
+            if (param->type != f_symbol) {
+                error("fn parameters must be symbols");
+            }
+            name_use use = scan_scope(scope, param->str());
+            boxed.push_back(use.captured && use.assigned);
+            fs->locals.push_back(
+              { param->str(), alloc_reg(), false, param->hint, false, {} });
+        }
+        if (lifted) {
+            // already boxed and checked where the variables are declared
+            for (auto& var : *lifted) {
+                fs->locals.push_back({ var.name,
+                                       alloc_reg(),
+                                       var.source.boxed,
+                                       var.source.hint,
+                                       false,
+                                       {} });
+            }
+        }
+        for (size_t n = 0; n < params.size(); ++n) {
+            emit_check(n, params[n]->hint);
+            if (boxed[n]) {
+                emit(encode_abc(op_box, n, n, 0));
+                fs->locals[n].boxed = true;
+            }
+        }
+
+        int result = alloc_reg();
+        body(f->items, params_at + 1, result);
+        emit(encode_abc(op_ret, result, 0, 0));
+        if (optimize) {
+            optimize_proto(child.proto, ir_dump);
+        }
+        mark_tail_calls(child.proto);
+        if (superinstructions) {
+            fuse_superinstructions(child.proto);
+        }
+    } catch (...) {
+        fs = child.parent;
+        throw;
+    }
+    fs = child.parent;
+
+    fs->proto->protos.push_back(child.proto);
+    emit(encode_abx(op_closure, dest, fs->proto->protos.size() - 1));
+}
+
+void
+compiler::if_(form* f, int dest)
+{
+    if (f->items.size() < 3 || f->items.size() > 4) {
+        error("if expects a condition, a then branch and an else branch");
+    }
+
+    value known;
+    if (constant_value(f->items[1], known)) {
+        if (known.truthy()) {
+            expr(f->items[2], dest);
+        } else if (f->items.size() == 4) {
+            expr(f->items[3], dest);
+        } else {
+            emit_constant(dest, value::nil());
+        }
+        return;
+    }
+
+    int save = fs->free_reg;
+    int cond = expr_any(f->items[1]);
+    free_to(save);
+
+    size_t to_else = emit_jump(op_jmpifnot, cond);
+    expr(f->items[2], dest);
+
+    if (f->items.size() == 4 || dest != no_reg) {
+        size_t to_end = emit_jump(op_jmp, 0);
+        patch_jump(to_else);
+        if (f->items.size() == 4) {
+            expr(f->items[3], dest);
+        } else {
+            emit(encode_abc(op_loadnil, dest, 0, 0));
+        }
+        patch_jump(to_end);
+    } else {
+        patch_jump(to_else);
+    }
+}
+
+void
+compiler::do_(form* f, int dest)
+{
+    body(f->items, 1, dest);
+}
+
+void
+compiler::while_(form* f, int dest)
+{
+    if (f->items.size() < 2) {
+        error("while expects a condition");
+    }
+
+    size_t top = fs->proto->code.size();
+
+    int save = fs->free_reg;
+    int cond = expr_any(f->items[1]);
+    free_to(save);
+    size_t to_end = emit_jump(op_jmpifnot, cond);
+
+    for (size_t i = 2; i < f->items.size(); ++i) {
+        expr(f->items[i], no_reg);
+        free_to(save);
+    }
+    emit_loop(top);
+    patch_jump(to_end);
+
+    if (dest != no_reg) {
+        emit(encode_abc(op_loadnil, dest, 0, 0));
+    }
+}
+
+// true if compiling f into a register writes it only once, after all operands
+// have been read
+static bool
+writes_once(form* f)
+{
+    if (f->type != f_list) {
+        return true;
+    }
+    if (f->items.size() < 2 || f->items[0]->type != f_symbol) {
+        return false;
+    }
+    static const char* ops[] = { "+", "-", "*", "/", "=", "<", "<=", ">", ">=" };
+    for (const char* op : ops) {
+        if (f->items[0]->is_symbol(op)) {
+            return f->items.size() == 3 ||
+                   (f->items.size() == 2 && f->items[0]->is_symbol("-"));
+        }
+    }
+    return f->items.size() == 2 && f->items[0]->is_symbol("not");
+}
+
+void
+compiler::set(form* f, int dest)
+{
+    if (f->items.size() != 3 || f->items[1]->type != f_symbol) {
+        error("set! expects a symbol and a value");
+    }
+
+    std::string name = f->items[1]->str();
+    form* val = f->items[2];
+    int save = fs->free_reg;
+
+    auto parts = path(name);
+    if (!parts.empty()) {
+        int object = alloc_reg();
+        path_ref(parts, parts.size() - 1, object);
+        int reg = expr_any(val);
+        emit(encode_abc(op_setfield, object, reg, add_site(parts.back())));
+        emit_move(dest, reg);
+        free_to(save);
+        return;
+    }
+
+    variable v = resolve(name, fs);
+
+    if (v.kind == variable::local && !v.boxed) {
+        int reg = v.index;
+        bool direct =
+          writes_once(val) &&
+          !(val->type == f_list && bound_locally(val->items[0]->str()));
+        if (direct) {
+            expr(val, reg);
+        } else {
+            emit_move(reg, expr_any(val));
+        }
+        emit_check(reg, v.hint);
+        free_to(save);
+        emit_move(dest, reg);
+        return;
+    }
+
+    int reg = expr_any(val);
+    emit_check(reg, v.hint);
+    if (v.kind == variable::local) {
+        emit(encode_abc(op_setbox, v.index, reg, 0));
+    } else if (v.kind == variable::capture) {
+        if (!v.boxed) {
+            error("can not assign to captured variable " + name);
+        }
+        int box = alloc_reg();
+        emit(encode_abc(op_getcap, box, v.index, 0));
+        emit(encode_abc(op_setbox, box, reg, 0));
+    } else {
+        emit(encode_abx(op_setglobal, reg, global_target(name)));
+    }
+    emit_move(dest, reg);
+    free_to(save);
+}
+
+void
+compiler::logic(form* f, int dest, bool is_and)
+{
+    if (f->items.size() == 1) {
+        if (dest != no_reg) {
+            emit(encode_abc(is_and ? op_loadtrue : op_loadnil, dest, 0, 0));
+        }
+        return;
+    }
+
+    int save = fs->free_reg;
+    int target = dest == no_reg ? alloc_reg() : dest;
+
+    std::vector<size_t> to_end;
+    for (size_t i = 1; i + 1 < f->items.size(); ++i) {
+        expr(f->items[i], target);
+        to_end.push_back(emit_jump(is_and ? op_jmpifnot : op_jmpif, target));
+    }
+    expr(f->items.back(), target);
+
+    for (size_t at : to_end) {
+        patch_jump(at);
+    }
+    free_to(save);
+}
@@ -0,0 +1,105 @@
+#include "interpreter.hpp"
+
+#include "compiler.hpp"
+#include "parser.hpp"
+
+interpreter::interpreter(bool use_cache)
+  : cache(use_cache ? token_cache::default_directory() : "")
+  , compiled(use_cache ? token_cache::default_directory() : "")
+  , disassemble(false)
+  , optimize(true)
+  , dump_ir(false)
+  , superinstructions(true)
+  , aot(false)
+{
+}
+
+value
+interpreter::eval(const std::string& name,
+                  const std::string& source,
+                  std::ostream* echo,
+                  bool cacheable)
+{
+    aot_module* module = nullptr;
+    if (aot && cacheable) {
+        aot_options options;
+        options.optimize = optimize;
+        options.superinstructions = superinstructions;
+        std::string error;
+        std::unique_ptr<aot_module> loaded;
+        // a source with an error in it is interpreted, so the forms before
+        // the error still run and then raise it as they would without aot
+        try {
+            loaded = aot_load(
+              token_cache::default_directory(), name, source, options, error);
+        } catch (parse_error&) {
+        } catch (compile_error&) {
+        }
+        if (loaded) {
+            module = loaded.get();
+            modules.push_back(std::move(loaded));
+        } else if (!error.empty()) {
+            std::cerr << "aot: " << error << ", interpreting " << name << "\n";
+        }
+    }
+
+    // the IR is only printed while compiling
+    uint32_t settings = optimize | superinstructions << 1;
+    std::vector<function_proto*> protos;
+    if (cacheable && !dump_ir &&
+        compiled.load(name, source, settings, machine, protos)) {
+        // protos are only kept by closures, so the forms still to run need
+        // theirs while the ones before collect
+        root_guard roots{ machine };
+        for (function_proto* proto : protos) {
+            roots.push(
+              value::obj(machine.make_closure(proto, nullptr, nullptr)));
+        }
+        value result;
+        for (function_proto* proto : protos) {
+            result = run_form(proto, module, name, echo);
+        }
+        return result;
+    }
+
+    source_map lines{ name, source };
+    parser reader{ &strings,
+                   lex_cached(cacheable ? &cache : nullptr, &strings, source) };
+    compiler comp{ &machine, &lines };
+    comp.optimize = optimize;
+    comp.ir_dump = dump_ir ? &std::cerr : nullptr;
+    comp.superinstructions = superinstructions;
+
+    bytecode_cache::writer written;
+    value result;
+    while (form* f = reader.read()) {
+        function_proto* proto = comp.compile_toplevel(f);
+        written.add(proto);
+        result = run_form(proto, module, name, echo);
+    }
+    if (cacheable) {
+        compiled.store(source, settings, written);
+    }
+    return result;
+}
+
+value
+interpreter::run_form(function_proto* proto,
+                      aot_module*& module,
+                      const std::string& name,
+                      std::ostream* echo)
+{
+    if (module && !module->attach(machine.jit, proto)) {
+        std::cerr << "aot: " << name
+                  << " does not match its module, interpreting the rest\n";
+        module = nullptr;
+    }
+    if (disassemble) {
+        ::disassemble(std::cerr, proto);
+    }
+    value result = machine.run(proto);
+    if (echo) {
+        *echo << result << "\n";
+    }
+    return result;
+}
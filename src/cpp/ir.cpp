@@ -0,0 +1,717 @@
+#include "ir.hpp"
+
+#include <algorithm>
+#include <functional>
+
+bool
+ir_is_pure(opcode op)
+{
+    switch (op) {
+        case op_move:
+        case op_loadk:
+        case op_loadi:
+        case op_loadnil:
+        case op_loadtrue:
+        case op_loadfalse:
+        case op_add:
+        case op_sub:
+        case op_mul:
+        case op_div:
+        case op_neg:
+        case op_eq:
+        case op_lt:
+        case op_le:
+        case op_lnot:
+        case op_check:
+        case op_getcap:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool
+ir_may_throw(opcode op)
+{
+    switch (op) {
+        case op_add:
+        case op_sub:
+        case op_mul:
+        case op_div:
+        case op_neg:
+        case op_lt:
+        case op_le:
+        case op_check:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool
+ir_is_terminator(opcode op)
+{
+    return op == op_jmp || op == op_jmpif || op == op_jmpifnot ||
+           op == op_ret;
+}
+
+ir_function::ir_function(function_proto* proto)
+  : proto(proto)
+{
+}
+
+int
+ir_function::add_block()
+{
+    blocks.emplace_back();
+    ir_block& block = blocks.back();
+    block.idom = -1;
+    block.removed = false;
+    block.place_before = -1;
+    return blocks.size() - 1;
+}
+
+ir_ref
+ir_function::add_instr(int block,
+                       ir_kind kind,
+                       opcode op,
+                       int imm,
+                       int line,
+                       std::vector<ir_ref> args,
+                       bool has_value)
+{
+    instrs.push_back(ir_instr{ kind,
+                               op,
+                               imm,
+                               line,
+                               block,
+                               has_value,
+                               false,
+                               no_ref,
+                               std::move(args) });
+    ir_ref ref = instrs.size() - 1;
+    if (kind == ir_phi) {
+        blocks[block].phis.push_back(ref);
+    } else {
+        blocks[block].code.push_back(ref);
+    }
+    return ref;
+}
+
+ir_ref
+ir_function::resolve(ir_ref ref) const
+{
+    while (instrs[ref].forward != no_ref) {
+        ref = instrs[ref].forward;
+    }
+    return ref;
+}
+
+void
+ir_function::compact()
+{
+    auto is_dead = [this](ir_ref ref) { return instrs[ref].dead; };
+    for (auto& block : blocks) {
+        block.phis.erase(
+          std::remove_if(block.phis.begin(), block.phis.end(), is_dead),
+          block.phis.end());
+        block.code.erase(
+          std::remove_if(block.code.begin(), block.code.end(), is_dead),
+          block.code.end());
+    }
+    for (auto& instr : instrs) {
+        if (!instr.dead) {
+            for (auto& arg : instr.args) {
+                arg = resolve(arg);
+            }
+        }
+    }
+}
+
+// * Lifting
+//
+// SSA construction follows Braun et al., "Simple and Efficient Construction of
+// Static Single Assignment Form": registers are read per block, looking
+// through predecessors on demand, and blocks whose predecessors are not all
+// known yet get incomplete phis that are filled in when the block is sealed.
+
+namespace {
+
+struct ssa_builder
+{
+    ir_function& fn;
+    std::vector<std::vector<ir_ref>> current_def;
+    std::vector<std::vector<std::pair<int, ir_ref>>> incomplete;
+    std::vector<bool> sealed;
+    std::vector<bool> filled;
+
+    ssa_builder(ir_function& fn)
+      : fn(fn)
+      , current_def(fn.blocks.size(),
+                    std::vector<ir_ref>(max_registers, no_ref))
+      , incomplete(fn.blocks.size())
+      , sealed(fn.blocks.size(), false)
+      , filled(fn.blocks.size(), false)
+    {
+    }
+
+    void write(int reg, int block, ir_ref value)
+    {
+        current_def[block][reg] = value;
+    }
+
+    ir_ref read(int reg, int block)
+    {
+        if (current_def[block][reg] != no_ref) {
+            return current_def[block][reg];
+        }
+
+        ir_block& b = fn.blocks[block];
+        ir_ref value;
+        if (!sealed[block]) {
+            value = fn.add_instr(block, ir_phi, op_move, 0, 0, {}, true);
+            incomplete[block].push_back({ reg, value });
+        } else if (block == 0) {
+            // registers the function never wrote start out nil
+            value = fn.add_instr(0, ir_op, op_loadnil, 0, 0, {}, true);
+            auto& code = fn.blocks[0].code;
+            if (code.size() > 1) {
+                std::rotate(code.end() - 2, code.end() - 1, code.end());
+            }
+        } else if (b.preds.size() == 1) {
+            value = read(reg, b.preds[0]);
+        } else {
+            value = fn.add_instr(block, ir_phi, op_move, 0, 0, {}, true);
+            write(reg, block, value);
+            add_phi_operands(reg, value);
+        }
+        write(reg, block, value);
+        return value;
+    }
+
+    void add_phi_operands(int reg, ir_ref phi)
+    {
+        int block = fn.instrs[phi].block;
+        std::vector<ir_ref> args;
+        for (int pred : fn.blocks[block].preds) {
+            args.push_back(read(reg, pred));
+        }
+        fn.instrs[phi].args = std::move(args);
+    }
+
+    void seal(int block)
+    {
+        sealed[block] = true;
+        for (auto& pending : incomplete[block]) {
+            add_phi_operands(pending.first, pending.second);
+        }
+        incomplete[block].clear();
+    }
+
+    void try_seal(int block)
+    {
+        if (sealed[block] || fn.blocks[block].removed) {
+            return;
+        }
+        for (int pred : fn.blocks[block].preds) {
+            if (!filled[pred]) {
+                return;
+            }
+        }
+        seal(block);
+    }
+};
+
+} // namespace
+
+void
+ir_function::build()
+{
+    const auto& code = proto->code;
+    size_t count = code.size();
+    if (count == 0) {
+        throw ir_unsupported("empty function");
+    }
+
+    // find basic block boundaries
+    std::vector<bool> leader(count + 1, false);
+    leader[0] = true;
+    for (size_t pc = 0; pc < count; ++pc) {
+        opcode op = instr_op(code[pc]);
+        if (op >= op_count) {
+            throw ir_unsupported("invalid opcode");
+        }
+        if (op == op_jmp || op == op_jmpif || op == op_jmpifnot) {
+            long target = (long)pc + 1 + instr_sbx(code[pc]);
+            if (target < 0 || target >= (long)count) {
+                throw ir_unsupported("jump out of function");
+            }
+            leader[target] = true;
+            leader[pc + 1] = true;
+        } else if (op == op_ret) {
+            leader[pc + 1] = true;
+        }
+    }
+
+    int entry = add_block();
+    std::vector<int> block_at(count, -1);
+    std::vector<size_t> block_start;
+    for (size_t pc = 0; pc < count; ++pc) {
+        if (leader[pc]) {
+            block_at[pc] = add_block();
+            block_start.push_back(pc);
+        }
+    }
+    block_start.push_back(count);
+
+    // successors from the last instruction of every block
+    blocks[entry].succs.push_back(block_at[0]);
+    for (size_t n = 0; n + 1 < block_start.size(); ++n) {
+        int block = block_at[block_start[n]];
+        size_t last = block_start[n + 1] - 1;
+        instr i = code[last];
+        switch (instr_op(i)) {
+            case op_jmp:
+                blocks[block].succs.push_back(
+                  block_at[last + 1 + instr_sbx(i)]);
+                break;
+            case op_jmpif:
+            case op_jmpifnot: {
+                if (last + 1 >= count) {
+                    throw ir_unsupported("branch falls off the end");
+                }
+                int taken = block_at[last + 1 + instr_sbx(i)];
+                int next = block_at[last + 1];
+                blocks[block].succs.push_back(taken);
+                if (next != taken) {
+                    blocks[block].succs.push_back(next);
+                }
+                break;
+            }
+            case op_ret:
+                break;
+            default:
+                if (last + 1 >= count) {
+                    throw ir_unsupported("code falls off the end");
+                }
+                blocks[block].succs.push_back(block_at[last + 1]);
+                break;
+        }
+    }
+
+    // drop unreachable blocks, then link predecessors
+    std::vector<bool> reachable(blocks.size(), false);
+    std::vector<int> work{ entry };
+    reachable[entry] = true;
+    while (!work.empty()) {
+        int block = work.back();
+        work.pop_back();
+        for (int succ : blocks[block].succs) {
+            if (!reachable[succ]) {
+                reachable[succ] = true;
+                work.push_back(succ);
+            }
+        }
+    }
+    for (size_t b = 0; b < blocks.size(); ++b) {
+        if (!reachable[b]) {
+            blocks[b].removed = true;
+            blocks[b].succs.clear();
+        }
+    }
+    for (size_t b = 0; b < blocks.size(); ++b) {
+        for (int succ : blocks[b].succs) {
+            blocks[succ].preds.push_back(b);
+        }
+    }
+
+    ssa_builder ssa{ *this };
+
+    int entry_line = proto->line_at(0);
+    for (int reg = 0; reg < proto->arity; ++reg) {
+        ssa.write(
+          reg, entry, add_instr(entry, ir_param, op_move, reg, entry_line, {}, true));
+    }
+    add_instr(entry, ir_op, op_jmp, 0, entry_line, {}, false);
+    ssa.sealed[entry] = true;
+    ssa.filled[entry] = true;
+
+    for (size_t n = 0; n + 1 < block_start.size(); ++n) {
+        size_t start = block_start[n];
+        size_t end = block_start[n + 1];
+        int block = block_at[start];
+        if (blocks[block].removed) {
+            continue;
+        }
+        ssa.try_seal(block);
+
+        auto use = [&](int reg) { return ssa.read(reg, block); };
+        auto def = [&](int reg, ir_ref value) { ssa.write(reg, block, value); };
+
+        bool terminated = false;
+        for (size_t pc = start; pc < end; ++pc) {
+            instr i = code[pc];
+            opcode op = instr_op(i);
+            int a = instr_a(i);
+            int b = instr_b(i);
+            int c = instr_c(i);
+            int line = proto->line_at(pc);
+
+            auto emit = [&](int imm, std::vector<ir_ref> args, bool value) {
+                return add_instr(block, ir_op, op, imm, line, args, value);
+            };
+
+            switch (op) {
+                case op_move:
+                    def(a, emit(0, { use(b) }, true));
+                    break;
+                case op_loadk:
+                case op_getglobal:
+                    def(a, emit(instr_bx(i), {}, true));
+                    break;
+                case op_closure: {
+                    // the registers the closure captures are its operands
+                    std::vector<ir_ref> args;
+                    for (auto& source : proto->protos[instr_bx(i)]->captures) {
+                        if (!source.from_capture) {
+                            args.push_back(use(source.index));
+                        }
+                    }
+                    def(a, emit(instr_bx(i), args, true));
+                    break;
+                }
+                case op_getcap:
+                    def(a, emit(b, {}, true));
+                    break;
+                case op_box:
+                case op_getbox:
+                    def(a, emit(0, { use(b) }, true));
+                    break;
+                case op_setbox:
+                    emit(0, { use(a), use(b) }, false);
+                    break;
+                case op_getfield:
+                case op_getmethod:
+                    def(a, emit(instr_c(i), { use(b) }, true));
+                    break;
+                case op_setfield:
+                    emit(instr_c(i), { use(a), use(b) }, false);
+                    break;
+                case op_loadi:
+                    def(a, emit(instr_sbx(i), {}, true));
+                    break;
+                case op_loadnil:
+                case op_loadtrue:
+                case op_loadfalse:
+                    def(a, emit(0, {}, true));
+                    break;
+                case op_setglobal:
+                    emit(instr_bx(i), { use(a) }, false);
+                    break;
+                case op_add:
+                case op_sub:
+                case op_mul:
+                case op_div:
+                case op_eq:
+                case op_lt:
+                case op_le:
+                    def(a, emit(0, { use(b), use(c) }, true));
+                    break;
+                case op_neg:
+                case op_lnot:
+                    def(a, emit(0, { use(b) }, true));
+                    break;
+                case op_check:
+                    def(a, emit(c, { use(b) }, true));
+                    break;
+                case op_call: {
+                    std::vector<ir_ref> args;
+                    for (int reg = a; reg <= a + b; ++reg) {
+                        args.push_back(use(reg));
+                    }
+                    def(a, emit(b, args, true));
+                    break;
+                }
+                case op_vec:
+                case op_set:
+                case op_map: {
+                    int items = op == op_map ? 2 * c : c;
+                    std::vector<ir_ref> args;
+                    for (int reg = b; reg < b + items; ++reg) {
+                        args.push_back(use(reg));
+                    }
+                    def(a, emit(c, args, true));
+                    break;
+                }
+                case op_jmp:
+                    emit(0, {}, false);
+                    terminated = true;
+                    break;
+                case op_jmpif:
+                case op_jmpifnot:
+                    if (blocks[block].succs.size() == 1) {
+                        // both edges go to the same place
+                        add_instr(block, ir_op, op_jmp, 0, line, {}, false);
+                    } else {
+                        emit(0, { use(a) }, false);
+                    }
+                    terminated = true;
+                    break;
+                case op_ret:
+                    emit(0, { use(a) }, false);
+                    terminated = true;
+                    break;
+                default:
+                    throw ir_unsupported(std::string("unsupported opcode ") +
+                                         opcode_names[op]);
+            }
+        }
+        if (!terminated) {
+            add_instr(
+              block, ir_op, op_jmp, 0, proto->line_at(end - 1), {}, false);
+        }
+
+        ssa.filled[block] = true;
+        for (int succ : blocks[block].succs) {
+            ssa.try_seal(succ);
+        }
+    }
+
+    for (size_t b = 0; b < blocks.size(); ++b) {
+        if (!blocks[b].removed && !ssa.sealed[b]) {
+            throw ir_unsupported("unsealed block");
+        }
+    }
+}
+
+// * Dominators and loops
+//
+// Dominators use the iterative algorithm from Cooper, Harvey and Kennedy, "A
+// Simple, Fast Dominance Algorithm".
+
+void
+ir_function::compute_dominators()
+{
+    std::vector<int> order;
+    std::vector<bool> visited(blocks.size(), false);
+    std::function<void(int)> visit = [&](int block) {
+        visited[block] = true;
+        for (int succ : blocks[block].succs) {
+            if (!visited[succ]) {
+                visit(succ);
+            }
+        }
+        order.push_back(block);
+    };
+    visit(0);
+    rpo.assign(order.rbegin(), order.rend());
+
+    std::vector<int> index(blocks.size(), -1);
+    for (size_t n = 0; n < rpo.size(); ++n) {
+        index[rpo[n]] = n;
+    }
+
+    for (auto& block : blocks) {
+        block.idom = -1;
+    }
+    blocks[0].idom = 0;
+
+    auto intersect = [&](int a, int b) {
+        while (a != b) {
+            while (index[a] > index[b]) {
+                a = blocks[a].idom;
+            }
+            while (index[b] > index[a]) {
+                b = blocks[b].idom;
+            }
+        }
+        return a;
+    };
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t n = 1; n < rpo.size(); ++n) {
+            int block = rpo[n];
+            int idom = -1;
+            for (int pred : blocks[block].preds) {
+                if (blocks[pred].idom == -1) {
+                    continue;
+                }
+                idom = idom == -1 ? pred : intersect(pred, idom);
+            }
+            if (idom != blocks[block].idom) {
+                blocks[block].idom = idom;
+                changed = true;
+            }
+        }
+    }
+}
+
+bool
+ir_function::dominates(int a, int b) const
+{
+    while (true) {
+        if (a == b) {
+            return true;
+        }
+        if (b == 0) {
+            return false;
+        }
+        b = blocks[b].idom;
+    }
+}
+
+std::vector<std::vector<int>>
+ir_function::dominator_children() const
+{
+    std::vector<std::vector<int>> children(blocks.size());
+    for (int block : rpo) {
+        if (block != 0) {
+            children[blocks[block].idom].push_back(block);
+        }
+    }
+    return children;
+}
+
+std::vector<ir_loop>
+ir_function::find_loops() const
+{
+    std::vector<ir_loop> loops;
+    std::vector<int> loop_of(blocks.size(), -1);
+
+    for (int block : rpo) {
+        for (int succ : blocks[block].succs) {
+            if (!dominates(succ, block)) {
+                continue;
+            }
+            // block -> succ is a back edge
+            if (loop_of[succ] == -1) {
+                loop_of[succ] = loops.size();
+                loops.push_back(
+                  { succ, -1, std::vector<bool>(blocks.size(), false), 1 });
+                loops.back().body[succ] = true;
+            }
+            ir_loop& loop = loops[loop_of[succ]];
+            std::vector<int> work{ block };
+            while (!work.empty()) {
+                int member = work.back();
+                work.pop_back();
+                if (loop.body[member]) {
+                    continue;
+                }
+                loop.body[member] = true;
+                ++loop.size;
+                for (int pred : blocks[member].preds) {
+                    work.push_back(pred);
+                }
+            }
+        }
+    }
+
+    for (auto& loop : loops) {
+        int outside = -1;
+        for (int pred : blocks[loop.header].preds) {
+            if (!loop.body[pred]) {
+                outside = outside == -1 ? pred : -2;
+            }
+        }
+        if (outside >= 0 && blocks[outside].succs.size() == 1) {
+            loop.preheader = outside;
+        }
+    }
+
+    std::sort(loops.begin(),
+              loops.end(),
+              [](const ir_loop& a, const ir_loop& b) { return a.size < b.size; });
+    return loops;
+}
+
+// * Dump
+
+void
+ir_function::dump(std::ostream& stream) const
+{
+    stream << "ir "
+           << (proto->name.empty() ? "<anonymous>" : proto->name.c_str())
+           << " (arity " << proto->arity << ")\n";
+
+    auto value_name = [](ir_ref ref) { return "v" + std::to_string(ref); };
+
+    for (size_t b = 0; b < blocks.size(); ++b) {
+        const ir_block& block = blocks[b];
+        if (block.removed) {
+            continue;
+        }
+        stream << "b" << b << ":";
+        if (!block.preds.empty()) {
+            stream << "\t; preds";
+            for (int pred : block.preds) {
+                stream << " b" << pred;
+            }
+        }
+        stream << "\n";
+
+        for (ir_ref ref : block.phis) {
+            stream << "    " << value_name(ref) << " = phi";
+            for (ir_ref arg : instrs[ref].args) {
+                stream << " " << value_name(resolve(arg));
+            }
+            stream << "\n";
+        }
+
+        for (ir_ref ref : block.code) {
+            const ir_instr& in = instrs[ref];
+            stream << "    ";
+            if (in.has_value) {
+                stream << value_name(ref) << " = ";
+            }
+            if (in.kind == ir_param) {
+                stream << "param " << in.imm << "\n";
+                continue;
+            }
+            stream << opcode_names[in.op];
+            for (ir_ref arg : in.args) {
+                stream << " " << value_name(resolve(arg));
+            }
+            switch (in.op) {
+                case op_loadk:
+                    stream << " k" << in.imm << "\t; "
+                           << proto->constants[in.imm];
+                    break;
+                case op_getglobal:
+                case op_setglobal:
+                    stream << " k" << in.imm << "\t; "
+                           << proto->constants[in.imm];
+                    break;
+                case op_loadi:
+                    stream << " " << in.imm;
+                    break;
+                case op_closure:
+                    stream << " fn" << in.imm;
+                    break;
+                case op_getcap:
+                    stream << " c" << in.imm;
+                    break;
+                case op_getfield:
+                case op_setfield:
+                case op_getmethod:
+                    stream << "\t; ." << proto->sites[in.imm].name;
+                    break;
+                case op_check:
+                    stream << (in.imm == checked_int ? " int" : " decimal");
+                    break;
+                case op_jmp:
+                case op_jmpif:
+                case op_jmpifnot:
+                    for (int succ : block.succs) {
+                        stream << " b" << succ;
+                    }
+                    break;
+                default:
+                    break;
+            }
+            stream << "\t; line " << in.line << "\n";
+        }
+    }
+}
@@ -0,0 +1,675 @@
+#include "ir.hpp"
+
+#include <algorithm>
+
+// Lowering back to register bytecode.
+//
+// Registers are assigned by a tree scan: blocks are visited in dominator tree
+// order, so every value live into a block already has a register, and each
+// definition takes a register that is free at that point. SSA live ranges
+// interfere only where both values are live, so this never needs more
+// registers than values live at once.
+//
+// Calls and collection literals read their operands from consecutive
+// registers; those are placed in a window above every value that stays live,
+// which the callee's frame may then overwrite. The allocation runs twice, the
+// second time with hints from the first so operands tend to be computed right
+// into their window slot and phi operands into the phi's register.
+
+namespace {
+
+struct lowering
+{
+    ir_function& fn;
+    size_t count;
+
+    std::vector<std::vector<bool>> live_in;
+    std::vector<std::vector<bool>> live_out;
+    std::vector<std::vector<ir_ref>> phi_users;
+
+    std::vector<int> reg;
+    std::vector<int> window;
+    std::vector<int> hint;
+    int max_reg;
+
+    std::vector<int> layout;
+
+    std::vector<instr> code;
+    std::vector<int> lines;
+
+    struct fixup
+    {
+        size_t at;
+        int label;
+    };
+    std::vector<fixup> fixups;
+
+    // edge copies for conditional branches live in stubs after the blocks
+    struct stub
+    {
+        int from;
+        int to;
+    };
+    std::vector<stub> stubs;
+
+    // capture sources of child functions and their new registers
+    std::vector<std::pair<capture_source*, int>> captured;
+
+    int scratch;
+    bool scratch_used;
+
+    lowering(ir_function& fn)
+      : fn(fn)
+      , count(fn.instrs.size())
+      , max_reg(-1)
+      , scratch(0)
+      , scratch_used(false)
+    {
+    }
+
+    // * Liveness
+
+    void compute_liveness()
+    {
+        size_t nblocks = fn.blocks.size();
+        live_in.assign(nblocks, std::vector<bool>(count, false));
+        live_out.assign(nblocks, std::vector<bool>(count, false));
+
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (auto it = fn.rpo.rbegin(); it != fn.rpo.rend(); ++it) {
+                int block = *it;
+                const ir_block& b = fn.blocks[block];
+
+                std::vector<bool> out(count, false);
+                for (int succ : b.succs) {
+                    const ir_block& s = fn.blocks[succ];
+                    for (size_t v = 0; v < count; ++v) {
+                        if (live_in[succ][v]) {
+                            out[v] = true;
+                        }
+                    }
+                    size_t k = pred_index(block, succ);
+                    for (ir_ref phi : s.phis) {
+                        out[fn.instrs[phi].args[k]] = true;
+                    }
+                }
+
+                std::vector<bool> in = out;
+                for (auto ref = b.code.rbegin(); ref != b.code.rend(); ++ref) {
+                    const ir_instr& instr = fn.instrs[*ref];
+                    if (instr.has_value) {
+                        in[*ref] = false;
+                    }
+                    for (ir_ref arg : instr.args) {
+                        in[arg] = true;
+                    }
+                }
+                for (ir_ref phi : b.phis) {
+                    in[phi] = false;
+                }
+
+                if (in != live_in[block] || out != live_out[block]) {
+                    live_in[block] = std::move(in);
+                    live_out[block] = std::move(out);
+                    changed = true;
+                }
+            }
+        }
+
+        phi_users.assign(count, {});
+        for (int block : fn.rpo) {
+            for (ir_ref phi : fn.blocks[block].phis) {
+                for (ir_ref arg : fn.instrs[phi].args) {
+                    phi_users[arg].push_back(phi);
+                }
+            }
+        }
+    }
+
+    size_t pred_index(int pred, int block) const
+    {
+        const auto& preds = fn.blocks[block].preds;
+        return std::find(preds.begin(), preds.end(), pred) - preds.begin();
+    }
+
+    // * Register allocation
+
+    static bool uses_window(const ir_instr& in)
+    {
+        return in.kind == ir_op && (in.op == op_call || in.op == op_vec ||
+                                    in.op == op_map || in.op == op_set);
+    }
+
+    int pick(ir_ref ref, const std::vector<bool>& used) const
+    {
+        auto free = [&](int r) { return r >= 0 && r < max_registers && !used[r]; };
+
+        if (free(hint[ref])) {
+            return hint[ref];
+        }
+        const ir_instr& in = fn.instrs[ref];
+        if (in.kind == ir_phi) {
+            for (ir_ref arg : in.args) {
+                if (free(reg[arg])) {
+                    return reg[arg];
+                }
+            }
+        }
+        for (ir_ref phi : phi_users[ref]) {
+            if (free(reg[phi])) {
+                return reg[phi];
+            }
+        }
+        for (int r = 0; r < max_registers; ++r) {
+            if (!used[r]) {
+                return r;
+            }
+        }
+        throw ir_unsupported("out of registers");
+    }
+
+    void allocate_block(int block)
+    {
+        const ir_block& b = fn.blocks[block];
+        std::vector<bool> used(max_registers, false);
+        for (size_t v = 0; v < count; ++v) {
+            if (live_in[block][v]) {
+                used[reg[v]] = true;
+            }
+        }
+
+        for (ir_ref phi : b.phis) {
+            reg[phi] = pick(phi, used);
+            used[reg[phi]] = true;
+            max_reg = std::max(max_reg, reg[phi]);
+        }
+
+        // last uses, found walking backwards from the end of the block
+        std::vector<std::vector<ir_ref>> kills(b.code.size());
+        std::vector<bool> def_live(b.code.size(), false);
+        std::vector<bool> live = live_out[block];
+        for (size_t pos = b.code.size(); pos-- > 0;) {
+            ir_ref ref = b.code[pos];
+            const ir_instr& in = fn.instrs[ref];
+            if (in.has_value) {
+                def_live[pos] = live[ref];
+                live[ref] = false;
+            }
+            for (ir_ref arg : in.args) {
+                if (!live[arg]) {
+                    live[arg] = true;
+                    kills[pos].push_back(arg);
+                }
+            }
+        }
+
+        for (size_t pos = 0; pos < b.code.size(); ++pos) {
+            ir_ref ref = b.code[pos];
+            const ir_instr& in = fn.instrs[ref];
+
+            if (in.kind == ir_param) {
+                reg[ref] = in.imm;
+                used[in.imm] = def_live[pos];
+                max_reg = std::max(max_reg, in.imm);
+                continue;
+            }
+
+            for (ir_ref arg : kills[pos]) {
+                used[reg[arg]] = false;
+            }
+
+            if (uses_window(in)) {
+                int base = 0;
+                for (int r = max_registers - 1; r >= 0; --r) {
+                    if (used[r]) {
+                        base = r + 1;
+                        break;
+                    }
+                }
+                if (base + (int)in.args.size() > max_registers) {
+                    throw ir_unsupported("out of registers");
+                }
+                window[ref] = base;
+                max_reg = std::max(max_reg, base + (int)in.args.size() - 1);
+            }
+
+            if (in.has_value) {
+                // a call leaves its result at the bottom of its window
+                int r = in.op == op_call ? window[ref] : pick(ref, used);
+                reg[ref] = r;
+                used[r] = def_live[pos];
+                max_reg = std::max(max_reg, r);
+            }
+        }
+    }
+
+    void allocate()
+    {
+        reg.assign(count, -1);
+        window.assign(count, -1);
+        max_reg = -1;
+
+        auto children = fn.dominator_children();
+        std::vector<int> stack{ 0 };
+        while (!stack.empty()) {
+            int block = stack.back();
+            stack.pop_back();
+            allocate_block(block);
+            for (auto it = children[block].rbegin();
+                 it != children[block].rend();
+                 ++it) {
+                stack.push_back(*it);
+            }
+        }
+    }
+
+    void allocate_with_hints()
+    {
+        hint.assign(count, -1);
+        allocate();
+
+        for (size_t ref = 0; ref < count; ++ref) {
+            const ir_instr& in = fn.instrs[ref];
+            if (in.dead) {
+                continue;
+            }
+            if (window[ref] >= 0) {
+                for (size_t k = 0; k < in.args.size(); ++k) {
+                    if (hint[in.args[k]] < 0) {
+                        hint[in.args[k]] = window[ref] + k;
+                    }
+                }
+            }
+            if (in.kind == ir_phi) {
+                hint[ref] = reg[ref];
+                for (ir_ref arg : in.args) {
+                    if (hint[arg] < 0) {
+                        hint[arg] = reg[ref];
+                    }
+                }
+            }
+        }
+
+        allocate();
+        scratch = max_reg + 1;
+    }
+
+    // * Layout
+    //
+    // Blocks keep their original order, with preheaders right before their
+    // loop. Loops whose header ends in a conditional exit are rotated so the
+    // header comes last: the body then falls into the test and branches back,
+    // saving the jump per iteration.
+
+    void compute_layout()
+    {
+        std::vector<std::vector<int>> before(fn.blocks.size());
+        std::vector<bool> reachable(fn.blocks.size(), false);
+        for (int block : fn.rpo) {
+            reachable[block] = true;
+        }
+        for (int block : fn.rpo) {
+            if (fn.blocks[block].place_before != -1) {
+                before[fn.blocks[block].place_before].push_back(block);
+            }
+        }
+
+        std::vector<int> pending;
+        for (size_t block = 0; block < fn.blocks.size(); ++block) {
+            if (!reachable[block] || fn.blocks[block].place_before != -1) {
+                continue;
+            }
+            pending.push_back(block);
+            while (!pending.empty()) {
+                int next = pending.back();
+                if (!before[next].empty()) {
+                    pending.push_back(before[next].back());
+                    before[next].pop_back();
+                    continue;
+                }
+                pending.pop_back();
+                layout.push_back(next);
+            }
+        }
+
+        for (auto& loop : fn.find_loops()) {
+            const ir_block& header = fn.blocks[loop.header];
+            const ir_instr& term = fn.instrs[header.code.back()];
+            if (loop.size < 2 ||
+                (term.op != op_jmpif && term.op != op_jmpifnot) ||
+                loop.body[header.succs[0]] == loop.body[header.succs[1]]) {
+                continue;
+            }
+            size_t pos =
+              std::find(layout.begin(), layout.end(), loop.header) -
+              layout.begin();
+            if (pos + loop.size > layout.size()) {
+                continue;
+            }
+            bool contiguous = true;
+            for (size_t n = pos; n < pos + loop.size; ++n) {
+                contiguous = contiguous && loop.body[layout[n]];
+            }
+            if (contiguous) {
+                std::rotate(layout.begin() + pos,
+                            layout.begin() + pos + 1,
+                            layout.begin() + pos + loop.size);
+            }
+        }
+    }
+
+    // * Emission
+
+    void emit(instr i, int line)
+    {
+        code.push_back(i);
+        lines.push_back(line);
+    }
+
+    void emit_jump(opcode op, int a, int label, int line)
+    {
+        fixups.push_back({ code.size(), label });
+        emit(encode_asbx(op, a, 0), line);
+    }
+
+    // emits moves so every dst gets the value src held before any of them
+    void parallel_copy(std::vector<std::pair<int, int>> moves, int line)
+    {
+        moves.erase(std::remove_if(moves.begin(),
+                                   moves.end(),
+                                   [](const std::pair<int, int>& m) {
+                                       return m.first == m.second;
+                                   }),
+                    moves.end());
+
+        while (!moves.empty()) {
+            bool progress = false;
+            for (size_t n = 0; n < moves.size(); ++n) {
+                int dst = moves[n].first;
+                bool blocked = false;
+                for (auto& other : moves) {
+                    blocked = blocked || other.second == dst;
+                }
+                if (!blocked) {
+                    emit(encode_abc(op_move, dst, moves[n].second, 0), line);
+                    moves.erase(moves.begin() + n);
+                    progress = true;
+                    break;
+                }
+            }
+            if (progress) {
+                continue;
+            }
+
+            // only cycles are left; park one destination in the scratch
+            // register so its move can go first
+            if (scratch >= max_registers) {
+                throw ir_unsupported("out of registers");
+            }
+            scratch_used = true;
+            int parked = moves[0].first;
+            emit(encode_abc(op_move, scratch, parked, 0), line);
+            for (auto& m : moves) {
+                if (m.second == parked) {
+                    m.second = scratch;
+                }
+            }
+        }
+    }
+
+    std::vector<std::pair<int, int>> edge_moves(int from, int to) const
+    {
+        std::vector<std::pair<int, int>> moves;
+        size_t k = pred_index(from, to);
+        for (ir_ref phi : fn.blocks[to].phis) {
+            int src = reg[fn.instrs[phi].args[k]];
+            if (reg[phi] != src) {
+                moves.push_back({ reg[phi], src });
+            }
+        }
+        return moves;
+    }
+
+    int edge_label(int from, int to)
+    {
+        if (edge_moves(from, to).empty()) {
+            return to;
+        }
+        stubs.push_back({ from, to });
+        return fn.blocks.size() + stubs.size() - 1;
+    }
+
+    void emit_terminator(int block, const ir_instr& in, int next)
+    {
+        const ir_block& b = fn.blocks[block];
+        switch (in.op) {
+            case op_ret:
+                emit(encode_abc(op_ret, reg[in.args[0]], 0, 0), in.line);
+                break;
+            case op_jmp:
+                parallel_copy(edge_moves(block, b.succs[0]), in.line);
+                if (b.succs[0] != next) {
+                    emit_jump(op_jmp, 0, b.succs[0], in.line);
+                }
+                break;
+            case op_jmpif:
+            case op_jmpifnot: {
+                int cond = reg[in.args[0]];
+                int taken = edge_label(block, b.succs[0]);
+                int fallthrough = edge_label(block, b.succs[1]);
+                opcode inverse = in.op == op_jmpif ? op_jmpifnot : op_jmpif;
+                if (fallthrough == next) {
+                    emit_jump(in.op, cond, taken, in.line);
+                } else if (taken == next) {
+                    emit_jump(inverse, cond, fallthrough, in.line);
+                } else {
+                    emit_jump(in.op, cond, taken, in.line);
+                    emit_jump(op_jmp, 0, fallthrough, in.line);
+                }
+                break;
+            }
+            default:
+                throw ir_unsupported("bad terminator");
+        }
+    }
+
+    void emit_instr(ir_ref ref)
+    {
+        const ir_instr& in = fn.instrs[ref];
+        auto r = [&](size_t n) { return reg[in.args[n]]; };
+
+        switch (in.op) {
+            case op_loadk:
+            case op_getglobal:
+                emit(encode_abx(in.op, reg[ref], in.imm), in.line);
+                break;
+            case op_closure: {
+                // captured registers follow the allocation once it is done
+                auto& sources = fn.proto->protos[in.imm]->captures;
+                size_t k = 0;
+                for (auto& source : sources) {
+                    if (!source.from_capture) {
+                        captured.push_back({ &source, r(k++) });
+                    }
+                }
+                emit(encode_abx(in.op, reg[ref], in.imm), in.line);
+                break;
+            }
+            case op_getcap:
+                emit(encode_abc(in.op, reg[ref], in.imm, 0), in.line);
+                break;
+            case op_box:
+            case op_getbox:
+                emit(encode_abc(in.op, reg[ref], r(0), 0), in.line);
+                break;
+            case op_setbox:
+                emit(encode_abc(in.op, r(0), r(1), 0), in.line);
+                break;
+            case op_getfield:
+            case op_getmethod:
+                emit(encode_abc(in.op, reg[ref], r(0), in.imm), in.line);
+                break;
+            case op_setfield:
+                emit(encode_abc(in.op, r(0), r(1), in.imm), in.line);
+                break;
+            case op_setglobal:
+                emit(encode_abx(in.op, r(0), in.imm), in.line);
+                break;
+            case op_loadi:
+                emit(encode_asbx(in.op, reg[ref], in.imm), in.line);
+                break;
+            case op_loadnil:
+            case op_loadtrue:
+            case op_loadfalse:
+                emit(encode_abc(in.op, reg[ref], 0, 0), in.line);
+                break;
+            case op_move:
+                if (reg[ref] != r(0)) {
+                    emit(encode_abc(op_move, reg[ref], r(0), 0), in.line);
+                }
+                break;
+            case op_add:
+            case op_sub:
+            case op_mul:
+            case op_div:
+            case op_eq:
+            case op_lt:
+            case op_le:
+            case op_add_ii:
+            case op_sub_ii:
+            case op_mul_ii:
+            case op_eq_ii:
+            case op_lt_ii:
+            case op_le_ii:
+            case op_add_dd:
+            case op_sub_dd:
+            case op_mul_dd:
+            case op_div_dd:
+            case op_lt_dd:
+            case op_le_dd:
+                emit(encode_abc(in.op, reg[ref], r(0), r(1)), in.line);
+                break;
+            case op_neg:
+            case op_lnot:
+                emit(encode_abc(in.op, reg[ref], r(0), 0), in.line);
+                break;
+            case op_check:
+                emit(encode_abc(in.op, reg[ref], r(0), in.imm), in.line);
+                break;
+            case op_call:
+            case op_vec:
+            case op_map:
+            case op_set: {
+                int base = window[ref];
+                std::vector<std::pair<int, int>> moves;
+                for (size_t k = 0; k < in.args.size(); ++k) {
+                    moves.push_back({ base + (int)k, r(k) });
+                }
+                parallel_copy(moves, in.line);
+                if (in.op == op_call) {
+                    emit(encode_abc(op_call, base, in.imm, 0), in.line);
+                } else {
+                    emit(encode_abc(in.op, reg[ref], base, in.imm), in.line);
+                }
+                break;
+            }
+            default:
+                throw ir_unsupported(std::string("can not lower ") +
+                                     opcode_names[in.op]);
+        }
+    }
+
+    void emit_code()
+    {
+        std::vector<long> label_pc(fn.blocks.size(), -1);
+
+        for (size_t n = 0; n < layout.size(); ++n) {
+            int block = layout[n];
+            int next = n + 1 < layout.size() ? layout[n + 1] : -1;
+            label_pc[block] = code.size();
+            for (ir_ref ref : fn.blocks[block].code) {
+                const ir_instr& in = fn.instrs[ref];
+                if (in.kind == ir_param) {
+                    continue;
+                }
+                if (ir_is_terminator(in.op)) {
+                    emit_terminator(block, in, next);
+                } else {
+                    emit_instr(ref);
+                }
+            }
+        }
+
+        for (auto& s : stubs) {
+            label_pc.push_back(code.size());
+            const ir_instr& term = fn.instrs[fn.blocks[s.from].code.back()];
+            parallel_copy(edge_moves(s.from, s.to), term.line);
+            emit_jump(op_jmp, 0, s.to, term.line);
+        }
+
+        for (auto& f : fixups) {
+            long offset = label_pc[f.label] - (long)(f.at + 1);
+            if (offset < -sbx_bias || offset > max_bx - sbx_bias) {
+                throw ir_unsupported("jump too far");
+            }
+            code[f.at] =
+              encode_asbx(instr_op(code[f.at]), instr_a(code[f.at]), offset);
+        }
+    }
+
+    void run()
+    {
+        fn.compact();
+        fn.compute_dominators();
+        compute_liveness();
+        allocate_with_hints();
+        compute_layout();
+        emit_code();
+
+        function_proto* proto = fn.proto;
+        int regs = std::max(max_reg + 1, scratch_used ? scratch + 1 : 0);
+        proto->num_regs = std::max({ regs, proto->arity, 1 });
+        proto->code = std::move(code);
+        proto->lines = std::move(lines);
+        for (auto& capture : captured) {
+            capture.first->index = capture.second;
+        }
+    }
+};
+
+} // namespace
+
+void
+lower(ir_function& fn)
+{
+    lowering{ fn }.run();
+}
+
+bool
+optimize_proto(function_proto* proto, std::ostream* ir_dump)
+{
+    try {
+        ir_function fn{ proto };
+        fn.build();
+        remove_trivial_phis(fn);
+        propagate_copies(fn);
+        fn.compute_dominators();
+        eliminate_common_subexpressions(fn);
+        hoist_loop_invariants(fn);
+        specialize_types(fn);
+        eliminate_dead_code(fn);
+        if (ir_dump) {
+            fn.dump(*ir_dump);
+        }
+        lower(fn);
+        return true;
+    } catch (ir_unsupported& e) {
+        if (ir_dump) {
+            *ir_dump << "ir: " << proto->name << " left unoptimized: "
+                     << e.what() << "\n";
+        }
+        return false;
+    }
+}
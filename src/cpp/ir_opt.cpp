@@ -0,0 +1,456 @@
+#include "ir.hpp"
+
+#include <algorithm>
+#include <map>
+
+// A phi whose operands are all the same value, or the phi itself, is that
+// value. Removing one can make others trivial, so this runs to a fixed point.
+void
+remove_trivial_phis(ir_function& fn)
+{
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto& block : fn.blocks) {
+            for (ir_ref phi : block.phis) {
+                ir_instr& in = fn.instrs[phi];
+                if (in.dead) {
+                    continue;
+                }
+                ir_ref same = no_ref;
+                bool trivial = true;
+                for (ir_ref arg : in.args) {
+                    arg = fn.resolve(arg);
+                    if (arg == phi || arg == same) {
+                        continue;
+                    }
+                    if (same != no_ref) {
+                        trivial = false;
+                        break;
+                    }
+                    same = arg;
+                }
+                if (!trivial) {
+                    continue;
+                }
+                if (same == no_ref) {
+                    throw ir_unsupported("phi without a value");
+                }
+                in.forward = same;
+                in.dead = true;
+                changed = true;
+            }
+        }
+    }
+    fn.compact();
+}
+
+// Register moves become plain uses of the moved value.
+void
+propagate_copies(ir_function& fn)
+{
+    for (auto& in : fn.instrs) {
+        if (!in.dead && in.kind == ir_op && in.op == op_move) {
+            in.forward = fn.resolve(in.args[0]);
+            in.dead = true;
+        }
+    }
+    fn.compact();
+    remove_trivial_phis(fn);
+}
+
+// Global value numbering over the dominator tree: a pure instruction with the
+// same operation and operands as one that dominates it reuses that value.
+// Instructions that may throw qualify too, since the dominating one already
+// ran without throwing.
+void
+eliminate_common_subexpressions(ir_function& fn)
+{
+    typedef std::vector<int> key;
+    std::map<key, ir_ref> available;
+    auto children = fn.dominator_children();
+
+    std::vector<std::vector<key>> scopes(fn.blocks.size());
+
+    // iterative preorder walk, undoing each block's entries on the way out
+    std::vector<int> stack{ 0 };
+    std::vector<size_t> next_child(fn.blocks.size(), 0);
+    std::vector<bool> entered(fn.blocks.size(), false);
+
+    while (!stack.empty()) {
+        int block = stack.back();
+        if (!entered[block]) {
+            entered[block] = true;
+            for (ir_ref ref : fn.blocks[block].code) {
+                ir_instr& in = fn.instrs[ref];
+                if (in.kind != ir_op || !ir_is_pure(in.op) || !in.has_value) {
+                    continue;
+                }
+                key k{ in.op, in.imm };
+                for (ir_ref arg : in.args) {
+                    k.push_back(fn.resolve(arg));
+                }
+                auto found = available.find(k);
+                if (found != available.end()) {
+                    in.forward = found->second;
+                    in.dead = true;
+                } else {
+                    available.emplace(k, ref);
+                    scopes[block].push_back(k);
+                }
+            }
+        }
+
+        if (next_child[block] < children[block].size()) {
+            stack.push_back(children[block][next_child[block]++]);
+            continue;
+        }
+
+        for (auto& k : scopes[block]) {
+            available.erase(k);
+        }
+        stack.pop_back();
+    }
+
+    fn.compact();
+    remove_trivial_phis(fn);
+}
+
+// Moves loop invariant pure instructions into the loop's preheader.
+//
+// Instructions that can not throw are hoisted from anywhere in the loop.
+// Ones that can are only hoisted from the header before anything else with an
+// effect: the header runs at least once whenever the loop is entered, so the
+// same error is raised, just one instruction earlier.
+void
+hoist_loop_invariants(ir_function& fn)
+{
+    // give every loop entered from a single block a preheader
+    fn.compute_dominators();
+    bool added = false;
+    for (auto& loop : fn.find_loops()) {
+        if (loop.preheader != -1) {
+            continue;
+        }
+        int outside = -1;
+        int count = 0;
+        for (int pred : fn.blocks[loop.header].preds) {
+            if (!loop.body[pred]) {
+                outside = pred;
+                ++count;
+            }
+        }
+        if (count != 1) {
+            continue;
+        }
+
+        int pre = fn.add_block();
+        ir_block& header = fn.blocks[loop.header];
+        int line = fn.instrs[header.code.front()].line;
+        fn.add_instr(pre, ir_op, op_jmp, 0, line, {}, false);
+        fn.blocks[pre].place_before = loop.header;
+        fn.blocks[pre].preds.push_back(outside);
+        fn.blocks[pre].succs.push_back(loop.header);
+        std::replace(fn.blocks[outside].succs.begin(),
+                     fn.blocks[outside].succs.end(),
+                     loop.header,
+                     pre);
+        std::replace(fn.blocks[loop.header].preds.begin(),
+                     fn.blocks[loop.header].preds.end(),
+                     outside,
+                     pre);
+        added = true;
+    }
+    if (added) {
+        fn.compute_dominators();
+    }
+
+    for (auto& loop : fn.find_loops()) {
+        if (loop.preheader == -1) {
+            continue;
+        }
+        ir_block& pre = fn.blocks[loop.preheader];
+
+        auto invariant = [&](const ir_instr& in) {
+            for (ir_ref arg : in.args) {
+                if (loop.body[fn.instrs[fn.resolve(arg)].block]) {
+                    return false;
+                }
+            }
+            return true;
+        };
+
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (int block : fn.rpo) {
+                if (!loop.body[block]) {
+                    continue;
+                }
+                bool clean = block == loop.header;
+                std::vector<ir_ref> kept;
+                for (ir_ref ref : fn.blocks[block].code) {
+                    ir_instr& in = fn.instrs[ref];
+                    bool hoist = in.kind == ir_op && ir_is_pure(in.op) &&
+                                 (!ir_may_throw(in.op) || clean) &&
+                                 invariant(in);
+                    if (hoist) {
+                        pre.code.insert(pre.code.end() - 1, ref);
+                        in.block = loop.preheader;
+                        changed = true;
+                        continue;
+                    }
+                    if (in.kind == ir_op &&
+                        (!ir_is_pure(in.op) || ir_may_throw(in.op))) {
+                        clean = false;
+                    }
+                    kept.push_back(ref);
+                }
+                fn.blocks[block].code = std::move(kept);
+            }
+        }
+    }
+}
+
+// * Types
+//
+// What kind of number each value is known to be, from type hint checks,
+// constants and arithmetic on known types, worked out optimistically around
+// loops: a value starts out unknown and only widens as more of its inputs are
+// seen, so a loop counter starting at 0 and counting up stays an int.
+
+enum ir_type : uint8_t
+{
+    ty_unknown,
+    ty_int,
+    ty_decimal,
+    ty_bool,
+    ty_any
+};
+
+static ir_type
+join(ir_type a, ir_type b)
+{
+    if (a == ty_unknown) {
+        return b;
+    }
+    if (b == ty_unknown || a == b) {
+        return a;
+    }
+    return ty_any;
+}
+
+// the type of arithmetic on operands of type b and c
+static ir_type
+arithmetic_type(opcode op, ir_type b, ir_type c)
+{
+    if (b == ty_unknown || c == ty_unknown) {
+        return ty_unknown;
+    }
+    if (b == c && (b == ty_decimal || (b == ty_int && op != op_div))) {
+        return b;
+    }
+    return ty_any;
+}
+
+static ir_type
+result_type(const ir_function& fn,
+            const ir_instr& in,
+            const std::vector<ir_type>& types)
+{
+    auto arg = [&](size_t k) { return types[fn.resolve(in.args[k])]; };
+
+    if (in.kind == ir_param) {
+        return ty_any;
+    }
+    if (in.kind == ir_phi) {
+        ir_type type = ty_unknown;
+        for (size_t k = 0; k < in.args.size(); ++k) {
+            type = join(type, arg(k));
+        }
+        return type;
+    }
+
+    switch (in.op) {
+        case op_loadi:
+            return ty_int;
+        case op_loadk: {
+            value k = fn.proto->constants[in.imm];
+            return k.is_int()       ? ty_int
+                   : k.is_decimal() ? ty_decimal
+                   : k.is_bool()    ? ty_bool
+                                    : ty_any;
+        }
+        case op_loadtrue:
+        case op_loadfalse:
+        case op_eq:
+        case op_lt:
+        case op_le:
+        case op_lnot:
+            return ty_bool;
+        case op_check:
+            return in.imm == checked_int ? ty_int : ty_decimal;
+        case op_add:
+        case op_sub:
+        case op_mul:
+        case op_div:
+            return arithmetic_type(in.op, arg(0), arg(1));
+        case op_neg:
+            return arithmetic_type(in.op, arg(0), arg(0));
+        default:
+            return ty_any;
+    }
+}
+
+// the quickened form of op for operands of type, or op
+static opcode
+typed_op(opcode op, ir_type type)
+{
+    static const opcode int_ops[][2] = {
+        { op_add, op_add_ii }, { op_sub, op_sub_ii }, { op_mul, op_mul_ii },
+        { op_eq, op_eq_ii },   { op_lt, op_lt_ii },   { op_le, op_le_ii }
+    };
+    static const opcode decimal_ops[][2] = {
+        { op_add, op_add_dd }, { op_sub, op_sub_dd }, { op_mul, op_mul_dd },
+        { op_div, op_div_dd }, { op_lt, op_lt_dd },   { op_le, op_le_dd }
+    };
+
+    if (type == ty_int) {
+        for (auto& pair : int_ops) {
+            if (pair[0] == op) {
+                return pair[1];
+            }
+        }
+    } else if (type == ty_decimal) {
+        for (auto& pair : decimal_ops) {
+            if (pair[0] == op) {
+                return pair[1];
+            }
+        }
+    }
+    return op;
+}
+
+// Drops checks of values known to have the checked type and has arithmetic
+// on known types use the quickened instruction for them from the start. The
+// quickened instructions still test their operands, so an int that grew past
+// the fixnum range only sends one back to the generic instruction.
+void
+specialize_types(ir_function& fn)
+{
+    std::vector<ir_type> types(fn.instrs.size(), ty_unknown);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int block : fn.rpo) {
+            auto& b = fn.blocks[block];
+            for (auto* refs : { &b.phis, &b.code }) {
+                for (ir_ref ref : *refs) {
+                    const ir_instr& in = fn.instrs[ref];
+                    if (in.dead || !in.has_value) {
+                        continue;
+                    }
+                    ir_type type = join(types[ref], result_type(fn, in, types));
+                    if (type != types[ref]) {
+                        types[ref] = type;
+                        changed = true;
+                    }
+                }
+            }
+        }
+    }
+
+    for (int block : fn.rpo) {
+        for (ir_ref ref : fn.blocks[block].code) {
+            ir_instr& in = fn.instrs[ref];
+            if (in.kind != ir_op || in.dead) {
+                continue;
+            }
+            if (in.op == op_check) {
+                ir_ref arg = fn.resolve(in.args[0]);
+                if (types[arg] == types[ref]) {
+                    in.forward = arg;
+                    in.dead = true;
+                }
+                continue;
+            }
+            if (in.args.size() == 2) {
+                ir_type b = types[fn.resolve(in.args[0])];
+                ir_type c = types[fn.resolve(in.args[1])];
+                if (b == c) {
+                    in.op = typed_op(in.op, b);
+                }
+            }
+        }
+    }
+    fn.compact();
+}
+
+static bool
+has_effect(const ir_instr& in)
+{
+    if (in.kind != ir_op) {
+        return false;
+    }
+    switch (in.op) {
+        case op_move:
+        case op_loadk:
+        case op_loadi:
+        case op_loadnil:
+        case op_loadtrue:
+        case op_loadfalse:
+        case op_eq:
+        case op_eq_ii:
+        case op_lnot:
+        case op_closure:
+        case op_getcap:
+        case op_box:
+        case op_getbox:
+        case op_vec:
+        case op_map:
+        case op_set:
+            return false;
+        default:
+            return true;
+    }
+}
+
+// Removes instructions whose values are never used and that have no effect.
+// Instructions that may throw are kept so errors do not disappear.
+void
+eliminate_dead_code(ir_function& fn)
+{
+    std::vector<bool> live(fn.instrs.size(), false);
+    std::vector<ir_ref> work;
+
+    for (auto& block : fn.blocks) {
+        if (block.removed) {
+            continue;
+        }
+        for (ir_ref ref : block.code) {
+            if (has_effect(fn.instrs[ref])) {
+                live[ref] = true;
+                work.push_back(ref);
+            }
+        }
+    }
+
+    while (!work.empty()) {
+        ir_ref ref = work.back();
+        work.pop_back();
+        for (ir_ref arg : fn.instrs[ref].args) {
+            arg = fn.resolve(arg);
+            if (!live[arg]) {
+                live[arg] = true;
+                work.push_back(arg);
+            }
+        }
+    }
+
+    for (size_t ref = 0; ref < fn.instrs.size(); ++ref) {
+        if (!live[ref]) {
+            fn.instrs[ref].dead = true;
+        }
+    }
+    fn.compact();
+}
@@ -0,0 +1,802 @@
+#include "jit.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#if FUNLANG_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+native_code::native_code(uint8_t* memory,
+                         size_t size,
+                         std::vector<uint32_t> offsets)
+  : memory(memory)
+  , size(size)
+  , offsets(std::move(offsets))
+  , aot(nullptr)
+  , deopts(0)
+{
+}
+
+native_code::native_code(aot_function aot)
+  : memory(nullptr)
+  , size(0)
+  , aot(aot)
+  , deopts(0)
+{
+}
+
+native_code::~native_code()
+{
+#if FUNLANG_JIT
+    if (memory) {
+        munmap(memory, size);
+    }
+#endif
+}
+
+uint32_t
+native_code::run(value* R, size_t pc) const
+{
+    // the code starts with a prologue taking the register file and the
+    // address to jump to
+    typedef uint32_t (*entry_fn)(value*, const uint8_t*);
+    entry_fn entry = reinterpret_cast<entry_fn>(memory);
+    return entry(R, memory + offsets[pc]);
+}
+
+jit_compiler::jit_compiler()
+  : enabled(FUNLANG_JIT)
+{
+}
+
+void
+jit_compiler::run(vm& vm, function_proto* proto, value* R, const instr*& pc)
+{
+    native_code* native = proto->native;
+    uint32_t at = pc - proto->code.data();
+    uint32_t exit;
+    if (native->aot) {
+        try {
+            exit = native->aot(vm, proto, R, at, &at);
+        } catch (...) {
+            pc = proto->code.data() + at + 1;
+            throw;
+        }
+    } else {
+        exit = native->run(R, at);
+        if ((exit & 1) && ++native->deopts > max_deopts) {
+            discard(proto);
+        }
+    }
+    pc = proto->code.data() + (exit >> 1);
+}
+
+void
+jit_compiler::install(function_proto* proto, aot_function fn)
+{
+    code.emplace_back(new native_code(fn));
+    proto->native = code.back().get();
+}
+
+void
+jit_compiler::discard(function_proto* proto)
+{
+    auto found =
+      std::find_if(code.begin(), code.end(), [&](const auto& native) {
+          return native.get() == proto->native;
+      });
+    code.erase(found);
+    proto->native = nullptr;
+    proto->no_jit = true;
+}
+
+#if FUNLANG_JIT
+
+namespace {
+
+// * Assembler
+//
+// Just the x86-64 encodings the templates need. Only the eight legacy
+// registers are used, so no REX.R or REX.B bits are ever needed.
+
+enum reg : uint8_t
+{
+    rax = 0,
+    rcx = 1,
+    rdx = 2,
+    rbx = 3,
+    rsi = 6,
+    rdi = 7
+};
+
+enum xmm : uint8_t
+{
+    xmm0 = 0,
+    xmm1 = 1
+};
+
+enum cond : uint8_t
+{
+    cc_o = 0x0,
+    cc_e = 0x4,
+    cc_ne = 0x5,
+    cc_be = 0x6,
+    cc_a = 0x7,
+    cc_p = 0xa,
+    cc_l = 0xc,
+    cc_le = 0xe
+};
+
+struct assembler
+{
+    std::vector<uint8_t> bytes;
+    std::vector<long> labels;
+
+    struct fixup
+    {
+        size_t at;
+        int label;
+    };
+    std::vector<fixup> fixups;
+
+    int new_label()
+    {
+        labels.push_back(-1);
+        return labels.size() - 1;
+    }
+
+    void bind(int label) { labels[label] = bytes.size(); }
+
+    void byte(uint8_t b) { bytes.push_back(b); }
+
+    void u32(uint32_t v)
+    {
+        for (int n = 0; n < 4; ++n) {
+            byte(v >> (8 * n));
+        }
+    }
+
+    void u64(uint64_t v)
+    {
+        for (int n = 0; n < 8; ++n) {
+            byte(v >> (8 * n));
+        }
+    }
+
+    void rel32(int label)
+    {
+        fixups.push_back({ bytes.size(), label });
+        u32(0);
+    }
+
+    void modrm(int mod, int reg, int rm) { byte(mod << 6 | reg << 3 | rm); }
+
+    // op r/m64, r64 with two registers
+    void rr(uint8_t opcode, reg regfield, reg rm)
+    {
+        byte(0x48);
+        byte(opcode);
+        modrm(3, regfield, rm);
+    }
+
+    // r = R[slot], the register file is in rbx
+    void load(reg r, int slot)
+    {
+        byte(0x48);
+        byte(0x8b);
+        modrm(2, r, rbx);
+        u32(slot * sizeof(value));
+    }
+
+    // R[slot] = r
+    void store(int slot, reg r)
+    {
+        byte(0x48);
+        byte(0x89);
+        modrm(2, r, rbx);
+        u32(slot * sizeof(value));
+    }
+
+    // r = [base]
+    void load_ptr(reg r, reg base)
+    {
+        byte(0x48);
+        byte(0x8b);
+        modrm(0, r, base);
+    }
+
+    // [base] = r
+    void store_ptr(reg base, reg r)
+    {
+        byte(0x48);
+        byte(0x89);
+        modrm(0, r, base);
+    }
+
+    void mov_imm(reg r, uint64_t imm)
+    {
+        byte(0x48);
+        byte(0xb8 + r);
+        u64(imm);
+    }
+
+    void mov_imm32(reg r, uint32_t imm)
+    {
+        byte(0xb8 + r);
+        u32(imm);
+    }
+
+    void mov(reg dst, reg src) { rr(0x89, src, dst); }
+    void add(reg dst, reg src) { rr(0x01, src, dst); }
+    void sub(reg dst, reg src) { rr(0x29, src, dst); }
+    void or_(reg dst, reg src) { rr(0x09, src, dst); }
+    // flags of a - b
+    void cmp(reg a, reg b) { rr(0x39, b, a); }
+
+    void imul(reg dst, reg src)
+    {
+        byte(0x48);
+        byte(0x0f);
+        byte(0xaf);
+        modrm(3, dst, src);
+    }
+
+    void shift(int kind, reg r, int count)
+    {
+        byte(0x48);
+        byte(0xc1);
+        modrm(3, kind, r);
+        byte(count);
+    }
+
+    void shl(reg r, int count) { shift(4, r, count); }
+    void shr(reg r, int count) { shift(5, r, count); }
+    void sar(reg r, int count) { shift(7, r, count); }
+
+    // 32 bit compare with an immediate
+    void cmp32(reg r, uint32_t imm)
+    {
+        byte(0x81);
+        modrm(3, 7, r);
+        u32(imm);
+    }
+
+    // 64 bit compare with a sign extended byte
+    void cmp8(reg r, int8_t imm)
+    {
+        byte(0x48);
+        byte(0x83);
+        modrm(3, 7, r);
+        byte(imm);
+    }
+
+    // r = condition ? 1 : 0
+    void set(cond c, reg r)
+    {
+        byte(0x0f);
+        byte(0x90 | c);
+        modrm(3, 0, r);
+        byte(0x0f);
+        byte(0xb6);
+        modrm(3, r, r);
+    }
+
+    void jcc(cond c, int label)
+    {
+        byte(0x0f);
+        byte(0x80 | c);
+        rel32(label);
+    }
+
+    void jmp(int label)
+    {
+        byte(0xe9);
+        rel32(label);
+    }
+
+    void movq(xmm dst, reg src)
+    {
+        byte(0x66);
+        byte(0x48);
+        byte(0x0f);
+        byte(0x6e);
+        modrm(3, dst, src);
+    }
+
+    void movq(reg dst, xmm src)
+    {
+        byte(0x66);
+        byte(0x48);
+        byte(0x0f);
+        byte(0x7e);
+        modrm(3, src, dst);
+    }
+
+    // scalar double operation, dst = dst op src
+    void sd(uint8_t opcode, xmm dst, xmm src)
+    {
+        byte(0xf2);
+        byte(0x0f);
+        byte(opcode);
+        modrm(3, dst, src);
+    }
+
+    void ucomisd(xmm a, xmm b)
+    {
+        byte(0x66);
+        byte(0x0f);
+        byte(0x2e);
+        modrm(3, a, b);
+    }
+
+    void resolve()
+    {
+        for (auto& f : fixups) {
+            int32_t rel = labels[f.label] - (long)(f.at + 4);
+            std::memcpy(&bytes[f.at], &rel, sizeof rel);
+        }
+    }
+};
+
+// * Templates
+
+enum class arith
+{
+    add,
+    sub,
+    mul,
+    div
+};
+
+enum class compare
+{
+    lt,
+    le,
+    eq
+};
+
+struct translator
+{
+    function_proto* proto;
+    assembler a;
+
+    int epilogue;
+    // one label per bytecode instruction, plus one past the end
+    std::vector<int> at;
+
+    struct exit_stub
+    {
+        int label;
+        size_t pc;
+        bool deopt;
+    };
+    std::vector<exit_stub> exits;
+
+    // second halves of fused pairs, emitted out of line
+    std::vector<size_t> deferred;
+
+    translator(function_proto* proto)
+      : proto(proto)
+    {
+    }
+
+    // a label leaving native code to run instruction pc in the interpreter
+    int exit_to(size_t pc, bool deopt)
+    {
+        for (auto& stub : exits) {
+            if (stub.pc == pc && stub.deopt == deopt) {
+                return stub.label;
+            }
+        }
+        exits.push_back({ a.new_label(), pc, deopt });
+        return exits.back().label;
+    }
+
+    // jumps to fail unless r holds a fixnum; clobbers rdx
+    void check_fixnum(reg r, int fail)
+    {
+        a.mov(rdx, r);
+        a.shr(rdx, 48);
+        a.cmp32(rdx, value::tag_int >> 48);
+        a.jcc(cc_ne, fail);
+    }
+
+    // jumps to fail unless r holds a decimal; clobbers rdx
+    void check_decimal(reg r, int fail)
+    {
+        a.mov(rdx, r);
+        a.shr(rdx, 51);
+        a.cmp32(rdx, value::box_mask >> 51);
+        a.jcc(cc_e, fail);
+    }
+
+    // R[A] = R[B] op R[C] for fixnums and/or decimals, going to fail for
+    // other operands and for results that would leave the fixnum range or be
+    // NaN
+    void arithmetic(instr i, arith op, bool ints, bool decimals, int fail)
+    {
+        a.load(rax, instr_b(i));
+        a.load(rcx, instr_c(i));
+        int done = a.new_label();
+
+        if (ints) {
+            int next = decimals ? a.new_label() : fail;
+            check_fixnum(rax, next);
+            check_fixnum(rcx, next);
+            // work on the payloads shifted to the top, so the processor's
+            // overflow flag tells whether the result fits a fixnum
+            if (op == arith::mul) {
+                a.shl(rax, 16);
+                a.sar(rax, 16);
+            } else {
+                a.shl(rax, 16);
+            }
+            a.shl(rcx, 16);
+            switch (op) {
+                case arith::add:
+                    a.add(rax, rcx);
+                    break;
+                case arith::sub:
+                    a.sub(rax, rcx);
+                    break;
+                default:
+                    a.imul(rax, rcx);
+                    break;
+            }
+            a.jcc(cc_o, fail);
+            a.shr(rax, 16);
+            a.mov_imm(rdx, value::tag_int);
+            a.or_(rax, rdx);
+            a.store(instr_a(i), rax);
+            if (decimals) {
+                a.jmp(done);
+                a.bind(next);
+            }
+        }
+
+        if (decimals) {
+            static const uint8_t opcodes[] = { 0x58, 0x5c, 0x59, 0x5e };
+            check_decimal(rax, fail);
+            check_decimal(rcx, fail);
+            a.movq(xmm0, rax);
+            a.movq(xmm1, rcx);
+            a.sd(opcodes[(int)op], xmm0, xmm1);
+            // NaN results are canonicalized by the interpreter
+            a.ucomisd(xmm0, xmm0);
+            a.jcc(cc_p, fail);
+            a.movq(rax, xmm0);
+            a.store(instr_a(i), rax);
+        }
+        a.bind(done);
+    }
+
+    // R[A] = R[B] op R[C] for fixnums and/or decimals, leaving 0 or 1 in rcx
+    void comparison(instr i, compare op, bool ints, bool decimals, int fail)
+    {
+        a.load(rax, instr_b(i));
+        a.load(rcx, instr_c(i));
+        int done = a.new_label();
+
+        if (ints) {
+            int next = decimals ? a.new_label() : fail;
+            check_fixnum(rax, next);
+            check_fixnum(rcx, next);
+            a.shl(rax, 16);
+            a.shl(rcx, 16);
+            a.cmp(rax, rcx);
+            a.set(op == compare::lt ? cc_l : op == compare::le ? cc_le : cc_e,
+                  rcx);
+            if (decimals) {
+                a.jmp(done);
+                a.bind(next);
+            }
+        }
+
+        if (decimals) {
+            check_decimal(rax, fail);
+            check_decimal(rcx, fail);
+            a.movq(xmm0, rax);
+            a.movq(xmm1, rcx);
+            // unordered compares set CF, so NaN makes lt false and le true,
+            // as in compare_values
+            if (op == compare::lt) {
+                a.ucomisd(xmm1, xmm0);
+                a.set(cc_a, rcx);
+            } else {
+                a.ucomisd(xmm0, xmm1);
+                a.set(cc_be, rcx);
+            }
+        }
+
+        a.bind(done);
+        a.mov_imm(rax, value::false_bits);
+        a.add(rax, rcx);
+        a.store(instr_a(i), rax);
+    }
+
+    // jumps to target when R[slot] is (or is not) truthy
+    void test(int slot, bool jump_if, int target)
+    {
+        a.load(rax, slot);
+        a.mov_imm(rdx, value::nil_bits);
+        a.sub(rax, rdx);
+        // nil and false are the two lowest special values
+        a.cmp8(rax, 1);
+        a.jcc(jump_if ? cc_a : cc_be, target);
+    }
+
+    void load_constant(int slot, value v)
+    {
+        a.mov_imm(rax, v.bits);
+        a.store(slot, rax);
+    }
+
+    // the code for instruction pc; returns whether the next instruction was
+    // consumed as the second half of a superinstruction
+    bool emit(size_t pc)
+    {
+        instr i = proto->code[pc];
+        auto target = [&](size_t from, instr jump) {
+            return at[from + 1 + instr_sbx(jump)];
+        };
+
+        switch (instr_op(i)) {
+            case op_move:
+                a.load(rax, instr_b(i));
+                a.store(instr_a(i), rax);
+                return false;
+            case op_loadk:
+                load_constant(instr_a(i), proto->constants[instr_bx(i)]);
+                return false;
+            case op_loadi:
+                load_constant(instr_a(i), value::fixnum(instr_sbx(i)));
+                return false;
+            case op_loadnil:
+                load_constant(instr_a(i), value::nil());
+                return false;
+            case op_loadtrue:
+                load_constant(instr_a(i), value::boolean(true));
+                return false;
+            case op_loadfalse:
+                load_constant(instr_a(i), value::boolean(false));
+                return false;
+            case op_getglobal: {
+                // cells never move, the interpreter raises the error
+                global_obj* cell =
+                  proto->constants[instr_bx(i)].as<global_obj>();
+                a.mov_imm(rcx, (uint64_t)(uintptr_t)&cell->item);
+                a.load_ptr(rax, rcx);
+                a.mov_imm(rdx, value::unbound_bits);
+                a.cmp(rax, rdx);
+                a.jcc(cc_e, exit_to(pc, false));
+                a.store(instr_a(i), rax);
+                return false;
+            }
+            case op_setglobal: {
+                global_obj* cell =
+                  proto->constants[instr_bx(i)].as<global_obj>();
+                a.load(rax, instr_a(i));
+                a.mov_imm(rcx, (uint64_t)(uintptr_t)&cell->item);
+                a.store_ptr(rcx, rax);
+                return false;
+            }
+
+            case op_add:
+                arithmetic(i, arith::add, true, true, exit_to(pc, false));
+                return false;
+            case op_sub:
+                arithmetic(i, arith::sub, true, true, exit_to(pc, false));
+                return false;
+            case op_mul:
+                arithmetic(i, arith::mul, true, true, exit_to(pc, false));
+                return false;
+            case op_add_ii:
+                arithmetic(i, arith::add, true, false, exit_to(pc, true));
+                return false;
+            case op_sub_ii:
+                arithmetic(i, arith::sub, true, false, exit_to(pc, true));
+                return false;
+            case op_mul_ii:
+                arithmetic(i, arith::mul, true, false, exit_to(pc, true));
+                return false;
+            case op_add_dd:
+                arithmetic(i, arith::add, false, true, exit_to(pc, true));
+                return false;
+            case op_sub_dd:
+                arithmetic(i, arith::sub, false, true, exit_to(pc, true));
+                return false;
+            case op_mul_dd:
+                arithmetic(i, arith::mul, false, true, exit_to(pc, true));
+                return false;
+            case op_div_dd:
+                arithmetic(i, arith::div, false, true, exit_to(pc, true));
+                return false;
+
+            case op_lt:
+                comparison(i, compare::lt, true, true, exit_to(pc, false));
+                return false;
+            case op_le:
+                comparison(i, compare::le, true, true, exit_to(pc, false));
+                return false;
+            case op_eq:
+                comparison(i, compare::eq, true, false, exit_to(pc, false));
+                return false;
+            case op_lt_ii:
+                comparison(i, compare::lt, true, false, exit_to(pc, true));
+                return false;
+            case op_le_ii:
+                comparison(i, compare::le, true, false, exit_to(pc, true));
+                return false;
+            case op_eq_ii:
+                comparison(i, compare::eq, true, false, exit_to(pc, true));
+                return false;
+            case op_lt_dd:
+                comparison(i, compare::lt, false, true, exit_to(pc, true));
+                return false;
+            case op_le_dd:
+                comparison(i, compare::le, false, true, exit_to(pc, true));
+                return false;
+
+            case op_lnot:
+                a.load(rax, instr_b(i));
+                a.mov_imm(rdx, value::nil_bits);
+                a.sub(rax, rdx);
+                a.cmp8(rax, 1);
+                a.set(cc_be, rcx);
+                a.mov_imm(rax, value::false_bits);
+                a.add(rax, rcx);
+                a.store(instr_a(i), rax);
+                return false;
+
+            case op_check:
+                // boxed ints and failed checks go through the interpreter
+                a.load(rax, instr_b(i));
+                if (instr_c(i) == checked_int) {
+                    check_fixnum(rax, exit_to(pc, false));
+                } else {
+                    check_decimal(rax, exit_to(pc, false));
+                }
+                a.store(instr_a(i), rax);
+                return false;
+
+            case op_jmp:
+                a.jmp(target(pc, i));
+                return false;
+            case op_jmpif:
+            case op_jmpifnot:
+                test(instr_a(i), instr_op(i) == op_jmpif, target(pc, i));
+                return false;
+
+            case op_lt_jmpif:
+            case op_lt_jmpifnot:
+            case op_le_jmpif:
+            case op_le_jmpifnot:
+            case op_eq_jmpif:
+            case op_eq_jmpifnot: {
+                opcode op = instr_op(i);
+                compare kind = op == op_lt_jmpif || op == op_lt_jmpifnot
+                                 ? compare::lt
+                               : op == op_le_jmpif || op == op_le_jmpifnot
+                                 ? compare::le
+                                 : compare::eq;
+                bool jump_if =
+                  op == op_lt_jmpif || op == op_le_jmpif || op == op_eq_jmpif;
+                comparison(i,
+                           kind,
+                           true,
+                           kind != compare::eq,
+                           exit_to(pc, false));
+                a.cmp8(rcx, 0);
+                a.jcc(jump_if ? cc_ne : cc_e,
+                      target(pc + 1, proto->code[pc + 1]));
+                deferred.push_back(pc + 1);
+                return true;
+            }
+            case op_move_call:
+                // the call after it exits
+                a.load(rax, instr_b(i));
+                a.store(instr_a(i), rax);
+                return false;
+
+            default:
+                // calls, returns and anything that allocates or
+                // needs the generic operations run in the interpreter
+                a.jmp(exit_to(pc, false));
+                return false;
+        }
+    }
+
+    void translate()
+    {
+        size_t count = proto->code.size();
+        for (size_t pc = 0; pc <= count; ++pc) {
+            at.push_back(a.new_label());
+        }
+        epilogue = a.new_label();
+
+        // uint32_t entry(value* R, const uint8_t* address)
+        a.byte(0x53); // push rbx
+        a.mov(rbx, rdi);
+        a.byte(0xff); // jmp rsi
+        a.modrm(3, 4, rsi);
+
+        a.bind(epilogue);
+        a.byte(0x5b); // pop rbx
+        a.byte(0xc3); // ret
+
+        for (size_t pc = 0; pc < count; ++pc) {
+            a.bind(at[pc]);
+            if (emit(pc)) {
+                ++pc;
+            }
+        }
+        // only reached by jumps; also the end of the last instruction,
+        // which never falls through
+        a.bind(at[count]);
+
+        for (size_t n = 0; n < deferred.size(); ++n) {
+            size_t pc = deferred[n];
+            a.bind(at[pc]);
+            emit(pc);
+            a.jmp(at[pc + 1]);
+        }
+
+        for (size_t n = 0; n < exits.size(); ++n) {
+            a.bind(exits[n].label);
+            a.mov_imm32(rax, exits[n].pc << 1 | exits[n].deopt);
+            a.jmp(epilogue);
+        }
+
+        a.resolve();
+    }
+};
+
+} // namespace
+
+bool
+jit_compiler::compile(function_proto* proto)
+{
+    translator t{ proto };
+    t.translate();
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = (t.a.bytes.size() + page - 1) / page * page;
+    void* memory = mmap(nullptr,
+                        size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1,
+                        0);
+    if (memory == MAP_FAILED) {
+        proto->no_jit = true;
+        return false;
+    }
+    std::memcpy(memory, t.a.bytes.data(), t.a.bytes.size());
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, size);
+        proto->no_jit = true;
+        return false;
+    }
+
+    std::vector<uint32_t> offsets;
+    for (size_t pc = 0; pc < proto->code.size(); ++pc) {
+        offsets.push_back(t.a.labels[t.at[pc]]);
+    }
+    code.emplace_back(
+      new native_code((uint8_t*)memory, size, std::move(offsets)));
+    proto->native = code.back().get();
+    return true;
+}
+
+#else
+
+bool
+jit_compiler::compile(function_proto* proto)
+{
+    proto->no_jit = true;
+    return false;
+}
+
+#endif
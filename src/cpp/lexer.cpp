@@ -1,5 +1,9 @@
 #include "lexer.hpp"
 
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+
 lexer::lexer(const std::string input, arena* arr)
   : _input(input)
   , begin(_input.begin())
@@ -66,9 +70,22 @@ lexer::scan_char()
             state = READ;
             break;
         case READ:
-            assert(iter != end);
+            if (iter == end) {
+                // only trailing whitespace left
+                _arena->discard_head();
+                state = HALT;
+                break;
+            }
 
-            if (isdigit(current())) {
+            token_start = distance(begin, iter);
+
+            if (current() == ';') {
+                // comment, skip to end of line
+                while (iter != end && current() != '\n') {
+                    step();
+                }
+                state = READ;
+            } else if (isdigit(current())) {
                 state = DIGIT;
             } else if (current() == '"') {
                 step();
@@ -148,7 +165,7 @@ lexer::scan_char()
 
                 if (!(isalnum(current()) ||
                       valid_ident_chars.count(current()))) {
-                    std::string tester{ buffer.data };
+                    std::string tester{ buffer.data, buffer.len };
 
                     if (valid_literals.count(tester)) {
                         state = LITERAL;
@@ -161,9 +178,8 @@ lexer::scan_char()
             }
             break;
         case LITERAL:
-            assert(iter != end);
             {
-                std::string test{ buffer.data };
+                std::string test{ buffer.data, buffer.len };
 
                 // @TODO: maybe make this faster:
 
@@ -195,7 +211,7 @@ lexer::scan_char()
 
             buf_type = t_keyword;
 
-            if (isspace(current())) {
+            if (!(isalnum(current()) || valid_ident_chars.count(current()))) {
                 state = PUSH;
             }
 
@@ -246,16 +262,16 @@ lexer::scan_char()
         case STR:
             assert(iter != end);
 
-            _arena->append_char(&buffer, current());
-            step();
-
             buf_type = t_str;
 
-            if (current() == '\\') {
-                state = ESCAPED_STR;
-            } else if (current() == '"') {
+            if (current() == '"') {
                 step();
                 state = PUSH;
+            } else if (current() == '\\') {
+                state = ESCAPED_STR;
+            } else {
+                _arena->append_char(&buffer, current());
+                step();
             }
             break;
         case ESCAPED_STR:
@@ -288,17 +304,14 @@ lexer::scan_char()
                 step();
             }
 
-            if (current() == '"') {
-                state = PUSH;
-            } else {
-                state = STR;
-            }
+            state = STR;
 
             break;
         case PUSH: {
             token cur;
 
             cur.type = buf_type;
+            cur.filepos = token_start;
             _arena->append_char(&buffer, '\0');
 
             _arena->realloc_head(&buffer, buffer.len - 1);
@@ -323,9 +336,22 @@ lexer::scan_char()
                     cur.data_char = buffer.data[0];
                     break;
                 case t_integer:
-                    cur.ts = ts_int;
-                    _arena->make_null_term(&buffer);
-                    cur.data_int = atoi(buffer.data);
+                    {
+                        _arena->make_null_term(&buffer);
+                        errno = 0;
+                        long num = strtol(buffer.data, nullptr, 10);
+                        if (errno == ERANGE) {
+                            // kept as text for the parser to report
+                            cur.ts = ts_str;
+                            cur.data_str = buffer;
+                        } else if (num >= INT_MIN && num <= INT_MAX) {
+                            cur.ts = ts_int;
+                            cur.data_int = num;
+                        } else {
+                            cur.ts = ts_long;
+                            cur.data_long = num;
+                        }
+                    }
                     break;
                 case t_decimal:
                     cur.ts = ts_dec;
@@ -387,7 +413,10 @@ lexer::scan_char()
                 case t_keyword:
                     break;
                 default:
-                    _arena->discard_head();
+                    // an out of range integer keeps its text
+                    if (buf_type != t_integer || cur.ts != ts_str) {
+                        _arena->discard_head();
+                    }
                     break;
             }
 
@@ -5,13 +5,18 @@
 #include <sstream>
 #include <utility>
 
+#include <chrono>
 #include <experimental/optional>
+#include <fstream>
 
 #include "affix_allocator.hpp"
 #include "allocator_base.hpp"
 #include "lang_datastructs.hpp"
 #include "mallocator.hpp"
 #include "stack_allocator.hpp"
+#include "bench.hpp"
+#include "interpreter.hpp"
+#include "token_cache.hpp"
 
 using namespace std;
 
@@ -54,16 +59,195 @@ template<typename T, typename Alloc>
 pvec<T, Alloc>
 pv_range(Alloc* _allc, T from, T to)
 {
-    typename pvec<T, Alloc>::tvec v{ _allc };
-    for (T i = from; i < to; ++i) {
-        v = v.conj(i);
+    size_t count = from < to ? to - from : 0;
+    return pvec<T, Alloc>::from_sized(
+      _allc, count, [from](size_t i) { return from + T(i); });
+}
+
+// ** Token dump
+// Lexes each file (through the token cache unless --no-cache is given) and
+// prints its token stream.
+int
+dump_tokens(const std::vector<string>& files, bool use_cache)
+{
+    arena strings;
+    token_cache cache{ use_cache ? token_cache::default_directory() : "" };
+
+    for (auto& path : files) {
+        std::ifstream file{ path };
+        if (!file) {
+            cerr << "could not open " << path << endl;
+            return 1;
+        }
+        stringstream contents;
+        contents << file.rdbuf();
+        string source = contents.str();
+
+        auto start = chrono::steady_clock::now();
+        auto tokens = lex_cached(&cache, &strings, source);
+        auto elapsed = chrono::duration_cast<chrono::microseconds>(
+          chrono::steady_clock::now() - start);
+
+        cout << path << ": " << tokens.size() << " tokens in "
+             << elapsed.count() << "us\n";
+        for (auto& tok : tokens) {
+            cout << tok << " ";
+        }
+        cout << endl;
     }
-    return v.to_persistent();
+    return 0;
 }
 
-// ** Main function
-int main( // int argc, char** argv
-  )
+// ** Running programs
+struct run_options
+{
+    bool use_cache = true;
+    bool disasm = false;
+    bool optimize = true;
+    bool dump_ir = false;
+    bool profile = false;
+    bool superinstructions = true;
+    bool jit = true;
+    bool aot = false;
+};
+
+void
+configure(interpreter& interp, const run_options& options)
+{
+    interp.disassemble = options.disasm;
+    interp.optimize = options.optimize;
+    interp.dump_ir = options.dump_ir;
+    interp.machine.profiling = options.profile;
+    interp.superinstructions = options.superinstructions;
+    interp.machine.jit.enabled = interp.machine.jit.enabled && options.jit;
+    interp.aot = options.aot;
+}
+
+int
+run_files(const std::vector<string>& files, const run_options& options)
+{
+    interpreter interp{ options.use_cache };
+    configure(interp, options);
+
+    int status = 0;
+    for (auto& path : files) {
+        std::ifstream file{ path };
+        if (!file) {
+            cerr << "could not open " << path << endl;
+            status = 1;
+            break;
+        }
+        stringstream contents;
+        contents << file.rdbuf();
+
+        try {
+            interp.eval(path, contents.str(), nullptr, true);
+        } catch (std::exception& e) {
+            cout.flush();
+            cerr << e.what() << endl;
+            status = 1;
+            break;
+        }
+    }
+    cout.flush();
+    if (options.profile) {
+        interp.machine.profile.dump(cerr);
+    }
+    return status;
+}
+
+// ** Ahead of time translation
+// Prints the C++ the --aot modules of the files are built from.
+int
+translate_files(const std::vector<string>& files, const run_options& options)
+{
+    aot_options aot;
+    aot.optimize = options.optimize;
+    aot.superinstructions = options.superinstructions;
+
+    for (auto& path : files) {
+        std::ifstream file{ path };
+        if (!file) {
+            cerr << "could not open " << path << endl;
+            return 1;
+        }
+        stringstream contents;
+        contents << file.rdbuf();
+        try {
+            aot_translate(path, contents.str(), aot, cout);
+        } catch (std::exception& e) {
+            cout.flush();
+            cerr << e.what() << endl;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// ** Language REPL
+// Collects lines until the brackets balance, then evaluates them and prints
+// every result.
+static int
+bracket_depth(const string& text)
+{
+    int depth = 0;
+    bool in_string = false;
+    for (size_t i = 0; i < text.size(); ++i) {
+        char c = text[i];
+        if (in_string) {
+            if (c == '\\') {
+                ++i;
+            } else if (c == '"') {
+                in_string = false;
+            }
+        } else if (c == '"') {
+            in_string = true;
+        } else if (c == ';') {
+            while (i < text.size() && text[i] != '\n') {
+                ++i;
+            }
+        } else if (c == '(' || c == '[' || c == '{') {
+            ++depth;
+        } else if (c == ')' || c == ']' || c == '}') {
+            --depth;
+        }
+    }
+    return depth;
+}
+
+int
+repl(const run_options& options)
+{
+    interpreter interp{ options.use_cache };
+    configure(interp, options);
+
+    string input;
+    string line;
+    while (true) {
+        cout << (input.empty() ? "> " : "  ") << flush;
+        if (!getline(cin, line)) {
+            break;
+        }
+        input += line;
+        input += "\n";
+        if (bracket_depth(input) > 0) {
+            continue;
+        }
+
+        try {
+            interp.eval("repl", input, &cout);
+        } catch (std::exception& e) {
+            cout << e.what() << endl;
+        }
+        input.clear();
+    }
+    cout << endl;
+    return 0;
+}
+
+// ** Persistent vector REPL
+int
+pvec_repl()
 {
     using myalloc = alb::affix_allocator<alb::mallocator, size_t>;
 
@@ -151,3 +335,54 @@ int main( // int argc, char** argv
 
     return 0;
 }
+
+// ** Main function
+int
+main(int argc, char** argv)
+{
+    std::vector<string> files;
+    run_options options;
+    bool tokens = false;
+    bool emit_aot = false;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--no-cache") {
+            options.use_cache = false;
+        } else if (arg == "--tokens") {
+            tokens = true;
+        } else if (arg == "--disasm") {
+            options.disasm = true;
+        } else if (arg == "--no-opt") {
+            options.optimize = false;
+        } else if (arg == "--ir") {
+            options.dump_ir = true;
+        } else if (arg == "--profile") {
+            options.profile = true;
+        } else if (arg == "--no-fuse") {
+            options.superinstructions = false;
+        } else if (arg == "--no-jit") {
+            options.jit = false;
+        } else if (arg == "--aot") {
+            options.aot = true;
+        } else if (arg == "--emit-aot") {
+            emit_aot = true;
+        } else if (arg == "--pvec") {
+            return pvec_repl();
+        } else if (arg == "--bench") {
+            return run_benchmarks(cout);
+        } else {
+            files.push_back(arg);
+        }
+    }
+
+    if (tokens) {
+        return dump_tokens(files, options.use_cache);
+    }
+    if (emit_aot) {
+        return translate_files(files, options);
+    }
+    if (!files.empty()) {
+        return run_files(files, options);
+    }
+    return repl(options);
+}
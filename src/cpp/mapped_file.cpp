@@ -0,0 +1,119 @@
+#include "mapped_file.hpp"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+mapped_file::mapped_file(mapped_file&& from)
+  : _data(from._data)
+  , _size(from._size)
+{
+    from._data = nullptr;
+    from._size = 0;
+}
+
+mapped_file&
+mapped_file::operator=(mapped_file&& from)
+{
+    if (this != &from) {
+        close();
+        _data = from._data;
+        _size = from._size;
+        from._data = nullptr;
+        from._size = 0;
+    }
+    return *this;
+}
+
+mapped_file::~mapped_file()
+{
+    close();
+}
+
+bool
+mapped_file::open(const std::string& path)
+{
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+
+    void* mem = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+
+    if (mem == MAP_FAILED) {
+        return false;
+    }
+
+    _data = mem;
+    _size = st.st_size;
+    return true;
+}
+
+void
+mapped_file::close()
+{
+    if (_data) {
+        munmap(_data, _size);
+        _data = nullptr;
+        _size = 0;
+    }
+}
+
+bool
+write_file_atomic(const std::string& path, const void* data, size_t size)
+{
+    std::string tmp_path = path + ".tmp." + std::to_string(getpid());
+
+    int fd = ::open(
+      tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    const char* pos = static_cast<const char*>(data);
+    size_t left = size;
+    while (left > 0) {
+        ssize_t written = ::write(fd, pos, left);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ::close(fd);
+            unlink(tmp_path.c_str());
+            return false;
+        }
+        pos += written;
+        left -= written;
+    }
+
+    if (::close(fd) != 0 || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool
+make_directories(const std::string& path)
+{
+    for (size_t i = 1; i <= path.size(); ++i) {
+        if (i == path.size() || path[i] == '/') {
+            std::string prefix = path.substr(0, i);
+            if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
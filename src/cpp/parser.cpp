@@ -1,4 +1,237 @@
+#include <algorithm>
 #include <functional>
+#include <stdexcept>
 
 #include "parser.hpp"
 #include "util.hpp"
+
+source_map::source_map(std::string name, const std::string& source)
+  : name(name)
+  , line_starts{ 0 }
+{
+    for (size_t i = 0; i < source.size(); ++i) {
+        if (source[i] == '\n') {
+            line_starts.push_back(i + 1);
+        }
+    }
+}
+
+int
+source_map::line_of(long filepos) const
+{
+    auto it =
+      std::upper_bound(line_starts.begin(), line_starts.end(), filepos);
+    return std::distance(line_starts.begin(), it);
+}
+
+form*
+parser::make_form(form_type type, const token& tok)
+{
+    forms.emplace_back(type, tok.filepos);
+    return &forms.back();
+}
+
+form*
+parser::read()
+{
+    if (at_end()) {
+        return nullptr;
+    }
+
+    const token& tok = tokens[pos++];
+    form* result = nullptr;
+
+    switch (tok.type) {
+        case t_nil:
+            result = make_form(f_nil, tok);
+            break;
+        case t_true:
+            result = make_form(f_true, tok);
+            break;
+        case t_false:
+            result = make_form(f_false, tok);
+            break;
+        case t_integer:
+            if (tok.ts == ts_str) {
+                throw parse_error("integer literal out of range: " +
+                                  std::string(tok.data_str.data,
+                                              tok.data_str.len));
+            }
+            result = make_form(f_integer, tok);
+            result->data_int = tok.ts == ts_long ? tok.data_long : tok.data_int;
+            break;
+        case t_decimal:
+            result = make_form(f_decimal, tok);
+            result->data_decimal = tok.data_decimal;
+            break;
+        case t_ratio:
+            if (tok.data_rat.divider == 0) {
+                throw parse_error("ratio with zero denominator");
+            }
+            result = make_form(f_ratio, tok);
+            result->data_rat = tok.data_rat;
+            break;
+        case t_chr:
+            result = make_form(f_chr, tok);
+            result->data_char = tok.data_char;
+            break;
+        case t_str:
+            result = make_form(f_str, tok);
+            result->data_str = tok.data_str;
+            break;
+        case t_keyword:
+            result = make_form(f_keyword, tok);
+            result->data_str = tok.data_str;
+            break;
+        case t_ident:
+            if (tok.data_str.len > 1 && tok.data_str.data[0] == '^') {
+                result = read_hinted(tok);
+            } else {
+                result = read_symbol(tok);
+            }
+            break;
+        case t_def:
+        case t_let:
+        case t_fn:
+        case t_if: {
+            // the lexer only keeps the first character of literal tokens
+            const char* name = tok.type == t_def
+                                 ? "def"
+                                 : tok.type == t_let
+                                     ? "let"
+                                     : tok.type == t_fn ? "fn" : "if";
+            result = make_form(f_symbol, tok);
+            result->data_str = _arena->alloc_str_from(name);
+        } break;
+        case t_par_open:
+            result = read_seq(f_list, t_par_close, tok);
+            break;
+        case t_vec_open:
+            result = read_seq(f_vector, t_vec_close, tok);
+            break;
+        case t_map_open:
+            result = read_seq(f_map, t_map_close, tok);
+            if (result->items.size() % 2 != 0) {
+                throw parse_error("map literal needs an even number of forms");
+            }
+            break;
+        case t_hash:
+            if (at_end() || tokens[pos].type != t_map_open) {
+                throw parse_error("expected { after #");
+            }
+            result = read_seq(f_set, t_map_close, tokens[pos++]);
+            break;
+        case t_par_close:
+        case t_map_close:
+        case t_vec_close:
+            throw parse_error(std::string("unexpected closing ") +
+                              tok.data_char);
+        case t_none:
+            throw parse_error("unexpected token");
+    }
+
+    return result;
+}
+
+form*
+parser::read_seq(form_type type, token_type close, const token& open)
+{
+    form* seq = make_form(type, open);
+    while (true) {
+        if (at_end()) {
+            throw parse_error("unexpected end of input, missing closing " +
+                              std::string(close == t_par_close
+                                            ? ")"
+                                            : close == t_vec_close ? "]"
+                                                                   : "}"));
+        }
+        if (tokens[pos].type == close) {
+            ++pos;
+            return seq;
+        }
+        seq->items.push_back(read());
+    }
+}
+
+form*
+parser::read_symbol(const token& tok)
+{
+    const mystr& s = tok.data_str;
+
+    // negative number literals lex as identifiers
+    if (s.len > 1 && s.data[0] == '-' && isdigit(s.data[1])) {
+        std::string text{ s.data, s.len };
+        size_t used = 0;
+        size_t slash = text.find('/');
+        if (slash != std::string::npos) {
+            form* f = make_form(f_ratio, tok);
+            try {
+                f->data_rat.counter = std::stoi(text.substr(0, slash), &used);
+                size_t used_div = 0;
+                if (used == slash && slash + 1 < text.size()) {
+                    f->data_rat.divider =
+                      std::stoi(text.substr(slash + 1), &used_div);
+                    if (used_div == text.size() - slash - 1 &&
+                        f->data_rat.divider != 0) {
+                        return f;
+                    }
+                }
+            } catch (std::out_of_range&) {
+                throw parse_error("ratio literal out of range: " + text);
+            }
+        } else if (text.find('.') != std::string::npos) {
+            form* f = make_form(f_decimal, tok);
+            f->data_decimal = std::stod(text, &used);
+            if (used == text.size()) {
+                return f;
+            }
+        } else {
+            form* f = make_form(f_integer, tok);
+            try {
+                f->data_int = std::stol(text, &used);
+            } catch (std::out_of_range&) {
+                throw parse_error("integer literal out of range: " + text);
+            }
+            if (used == text.size()) {
+                return f;
+            }
+        }
+        forms.pop_back();
+    }
+
+    form* f = make_form(f_symbol, tok);
+    f->data_str = s;
+    return f;
+}
+
+std::vector<form*>
+parser::read_all()
+{
+    std::vector<form*> result;
+    while (!at_end()) {
+        result.push_back(read());
+    }
+    return result;
+}
+
+// ^int x: the type hint goes on the symbol after it
+form*
+parser::read_hinted(const token& tok)
+{
+    std::string name{ tok.data_str.data + 1, tok.data_str.len - 1 };
+    type_hint hint;
+    if (name == "int") {
+        hint = hint_int;
+    } else if (name == "decimal") {
+        hint = hint_decimal;
+    } else {
+        throw parse_error("unknown type hint ^" + name);
+    }
+
+    form* target = at_end() ? nullptr : read();
+    if (!target || target->type != f_symbol || target->hint != hint_none) {
+        throw parse_error("expected a symbol after ^" + name);
+    }
+    target->hint = hint;
+    return target;
+}
@@ -0,0 +1,1060 @@
+#include "runtime.hpp"
+#include "bytecode.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+rt_allocator runtime_allocator;
+
+// * Heap
+
+gc_heap::gc_heap()
+  : objects(nullptr)
+  , count(0)
+  , next_collection(min_collection)
+  , collection(1)
+{
+}
+
+gc_heap::~gc_heap()
+{
+    while (objects) {
+        object* next = objects->next;
+        free_object(objects);
+        objects = next;
+    }
+}
+
+value
+gc_heap::make_string(std::string str)
+{
+    return value::obj(make<string_obj>(std::move(str)));
+}
+
+value
+gc_heap::intern_keyword(const std::string& name)
+{
+    auto found = keywords.find(name);
+    if (found != keywords.end()) {
+        return value::obj(found->second);
+    }
+    keyword_obj* kw = make<keyword_obj>(name);
+    keywords.emplace(name, kw);
+    return value::obj(kw);
+}
+
+value
+gc_heap::make_vector(value_vec items)
+{
+    return value::obj(make<vector_obj>(items));
+}
+
+value
+gc_heap::make_list(value_list items)
+{
+    return value::obj(make<list_obj>(items));
+}
+
+value
+gc_heap::make_map(value_map entries)
+{
+    return value::obj(make<map_obj>(entries));
+}
+
+value
+gc_heap::make_set(value_set items)
+{
+    return value::obj(make<set_obj>(items));
+}
+
+value
+gc_heap::make_sorted_map(value_sorted_map entries)
+{
+    return value::obj(make<sorted_map_obj>(entries));
+}
+
+closure_obj*
+gc_heap::make_closure(function_proto* proto, uint32_t captures)
+{
+    void* memory =
+      ::operator new(sizeof(closure_obj) + captures * sizeof(value));
+    closure_obj* closure = new (memory) closure_obj(proto, captures);
+    std::fill_n(closure->captures(), captures, value::nil());
+    return track(closure);
+}
+
+instance_obj*
+gc_heap::make_instance(shape_obj* shape)
+{
+    size_t count = shape->fields.size();
+    void* memory = ::operator new(sizeof(instance_obj) + count * sizeof(value));
+    instance_obj* instance = new (memory) instance_obj(shape);
+    std::fill_n(instance->slots(), count, value::nil());
+    return track(instance);
+}
+
+int
+shape_obj::field_index(const std::string& field) const
+{
+    auto found = std::find(fields.begin(), fields.end(), field);
+    return found == fields.end() ? -1 : found - fields.begin();
+}
+
+int
+shape_obj::method_index(const std::string& method) const
+{
+    auto found = std::find(method_names.begin(), method_names.end(), method);
+    return found == method_names.end() ? -1 : found - method_names.begin();
+}
+
+template<typename Func>
+static void
+for_each_item(const value_vec& items, Func&& func)
+{
+    items.for_each_chunk([&](value_vec::chunk run) {
+        for (value item : run) {
+            func(item);
+        }
+    });
+}
+
+void
+gc_heap::mark(function_proto* proto)
+{
+    if (proto->marked_in != collection) {
+        proto->marked_in = collection;
+        gray_protos.push_back(proto);
+    }
+}
+
+void
+gc_heap::trace()
+{
+    auto mark_item = [this](value v) { mark(v); };
+
+    while (!gray.empty() || !gray_protos.empty()) {
+        if (gray.empty()) {
+            function_proto* proto = gray_protos.back();
+            gray_protos.pop_back();
+            for (value constant : proto->constants) {
+                mark(constant);
+            }
+            if (proto->shared) {
+                mark(proto->shared);
+            }
+            // cached shapes must not be reused for new ones
+            for (auto& site : proto->sites) {
+                for (int n = 0; n < site.cache.count; ++n) {
+                    mark(const_cast<shape_obj*>(site.cache.entries[n].shape));
+                }
+            }
+            for (function_proto* child : proto->protos) {
+                mark(child);
+            }
+            continue;
+        }
+
+        object* obj = gray.back();
+        gray.pop_back();
+
+        switch (obj->type) {
+            case o_vector:
+                for_each_item(static_cast<vector_obj*>(obj)->items, mark_item);
+                break;
+            case o_map:
+                for (const auto& entry : static_cast<map_obj*>(obj)->entries) {
+                    mark(entry.key);
+                    mark(entry.val);
+                }
+                break;
+            case o_set:
+                for (value item : static_cast<set_obj*>(obj)->items) {
+                    mark(item);
+                }
+                break;
+            case o_sorted_map:
+                for (const auto& entry :
+                     static_cast<sorted_map_obj*>(obj)->entries) {
+                    mark(entry.key);
+                    mark(entry.val);
+                }
+                break;
+            case o_list:
+                for (value item : static_cast<list_obj*>(obj)->items) {
+                    mark(item);
+                }
+                break;
+            case o_closure: {
+                closure_obj* closure = static_cast<closure_obj*>(obj);
+                mark(closure->proto);
+                for (uint32_t n = 0; n < closure->capture_count; ++n) {
+                    mark(closure->captures()[n]);
+                }
+            } break;
+            case o_box:
+                mark(static_cast<box_obj*>(obj)->item);
+                break;
+            case o_global:
+                mark(static_cast<global_obj*>(obj)->item);
+                break;
+            case o_shape:
+                for (value method : static_cast<shape_obj*>(obj)->methods) {
+                    mark(method);
+                }
+                break;
+            case o_instance: {
+                instance_obj* instance = static_cast<instance_obj*>(obj);
+                mark(instance->shape);
+                for (size_t n = 0; n < instance->shape->fields.size(); ++n) {
+                    mark(instance->slots()[n]);
+                }
+            } break;
+            case o_int:
+            case o_ratio:
+            case o_string:
+            case o_keyword:
+            case o_native:
+                break;
+        }
+    }
+}
+
+size_t
+gc_heap::sweep()
+{
+    for (auto& kw : keywords) {
+        kw.second->marked = true;
+    }
+
+    size_t freed = 0;
+    object** link = &objects;
+    while (*link) {
+        object* obj = *link;
+        if (obj->marked) {
+            obj->marked = false;
+            link = &obj->next;
+        } else {
+            *link = obj->next;
+            free_object(obj);
+            ++freed;
+        }
+    }
+
+    count -= freed;
+    next_collection = std::max(min_collection, count * 2);
+    ++collection;
+    return freed;
+}
+
+void
+gc_heap::free_object(object* obj)
+{
+    switch (obj->type) {
+        case o_int:
+            delete static_cast<int_obj*>(obj);
+            break;
+        case o_ratio:
+            delete static_cast<ratio_obj*>(obj);
+            break;
+        case o_string:
+            delete static_cast<string_obj*>(obj);
+            break;
+        case o_keyword:
+            delete static_cast<keyword_obj*>(obj);
+            break;
+        case o_vector:
+            delete static_cast<vector_obj*>(obj);
+            break;
+        case o_list:
+            delete static_cast<list_obj*>(obj);
+            break;
+        case o_map:
+            delete static_cast<map_obj*>(obj);
+            break;
+        case o_set:
+            delete static_cast<set_obj*>(obj);
+            break;
+        case o_sorted_map:
+            delete static_cast<sorted_map_obj*>(obj);
+            break;
+        case o_closure:
+            static_cast<closure_obj*>(obj)->~closure_obj();
+            ::operator delete(obj);
+            break;
+        case o_native:
+            delete static_cast<native_obj*>(obj);
+            break;
+        case o_box:
+            delete static_cast<box_obj*>(obj);
+            break;
+        case o_global:
+            delete static_cast<global_obj*>(obj);
+            break;
+        case o_shape:
+            delete static_cast<shape_obj*>(obj);
+            break;
+        case o_instance:
+            static_cast<instance_obj*>(obj)->~instance_obj();
+            ::operator delete(obj);
+            break;
+    }
+}
+
+// * Equality and ordering
+
+const char*
+type_name(value v)
+{
+    switch (v.type()) {
+        case v_nil:
+            return "nil";
+        case v_bool:
+            return "bool";
+        case v_int:
+            return "int";
+        case v_decimal:
+            return "decimal";
+        case v_ratio:
+            return "ratio";
+        case v_char:
+            return "char";
+        case v_object:
+            switch (v.as_object()->type) {
+                case o_int:
+                    return "int";
+                case o_ratio:
+                    return "ratio";
+                case o_string:
+                    return "string";
+                case o_keyword:
+                    return "keyword";
+                case o_vector:
+                    return "vector";
+                case o_list:
+                    return "list";
+                case o_map:
+                    return "map";
+                case o_set:
+                    return "set";
+                case o_closure:
+                case o_native:
+                    return "fn";
+                case o_box:
+                    return "box";
+                case o_global:
+                    return "var";
+                case o_shape:
+                    return "struct";
+                case o_instance:
+                    return v.as<instance_obj>()->shape->name.c_str();
+                case o_sorted_map:
+                    return "sorted-map";
+            }
+    }
+    return "unknown";
+}
+
+static bool
+vecs_equal(const value_vec& a, const value_vec& b)
+{
+    return a.count == b.count &&
+           std::equal(a.begin(), a.end(), b.begin(), values_equal);
+}
+
+bool
+values_equal(value a, value b)
+{
+    if (a.is_fixnum() && b.is_fixnum()) {
+        return a.bits == b.bits;
+    }
+    if (a.type() != b.type()) {
+        return false;
+    }
+
+    switch (a.type()) {
+        case v_nil:
+            return true;
+        case v_bool:
+            return a.as_bool() == b.as_bool();
+        case v_int:
+            return a.as_int() == b.as_int();
+        case v_decimal:
+            return a.as_decimal() == b.as_decimal();
+        case v_ratio:
+            return a.as_ratio().counter == b.as_ratio().counter &&
+                   a.as_ratio().divider == b.as_ratio().divider;
+        case v_char:
+            return a.as_char() == b.as_char();
+        case v_object:
+            break;
+    }
+
+    object* oa = a.as_object();
+    object* ob = b.as_object();
+    if (oa == ob) {
+        return true;
+    }
+    if (oa->type != ob->type) {
+        return false;
+    }
+
+    switch (oa->type) {
+        case o_string:
+            return a.as<string_obj>()->str == b.as<string_obj>()->str;
+        case o_vector:
+            return vecs_equal(a.as<vector_obj>()->items,
+                              b.as<vector_obj>()->items);
+        case o_list: {
+            const value_list& la = a.as<list_obj>()->items;
+            const value_list& lb = b.as<list_obj>()->items;
+            if (la.count != lb.count) {
+                return false;
+            }
+            return std::equal(la.begin(), la.end(), lb.begin(), values_equal);
+        }
+        case o_map: {
+            map_obj* ma = a.as<map_obj>();
+            map_obj* mb = b.as<map_obj>();
+            if (ma->count() != mb->count()) {
+                return false;
+            }
+            for (const auto& entry : ma->entries) {
+                const value* other = mb->entries.find(entry.key);
+                if (!other || !values_equal(entry.val, *other)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        case o_set: {
+            set_obj* sa = a.as<set_obj>();
+            set_obj* sb = b.as<set_obj>();
+            if (sa->items.count != sb->items.count) {
+                return false;
+            }
+            for (value item : sa->items) {
+                if (!sb->items.contains(item)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        case o_sorted_map: {
+            // both in key order, so entries pair up
+            const value_sorted_map& ma = a.as<sorted_map_obj>()->entries;
+            const value_sorted_map& mb = b.as<sorted_map_obj>()->entries;
+            if (ma.count != mb.count) {
+                return false;
+            }
+            return std::equal(ma.begin(),
+                              ma.end(),
+                              mb.begin(),
+                              [](const auto& ea, const auto& eb) {
+                                  return values_equal(ea.key, eb.key) &&
+                                         values_equal(ea.val, eb.val);
+                              });
+        }
+        case o_int:
+        case o_ratio:
+        case o_keyword:
+        case o_closure:
+        case o_native:
+        case o_box:
+        case o_global:
+        case o_shape:
+        case o_instance:
+            return false;
+    }
+    return false;
+}
+
+// finishes a hash so each of its bits depends on all of h; the tries take
+// positions from the low bits first
+static size_t
+mix_hash(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+size_t
+value_hash(value v)
+{
+    switch (v.type()) {
+        case v_nil:
+            return mix_hash(0);
+        case v_bool:
+            return mix_hash(v.as_bool() ? 1 : 2);
+        case v_int:
+            return mix_hash(v.as_int());
+        case v_decimal: {
+            // 0.0 and -0.0 are equal
+            double d = v.as_decimal();
+            if (d == 0) {
+                d = 0;
+            }
+            uint64_t bits;
+            memcpy(&bits, &d, sizeof bits);
+            return mix_hash(bits);
+        }
+        case v_ratio:
+            return mix_hash(v.as_ratio().counter * 31 + v.as_ratio().divider);
+        case v_char:
+            return mix_hash(v.as_char());
+        case v_object:
+            break;
+    }
+
+    object* obj = v.as_object();
+    switch (obj->type) {
+        case o_string:
+            return mix_hash(std::hash<std::string>()(v.as<string_obj>()->str));
+        case o_vector: {
+            uint64_t h = 1;
+            for (value item : v.as<vector_obj>()->items) {
+                h = h * 31 + value_hash(item);
+            }
+            return mix_hash(h);
+        }
+        case o_list: {
+            uint64_t h = 2;
+            for (value item : v.as<list_obj>()->items) {
+                h = h * 31 + value_hash(item);
+            }
+            return mix_hash(h);
+        }
+        case o_map: {
+            // summed, since the order of entries says nothing
+            uint64_t h = 3;
+            for (const auto& entry : v.as<map_obj>()->entries) {
+                h += value_hash(entry.key) ^ (value_hash(entry.val) * 31);
+            }
+            return mix_hash(h);
+        }
+        case o_set: {
+            uint64_t h = 4;
+            for (value item : v.as<set_obj>()->items) {
+                h += value_hash(item);
+            }
+            return mix_hash(h);
+        }
+        case o_sorted_map: {
+            uint64_t h = 7;
+            for (const auto& entry : v.as<sorted_map_obj>()->entries) {
+                h = h * 31 + (value_hash(entry.key) ^ value_hash(entry.val));
+            }
+            return mix_hash(h);
+        }
+        case o_keyword:
+            // interned, so equal only to themselves, but hashed by name to
+            // keep the order of maps the same from run to run
+            return mix_hash(
+              std::hash<std::string>()(v.as<keyword_obj>()->name) + 5);
+        case o_global:
+            return mix_hash(
+              std::hash<std::string>()(v.as<global_obj>()->name) + 6);
+        case o_int:
+        case o_ratio:
+        case o_closure:
+        case o_native:
+        case o_box:
+        case o_shape:
+        case o_instance:
+            // equal only to themselves
+            return mix_hash(reinterpret_cast<uintptr_t>(obj));
+    }
+    return 0;
+}
+
+size_t
+value_hasher::operator()(value v) const
+{
+    return value_hash(v);
+}
+
+bool
+value_equal_to::operator()(value a, value b) const
+{
+    return values_equal(a, b);
+}
+
+bool
+value_less::operator()(value a, value b) const
+{
+    return compare_values(a, b) < 0;
+}
+
+static double
+to_double(value v)
+{
+    switch (v.type()) {
+        case v_int:
+            return v.as_int();
+        case v_ratio:
+            return (double)v.as_ratio().counter / v.as_ratio().divider;
+        default:
+            return v.as_decimal();
+    }
+}
+
+static ratio
+to_ratio(value v)
+{
+    if (v.is_ratio()) {
+        return v.as_ratio();
+    }
+    return { (int)v.as_int(), 1 };
+}
+
+int
+compare_values(value a, value b)
+{
+    if (a.is_fixnum() && b.is_fixnum()) {
+        int64_t ia = a.as_fixnum();
+        int64_t ib = b.as_fixnum();
+        return ia < ib ? -1 : ia > ib;
+    }
+    if (a.is_number() && b.is_number()) {
+        if (a.is_int() && b.is_int()) {
+            return a.as_int() < b.as_int() ? -1 : a.as_int() > b.as_int();
+        }
+        if (a.is_decimal() || b.is_decimal()) {
+            double da = to_double(a);
+            double db = to_double(b);
+            return da < db ? -1 : da > db;
+        }
+        // a/b < c/d  <=>  a*d < c*b, dividers are always positive
+        __int128 lhs, rhs;
+        if (a.is_int()) {
+            lhs = (__int128)a.as_int() * b.as_ratio().divider;
+            rhs = b.as_ratio().counter;
+        } else if (b.is_int()) {
+            lhs = a.as_ratio().counter;
+            rhs = (__int128)b.as_int() * a.as_ratio().divider;
+        } else {
+            lhs = (__int128)a.as_ratio().counter * b.as_ratio().divider;
+            rhs = (__int128)b.as_ratio().counter * a.as_ratio().divider;
+        }
+        return lhs < rhs ? -1 : lhs > rhs;
+    }
+
+    if (a.is_char() && b.is_char()) {
+        return a.as_char() < b.as_char() ? -1 : a.as_char() > b.as_char();
+    }
+
+    if (a.is_object(o_string) && b.is_object(o_string)) {
+        return a.as<string_obj>()->str.compare(b.as<string_obj>()->str);
+    }
+
+    if (a.is_object(o_keyword) && b.is_object(o_keyword)) {
+        return a.as<keyword_obj>()->name.compare(b.as<keyword_obj>()->name);
+    }
+
+    throw vm_error(std::string("cannot compare ") + type_name(a) + " and " +
+                   type_name(b));
+}
+
+// * Arithmetic
+//
+// ints widen to ratios and ratios to decimals; ratios whose parts no longer
+// fit the ratio struct become decimals. An int result that does not fit 64
+// bits is an error, rather than a decimal that quietly dropped digits.
+
+static int64_t
+gcd(int64_t a, int64_t b)
+{
+    while (b != 0) {
+        int64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a < 0 ? -a : a;
+}
+
+value
+make_ratio(gc_heap& heap, int64_t counter, int64_t divider)
+{
+    if (divider == 0) {
+        throw vm_error("divide by zero");
+    }
+    if (divider < 0) {
+        counter = -counter;
+        divider = -divider;
+    }
+    int64_t g = gcd(counter, divider);
+    if (g > 1) {
+        counter /= g;
+        divider /= g;
+    }
+    if (divider == 1) {
+        return heap.make_int(counter);
+    }
+    if (counter < INT32_MIN || counter > INT32_MAX || divider > INT32_MAX) {
+        return value::decimal((double)counter / divider);
+    }
+    return value::obj(heap.make<ratio_obj>(ratio{ (int)counter, (int)divider }));
+}
+
+enum class arith
+{
+    add,
+    sub,
+    mul,
+    div
+};
+
+[[noreturn]] static void
+integer_overflow()
+{
+    throw vm_error("integer overflow");
+}
+
+[[noreturn]] static void
+arith_type_error(const char* op, value a, value b)
+{
+    throw vm_error(std::string("cannot ") + op + " " + type_name(a) +
+                   " and " + type_name(b));
+}
+
+static value
+arith_numbers(gc_heap& heap, arith op, value a, value b)
+{
+    if (a.is_decimal() || b.is_decimal()) {
+        double da = to_double(a);
+        double db = to_double(b);
+        switch (op) {
+            case arith::add:
+                return value::decimal(da + db);
+            case arith::sub:
+                return value::decimal(da - db);
+            case arith::mul:
+                return value::decimal(da * db);
+            case arith::div:
+                return value::decimal(da / db);
+        }
+    }
+
+    if (a.is_int() && b.is_int()) {
+        int64_t ia = a.as_int();
+        int64_t ib = b.as_int();
+        int64_t result;
+        switch (op) {
+            case arith::add:
+                if (__builtin_add_overflow(ia, ib, &result)) {
+                    integer_overflow();
+                }
+                return heap.make_int(result);
+            case arith::sub:
+                if (__builtin_sub_overflow(ia, ib, &result)) {
+                    integer_overflow();
+                }
+                return heap.make_int(result);
+            case arith::mul:
+                if (__builtin_mul_overflow(ia, ib, &result)) {
+                    integer_overflow();
+                }
+                return heap.make_int(result);
+            case arith::div:
+                if (ib == 0) {
+                    throw vm_error("divide by zero");
+                }
+                if (ia == INT64_MIN && ib == -1) {
+                    integer_overflow();
+                }
+                if (ia % ib == 0) {
+                    return heap.make_int(ia / ib);
+                }
+                return make_ratio(heap, ia, ib);
+        }
+    }
+
+    if (!(a.is_int() && (a.as_int() < INT32_MIN || a.as_int() > INT32_MAX)) &&
+        !(b.is_int() && (b.as_int() < INT32_MIN || b.as_int() > INT32_MAX))) {
+        ratio ra = to_ratio(a);
+        ratio rb = to_ratio(b);
+        int64_t n1 = ra.counter, d1 = ra.divider;
+        int64_t n2 = rb.counter, d2 = rb.divider;
+        switch (op) {
+            case arith::add:
+                return make_ratio(heap, n1 * d2 + n2 * d1, d1 * d2);
+            case arith::sub:
+                return make_ratio(heap, n1 * d2 - n2 * d1, d1 * d2);
+            case arith::mul:
+                return make_ratio(heap, n1 * n2, d1 * d2);
+            case arith::div:
+                return make_ratio(heap, n1 * d2, d1 * n2);
+        }
+    }
+
+    // a ratio combined with an int too wide for it
+    return arith_numbers(heap, op, value::decimal(to_double(a)), b);
+}
+
+value
+value_add(gc_heap& heap, value a, value b)
+{
+    // immediates are 48 bits, their sum can not overflow
+    if (a.is_fixnum() && b.is_fixnum()) {
+        return heap.make_int(a.as_fixnum() + b.as_fixnum());
+    }
+    if (a.is_number() && b.is_number()) {
+        return arith_numbers(heap, arith::add, a, b);
+    }
+    if (a.is_object(o_string) && b.is_object(o_string)) {
+        return heap.make_string(a.as<string_obj>()->str +
+                                b.as<string_obj>()->str);
+    }
+    arith_type_error("add", a, b);
+}
+
+value
+value_sub(gc_heap& heap, value a, value b)
+{
+    if (a.is_fixnum() && b.is_fixnum()) {
+        return heap.make_int(a.as_fixnum() - b.as_fixnum());
+    }
+    if (a.is_number() && b.is_number()) {
+        return arith_numbers(heap, arith::sub, a, b);
+    }
+    arith_type_error("subtract", a, b);
+}
+
+value
+value_mul(gc_heap& heap, value a, value b)
+{
+    if (a.is_number() && b.is_number()) {
+        return arith_numbers(heap, arith::mul, a, b);
+    }
+    arith_type_error("multiply", a, b);
+}
+
+value
+value_div(gc_heap& heap, value a, value b)
+{
+    if (a.is_number() && b.is_number()) {
+        return arith_numbers(heap, arith::div, a, b);
+    }
+    arith_type_error("divide", a, b);
+}
+
+value
+value_neg(gc_heap& heap, value a)
+{
+    return value_sub(heap, value::fixnum(0), a);
+}
+
+// * Printing
+
+template<typename Items>
+static void
+print_items(std::ostream& stream,
+            const Items& items,
+            const char* separator,
+            bool readable)
+{
+    bool first = true;
+    for (value item : items) {
+        if (!first) {
+            stream << separator;
+        }
+        first = false;
+        print_value(stream, item, readable);
+    }
+}
+
+void
+print_value(std::ostream& stream, value v, bool readable)
+{
+    switch (v.type()) {
+        case v_nil:
+            stream << "nil";
+            return;
+        case v_bool:
+            stream << (v.as_bool() ? "true" : "false");
+            return;
+        case v_int:
+            stream << v.as_int();
+            return;
+        case v_decimal: {
+            std::ostringstream out;
+            out.precision(15);
+            out << v.as_decimal();
+            std::string str = out.str();
+            stream << str;
+            if (std::isfinite(v.as_decimal()) &&
+                str.find_first_of(".e") == std::string::npos) {
+                stream << ".0";
+            }
+            return;
+        }
+        case v_ratio:
+            stream << v.as_ratio().counter << "/" << v.as_ratio().divider;
+            return;
+        case v_char:
+            if (readable) {
+                stream << "?";
+            }
+            stream << v.as_char();
+            return;
+        case v_object:
+            break;
+    }
+
+    object* obj = v.as_object();
+    switch (obj->type) {
+        case o_int:
+        case o_ratio:
+            return;
+        case o_string:
+            if (!readable) {
+                stream << v.as<string_obj>()->str;
+                return;
+            }
+            stream << '"';
+            for (char c : v.as<string_obj>()->str) {
+                switch (c) {
+                    case '"':
+                        stream << "\\\"";
+                        break;
+                    case '\\':
+                        stream << "\\\\";
+                        break;
+                    case '\n':
+                        stream << "\\n";
+                        break;
+                    case '\t':
+                        stream << "\\t";
+                        break;
+                    default:
+                        stream << c;
+                        break;
+                }
+            }
+            stream << '"';
+            return;
+        case o_keyword:
+            stream << ":" << v.as<keyword_obj>()->name;
+            return;
+        case o_vector:
+            stream << "[";
+            print_items(stream, v.as<vector_obj>()->items, " ", readable);
+            stream << "]";
+            return;
+        case o_list: {
+            stream << "(";
+            bool first = true;
+            for (value item : v.as<list_obj>()->items) {
+                if (!first) {
+                    stream << " ";
+                }
+                first = false;
+                print_value(stream, item, readable);
+            }
+            stream << ")";
+            return;
+        }
+        case o_map: {
+            stream << "{";
+            bool first = true;
+            for (const auto& entry : v.as<map_obj>()->entries) {
+                if (!first) {
+                    stream << ", ";
+                }
+                first = false;
+                print_value(stream, entry.key, readable);
+                stream << " ";
+                print_value(stream, entry.val, readable);
+            }
+            stream << "}";
+            return;
+        }
+        case o_set:
+            stream << "#{";
+            print_items(stream, v.as<set_obj>()->items, " ", readable);
+            stream << "}";
+            return;
+        case o_sorted_map: {
+            stream << "{";
+            bool first = true;
+            for (const auto& entry : v.as<sorted_map_obj>()->entries) {
+                if (!first) {
+                    stream << ", ";
+                }
+                first = false;
+                print_value(stream, entry.key, readable);
+                stream << " ";
+                print_value(stream, entry.val, readable);
+            }
+            stream << "}";
+            return;
+        }
+        case o_closure:
+            stream << "#<fn>";
+            return;
+        case o_native:
+            stream << "#<native " << v.as<native_obj>()->name << ">";
+            return;
+        case o_box:
+            stream << "#<box>";
+            return;
+        case o_global:
+            stream << "#'" << v.as<global_obj>()->name;
+            return;
+        case o_shape:
+            stream << "#<struct " << v.as<shape_obj>()->name << ">";
+            return;
+        case o_instance: {
+            instance_obj* instance = v.as<instance_obj>();
+            const shape_obj* shape = instance->shape;
+            stream << "#" << shape->name << "{";
+            for (size_t n = 0; n < shape->fields.size(); ++n) {
+                stream << (n ? ", :" : ":") << shape->fields[n] << " ";
+                print_value(stream, instance->slots()[n], readable);
+            }
+            stream << "}";
+            return;
+        }
+    }
+}
+
+std::ostream&
+operator<<(std::ostream& stream, value v)
+{
+    print_value(stream, v, true);
+    return stream;
+}
+
+// * Maps and sets
+
+value
+map_get(map_obj* map, value key, value not_found)
+{
+    return map->entries.get(key, not_found);
+}
+
+value
+map_assoc(gc_heap& heap, map_obj* map, value key, value val)
+{
+    return heap.make_map(map->entries.assoc(key, val));
+}
+
+bool
+set_contains(set_obj* set, value item)
+{
+    return set->items.contains(item);
+}
+
+value
+set_conj(gc_heap& heap, set_obj* set, value item)
+{
+    value_set items = set->items.conj(item);
+    if (items.root.get() == set->items.root.get()) {
+        return value::obj(set);
+    }
+    return heap.make_set(items);
+}
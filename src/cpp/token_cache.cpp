@@ -0,0 +1,221 @@
+#include "token_cache.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+
+#include "lexer.hpp"
+#include "util.hpp"
+#include "version.hpp"
+
+token_cache::token_cache(std::string directory)
+  : directory(directory)
+  , enabled(!directory.empty())
+{
+}
+
+std::string
+token_cache::default_directory()
+{
+    if (const char* dir = getenv("FUNLANG_CACHE_DIR")) {
+        return dir;
+    }
+    if (const char* xdg = getenv("XDG_CACHE_HOME")) {
+        return std::string(xdg) + "/funlang";
+    }
+    if (const char* home = getenv("HOME")) {
+        return std::string(home) + "/.cache/funlang";
+    }
+    return "";
+}
+
+uint64_t
+token_cache::key_for(const std::string& source) const
+{
+    const char* version = FUNLANG_VERSION;
+    uint64_t seed = fnv1a64(version, strlen(version));
+    seed = fnv1a64(reinterpret_cast<const char*>(&format_version),
+                   sizeof(format_version),
+                   seed);
+    return fnv1a64(source.data(), source.size(), seed);
+}
+
+std::string
+token_cache::path_for(uint64_t key) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.fltc", (unsigned long long)key);
+    return directory + "/" + name;
+}
+
+bool
+token_cache::load(const std::string& source, std::vector<token>& tokens)
+{
+    if (!enabled) {
+        return false;
+    }
+
+    uint64_t key = key_for(source);
+
+    mapped_file file;
+    if (!file.open(path_for(key)) || file.size() < sizeof(cache_header)) {
+        return false;
+    }
+
+    const cache_header* header =
+      reinterpret_cast<const cache_header*>(file.data());
+    if (header->magic != magic || header->format_version != format_version ||
+        header->key != key || header->source_size != source.size()) {
+        return false;
+    }
+
+    size_t tokens_size = header->token_count * sizeof(cached_token);
+    if (header->token_count > file.size() / sizeof(cached_token) ||
+        file.size() !=
+          sizeof(cache_header) + tokens_size + header->string_bytes) {
+        return false;
+    }
+
+    const cached_token* records =
+      reinterpret_cast<const cached_token*>(file.data() + sizeof(*header));
+    const char* strings = file.data() + sizeof(*header) + tokens_size;
+
+    std::vector<token> loaded;
+    loaded.reserve(header->token_count);
+
+    for (size_t i = 0; i < header->token_count; ++i) {
+        const cached_token& rec = records[i];
+        if (rec.type > t_hash || rec.ts > ts_str) {
+            return false;
+        }
+
+        token tok;
+        tok.type = static_cast<token_type>(rec.type);
+        tok.ts = static_cast<token_storage_type>(rec.ts);
+        tok.filepos = rec.filepos;
+
+        switch (tok.ts) {
+            case ts_int:
+                tok.data_int = rec.data_int;
+                break;
+            case ts_rat:
+                tok.data_rat = rec.data_rat;
+                break;
+            case ts_dec:
+                tok.data_decimal = rec.data_decimal;
+                break;
+            case ts_long:
+                tok.data_long = rec.data_long;
+                break;
+            case ts_char:
+                tok.data_char = rec.data_char;
+                break;
+            case ts_str: {
+                uint64_t offset = rec.data_str.offset;
+                uint64_t len = rec.data_str.len;
+                if (offset >= header->string_bytes ||
+                    len >= header->string_bytes - offset ||
+                    strings[offset + len] != '\0') {
+                    return false;
+                }
+                tok.data_str.len = len;
+                tok.data_str.data = const_cast<char*>(strings + offset);
+            } break;
+        }
+
+        loaded.push_back(tok);
+    }
+
+    tokens = std::move(loaded);
+    mappings.push_back(std::move(file));
+    return true;
+}
+
+bool
+token_cache::store(const std::string& source, const std::vector<token>& tokens)
+{
+    if (!enabled || !make_directories(directory)) {
+        return false;
+    }
+
+    std::vector<cached_token> records;
+    records.reserve(tokens.size());
+
+    std::string strings;
+    std::unordered_map<std::string, uint64_t> interned;
+
+    for (const token& tok : tokens) {
+        cached_token rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.type = tok.type;
+        rec.ts = tok.ts;
+        rec.filepos = tok.filepos;
+
+        switch (tok.ts) {
+            case ts_int:
+                rec.data_int = tok.data_int;
+                break;
+            case ts_rat:
+                rec.data_rat = tok.data_rat;
+                break;
+            case ts_dec:
+                rec.data_decimal = tok.data_decimal;
+                break;
+            case ts_long:
+                rec.data_long = tok.data_long;
+                break;
+            case ts_char:
+                rec.data_char = tok.data_char;
+                break;
+            case ts_str: {
+                std::string str{ tok.data_str.data, tok.data_str.len };
+                auto found = interned.find(str);
+                if (found == interned.end()) {
+                    found = interned.emplace(str, strings.size()).first;
+                    strings.append(str);
+                    strings.push_back('\0');
+                }
+                rec.data_str.offset = found->second;
+                rec.data_str.len = str.size();
+            } break;
+        }
+
+        records.push_back(rec);
+    }
+
+    cache_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = magic;
+    header.format_version = format_version;
+    header.key = key_for(source);
+    header.source_size = source.size();
+    header.token_count = records.size();
+    header.string_bytes = strings.size();
+
+    std::string out;
+    out.reserve(sizeof(header) + records.size() * sizeof(cached_token) +
+                strings.size());
+    out.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.append(reinterpret_cast<const char*>(records.data()),
+               records.size() * sizeof(cached_token));
+    out.append(strings);
+
+    return write_file_atomic(path_for(header.key), out.data(), out.size());
+}
+
+std::vector<token>
+lex_cached(token_cache* cache, arena* arena, const std::string& source)
+{
+    std::vector<token> tokens;
+    if (cache && cache->load(source, tokens)) {
+        return tokens;
+    }
+
+    lexer lex{ source, arena };
+    lex.scan_all();
+
+    if (cache) {
+        cache->store(source, lex.tokens);
+    }
+    return lex.tokens;
+}
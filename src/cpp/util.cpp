@@ -11,6 +11,17 @@ mstoi(mystr s)
     return k;
 }
 
+uint64_t
+fnv1a64(const char* data, size_t len, uint64_t seed)
+{
+    uint64_t h = seed;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= static_cast<unsigned char>(data[i]);
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
 std::string
 get_caller()
 {
@@ -0,0 +1,1040 @@
+#include "vm.hpp"
+
+#include <algorithm>
+#include <iomanip>
+#include <new>
+#include <sstream>
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+static void
+dump_sequences(std::ostream& stream,
+               const std::vector<uint64_t>& counts,
+               int length,
+               size_t top)
+{
+    std::vector<size_t> order;
+    for (size_t n = 0; n < counts.size(); ++n) {
+        if (counts[n] > 0) {
+            order.push_back(n);
+        }
+    }
+    top = std::min(top, order.size());
+    std::partial_sort(
+      order.begin(), order.begin() + top, order.end(), [&](size_t a, size_t b) {
+          return counts[a] > counts[b];
+      });
+
+    for (size_t n = 0; n < top; ++n) {
+        std::string names;
+        size_t index = order[n];
+        for (int k = 0; k < length; ++k) {
+            names = opcode_names[index % op_count] + (k ? " " + names : "");
+            index /= op_count;
+        }
+        stream << "  " << std::left << std::setw(36) << names << std::right
+               << std::setw(12) << counts[order[n]] << "\n";
+    }
+}
+
+void
+vm_profile::dump(std::ostream& stream, size_t top) const
+{
+    stream << executed << " instructions executed\n";
+    for (size_t op = 0; op < op_count; ++op) {
+        if (op_counts[op] > 0) {
+            stream << "  " << std::left << std::setw(12) << opcode_names[op]
+                   << std::right << std::setw(12) << op_counts[op] << "\n";
+        }
+    }
+    stream << "most frequent pairs\n";
+    dump_sequences(stream, pair_counts, 2, top);
+    stream << "most frequent triples\n";
+    dump_sequences(stream, triple_counts, 3, top);
+}
+
+value_stack::value_stack(size_t size)
+  : _size(size)
+{
+    void* memory = mmap(nullptr,
+                        size * sizeof(value),
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                        -1,
+                        0);
+    if (memory == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+    _data = static_cast<value*>(memory);
+}
+
+value_stack::~value_stack()
+{
+    munmap(_data, _size * sizeof(value));
+}
+
+// Half the C++ stack the process may use, leaving the rest to the natives
+// and library code running below the vm, and to whatever ran before it.
+static size_t
+native_stack_budget()
+{
+    const size_t fallback = size_t(8) << 20;
+    struct rlimit limit;
+    size_t bytes = fallback;
+    if (getrlimit(RLIMIT_STACK, &limit) == 0 &&
+        limit.rlim_cur != RLIM_INFINITY) {
+        bytes = std::min<size_t>(limit.rlim_cur, fallback);
+    }
+    return bytes / 2;
+}
+
+vm::vm()
+  : stack(stack_size)
+  , stack_top(stack.data())
+  , profiling(false)
+  , reentries(0)
+  , native_base(nullptr)
+  , native_budget(native_stack_budget())
+{
+    frames.reserve(256);
+    install_builtins(*this);
+}
+
+function_proto*
+vm::new_proto()
+{
+    protos.emplace_back(new function_proto());
+    return protos.back().get();
+}
+
+global_obj*
+vm::global(const std::string& name)
+{
+    auto found = globals.find(name);
+    if (found != globals.end()) {
+        return found->second;
+    }
+    global_obj* cell = heap.make<global_obj>(name);
+    globals.emplace(name, cell);
+    return cell;
+}
+
+void
+vm::define_native(const char* name, native_fn fn, int min_args, int max_args)
+{
+    global(name)->item =
+      value::obj(heap.make<native_obj>(name, fn, min_args, max_args));
+}
+
+value
+vm::run(function_proto* proto)
+{
+    value fn = value::obj(make_closure(proto, nullptr, nullptr));
+    return call(fn, 0, nullptr);
+}
+
+// Counts one call into the vm for as long as it runs, and throws when the C++
+// stack below the outermost one has grown past the budget.
+struct reentry_guard
+{
+    vm& _vm;
+
+    reentry_guard(vm& vm)
+      : _vm(vm)
+    {
+        const char* here =
+          static_cast<const char*>(__builtin_frame_address(0));
+        if (_vm.reentries == 0) {
+            _vm.native_base = here;
+        } else if (size_t(_vm.native_base - here) > _vm.native_budget) {
+            throw vm_error("stack overflow");
+        }
+        ++_vm.reentries;
+    }
+
+    ~reentry_guard() { --_vm.reentries; }
+
+    reentry_guard(const reentry_guard&) = delete;
+};
+
+closure_obj*
+vm::make_closure(function_proto* proto,
+                 const value* R,
+                 closure_obj* enclosing)
+{
+    if (proto->captures.empty()) {
+        if (!proto->shared) {
+            proto->shared = heap.make_closure(proto, 0);
+        }
+        return proto->shared;
+    }
+
+    closure_obj* closure = heap.make_closure(proto, proto->captures.size());
+    value* captures = closure->captures();
+    for (size_t n = 0; n < proto->captures.size(); ++n) {
+        const capture_source& source = proto->captures[n];
+        captures[n] = source.from_capture
+                        ? enclosing->captures()[source.index]
+                        : R[source.index];
+    }
+    return closure;
+}
+
+static void
+check_arity(const char* name, int expected_min, int expected_max, int argc)
+{
+    if (argc < expected_min || (expected_max >= 0 && argc > expected_max)) {
+        std::ostringstream msg;
+        msg << (name && *name ? name : "fn") << ": expected ";
+        if (expected_min == expected_max) {
+            msg << expected_min;
+        } else if (expected_max < 0) {
+            msg << "at least " << expected_min;
+        } else {
+            msg << expected_min << " to " << expected_max;
+        }
+        msg << " arguments, got " << argc;
+        throw vm_error(msg.str());
+    }
+}
+
+value
+vm::construct(shape_obj* shape, const value* args, int argc)
+{
+    int fields = shape->fields.size();
+    check_arity(shape->name.c_str(), fields, fields, argc);
+    instance_obj* instance = heap.make_instance(shape);
+    std::copy(args, args + argc, instance->slots());
+    return value::obj(instance);
+}
+
+value
+vm::call(value fn, int argc, const value* args)
+{
+    reentry_guard reentry{ *this };
+    value* base = stack_top;
+    value* stack_end = stack.data() + stack.size();
+
+    if (base + 1 + argc > stack_end) {
+        throw vm_error("stack overflow");
+    }
+
+    base[0] = fn;
+    std::copy(args, args + argc, base + 1);
+
+    if (fn.is_object(o_native)) {
+        native_obj* native = fn.as<native_obj>();
+        check_arity(native->name, native->min_args, native->max_args, argc);
+        stack_top = base + 1 + argc;
+        try {
+            value result = native->fn(*this, base + 1, argc);
+            stack_top = base;
+            return result;
+        } catch (...) {
+            stack_top = base;
+            throw;
+        }
+    }
+
+    if (fn.is_object(o_shape)) {
+        value result = construct(fn.as<shape_obj>(), args, argc);
+        stack_top = base;
+        return result;
+    }
+
+    if (!fn.is_object(o_closure)) {
+        throw vm_error(std::string("cannot call ") + type_name(fn));
+    }
+
+    closure_obj* closure = fn.as<closure_obj>();
+    function_proto* proto = closure->proto;
+    check_arity(proto->name.c_str(), proto->arity, proto->arity, argc);
+
+    value* regs = base + 1;
+    if (regs + proto->num_regs > stack_end || frames.size() >= max_frames) {
+        throw vm_error("stack overflow");
+    }
+    std::fill(regs + argc, regs + proto->num_regs, value::nil());
+
+    size_t entry_depth = frames.size();
+    frames.push_back({ closure, proto->code.data(), regs });
+    stack_top = regs + proto->num_regs;
+
+    try {
+        value result = execute(entry_depth);
+        stack_top = base;
+        return result;
+    } catch (...) {
+        stack_top = base;
+        throw;
+    }
+}
+
+value
+vm::execute(size_t entry_depth)
+{
+    if (profiling) {
+        return dispatch<true>(entry_depth);
+    }
+    return dispatch<false>(entry_depth);
+}
+
+void
+vm::collect_garbage()
+{
+    for (value* v = stack.data(); v < stack_top; ++v) {
+        heap.mark(*v);
+    }
+    for (auto& frame : frames) {
+        heap.mark(frame.closure);
+    }
+    for (auto& global : globals) {
+        heap.mark(global.second);
+    }
+    for (auto& root : temp_roots) {
+        heap.mark(root);
+    }
+    heap.trace();
+    heap.sweep();
+}
+
+// * Struct access
+
+static shape_obj*
+shape_of(const char* what, access_site& site, value obj)
+{
+    if (!obj.is_object(o_instance)) {
+        throw vm_error(std::string("cannot get ") + what + " " + site.name +
+                       " of " + type_name(obj));
+    }
+    return obj.as<instance_obj>()->shape;
+}
+
+int
+field_slot(access_site& site, value obj)
+{
+    shape_obj* shape = shape_of("field", site, obj);
+    int slot = shape->field_index(site.name);
+    if (slot < 0) {
+        throw vm_error(shape->name + " has no field " + site.name);
+    }
+    if (!site.cache.megamorphic) {
+        site.cache.add(shape, slot);
+    }
+    return slot;
+}
+
+int
+method_slot(access_site& site, value obj)
+{
+    shape_obj* shape = shape_of("method", site, obj);
+    int slot = shape->method_index(site.name);
+    if (slot < 0) {
+        throw vm_error(shape->name + " has no method " + site.name);
+    }
+    if (!site.cache.megamorphic) {
+        site.cache.add(shape, slot);
+    }
+    return slot;
+}
+
+// * Type hints
+
+void
+check_failed(value v, int type)
+{
+    throw vm_error(std::string("type hint: expected ") +
+                   (type == checked_int ? "int" : "decimal") + ", got " +
+                   type_name(v));
+}
+
+// A trace names the frames nearest the error and the outermost one, with
+// "..." for any between, so deep recursion does not print a line per frame.
+// Calls from natives unwind one run at a time, each adding to the message.
+static constexpr size_t max_trace_frames = 16;
+
+void
+vm::unwind(const vm_error& error, const instr* pc, size_t entry_depth)
+{
+    std::ostringstream trace;
+    trace << error.what();
+
+    std::string so_far = error.what();
+    size_t traced = std::count(so_far.begin(), so_far.end(), '\n');
+    bool elided = so_far.find("\n  ...") != std::string::npos;
+
+    frames.back().pc = pc;
+    for (size_t depth = frames.size(); depth > entry_depth; --depth) {
+        if (traced >= max_trace_frames && depth > 1) {
+            if (!elided) {
+                trace << "\n  ...";
+                elided = true;
+            }
+            continue;
+        }
+        ++traced;
+        const call_frame& frame = frames[depth - 1];
+        const function_proto* proto = frame.closure->proto;
+        size_t at = frame.pc - proto->code.data() - 1;
+        trace << "\n  at " << (proto->name.empty() ? "fn" : proto->name)
+              << " (" << proto->source_name << ":" << proto->line_at(at)
+              << ")";
+    }
+
+    frames.resize(entry_depth);
+    throw vm_error(trace.str());
+}
+
+// * Quickening
+//
+// add, sub, mul, div, eq, lt and le rewrite themselves in place into a form
+// specialized for the operand types they see, which only checks those types
+// instead of dispatching on them. When the check fails the instruction goes
+// back to the generic form; one that has done so max_deopts times stays
+// generic, so sites that really see mixed types stop flipping.
+
+static constexpr uint8_t max_deopts = 4;
+
+static bool
+both_fixnums(value b, value c)
+{
+    return b.is_fixnum() && c.is_fixnum();
+}
+
+static bool
+both_decimals(value b, value c)
+{
+    return b.is_decimal() && c.is_decimal();
+}
+
+static bool
+both_strings(value b, value c)
+{
+    return b.is_object(o_string) && c.is_object(o_string);
+}
+
+static value
+fixnum_mul(gc_heap& heap, value b, value c)
+{
+    int64_t result;
+    if (__builtin_mul_overflow(b.as_fixnum(), c.as_fixnum(), &result)) {
+        return value_mul(heap, b, c);
+    }
+    return heap.make_int(result);
+}
+
+static opcode
+specialize(opcode op, value b, value c)
+{
+    if (both_fixnums(b, c)) {
+        switch (op) {
+            case op_add:
+                return op_add_ii;
+            case op_sub:
+                return op_sub_ii;
+            case op_mul:
+                return op_mul_ii;
+            case op_eq:
+                return op_eq_ii;
+            case op_lt:
+                return op_lt_ii;
+            case op_le:
+                return op_le_ii;
+            default:
+                return op;
+        }
+    }
+    if (both_decimals(b, c)) {
+        switch (op) {
+            case op_add:
+                return op_add_dd;
+            case op_sub:
+                return op_sub_dd;
+            case op_mul:
+                return op_mul_dd;
+            case op_div:
+                return op_div_dd;
+            case op_lt:
+                return op_lt_dd;
+            case op_le:
+                return op_le_dd;
+            default:
+                return op;
+        }
+    }
+    if (op == op_add && both_strings(b, c)) {
+        return op_add_ss;
+    }
+    return op;
+}
+
+static void
+rewrite(const instr* at, opcode op)
+{
+    instr* code = const_cast<instr*>(at);
+    *code = (*code & ~(instr)0xff) | op;
+}
+
+// next is the pc after the instruction, as in the dispatch loop
+static void
+quicken(function_proto* proto, const instr* next, value b, value c)
+{
+    opcode generic = instr_op(next[-1]);
+    opcode quick = specialize(generic, b, c);
+    if (quick == generic) {
+        return;
+    }
+    size_t at = next - 1 - proto->code.data();
+    if (at < proto->deopts.size() && proto->deopts[at] >= max_deopts) {
+        return;
+    }
+    rewrite(next - 1, quick);
+}
+
+static void
+dequicken(function_proto* proto, const instr* next, opcode generic)
+{
+    if (proto->deopts.size() != proto->code.size()) {
+        proto->deopts.resize(proto->code.size());
+    }
+    ++proto->deopts[next - 1 - proto->code.data()];
+    rewrite(next - 1, generic);
+}
+
+// * Superinstructions
+//
+// Fused comparisons are not quickened, they check for fixnums and decimals
+// inline.
+
+static bool
+fused_lt(value b, value c)
+{
+    if (both_fixnums(b, c)) {
+        return b.as_fixnum() < c.as_fixnum();
+    }
+    if (both_decimals(b, c)) {
+        return b.as_decimal() < c.as_decimal();
+    }
+    return compare_values(b, c) < 0;
+}
+
+static bool
+fused_le(value b, value c)
+{
+    if (both_fixnums(b, c)) {
+        return b.as_fixnum() <= c.as_fixnum();
+    }
+    if (both_decimals(b, c)) {
+        return !(b.as_decimal() > c.as_decimal());
+    }
+    return compare_values(b, c) <= 0;
+}
+
+static bool
+fused_eq(value b, value c)
+{
+    if (both_fixnums(b, c)) {
+        return b.bits == c.bits;
+    }
+    return values_equal(b, c);
+}
+
+// clang-format off
+#if FUNLANG_COMPUTED_GOTO
+#define VM_FETCH()                                                             \
+    do {                                                                       \
+        i = *pc++;                                                             \
+        if (Profile) {                                                         \
+            profile.record(instr_op(i));                                       \
+        }                                                                      \
+    } while (0)
+#define VM_NEXT()                                                              \
+    do {                                                                       \
+        VM_FETCH();                                                            \
+        goto* dispatch_table[instr_op(i)];                                     \
+    } while (0)
+#define VM_SWITCH() VM_NEXT();
+#define VM_CASE(name) L_##name:
+#else
+#define VM_FETCH_EXPR                                                          \
+    (i = *pc++, Profile ? profile.record(instr_op(i)) : (void)0)
+#define VM_SWITCH() for (VM_FETCH_EXPR;; VM_FETCH_EXPR) switch (instr_op(i))
+#define VM_NEXT() continue
+#define VM_CASE(name) case op_##name:
+#endif
+// clang-format on
+
+#define RA R[instr_a(i)]
+#define RB R[instr_b(i)]
+#define RC R[instr_c(i)]
+
+// Loop back edges are safe points for the collector and count towards
+// compiling the function.
+#define VM_BACK_EDGE(offset)                                                   \
+    do {                                                                       \
+        if ((offset) < 0) {                                                    \
+            if (heap.should_collect()) {                                       \
+                collect_garbage();                                             \
+            }                                                                  \
+            if (!Profile && jit.tier_up(proto)) {                              \
+                goto enter_native;                                             \
+            }                                                                  \
+        }                                                                      \
+    } while (0)
+
+// A comparison fused with the conditional jump after it.
+#define VM_COMPARE_JUMP(name, compare, jump_if)                                \
+    VM_CASE(name)                                                              \
+    {                                                                          \
+        bool result = compare(RB, RC);                                         \
+        RA = value::boolean(result);                                           \
+        int offset = instr_sbx(*pc++);                                         \
+        if (result == jump_if) {                                               \
+            pc += offset;                                                      \
+            VM_BACK_EDGE(offset);                                              \
+        }                                                                      \
+        VM_NEXT();                                                             \
+    }
+
+// A generic instruction runs, then tries to quicken itself for the operand
+// types it just saw.
+#define VM_GENERIC(name, result)                                               \
+    VM_CASE(name)                                                              \
+    {                                                                          \
+        value b = RB;                                                          \
+        value c = RC;                                                          \
+        RA = result;                                                           \
+        quicken(proto, pc, b, c);                                              \
+        VM_NEXT();                                                             \
+    }
+
+// A quickened instruction whose guard fails turns back into the generic one
+// and runs again as that.
+#define VM_QUICK(name, generic, guard, result)                                 \
+    VM_CASE(name)                                                              \
+    {                                                                          \
+        value b = RB;                                                          \
+        value c = RC;                                                          \
+        if (guard(b, c)) {                                                     \
+            RA = result;                                                       \
+            VM_NEXT();                                                         \
+        }                                                                      \
+        dequicken(proto, pc, op_##generic);                                    \
+        --pc;                                                                  \
+        VM_NEXT();                                                             \
+    }
+
+template<bool Profile>
+value
+vm::dispatch(size_t entry_depth)
+{
+#if FUNLANG_COMPUTED_GOTO
+    static void* const dispatch_table[op_count] = {
+#define FUNLANG_OPCODE_LABEL(name, format) &&L_##name,
+        FUNLANG_OPCODES(FUNLANG_OPCODE_LABEL)
+#undef FUNLANG_OPCODE_LABEL
+    };
+#endif
+
+    value* const stack_end = stack.data() + stack.size();
+
+    call_frame* frame = &frames.back();
+    function_proto* proto = frame->closure->proto;
+    value* R = frame->base;
+    const value* K = proto->constants.data();
+    const instr* pc = frame->pc;
+    instr i;
+
+    try {
+        if (!Profile && jit.tier_up(proto)) {
+            goto enter_native;
+        }
+
+        VM_SWITCH()
+        {
+            VM_CASE(move)
+            {
+                RA = RB;
+                VM_NEXT();
+            }
+            VM_CASE(loadk)
+            {
+                RA = K[instr_bx(i)];
+                VM_NEXT();
+            }
+            VM_CASE(loadi)
+            {
+                RA = value::fixnum(instr_sbx(i));
+                VM_NEXT();
+            }
+            VM_CASE(loadnil)
+            {
+                RA = value::nil();
+                VM_NEXT();
+            }
+            VM_CASE(loadtrue)
+            {
+                RA = value::boolean(true);
+                VM_NEXT();
+            }
+            VM_CASE(loadfalse)
+            {
+                RA = value::boolean(false);
+                VM_NEXT();
+            }
+            VM_CASE(getglobal)
+            {
+                global_obj* cell = K[instr_bx(i)].as<global_obj>();
+                if (!cell->bound()) {
+                    throw vm_error("undefined symbol " + cell->name);
+                }
+                RA = cell->item;
+                VM_NEXT();
+            }
+            VM_CASE(setglobal)
+            {
+                K[instr_bx(i)].as<global_obj>()->item = RA;
+                VM_NEXT();
+            }
+            VM_GENERIC(add, value_add(heap, b, c))
+            VM_GENERIC(sub, value_sub(heap, b, c))
+            VM_GENERIC(mul, value_mul(heap, b, c))
+            VM_GENERIC(div, value_div(heap, b, c))
+            VM_CASE(neg)
+            {
+                RA = value_neg(heap, RB);
+                VM_NEXT();
+            }
+            VM_GENERIC(eq, value::boolean(values_equal(b, c)))
+            VM_GENERIC(lt, value::boolean(compare_values(b, c) < 0))
+            VM_GENERIC(le, value::boolean(compare_values(b, c) <= 0))
+            VM_CASE(lnot)
+            {
+                RA = value::boolean(!RB.truthy());
+                VM_NEXT();
+            }
+            VM_CASE(check)
+            {
+                RA = checked(RB, instr_c(i));
+                VM_NEXT();
+            }
+            VM_CASE(jmp)
+            {
+                int offset = instr_sbx(i);
+                pc += offset;
+                VM_BACK_EDGE(offset);
+                VM_NEXT();
+            }
+            VM_CASE(jmpif)
+            {
+                if (RA.truthy()) {
+                    int offset = instr_sbx(i);
+                    pc += offset;
+                    VM_BACK_EDGE(offset);
+                }
+                VM_NEXT();
+            }
+            VM_CASE(jmpifnot)
+            {
+                if (!RA.truthy()) {
+                    int offset = instr_sbx(i);
+                    pc += offset;
+                    VM_BACK_EDGE(offset);
+                }
+                VM_NEXT();
+            }
+            VM_CASE(move_call)
+            {
+                RA = RB;
+                i = *pc++;
+                goto call_instr;
+            }
+            VM_CASE(call)
+            {
+            call_instr:
+                int a = instr_a(i);
+                int argc = instr_b(i);
+                value callee = R[a];
+
+                if (callee.is_object(o_closure)) {
+                    closure_obj* closure = callee.as<closure_obj>();
+                    function_proto* callee_proto = closure->proto;
+                    if (argc != callee_proto->arity) {
+                        check_arity(callee_proto->name.c_str(),
+                                    callee_proto->arity,
+                                    callee_proto->arity,
+                                    argc);
+                    }
+
+                    value* base = R + a + 1;
+                    if (base + callee_proto->num_regs > stack_end ||
+                        frames.size() >= max_frames) {
+                        throw vm_error("stack overflow");
+                    }
+                    std::fill(base + argc,
+                              base + callee_proto->num_regs,
+                              value::nil());
+
+                    frame->pc = pc;
+                    frames.push_back(
+                      { closure, callee_proto->code.data(), base });
+                    frame = &frames.back();
+
+                    proto = callee_proto;
+                    R = base;
+                    K = proto->constants.data();
+                    pc = frame->pc;
+                    stack_top = base + proto->num_regs;
+
+                    if (heap.should_collect()) {
+                        collect_garbage();
+                    }
+                    if (!Profile && jit.tier_up(proto)) {
+                        goto enter_native;
+                    }
+                    VM_NEXT();
+                }
+
+                if (callee.is_object(o_native)) {
+                    native_obj* native = callee.as<native_obj>();
+                    check_arity(
+                      native->name, native->min_args, native->max_args, argc);
+                    frame->pc = pc;
+                    R[a] = native->fn(*this, R + a + 1, argc);
+                    VM_NEXT();
+                }
+
+                if (callee.is_object(o_shape)) {
+                    R[a] = construct(callee.as<shape_obj>(), R + a + 1, argc);
+                    VM_NEXT();
+                }
+
+                throw vm_error(std::string("cannot call ") + type_name(callee));
+            }
+            VM_CASE(tailcall)
+            {
+                int a = instr_a(i);
+                int argc = instr_b(i);
+                value callee = R[a];
+
+                if (callee.is_object(o_closure)) {
+                    closure_obj* closure = callee.as<closure_obj>();
+                    function_proto* callee_proto = closure->proto;
+                    if (argc != callee_proto->arity) {
+                        check_arity(callee_proto->name.c_str(),
+                                    callee_proto->arity,
+                                    callee_proto->arity,
+                                    argc);
+                    }
+                    if (R + callee_proto->num_regs > stack_end) {
+                        throw vm_error("stack overflow");
+                    }
+
+                    // the callee and its arguments take the place of this
+                    // frame's, which start right below its first register
+                    std::copy(R + a, R + a + 1 + argc, R - 1);
+                    std::fill(
+                      R + argc, R + callee_proto->num_regs, value::nil());
+                    frame->closure = closure;
+
+                    proto = callee_proto;
+                    K = proto->constants.data();
+                    pc = proto->code.data();
+                    stack_top = R + proto->num_regs;
+
+                    if (heap.should_collect()) {
+                        collect_garbage();
+                    }
+                    if (!Profile && jit.tier_up(proto)) {
+                        goto enter_native;
+                    }
+                    VM_NEXT();
+                }
+
+                if (callee.is_object(o_native)) {
+                    native_obj* native = callee.as<native_obj>();
+                    check_arity(
+                      native->name, native->min_args, native->max_args, argc);
+                    frame->pc = pc;
+                    R[a] = native->fn(*this, R + a + 1, argc);
+                    i = encode_abc(op_ret, a, 0, 0);
+                    goto ret_instr;
+                }
+
+                if (callee.is_object(o_shape)) {
+                    R[a] = construct(callee.as<shape_obj>(), R + a + 1, argc);
+                    i = encode_abc(op_ret, a, 0, 0);
+                    goto ret_instr;
+                }
+
+                throw vm_error(std::string("cannot call ") + type_name(callee));
+            }
+            VM_CASE(ret)
+            {
+            ret_instr:
+                value result = RA;
+                frames.pop_back();
+                if (frames.size() == entry_depth) {
+                    return result;
+                }
+
+                // the callee sat right below its first register
+                R[-1] = result;
+
+                frame = &frames.back();
+                proto = frame->closure->proto;
+                R = frame->base;
+                K = proto->constants.data();
+                pc = frame->pc;
+                stack_top = R + proto->num_regs;
+                if (!Profile && proto->native) {
+                    goto enter_native;
+                }
+                VM_NEXT();
+            }
+            VM_CASE(closure)
+            {
+                RA = value::obj(make_closure(
+                  proto->protos[instr_bx(i)], R, frame->closure));
+                VM_NEXT();
+            }
+            VM_CASE(getcap)
+            {
+                RA = frame->closure->captures()[instr_b(i)];
+                VM_NEXT();
+            }
+            VM_CASE(box)
+            {
+                RA = value::obj(heap.make<box_obj>(RB));
+                VM_NEXT();
+            }
+            // the compiler only boxes registers it then reads through, but
+            // code loaded from the cache could name any register
+            VM_CASE(getbox)
+            {
+                if (!RB.is_object(o_box)) {
+                    throw vm_error("invalid box");
+                }
+                RA = RB.as<box_obj>()->item;
+                VM_NEXT();
+            }
+            VM_CASE(setbox)
+            {
+                if (!RA.is_object(o_box)) {
+                    throw vm_error("invalid box");
+                }
+                RA.as<box_obj>()->item = RB;
+                VM_NEXT();
+            }
+            VM_CASE(getfield)
+            {
+                RA = get_field(proto->sites[instr_c(i)], RB);
+                VM_NEXT();
+            }
+            VM_CASE(setfield)
+            {
+                set_field(proto->sites[instr_c(i)], RA, RB);
+                VM_NEXT();
+            }
+            VM_CASE(getmethod)
+            {
+                RA = get_method(proto->sites[instr_c(i)], RB);
+                VM_NEXT();
+            }
+            VM_CASE(vec)
+            {
+                const value* items = &R[instr_b(i)];
+                RA = heap.make_vector(value_vec::from_range(
+                  &runtime_allocator, items, items + instr_c(i)));
+                VM_NEXT();
+            }
+            VM_CASE(map)
+            {
+                value_map::tmap entries{ value_map{ &runtime_allocator } };
+                for (int j = 0; j < instr_c(i); ++j) {
+                    value* pair = R + instr_b(i) + 2 * j;
+                    entries.assoc(pair[0], pair[1]);
+                }
+                RA = heap.make_map(entries.to_persistent());
+                VM_NEXT();
+            }
+            VM_CASE(set)
+            {
+                value_set::tset items{ value_set{ &runtime_allocator } };
+                for (int j = 0; j < instr_c(i); ++j) {
+                    items.conj(R[instr_b(i) + j]);
+                }
+                RA = heap.make_set(items.to_persistent());
+                VM_NEXT();
+            }
+            VM_QUICK(add_ii,
+                     add,
+                     both_fixnums,
+                     heap.make_int(b.as_fixnum() + c.as_fixnum()))
+            VM_QUICK(sub_ii,
+                     sub,
+                     both_fixnums,
+                     heap.make_int(b.as_fixnum() - c.as_fixnum()))
+            VM_QUICK(mul_ii, mul, both_fixnums, fixnum_mul(heap, b, c))
+            VM_QUICK(eq_ii, eq, both_fixnums, value::boolean(b.bits == c.bits))
+            VM_QUICK(lt_ii,
+                     lt,
+                     both_fixnums,
+                     value::boolean(b.as_fixnum() < c.as_fixnum()))
+            VM_QUICK(le_ii,
+                     le,
+                     both_fixnums,
+                     value::boolean(b.as_fixnum() <= c.as_fixnum()))
+            VM_QUICK(add_dd,
+                     add,
+                     both_decimals,
+                     value::decimal(b.as_decimal() + c.as_decimal()))
+            VM_QUICK(sub_dd,
+                     sub,
+                     both_decimals,
+                     value::decimal(b.as_decimal() - c.as_decimal()))
+            VM_QUICK(mul_dd,
+                     mul,
+                     both_decimals,
+                     value::decimal(b.as_decimal() * c.as_decimal()))
+            VM_QUICK(div_dd,
+                     div,
+                     both_decimals,
+                     value::decimal(b.as_decimal() / c.as_decimal()))
+            VM_QUICK(lt_dd,
+                     lt,
+                     both_decimals,
+                     value::boolean(b.as_decimal() < c.as_decimal()))
+            // not >, so NaN compares the way compare_values has it
+            VM_QUICK(le_dd,
+                     le,
+                     both_decimals,
+                     value::boolean(!(b.as_decimal() > c.as_decimal())))
+            VM_QUICK(add_ss,
+                     add,
+                     both_strings,
+                     heap.make_string(b.as<string_obj>()->str +
+                                      c.as<string_obj>()->str))
+            VM_COMPARE_JUMP(lt_jmpif, fused_lt, true)
+            VM_COMPARE_JUMP(lt_jmpifnot, fused_lt, false)
+            VM_COMPARE_JUMP(le_jmpif, fused_le, true)
+            VM_COMPARE_JUMP(le_jmpifnot, fused_le, false)
+            VM_COMPARE_JUMP(eq_jmpif, fused_eq, true)
+            VM_COMPARE_JUMP(eq_jmpifnot, fused_eq, false)
+            // runs the current frame in native code until it exits back
+            // to the interpreter
+        enter_native:
+            {
+                jit.run(*this, proto, R, pc);
+                VM_NEXT();
+            }
+#if !FUNLANG_COMPUTED_GOTO
+            default:
+                throw vm_error("invalid opcode");
+#endif
+        }
+    } catch (vm_error& error) {
+        unwind(error, pc, entry_depth);
+    }
+}
@@ -0,0 +1,192 @@
+#include "work_pool.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <exception>
+
+// the pool whose worker runs on this thread, if any, and its deque there
+static thread_local const work_pool* worker_pool = nullptr;
+static thread_local size_t worker_index = 0;
+
+struct work_pool::job
+{
+    const range_body* body;
+    size_t grain;
+    // items in ranges that have not finished
+    std::atomic<size_t> pending;
+    std::atomic<bool> failed{ false };
+    std::mutex error_lock;
+    std::exception_ptr error;
+};
+
+work_pool::work_pool(size_t workers)
+{
+    for (size_t i = 0; i <= workers; ++i) {
+        queues.push_back(std::make_unique<queue>());
+    }
+    for (size_t i = 0; i < workers; ++i) {
+        threads.emplace_back(&work_pool::work, this, i);
+    }
+}
+
+work_pool::~work_pool()
+{
+    {
+        std::lock_guard<std::mutex> hold(sleep_lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+static size_t
+default_workers()
+{
+    if (const char* threads = getenv("FUNLANG_THREADS")) {
+        long n = atol(threads);
+        if (n > 0) {
+            return n - 1;
+        }
+    }
+    unsigned cores = std::thread::hardware_concurrency();
+    return cores > 1 ? cores - 1 : 0;
+}
+
+work_pool&
+work_pool::shared()
+{
+    static work_pool pool(default_workers());
+    return pool;
+}
+
+void
+work_pool::for_range(size_t n, size_t grain, const range_body& body)
+{
+    grain = std::max<size_t>(grain, 1);
+    if (threads.empty() || n <= grain) {
+        for (size_t first = 0; first < n; first += grain) {
+            body(first, std::min(n, first + grain));
+        }
+        return;
+    }
+
+    job j;
+    j.body = &body;
+    j.grain = grain;
+    j.pending = n;
+
+    queue& q = home();
+    run({ &j, 0, n }, q);
+    // ranges of other jobs found on the way are run as well; they are
+    // someone's work too
+    while (j.pending.load(std::memory_order_acquire) != 0) {
+        task t;
+        if (pop(q, t) || steal(q, t)) {
+            run(t, q);
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    if (j.error) {
+        std::rethrow_exception(j.error);
+    }
+}
+
+work_pool::queue&
+work_pool::home()
+{
+    return worker_pool == this ? *queues[worker_index] : *queues.back();
+}
+
+void
+work_pool::push(queue& q, const task& t)
+{
+    {
+        std::lock_guard<std::mutex> hold(q.lock);
+        q.tasks.push_back(t);
+    }
+    queued.fetch_add(1);
+    // a worker that just found nothing to do either sees the count or is
+    // already waiting
+    {
+        std::lock_guard<std::mutex> hold(sleep_lock);
+    }
+    wake.notify_one();
+}
+
+bool
+work_pool::pop(queue& q, task& t)
+{
+    std::lock_guard<std::mutex> hold(q.lock);
+    if (q.tasks.empty()) {
+        return false;
+    }
+    t = q.tasks.back();
+    q.tasks.pop_back();
+    queued.fetch_sub(1);
+    return true;
+}
+
+bool
+work_pool::steal(const queue& thief, task& t)
+{
+    for (auto& victim : queues) {
+        if (victim.get() == &thief) {
+            continue;
+        }
+        std::lock_guard<std::mutex> hold(victim->lock);
+        if (!victim->tasks.empty()) {
+            t = victim->tasks.front();
+            victim->tasks.pop_front();
+            queued.fetch_sub(1);
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+work_pool::run(task t, queue& q)
+{
+    job& j = *t.owner;
+    while (t.last - t.first > j.grain) {
+        size_t mid = t.first + (t.last - t.first) / 2;
+        push(q, { t.owner, mid, t.last });
+        t.last = mid;
+    }
+    if (!j.failed.load(std::memory_order_relaxed)) {
+        try {
+            (*j.body)(t.first, t.last);
+        } catch (...) {
+            std::lock_guard<std::mutex> hold(j.error_lock);
+            if (!j.error) {
+                j.error = std::current_exception();
+            }
+            j.failed = true;
+        }
+    }
+    // the last thing done with j, which its caller may free right after
+    j.pending.fetch_sub(t.last - t.first, std::memory_order_acq_rel);
+}
+
+void
+work_pool::work(size_t index)
+{
+    worker_pool = this;
+    worker_index = index;
+    queue& q = *queues[index];
+    for (;;) {
+        task t;
+        if (pop(q, t) || steal(q, t)) {
+            run(t, q);
+            continue;
+        }
+        std::unique_lock<std::mutex> hold(sleep_lock);
+        wake.wait(hold, [this] { return stopping || queued.load() != 0; });
+        if (stopping) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,211 @@
+#ifndef AOT_HPP
+#define AOT_HPP
+
+#include <iosfwd>
+#include <memory>
+#include <string>
+
+#include "vm.hpp"
+
+// Ahead of time compilation of whole source files to C++.
+//
+// Every function compiled from a file becomes a C++ function following the
+// bytecode instruction by instruction on the vm's register file, the way the
+// jit's templates do, so the interpreter and compiled code can hand a frame
+// back and forth at any instruction. Arithmetic and comparisons get their
+// fixnum and decimal cases inline and call the runtime for the rest; calls and
+// returns exit to the interpreter, which keeps frames, arity checks and error
+// traces in one place and enters the caller's compiled code again on return.
+//
+// The generated file is built into a shared object with the system compiler
+// and cached next to the token cache, keyed by the source text and a hash of
+// the headers it compiles against, so a file is only built once per build of
+// the executable. The executable exports the runtime for it.
+// Loading still compiles the file to bytecode; each function's compiled code
+// is checked against a hash of its bytecode before it is used, so a stale or
+// mismatched module only means running in the interpreter.
+
+struct aot_entry
+{
+    uint64_t code_hash;
+    aot_function fn;
+};
+
+// hash of what a compiled function was generated from
+uint64_t
+aot_code_hash(const function_proto* proto);
+
+// A loaded shared object.
+struct aot_module
+{
+    void* handle;
+    const aot_entry* entries;
+    size_t count;
+    // entry of the next function to attach
+    size_t next;
+
+    aot_module(void* handle, const aot_entry* entries, size_t count);
+    ~aot_module();
+
+    aot_module(const aot_module&) = delete;
+    aot_module& operator=(const aot_module&) = delete;
+
+    // gives a just compiled top level function and the ones nested in it
+    // their compiled code, in the order the module was generated in; returns
+    // false, attaching nothing, when they do not match
+    bool attach(jit_compiler& jit, function_proto* proto);
+};
+
+struct aot_options
+{
+    bool optimize = true;
+    bool superinstructions = true;
+};
+
+// Writes the C++ translation of every function compiled from source to out.
+// Throws the error of the first form that does not read or compile, naming
+// the file and line it is on.
+void
+aot_translate(const std::string& name,
+              const std::string& source,
+              const aot_options& options,
+              std::ostream& out);
+
+// Loads the module for source from directory, translating and building it
+// first when it is not there. Returns nullptr and sets error when it can not
+// be built or loaded; a source that does not compile throws as
+// aot_translate does.
+std::unique_ptr<aot_module>
+aot_load(const std::string& directory,
+         const std::string& name,
+         const std::string& source,
+         const aot_options& options,
+         std::string& error);
+
+// * Runtime for generated code
+//
+// The generic paths live in aot.cpp, so generated files only inline the
+// cases worth inlining.
+
+[[noreturn]] void
+aot_unbound(value cell);
+
+inline value
+aot_getglobal(value cell)
+{
+    global_obj* global = cell.as<global_obj>();
+    if (!global->bound()) {
+        aot_unbound(cell);
+    }
+    return global->item;
+}
+
+value
+aot_closure(vm& vm, function_proto* proto, int index, const value* R);
+
+inline value
+aot_box(vm& vm, value item)
+{
+    return value::obj(vm.heap.make<box_obj>(item));
+}
+
+value
+aot_vec(vm& vm, const value* items, int count);
+
+value
+aot_map(vm& vm, const value* pairs, int count);
+
+value
+aot_set(vm& vm, const value* items, int count);
+
+inline value
+aot_add(vm& vm, value b, value c)
+{
+    if (b.is_fixnum() && c.is_fixnum()) {
+        return vm.heap.make_int(b.as_fixnum() + c.as_fixnum());
+    }
+    if (b.is_decimal() && c.is_decimal()) {
+        return value::decimal(b.as_decimal() + c.as_decimal());
+    }
+    return value_add(vm.heap, b, c);
+}
+
+inline value
+aot_sub(vm& vm, value b, value c)
+{
+    if (b.is_fixnum() && c.is_fixnum()) {
+        return vm.heap.make_int(b.as_fixnum() - c.as_fixnum());
+    }
+    if (b.is_decimal() && c.is_decimal()) {
+        return value::decimal(b.as_decimal() - c.as_decimal());
+    }
+    return value_sub(vm.heap, b, c);
+}
+
+inline value
+aot_mul(vm& vm, value b, value c)
+{
+    int64_t result;
+    if (b.is_fixnum() && c.is_fixnum() &&
+        !__builtin_mul_overflow(b.as_fixnum(), c.as_fixnum(), &result)) {
+        return vm.heap.make_int(result);
+    }
+    if (b.is_decimal() && c.is_decimal()) {
+        return value::decimal(b.as_decimal() * c.as_decimal());
+    }
+    return value_mul(vm.heap, b, c);
+}
+
+inline value
+aot_div(vm& vm, value b, value c)
+{
+    if (b.is_decimal() && c.is_decimal()) {
+        return value::decimal(b.as_decimal() / c.as_decimal());
+    }
+    return value_div(vm.heap, b, c);
+}
+
+inline bool
+aot_lt(value b, value c)
+{
+    if (b.is_fixnum() && c.is_fixnum()) {
+        return b.as_fixnum() < c.as_fixnum();
+    }
+    if (b.is_decimal() && c.is_decimal()) {
+        return b.as_decimal() < c.as_decimal();
+    }
+    return compare_values(b, c) < 0;
+}
+
+inline bool
+aot_le(value b, value c)
+{
+    if (b.is_fixnum() && c.is_fixnum()) {
+        return b.as_fixnum() <= c.as_fixnum();
+    }
+    if (b.is_decimal() && c.is_decimal()) {
+        // not >, so NaN compares the way compare_values has it
+        return !(b.as_decimal() > c.as_decimal());
+    }
+    return compare_values(b, c) <= 0;
+}
+
+inline bool
+aot_eq(value b, value c)
+{
+    if (b.is_fixnum() && c.is_fixnum()) {
+        return b.bits == c.bits;
+    }
+    return values_equal(b, c);
+}
+
+// collection point at loop back edges, as in the interpreter
+inline void
+aot_safepoint(vm& vm)
+{
+    if (vm.heap.should_collect()) {
+        vm.collect_garbage();
+    }
+}
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef AST_HPP
+#define AST_HPP
+
+#include <iostream>
+#include <vector>
+
+#include "mystr.hpp"
+#include "ratio.hpp"
+
+// The reader turns the token stream into forms. Code is data: special forms
+// like (let [...] ...) are plain lists whose head is a symbol, and it is up to
+// the compiler to give them meaning.
+enum form_type
+{
+    f_nil,
+    f_true,
+    f_false,
+
+    f_integer,
+    f_decimal,
+    f_ratio,
+    f_chr,
+    f_str,
+
+    f_symbol,
+    f_keyword,
+
+    f_list,
+    f_vector,
+    f_map,
+    f_set,
+};
+
+// ^int or ^decimal before a symbol binding a local, see compiler::declare
+enum type_hint : uint8_t
+{
+    hint_none,
+    hint_int,
+    hint_decimal
+};
+
+struct form
+{
+    form_type type;
+
+    long filepos;
+
+    type_hint hint;
+
+    union
+    {
+        long data_int;
+        double data_decimal;
+        ratio data_rat;
+        char data_char;
+        mystr data_str;
+    };
+
+    // children of lists, vectors, maps and sets
+    std::vector<form*> items;
+
+    form(form_type type, long filepos)
+      : type(type)
+      , filepos(filepos)
+      , hint(hint_none)
+      , data_int(0)
+      , items()
+    {
+    }
+
+    bool is_symbol(const char* name) const
+    {
+        return type == f_symbol && data_str.len == strlen(name) &&
+               strncmp(data_str.data, name, data_str.len) == 0;
+    }
+
+    std::string str() const { return { data_str.data, data_str.len }; }
+
+    friend std::ostream& operator<<(std::ostream& stream, const form& f)
+    {
+        switch (f.type) {
+            case f_nil:
+                return stream << "nil";
+            case f_true:
+                return stream << "true";
+            case f_false:
+                return stream << "false";
+            case f_integer:
+                return stream << f.data_int;
+            case f_decimal:
+                return stream << f.data_decimal;
+            case f_ratio:
+                return stream << f.data_rat.counter << "/"
+                              << f.data_rat.divider;
+            case f_chr:
+                return stream << "?" << f.data_char;
+            case f_str:
+                return stream << "\"" << f.data_str << "\"";
+            case f_symbol:
+                if (f.hint != hint_none) {
+                    stream << (f.hint == hint_int ? "^int " : "^decimal ");
+                }
+                return stream << f.data_str;
+            case f_keyword:
+                return stream << ":" << f.data_str;
+            case f_list:
+            case f_vector:
+            case f_map:
+            case f_set: {
+                const char* open = f.type == f_list
+                                     ? "("
+                                     : f.type == f_vector
+                                         ? "["
+                                         : f.type == f_map ? "{" : "#{";
+                const char* close = f.type == f_list
+                                      ? ")"
+                                      : f.type == f_vector ? "]" : "}";
+                stream << open;
+                for (size_t i = 0; i < f.items.size(); ++i) {
+                    if (i > 0) {
+                        stream << " ";
+                    }
+                    stream << *f.items[i];
+                }
+                return stream << close;
+            }
+        }
+        return stream;
+    }
+};
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef BENCH_HPP
+#define BENCH_HPP
+
+#include <iostream>
+
+// Runs the built in vm microbenchmarks and prints one line per benchmark.
+// Returns nonzero if a benchmark failed to run.
+int
+run_benchmarks(std::ostream& out);
+
+#endif
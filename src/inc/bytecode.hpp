@@ -0,0 +1,312 @@
+#ifndef BYTECODE_HPP
+#define BYTECODE_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "runtime.hpp"
+
+// Register bytecode.
+//
+// Every instruction is 32 bits: an 8 bit opcode followed by either three 8 bit
+// operands A B C, or A and a 16 bit operand Bx. sBx is Bx with a bias so jumps
+// can go backwards; jump offsets are relative to the next instruction.
+//
+//   | C:8 | B:8 | A:8 | op:8 |      | Bx:16 | A:8 | op:8 |
+//
+// R[x] is register x of the current frame, K[x] constant x of the current
+// function.
+
+enum operand_format
+{
+    fmt_a,
+    fmt_ab,
+    fmt_abc,
+    fmt_abx,
+    fmt_asbx,
+    fmt_sbx
+};
+
+#define FUNLANG_OPCODES(X)                                                     \
+    X(move, fmt_ab)         /* R[A] = R[B] */                                  \
+    X(loadk, fmt_abx)       /* R[A] = K[Bx] */                                 \
+    X(loadi, fmt_asbx)      /* R[A] = sBx */                                   \
+    X(loadnil, fmt_a)       /* R[A] = nil */                                   \
+    X(loadtrue, fmt_a)      /* R[A] = true */                                  \
+    X(loadfalse, fmt_a)     /* R[A] = false */                                 \
+    X(getglobal, fmt_abx)   /* R[A] = global cell K[Bx] */                     \
+    X(setglobal, fmt_abx)   /* global cell K[Bx] = R[A] */                     \
+    X(add, fmt_abc)         /* R[A] = R[B] + R[C] */                           \
+    X(sub, fmt_abc)         /* R[A] = R[B] - R[C] */                           \
+    X(mul, fmt_abc)         /* R[A] = R[B] * R[C] */                           \
+    X(div, fmt_abc)         /* R[A] = R[B] / R[C] */                           \
+    X(neg, fmt_ab)          /* R[A] = -R[B] */                                 \
+    X(eq, fmt_abc)          /* R[A] = R[B] == R[C] */                          \
+    X(lt, fmt_abc)          /* R[A] = R[B] < R[C] */                           \
+    X(le, fmt_abc)          /* R[A] = R[B] <= R[C] */                          \
+    X(lnot, fmt_ab)         /* R[A] = !R[B] */                                 \
+    X(check, fmt_abc)       /* R[A] = R[B], checked to have type C */          \
+    X(jmp, fmt_sbx)         /* pc += sBx */                                    \
+    X(jmpif, fmt_asbx)      /* if R[A] then pc += sBx */                       \
+    X(jmpifnot, fmt_asbx)   /* if !R[A] then pc += sBx */                      \
+    X(call, fmt_abc)        /* R[A] = R[A](R[A+1] .. R[A+B]) */                \
+    X(tailcall, fmt_abc)    /* return R[A](R[A+1] .. R[A+B]) */                \
+    X(ret, fmt_a)           /* return R[A] */                                  \
+    X(closure, fmt_abx)     /* R[A] = fn for child prototype Bx */             \
+    X(getcap, fmt_ab)       /* R[A] = captured value B of the running fn */    \
+    X(box, fmt_ab)          /* R[A] = new box holding R[B] */                  \
+    X(getbox, fmt_ab)       /* R[A] = contents of box R[B] */                  \
+    X(setbox, fmt_ab)       /* contents of box R[A] = R[B] */                  \
+    X(getfield, fmt_abc)    /* R[A] = field of R[B] named at site C */         \
+    X(setfield, fmt_abc)    /* field of R[A] named at site C = R[B] */         \
+    X(getmethod, fmt_abc)   /* R[A] = method of R[B] named at site C */        \
+    X(vec, fmt_abc)         /* R[A] = [R[B] .. R[B+C-1]] */                    \
+    X(map, fmt_abc)         /* R[A] = {R[B] R[B+1] .. R[B+2C-1]} */            \
+    X(set, fmt_abc)         /* R[A] = #{R[B] .. R[B+C-1]} */                   \
+    /* quickened forms, written by the vm over the generic ones above, and     \
+       by the optimizer where it knows the operand types */                    \
+    X(add_ii, fmt_abc)      /* add of two fixnums */                           \
+    X(sub_ii, fmt_abc)      /* sub of two fixnums */                           \
+    X(mul_ii, fmt_abc)      /* mul of two fixnums */                           \
+    X(eq_ii, fmt_abc)       /* eq of two fixnums */                            \
+    X(lt_ii, fmt_abc)       /* lt of two fixnums */                            \
+    X(le_ii, fmt_abc)       /* le of two fixnums */                            \
+    X(add_dd, fmt_abc)      /* add of two decimals */                          \
+    X(sub_dd, fmt_abc)      /* sub of two decimals */                          \
+    X(mul_dd, fmt_abc)      /* mul of two decimals */                          \
+    X(div_dd, fmt_abc)      /* div of two decimals */                          \
+    X(lt_dd, fmt_abc)       /* lt of two decimals */                           \
+    X(le_dd, fmt_abc)       /* le of two decimals */                           \
+    X(add_ss, fmt_abc)      /* add of two strings */                           \
+    /* superinstructions, see fuse_superinstructions; each also runs the       \
+       instruction after it and skips over it */                               \
+    X(lt_jmpif, fmt_abc)    /* lt, then the jmpif after it */                  \
+    X(lt_jmpifnot, fmt_abc) /* lt, then the jmpifnot after it */               \
+    X(le_jmpif, fmt_abc)    /* le, then the jmpif after it */                  \
+    X(le_jmpifnot, fmt_abc) /* le, then the jmpifnot after it */               \
+    X(eq_jmpif, fmt_abc)    /* eq, then the jmpif after it */                  \
+    X(eq_jmpifnot, fmt_abc) /* eq, then the jmpifnot after it */               \
+    X(move_call, fmt_ab)    /* move, then the call after it */
+
+enum opcode : uint8_t
+{
+#define FUNLANG_OPCODE_ENUM(name, format) op_##name,
+    FUNLANG_OPCODES(FUNLANG_OPCODE_ENUM)
+#undef FUNLANG_OPCODE_ENUM
+      op_count
+};
+
+extern const char* const opcode_names[op_count];
+extern const operand_format opcode_formats[op_count];
+
+typedef uint32_t instr;
+
+constexpr int max_registers = 250;
+constexpr int max_bx = 0xffff;
+constexpr int sbx_bias = 0x7fff;
+
+inline constexpr instr
+encode_abc(opcode op, int a, int b, int c)
+{
+    return op | (a << 8) | (b << 16) | ((instr)c << 24);
+}
+
+inline constexpr instr
+encode_abx(opcode op, int a, int bx)
+{
+    return op | (a << 8) | ((instr)bx << 16);
+}
+
+inline constexpr instr
+encode_asbx(opcode op, int a, int sbx)
+{
+    return encode_abx(op, a, sbx + sbx_bias);
+}
+
+inline constexpr opcode
+instr_op(instr i)
+{
+    return static_cast<opcode>(i & 0xff);
+}
+
+inline constexpr int
+instr_a(instr i)
+{
+    return (i >> 8) & 0xff;
+}
+
+inline constexpr int
+instr_b(instr i)
+{
+    return (i >> 16) & 0xff;
+}
+
+inline constexpr int
+instr_c(instr i)
+{
+    return i >> 24;
+}
+
+inline constexpr int
+instr_bx(instr i)
+{
+    return i >> 16;
+}
+
+inline constexpr int
+instr_sbx(instr i)
+{
+    return (int)(i >> 16) - sbx_bias;
+}
+
+struct native_code;
+
+// The types a check instruction can require, what the ^int and ^decimal type
+// hints compile to.
+enum checked_type
+{
+    checked_int,
+    checked_decimal,
+    checked_type_count
+};
+
+// The inline cache of a field access or method call site: shapes seen there
+// and where they keep the field or method, most recent first. A site that
+// sees more shapes than the cache holds is megamorphic and stops caching.
+struct inline_cache
+{
+    static constexpr int ways = 4;
+
+    struct entry
+    {
+        const shape_obj* shape;
+        uint32_t index;
+    };
+
+    entry entries[ways];
+    uint8_t count;
+    bool megamorphic;
+
+    inline_cache()
+      : count(0)
+      , megamorphic(false)
+    {
+    }
+
+    // -1 on a miss
+    int lookup(const shape_obj* shape) const
+    {
+        if (count > 0 && entries[0].shape == shape) {
+            return entries[0].index;
+        }
+        for (int n = 1; n < count; ++n) {
+            if (entries[n].shape == shape) {
+                return entries[n].index;
+            }
+        }
+        return -1;
+    }
+
+    void add(const shape_obj* shape, uint32_t index)
+    {
+        if (count == ways) {
+            megamorphic = true;
+            return;
+        }
+        std::copy_backward(entries, entries + count, entries + count + 1);
+        entries[0] = { shape, index };
+        ++count;
+    }
+};
+
+// A field access or method call instruction's name and cache.
+struct access_site
+{
+    std::string name;
+    inline_cache cache;
+};
+
+// Where a closure gets one of its captured values from when it is created:
+// a register of the function creating it, or one of that function's own
+// captures.
+struct capture_source
+{
+    bool from_capture;
+    uint8_t index;
+};
+
+// A compiled function. Prototypes are owned by the vm and live as long as it
+// does; closures point at them.
+struct function_proto
+{
+    std::string name;
+    std::string source_name;
+
+    int arity;
+    int num_regs;
+
+    std::vector<instr> code;
+    // source line of every instruction in code
+    std::vector<int> lines;
+
+    std::vector<value> constants;
+    std::vector<function_proto*> protos;
+
+    // field and method names of getfield, setfield and getmethod
+    std::vector<access_site> sites;
+
+    // values closures of this function capture, copied in on creation
+    std::vector<capture_source> captures;
+    // the one closure of a function capturing nothing, made on first use
+    closure_obj* shared;
+
+    // how often each instruction fell back from a quickened form, see the
+    // quickening in vm.cpp; sized on first use
+    std::vector<uint8_t> deopts;
+
+    // jit state, see jit.hpp: machine code once compiled, calls plus loop
+    // iterations until then, and whether compiling is off for good
+    native_code* native;
+    uint32_t hotness;
+    bool no_jit;
+
+    // the last collection that reached this, see gc_heap
+    uint32_t marked_in;
+
+    function_proto()
+      : arity(0)
+      , num_regs(1)
+      , shared(nullptr)
+      , native(nullptr)
+      , hotness(0)
+      , no_jit(false)
+      , marked_in(0)
+    {
+    }
+
+    int line_at(size_t pc) const { return pc < lines.size() ? lines[pc] : 0; }
+};
+
+// Rewrites calls whose result is returned right away, possibly through moves
+// and jumps, into tail calls, which reuse the caller's frame.
+void
+mark_tail_calls(function_proto* proto);
+
+// Rewrites frequent instruction pairs into superinstructions. The second
+// instruction of a pair stays in place, so jumps to it still work; the fused
+// one runs both and steps over it.
+void
+fuse_superinstructions(function_proto* proto);
+
+void
+disassemble(std::ostream& stream, const function_proto* proto);
+
+void
+disassemble_instr(std::ostream& stream,
+                  const function_proto* proto,
+                  size_t pc);
+
+#endif
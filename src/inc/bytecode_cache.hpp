@@ -0,0 +1,151 @@
+#ifndef BYTECODE_CACHE_HPP
+#define BYTECODE_CACHE_HPP
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bytecode.hpp"
+
+struct vm;
+
+// On-disk cache of compiled source files.
+//
+// A cache file holds the bytecode of every top level form of one source text,
+// keyed by a hash of the text, the compiler version and the compiler settings.
+// Loading maps the file and relocates it: function records become prototypes
+// whose code and line tables are copied straight out of the mapping, and
+// constants are rebuilt from the constant pool. Nothing is lexed, parsed or
+// compiled, so a file that hits the cache starts running right away.
+//
+// Functions are stored depth first, each top level form's function followed
+// by the ones nested in it. Names, strings and keywords live once in a string
+// table at the end; constant records refer to it by offset. Functions list
+// their constants, and collection constants their items, as runs of the items
+// table, which holds constant pool indices; items always come before the
+// collection holding them.
+//
+// Layout (all little endian, native widths, every section padded to 8 bytes):
+//   module_header
+//   uint32_t toplevel[toplevel_count]      function index of every form
+//   function_record[function_count]
+//   uint32_t children[child_count]         function indices
+//   uint32_t captures[capture_count]       register, or capture index plus
+//                                          capture_from_enclosing
+//   uint32_t sites[site_count]             string offset of the field name
+//   constant_record[constant_count]
+//   uint32_t items[item_count]             constant indices
+//   instr code[code_count]
+//   int32_t lines[code_count]
+//   char strings[string_bytes]             every entry NUL terminated
+struct bytecode_cache
+{
+    static constexpr uint32_t magic = 0x43424c46; // "FLBC"
+    static constexpr uint32_t format_version = 10;
+    static constexpr uint32_t capture_from_enclosing = 0x100;
+
+    struct module_header
+    {
+        uint32_t magic;
+        uint32_t format_version;
+        uint64_t key;
+        uint64_t source_size;
+        uint32_t toplevel_count;
+        uint32_t function_count;
+        uint32_t child_count;
+        uint32_t capture_count;
+        uint32_t site_count;
+        uint32_t constant_count;
+        uint32_t item_count;
+        uint32_t code_count;
+        uint64_t string_bytes;
+    };
+
+    struct function_record
+    {
+        uint32_t name;
+        int32_t arity;
+        int32_t num_regs;
+        uint32_t code_first;
+        uint32_t code_count;
+        // run of the items table
+        uint32_t constant_first;
+        uint32_t constant_count;
+        uint32_t child_first;
+        uint32_t child_count;
+        uint32_t capture_first;
+        uint32_t capture_count;
+        uint32_t site_first;
+        uint32_t site_count;
+    };
+
+    enum constant_kind : uint32_t
+    {
+        k_immediate, // payload is the value's bits
+        k_int,       // payload is the number
+        k_ratio,     // payload is the counter, count the divider
+        k_string,    // payload is a string table offset
+        k_keyword,   // likewise
+        k_global,    // likewise, the cell of the global with that name
+        k_vector,    // payload is the first item, count the number of items
+        k_list,
+        k_map,       // items alternate keys and values
+        k_set
+    };
+
+    struct constant_record
+    {
+        uint32_t kind;
+        uint32_t count;
+        uint64_t payload;
+    };
+
+    // Collects the functions of a source file as its forms are compiled,
+    // before running them can quicken their code.
+    struct writer
+    {
+        std::vector<uint32_t> toplevel;
+        std::vector<function_record> functions;
+        std::vector<uint32_t> children;
+        std::vector<uint32_t> captures;
+        std::vector<uint32_t> sites;
+        std::vector<constant_record> constants;
+        std::vector<uint32_t> items;
+        std::vector<instr> code;
+        std::vector<int32_t> lines;
+        std::string strings;
+        std::unordered_map<std::string, uint32_t> interned;
+        // set when a constant has no file representation
+        bool failed = false;
+
+        void add(const function_proto* proto);
+
+      private:
+        uint32_t add_function(const function_proto* proto);
+        uint32_t add_constant(value v);
+        uint32_t add_string(const std::string& str);
+    };
+
+    std::string directory;
+    bool enabled;
+
+    bytecode_cache(std::string directory);
+
+    // settings are the compiler options that change the bytecode
+    uint64_t key_for(const std::string& source, uint32_t settings) const;
+    std::string path_for(uint64_t key) const;
+
+    // creates the prototypes of every top level form of source in machine,
+    // in order
+    bool load(const std::string& name,
+              const std::string& source,
+              uint32_t settings,
+              vm& machine,
+              std::vector<function_proto*>& toplevel);
+    bool store(const std::string& source,
+               uint32_t settings,
+               const writer& module);
+};
+
+#endif
@@ -0,0 +1,208 @@
+#ifndef COMPILER_HPP
+#define COMPILER_HPP
+
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ast.hpp"
+#include "bytecode.hpp"
+#include "parser.hpp"
+#include "vm.hpp"
+
+struct compile_error : std::runtime_error
+{
+    compile_error(const std::string& message)
+      : std::runtime_error(message)
+    {
+    }
+};
+
+// Compiles forms to register bytecode.
+//
+// Locals live in registers for their whole scope; temporaries are allocated
+// stack-wise above them and released as soon as the expression that needed
+// them is done. Expressions are compiled into a destination register chosen by
+// the caller, so (+ a b) on two locals is a single add.
+//
+// Functions close over locals of enclosing functions by copying them into the
+// closure when it is created (see closure_obj). Locals that are both captured
+// and assigned to live in a box the closures share. A function bound by let
+// and only ever called right there does not escape: it is lambda lifted, its
+// free locals passed as extra arguments on every call, so it captures nothing
+// and needs no closure of its own.
+//
+// Locals bound with a type hint, ^int i or ^decimal x, are checked whenever
+// they are written. The optimizer takes the types from there and from what
+// arithmetic on known types gives, drops checks it can prove and picks the
+// specialized arithmetic instructions up front, see specialize_types.
+//
+// A symbol with dots in it, a.b.c, reads the fields of struct instances
+// along the path, unless a local has that very name; (a.b args...) calls
+// method b of a with a as its first argument. Every access gets its own
+// site, so its inline cache only sees the shapes that turn up right there.
+struct compiler
+{
+    // what a name refers to
+    struct variable
+    {
+        enum kind_t
+        {
+            global,
+            local,
+            capture
+        } kind;
+        // register or capture index
+        int index;
+        // holds a box_obj
+        bool boxed;
+        type_hint hint;
+    };
+
+    // a local passed along to a lambda lifted function
+    struct free_var
+    {
+        std::string name;
+        variable source;
+    };
+
+    struct local
+    {
+        std::string name;
+        int reg;
+        bool boxed;
+        type_hint hint;
+        // for a lambda lifted function, what its calls pass after the
+        // arguments
+        bool lifted_fn;
+        std::vector<free_var> lifted;
+    };
+
+    struct capture
+    {
+        std::string name;
+        bool boxed;
+        type_hint hint;
+    };
+
+    // Constants are pooled by value, except that decimals have to match bit
+    // for bit: 0.0 and -0.0 are equal but not interchangeable. Collections,
+    // which compare their items with values_equal, are not pooled.
+    struct constant_hasher
+    {
+        size_t operator()(value v) const;
+    };
+
+    struct same_constant
+    {
+        bool operator()(value a, value b) const;
+    };
+
+    struct func_state
+    {
+        function_proto* proto;
+        func_state* parent;
+        std::vector<local> locals;
+        int free_reg;
+        // parallel to proto->captures
+        std::vector<capture> captures;
+        // where each of proto->constants but the collections is
+        std::unordered_map<value, uint16_t, constant_hasher, same_constant>
+          constant_index;
+    };
+
+    vm* _vm;
+    const source_map* _source;
+    // run each compiled function through the IR optimizer
+    bool optimize;
+    // optimized IR is written here when set
+    std::ostream* ir_dump;
+    // fuse frequent instruction pairs into superinstructions
+    bool superinstructions;
+    func_state* fs;
+    long cur_pos;
+
+    compiler(vm* vm, const source_map* source);
+
+    // compiles a top level form into a function of no arguments returning the
+    // form's value
+    function_proto* compile_toplevel(form* f);
+
+  private:
+    [[noreturn]] void error(const std::string& message);
+
+    int line() const;
+
+    size_t emit(instr i);
+    size_t emit_jump(opcode op, int a);
+    void patch_jump(size_t at);
+    void emit_loop(size_t target);
+    void emit_move(int dest, int src);
+
+    int alloc_reg();
+    void free_to(int reg);
+    int active_local_regs() const;
+
+    int add_constant(value v);
+    // the constant holding the cell of global name
+    int global_constant(const std::string& name);
+    // likewise for a global about to be assigned
+    int global_target(const std::string& name);
+
+    const local* find_local(const std::string& name, func_state* state) const;
+    // adds captures down from the function declaring name as needed
+    variable resolve(const std::string& name, func_state* state);
+    // true if name is a local of this or an enclosing function
+    bool bound_locally(const std::string& name) const;
+    // the parts of a field path, empty for a plain name
+    std::vector<std::string> path(const std::string& name) const;
+    int add_site(const std::string& name);
+    void declare(const std::string& name,
+                 int reg,
+                 bool boxed,
+                 type_hint hint = hint_none);
+    // checks reg against hint
+    void emit_check(int reg, type_hint hint);
+
+    void emit_constant(int dest, value v);
+    bool constant_value(form* f, value& out);
+    bool fold_operator(form* f, value& out);
+
+    void expr(form* f, int dest);
+    int expr_any(form* f);
+
+    void body(const std::vector<form*>& forms, size_t first, int dest);
+
+    void list(form* f, int dest);
+    void call(form* f, int dest);
+    void symbol(form* f, int dest);
+    void variable_ref(const std::string& name, int dest);
+    // loads the first count parts of path
+    void path_ref(const std::vector<std::string>& parts,
+                  size_t count,
+                  int dest);
+    void literal_seq(form* f, int dest, opcode op);
+
+    bool builtin_op(form* f, int dest);
+
+    void def(form* f, int dest);
+    void defn(form* f, int dest);
+    void defstruct(form* f, int dest);
+    void let(form* f, int dest);
+    void fn(form* f,
+            int dest,
+            const std::string& name,
+            const std::vector<free_var>* lifted = nullptr);
+    bool lift(form* fn_form,
+              const std::string& name,
+              const std::vector<form*>& scope,
+              std::vector<free_var>& lifted);
+    void if_(form* f, int dest);
+    void do_(form* f, int dest);
+    void while_(form* f, int dest);
+    void set(form* f, int dest);
+    void logic(form* f, int dest, bool is_and);
+};
+
+#endif
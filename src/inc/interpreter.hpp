@@ -0,0 +1,57 @@
+#ifndef INTERPRETER_HPP
+#define INTERPRETER_HPP
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "aot.hpp"
+#include "bytecode_cache.hpp"
+#include "string_arena.hpp"
+#include "token_cache.hpp"
+#include "vm.hpp"
+
+// Runs source text through the whole pipeline: tokens (through the token
+// cache), forms, bytecode and the vm. Top level forms are compiled and run one
+// at a time, so a def is visible to every form after it. A source that was
+// compiled before skips all of that and loads from the bytecode cache.
+struct interpreter
+{
+    arena strings;
+    token_cache cache;
+    bytecode_cache compiled;
+    vm machine;
+
+    // print the bytecode of every top level form before running it
+    bool disassemble;
+    // run compiled functions through the IR optimizer
+    bool optimize;
+    // print the optimized IR of every function as it is compiled
+    bool dump_ir;
+    // let the compiler emit superinstructions
+    bool superinstructions;
+    // run sources through modules compiled ahead of time, see aot.hpp
+    bool aot;
+
+    std::vector<std::unique_ptr<aot_module>> modules;
+
+    interpreter(bool use_cache);
+
+    // Returns the value of the last form; results are printed to echo when
+    // it is given. Only cacheable sources go through the token, bytecode and
+    // aot caches: one-off input such as REPL lines would only fill them with
+    // entries nothing ever hits.
+    value eval(const std::string& name,
+               const std::string& source,
+               std::ostream* echo = nullptr,
+               bool cacheable = false);
+
+  private:
+    value run_form(function_proto* proto,
+                   aot_module*& module,
+                   const std::string& name,
+                   std::ostream* echo);
+};
+
+#endif
@@ -0,0 +1,161 @@
+#ifndef IR_HPP
+#define IR_HPP
+
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include "bytecode.hpp"
+
+// Mid-level SSA IR.
+//
+// A function's bytecode is lifted into basic blocks of SSA values, optimized,
+// and lowered back to register bytecode with a fresh register allocation.
+// Every instruction defines at most one value and is referred to by its index
+// in ir_function::instrs. Passes never renumber instructions: a removed
+// instruction is marked dead and, if it was replaced by another value,
+// forwards to it.
+
+typedef int ir_ref;
+constexpr ir_ref no_ref = -1;
+
+enum ir_kind : uint8_t
+{
+    ir_param,
+    ir_phi,
+    ir_op
+};
+
+struct ir_instr
+{
+    ir_kind kind;
+    // bytecode operation for ir_op
+    opcode op;
+    // Bx, sBx, argument or element count, or the parameter index
+    int imm;
+    int line;
+    int block;
+    bool has_value;
+    bool dead;
+    ir_ref forward;
+    // operands; a phi has one per predecessor of its block, in order
+    std::vector<ir_ref> args;
+};
+
+struct ir_block
+{
+    std::vector<ir_ref> phis;
+    // always ends with one of jmp, jmpif, jmpifnot or ret
+    std::vector<ir_ref> code;
+
+    std::vector<int> preds;
+    // jmp: target; jmpif and jmpifnot: taken, then fallthrough
+    std::vector<int> succs;
+
+    int idom;
+    bool removed;
+    // blocks created by passes are laid out right before this block
+    int place_before;
+};
+
+struct ir_loop
+{
+    int header;
+    int preheader; // -1 when the loop is entered from several blocks
+    std::vector<bool> body;
+    size_t size;
+};
+
+// thrown for bytecode the IR does not model; the function keeps its code
+struct ir_unsupported : std::runtime_error
+{
+    ir_unsupported(const std::string& message)
+      : std::runtime_error(message)
+    {
+    }
+};
+
+struct ir_function
+{
+    function_proto* proto;
+
+    std::vector<ir_instr> instrs;
+    std::vector<ir_block> blocks;
+
+    // reverse postorder of the reachable blocks, see compute_dominators
+    std::vector<int> rpo;
+
+    explicit ir_function(function_proto* proto);
+
+    // lifts proto's bytecode into SSA form; block 0 is a synthetic entry
+    // holding the parameters
+    void build();
+
+    int add_block();
+    ir_ref add_instr(int block,
+                     ir_kind kind,
+                     opcode op,
+                     int imm,
+                     int line,
+                     std::vector<ir_ref> args,
+                     bool has_value);
+
+    ir_ref resolve(ir_ref ref) const;
+
+    // resolves every operand and drops dead instructions from the blocks
+    void compact();
+
+    void compute_dominators();
+    bool dominates(int a, int b) const;
+    std::vector<std::vector<int>> dominator_children() const;
+
+    // natural loops, innermost first; needs compute_dominators
+    std::vector<ir_loop> find_loops() const;
+
+    void dump(std::ostream& stream) const;
+};
+
+// no side effects, same operands give the same result
+bool
+ir_is_pure(opcode op);
+
+// pure operations that can still raise an error, like arithmetic on the wrong
+// types
+bool
+ir_may_throw(opcode op);
+
+bool
+ir_is_terminator(opcode op);
+
+// * Passes, in the order optimize_proto runs them
+
+void
+remove_trivial_phis(ir_function& fn);
+
+void
+propagate_copies(ir_function& fn);
+
+void
+eliminate_common_subexpressions(ir_function& fn);
+
+void
+hoist_loop_invariants(ir_function& fn);
+
+void
+specialize_types(ir_function& fn);
+
+void
+eliminate_dead_code(ir_function& fn);
+
+// replaces the code of fn.proto; throws ir_unsupported when the result would
+// not fit the bytecode limits
+void
+lower(ir_function& fn);
+
+// Lifts, optimizes and lowers proto. Returns false and leaves the bytecode
+// untouched if the function can not be handled. The optimized IR is written
+// to ir_dump when it is given.
+bool
+optimize_proto(function_proto* proto, std::ostream* ir_dump);
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef JIT_HPP
+#define JIT_HPP
+
+#include <memory>
+#include <vector>
+
+#include "bytecode.hpp"
+
+// Baseline compiler from bytecode to x86-64 machine code.
+//
+// Every bytecode instruction becomes a fixed template working directly on the
+// vm's register file, so native code and the interpreter can hand a frame back
+// and forth at any instruction. Native code handles moves, constants, globals,
+// jumps and the fixnum and decimal cases of arithmetic and comparisons;
+// anything else, like calls, returns or allocation, exits to the interpreter at
+// that instruction. The interpreter runs from there and enters native code
+// again at the next call, return or loop back edge.
+//
+// Quickened instructions compile to guarded code for the types they were
+// specialized to. A failing guard deoptimizes: it exits before the instruction
+// has any effect and the interpreter runs it generically. Functions that keep
+// deoptimizing lose their native code.
+//
+// Functions are compiled once calls plus loop iterations reach hot_threshold.
+// Native code is placed in its own mmap'd pages, writable while it is
+// assembled and executable afterwards.
+
+#ifndef FUNLANG_JIT
+#if defined(__x86_64__) && defined(__linux__)
+#define FUNLANG_JIT 1
+#else
+#define FUNLANG_JIT 0
+#endif
+#endif
+
+struct vm;
+
+// A function compiled ahead of time, see aot.hpp. Same contract as jitted
+// code, except that it may throw; it keeps the instruction it is at in *at so
+// the error can be traced.
+typedef uint32_t (*aot_function)(vm& vm,
+                                 function_proto* proto,
+                                 value* R,
+                                 uint32_t pc,
+                                 uint32_t* at);
+
+struct native_code
+{
+    // jitted machine code
+    uint8_t* memory;
+    size_t size;
+    // code offset of every bytecode instruction
+    std::vector<uint32_t> offsets;
+
+    // or an ahead of time compiled function
+    aot_function aot;
+
+    uint32_t deopts;
+
+    native_code(uint8_t* memory, size_t size, std::vector<uint32_t> offsets);
+    explicit native_code(aot_function aot);
+    ~native_code();
+
+    native_code(const native_code&) = delete;
+    native_code& operator=(const native_code&) = delete;
+
+    // runs from bytecode instruction pc with R as the register file; returns
+    // the instruction to continue from, shifted left by one, with the low bit
+    // set when a guard failed
+    uint32_t run(value* R, size_t pc) const;
+};
+
+struct jit_compiler
+{
+    static constexpr uint32_t hot_threshold = 1000;
+    static constexpr uint32_t max_deopts = 1000;
+
+    bool enabled;
+
+    jit_compiler();
+
+    // counts a call or loop iteration of proto, compiling it once it gets
+    // hot; returns whether proto has native code
+    bool tier_up(function_proto* proto)
+    {
+        if (proto->native) {
+            return true;
+        }
+        if (!enabled || proto->no_jit || ++proto->hotness < hot_threshold) {
+            return false;
+        }
+        return compile(proto);
+    }
+
+    // runs proto's native code from pc and moves pc to where the interpreter
+    // goes on, or to just past the failing instruction if it throws
+    void run(vm& vm, function_proto* proto, value* R, const instr*& pc);
+
+    // gives proto ahead of time compiled code
+    void install(function_proto* proto, aot_function fn);
+
+  private:
+    std::vector<std::unique_ptr<native_code>> code;
+
+    bool compile(function_proto* proto);
+    void discard(function_proto* proto);
+};
+
+#endif
@@ -1,13 +1,25 @@
 #ifndef DATASTRUCTS_H
 #define DATASTRUCTS_H
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
 #include <experimental/optional>
 #include <iostream>
+#include <iterator>
+#include <limits>
 #include <memory>
+#include <new>
 #include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 #include "allocator_base.hpp"
+#include "work_pool.hpp"
 
 template<typename TFrom, typename Func>
 auto
@@ -21,15 +33,280 @@ operator>>=(std::experimental::optional<TFrom> from, Func&& func)
     }
 }
 
+// * Node storage
+//
+// Nodes of the persistent collections count their own references and come
+// from a pool per node size, so a child pointer is one word and sharing a
+// node is an increment of a plain integer. The count is not atomic: a
+// collection is only changed by one thread, and the parallel operations on
+// vectors read shared nodes without counting references to them.
+
+// Fixed size blocks carved out of chunks taken from Allocator. Freed blocks
+// go on a free list for the next node of the same size; chunks are kept for
+// the life of the program. Each thread has its own free list, so threads
+// can build nodes side by side, and a block freed on another thread than
+// the one it came from just joins that thread's list.
+template<typename Allocator, size_t Size>
+struct node_pool
+{
+    static constexpr size_t block_size =
+      (Size + alignof(void*) - 1) & ~(alignof(void*) - 1);
+    static constexpr size_t chunk_blocks = 64;
+
+    struct free_block
+    {
+        free_block* next;
+    };
+
+    static thread_local free_block* free_list;
+
+    static void* allocate(Allocator* allocator)
+    {
+        if (!free_list) {
+            refill(allocator);
+        }
+        free_block* block = free_list;
+        free_list = block->next;
+        return block;
+    }
+
+    static void deallocate(void* ptr)
+    {
+        free_block* block = static_cast<free_block*>(ptr);
+        block->next = free_list;
+        free_list = block;
+    }
+
+    static void refill(Allocator* allocator)
+    {
+        assert(allocator);
+        alb::block chunk = allocator->allocate(block_size * chunk_blocks);
+        if (!chunk.ptr) {
+            throw std::bad_alloc();
+        }
+        char* bytes = static_cast<char*>(chunk.ptr);
+        for (size_t i = chunk_blocks; i > 0; --i) {
+            deallocate(bytes + (i - 1) * block_size);
+        }
+    }
+};
+
+template<typename Allocator, size_t Size>
+thread_local typename node_pool<Allocator, Size>::free_block*
+  node_pool<Allocator, Size>::free_list = nullptr;
+
+// Pools for nodes whose size varies: a node goes in the smallest of Sizes it
+// fits, which is its class.
+template<typename Allocator, size_t Size, size_t... Sizes>
+struct block_classes
+{
+    typedef block_classes<Allocator, Sizes...> larger;
+
+    static constexpr size_t count = 1 + sizeof...(Sizes);
+
+    // count when bytes fits in none of them
+    static size_t class_for(size_t bytes)
+    {
+        return bytes <= Size ? 0 : 1 + larger::class_for(bytes);
+    }
+
+    static size_t size(size_t cls)
+    {
+        return cls == 0 ? Size : larger::size(cls - 1);
+    }
+
+    static void* allocate(Allocator* allocator, size_t cls)
+    {
+        return cls == 0 ? node_pool<Allocator, Size>::allocate(allocator)
+                        : larger::allocate(allocator, cls - 1);
+    }
+
+    static void deallocate(void* ptr, size_t cls)
+    {
+        if (cls == 0) {
+            node_pool<Allocator, Size>::deallocate(ptr);
+        } else {
+            larger::deallocate(ptr, cls - 1);
+        }
+    }
+};
+
+template<typename Allocator, size_t Size>
+struct block_classes<Allocator, Size>
+{
+    static constexpr size_t count = 1;
+
+    static size_t class_for(size_t bytes) { return bytes <= Size ? 0 : 1; }
+
+    static size_t size(size_t cls) { return Size; }
+
+    static void* allocate(Allocator* allocator, size_t cls)
+    {
+        return node_pool<Allocator, Size>::allocate(allocator);
+    }
+
+    static void deallocate(void* ptr, size_t cls)
+    {
+        node_pool<Allocator, Size>::deallocate(ptr);
+    }
+};
+
+// A number naming one transient editing session. Nodes a map or set
+// transient creates carry it and may be changed in place until the transient
+// is made persistent; 0 is never handed out and marks nodes no one may
+// change. Vector transients only use it to tell whether they are live.
+inline uint64_t
+new_edit_session()
+{
+    static std::atomic<uint64_t> last{ 0 };
+    return ++last;
+}
+
+// Base of every pooled node: the number of node_ptrs holding it. Copying a
+// node's contents never copies its count.
+struct counted_node
+{
+    uint32_t refs = 0;
+
+    counted_node() = default;
+    counted_node(const counted_node&) {}
+    counted_node& operator=(const counted_node&) { return *this; }
+};
+
+// An owning pointer to a counted node. When the last one lets go, the node
+// is handed to N::destroy, which runs its destructor and returns it to its
+// pool.
+template<typename N>
+class node_ptr
+{
+    N* ptr = nullptr;
+
+    void retain() const
+    {
+        if (ptr) {
+            ++ptr->refs;
+        }
+    }
+
+  public:
+    node_ptr() = default;
+
+    node_ptr(std::nullptr_t) {}
+
+    explicit node_ptr(N* ptr)
+      : ptr(ptr)
+    {
+        retain();
+    }
+
+    node_ptr(const node_ptr& other)
+      : ptr(other.ptr)
+    {
+        retain();
+    }
+
+    node_ptr(node_ptr&& other) noexcept
+      : ptr(other.ptr)
+    {
+        other.ptr = nullptr;
+    }
+
+    template<typename M,
+             typename = typename std::enable_if<
+               std::is_convertible<M*, N*>::value>::type>
+    node_ptr(const node_ptr<M>& other)
+      : ptr(other.get())
+    {
+        retain();
+    }
+
+    template<typename M,
+             typename = typename std::enable_if<
+               std::is_convertible<M*, N*>::value>::type>
+    node_ptr(node_ptr<M>&& other) noexcept
+      : ptr(other.detach())
+    {
+    }
+
+    ~node_ptr() { reset(); }
+
+    node_ptr& operator=(node_ptr other) noexcept
+    {
+        std::swap(ptr, other.ptr);
+        return *this;
+    }
+
+    void reset()
+    {
+        if (ptr && --ptr->refs == 0) {
+            N::destroy(ptr);
+        }
+        ptr = nullptr;
+    }
+
+    // takes over a reference given up by detach
+    static node_ptr adopt(N* ptr) noexcept
+    {
+        node_ptr result;
+        result.ptr = ptr;
+        return result;
+    }
+
+    // gives up the reference without dropping it
+    N* detach() noexcept
+    {
+        N* result = ptr;
+        ptr = nullptr;
+        return result;
+    }
+
+    N* get() const { return ptr; }
+    N* operator->() const { return ptr; }
+    N& operator*() const { return *ptr; }
+    explicit operator bool() const { return ptr != nullptr; }
+};
+
+template<typename To, typename From>
+node_ptr<To>
+static_node_cast(const node_ptr<From>& from)
+{
+    return node_ptr<To>(static_cast<To*>(from.get()));
+}
+
+template<typename To, typename From>
+node_ptr<To>
+static_node_cast(node_ptr<From>&& from)
+{
+    return node_ptr<To>::adopt(static_cast<To*>(from.detach()));
+}
+
+template<typename N, typename Allocator, typename... Args>
+node_ptr<N>
+make_node(Allocator* allocator, Args&&... args)
+{
+    static_assert(alignof(N) <= alignof(void*),
+                  "pool blocks are only pointer aligned");
+    void* mem = node_pool<Allocator, sizeof(N)>::allocate(allocator);
+    return node_ptr<N>(new (mem) N(std::forward<Args>(args)...));
+}
+
+template<typename Allocator, typename N>
+void
+free_node(N* node)
+{
+    node->~N();
+    node_pool<Allocator, sizeof(N)>::deallocate(node);
+}
+
 template<typename T, typename Allocator>
 struct plist
 {
     struct node_t;
-    typedef std::shared_ptr<node_t> node;
+    typedef node_ptr<node_t> node;
 
     using allocator = Allocator;
 
-    struct node_t
+    struct node_t : counted_node
     {
         T item;
         node rest;
@@ -42,6 +319,17 @@ struct plist
 
         node_t(const node_t&) = default;
 
+        // unlinks the rest of the list first, so dropping a long list does
+        // not recurse once per node
+        static void destroy(node_t* n)
+        {
+            while (n) {
+                node_t* rest = n->rest.detach();
+                free_node<Allocator>(n);
+                n = rest && --rest->refs == 0 ? rest : nullptr;
+            }
+        }
+
         friend std::ostream& operator<<(std::ostream& stream, node_t& data)
         {
             stream << data.item;
@@ -81,19 +369,19 @@ struct plist
         return res;
     }
 
-    node make_node()
+    node make_node() const
     {
         assert(_allocator);
-        return alb::make_shared<node_t>(*_allocator);
+        return ::make_node<node_t>(_allocator);
     }
 
-    const T& peek()
+    const T& peek() const
     {
         assert(first);
         return first->item;
     }
 
-    plist pop()
+    plist pop() const
     {
         if (first) {
             return plist(first->rest, count - 1, _allocator);
@@ -102,20 +390,63 @@ struct plist
         }
     }
 
-    plist conj(T item)
+    plist conj(T item) const
     {
         node newnode = make_node();
         assert(newnode);
         newnode->item = item;
-        size_t newcount = 0;
-        if (first) {
-            newnode->rest = first;
-            newcount = count + 1;
-        } else {
-        }
-        return plist(newnode, newcount, _allocator);
+        newnode->rest = first;
+        return plist(newnode, count + 1, _allocator);
     }
 
+    class const_iterator
+    {
+        const node_t* curr = nullptr;
+
+      public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
+        const_iterator() = default;
+
+        const_iterator(const node_t* curr)
+          : curr(curr)
+        {
+        }
+
+        reference operator*() const { return curr->item; }
+        pointer operator->() const { return &curr->item; }
+
+        const_iterator& operator++()
+        {
+            curr = curr->rest.get();
+            return *this;
+        }
+
+        const_iterator operator++(int)
+        {
+            const_iterator old = *this;
+            ++*this;
+            return old;
+        }
+
+        bool operator==(const const_iterator& other) const
+        {
+            return curr == other.curr;
+        }
+
+        bool operator!=(const const_iterator& other) const
+        {
+            return curr != other.curr;
+        }
+    };
+
+    const_iterator begin() const { return first.get(); }
+    const_iterator end() const { return nullptr; }
+
     friend std::ostream& operator<<(std::ostream& stream, plist& data)
     {
         stream << "(";
@@ -134,6 +465,15 @@ create_plist(Allocator* allocator, std::initializer_list<T> list)
     return plist<T, Allocator>::create(allocator, list);
 }
 
+// A persistent vector: a relaxed radix balanced tree of leaves holding up to
+// width items each, plus a tail leaf the last items go into until it fills.
+//
+// A node at level L (leaves are at level 0) has children holding up to
+// 1 << L items each. In a balanced node every child but the last is full, so
+// the child holding an index is found by shifting, as in a plain radix tree.
+// Concatenating and slicing leave relaxed nodes behind, whose children may
+// hold fewer; those carry a table of their children's running item counts
+// which lookups search instead. Vectors built by conj alone never have any.
 template<typename T, typename Allocator, size_t BITS = 5>
 struct pvec
 {
@@ -144,13 +484,13 @@ struct pvec
 
     using key_type = size_t;
 
-    enum class node_type
+    enum class node_type : uint8_t
     {
         internal = 0,
         leaf = 1
     };
 
-    class node_t
+    class node_t : public counted_node
     {
 
       protected:
@@ -163,9 +503,16 @@ struct pvec
         node_t(node_t& n) = default;
 
         node_type type;
-        size_t count = 0;
-        // std::thread::id editing_thread;
-        size_t editing_thread;
+        uint16_t count = 0;
+
+        static void destroy(node_t* n)
+        {
+            if (n->type == node_type::leaf) {
+                free_node<Allocator>(static_cast<leaf_node_t*>(n));
+            } else {
+                free_node<Allocator>(static_cast<internal_node_t*>(n));
+            }
+        }
 
         friend std::ostream& operator<<(std::ostream& stream, node_t& data)
         {
@@ -173,13 +520,12 @@ struct pvec
                 leaf_node_t* nodeptr = (leaf_node_t*)&data;
                 assert(nodeptr);
                 for (key_type i = 0; i < nodeptr->count; i++) {
-                    stream << nodeptr->values[i] << " ";
+                    stream << nodeptr->values()[i] << " ";
                 }
             } else {
                 internal_node_t* nodeptr = (internal_node_t*)&data;
                 assert(nodeptr);
                 for (key_type i = 0; i < nodeptr->count; ++i) {
-                    assert(nodeptr->children[i]);
                     stream << *(nodeptr->children[i]);
                 }
             }
@@ -187,35 +533,93 @@ struct pvec
         }
     };
 
-    typedef std::shared_ptr<node_t> node;
+    typedef node_ptr<node_t> node;
+
+    // running item counts of a relaxed node's children
+    struct size_table_t : counted_node
+    {
+        size_t sums[width];
+
+        static void destroy(size_table_t* table)
+        {
+            free_node<Allocator>(table);
+        }
+    };
+
+    typedef node_ptr<size_table_t> size_table;
 
+    // count is the number of children, which fill children from the front
     struct internal_node_t : node_t
     {
         using coll = std::array<node, width>;
 
         coll children;
+        // only set on relaxed nodes
+        size_table sizes;
 
         internal_node_t()
           : node_t(node_type::internal)
         {
-            children.fill(nullptr);
         }
     };
 
+    // Leaf items live in raw storage and only the first count of them are
+    // constructed, so making or copying a short leaf touches no more than it
+    // holds.
     struct leaf_node_t : node_t
     {
-        using coll = std::array<T, width>;
-
-        coll values;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type
+          storage[width];
 
         leaf_node_t()
           : node_t(node_type::leaf)
         {
         }
+
+        // holds the first n items of other
+        leaf_node_t(const leaf_node_t& other, size_t n)
+          : node_t(node_type::leaf)
+        {
+            append(other.values(), n);
+        }
+
+        leaf_node_t(const leaf_node_t&) = delete;
+
+        ~leaf_node_t()
+        {
+            for (size_t i = 0; i < this->count; ++i) {
+                values()[i].~T();
+            }
+        }
+
+        T* values() { return reinterpret_cast<T*>(storage); }
+        const T* values() const { return reinterpret_cast<const T*>(storage); }
+
+        void push(const T& item)
+        {
+            assert(this->count < width);
+            new (values() + this->count) T(item);
+            ++this->count;
+        }
+
+        void append(const T* items, size_t n)
+        {
+            assert(this->count + n <= width);
+            if (n == 0) {
+                return;
+            }
+            if (std::is_trivially_copyable<T>::value) {
+                std::memcpy(values() + this->count, items, n * sizeof(T));
+            } else {
+                std::uninitialized_copy(
+                  items, items + n, values() + this->count);
+            }
+            this->count += n;
+        }
     };
 
-    typedef std::shared_ptr<internal_node_t> internal_node;
-    typedef std::shared_ptr<leaf_node_t> leaf_node;
+    typedef node_ptr<internal_node_t> internal_node;
+    typedef node_ptr<leaf_node_t> leaf_node;
 
     using allocator = Allocator;
 
@@ -229,13 +633,13 @@ struct pvec
     static inline internal_node make_internal(allocator* _allocator)
     {
         assert(_allocator);
-        return alb::make_shared<internal_node_t>(*_allocator);
+        return make_node<internal_node_t>(_allocator);
     }
 
     static inline leaf_node make_leaf(allocator* _allocator)
     {
         assert(_allocator);
-        return alb::make_shared<leaf_node_t>(*_allocator);
+        return make_node<leaf_node_t>(_allocator);
     }
 
     pvec(size_t count,
@@ -262,491 +666,3134 @@ struct pvec
 
     static pvec create(allocator* allocator, std::initializer_list<T> list)
     {
-        tvec res{ allocator };
-        for (auto& item : list) {
-            res.conj(item);
-        }
-        pvec result = res.to_persistent();
-        return result;
+        return from_range(allocator, list.begin(), list.end());
     }
 
-    static leaf_node copy_leaf(allocator* _allocator, const leaf_node& node)
+    // * Bulk construction
+    //
+    // Leaves are filled straight from the source and the levels above them
+    // built bottom up, so n items cost their leaves and the few internal
+    // nodes over them rather than a path copy each.
+
+    // the vector of gen(0), gen(1), ..., gen(n - 1)
+    template<typename Gen>
+    static pvec from_sized(allocator* alloc, size_t n, Gen&& gen)
     {
-        leaf_node newnode = make_leaf(_allocator);
-        newnode->values = node->values;
-        newnode->count = node->count;
-        return newnode;
+        return build(
+          alloc, n, [&](leaf_node_t& leaf, size_t first, size_t count) {
+              for (size_t i = first; i < first + count; ++i) {
+                  leaf.push(gen(i));
+              }
+          });
     }
 
-    static internal_node copy_internal(allocator* _allocator,
-                                       const internal_node& node)
+    // the vector of the items in [first, last), which is walked once
+    template<typename Iter>
+    static pvec from_range(allocator* alloc, Iter first, Iter last)
     {
-        internal_node newnode = make_internal(_allocator);
-        newnode->children = node->children;
-        newnode->count = node->count;
-        return newnode;
+        size_t n = std::distance(first, last);
+        return build(alloc, n, [&](leaf_node_t& leaf, size_t, size_t count) {
+            fill_leaf(leaf, first, count);
+        });
     }
 
-    static inline internal_node copy_internal(allocator* _allocator,
-                                              const node& node)
+    template<typename Iter>
+    static void fill_leaf(leaf_node_t& leaf, Iter& first, size_t count)
     {
-        internal_node casted = std::static_pointer_cast<internal_node_t>(node);
-        return copy_internal(_allocator, casted);
+        for (size_t i = 0; i < count; ++i, ++first) {
+            leaf.push(*first);
+        }
     }
 
-    static inline leaf_node copy_leaf(allocator* _allocator, const node& node)
+    static void fill_leaf(leaf_node_t& leaf, const T*& first, size_t count)
     {
-        leaf_node casted = std::static_pointer_cast<leaf_node_t>(node);
-        return copy_leaf(_allocator, casted);
+        leaf.append(first, count);
+        first += count;
     }
 
-    node node_for(key_type key)
+    static void fill_leaf(leaf_node_t& leaf, T*& first, size_t count)
     {
-        if (key < this->count) {
-            if (key >= tail_offset()) {
-                return tail;
-            }
-            node curr_node = this->root;
-            for (size_t level = this->shift; level > 0; level -= bits) {
-                internal_node tmp =
-                  std::static_pointer_cast<internal_node_t>(curr_node);
-                curr_node = tmp->children[(key >> level) & index_mask];
-            }
-            return curr_node;
-        } else {
-            return nullptr;
-        }
+        leaf.append(first, count);
+        first += count;
     }
 
-    size_t tail_offset() const
+    // fill(leaf, first, count) pushes items first to first + count - 1
+    template<typename Fill>
+    static pvec build(allocator* alloc, size_t n, Fill&& fill)
     {
-        if (count < width) {
-            return 0;
-        } else {
-            return ((count - 1) >> bits) << bits;
+        size_t tail_start = n < width ? 0 : ((n - 1) >> bits) << bits;
+
+        std::vector<node> level;
+        level.reserve(tail_start >> bits);
+        for (size_t first = 0; first < tail_start; first += width) {
+            leaf_node leaf = make_leaf(alloc);
+            fill(*leaf, first, width);
+            level.push_back(std::move(leaf));
         }
+        leaf_node tail = make_leaf(alloc);
+        fill(*tail, tail_start, n - tail_start);
+        return from_leaves(alloc, std::move(level), std::move(tail));
     }
 
-    const T& nth(key_type key, const T& not_found)
+    // The vector of the full leaves in level followed by the items of tail.
+    // tail may be empty, in which case the last full leaf becomes the tail.
+    static pvec from_leaves(allocator* alloc,
+                            std::vector<node> level,
+                            leaf_node tail)
     {
-        leaf_node lookup_node =
-          std::static_pointer_cast<leaf_node_t>(node_for(key));
+        if (tail->count == 0 && !level.empty()) {
+            tail = static_node_cast<leaf_node_t>(std::move(level.back()));
+            level.pop_back();
+        }
+        size_t n = level.size() * width + tail->count;
+
+        // as deep as conj would have grown it
+        size_t shift = bits;
+        while (level.size() > (size_t(1) << shift)) {
+            shift += bits;
+        }
+        for (size_t depth = bits; depth <= shift; depth += bits) {
+            std::vector<node> parents;
+            parents.reserve((level.size() + width - 1) / width);
+            for (size_t i = 0; i < level.size(); i += width) {
+                internal_node parent = make_internal(alloc);
+                size_t end = std::min(level.size(), i + width);
+                for (size_t j = i; j < end; ++j) {
+                    parent->children[j - i] = std::move(level[j]);
+                }
+                parent->count = end - i;
+                parents.push_back(std::move(parent));
+            }
+            level = std::move(parents);
+        }
 
-        if (!lookup_node) {
-            return not_found;
+        internal_node root;
+        if (level.empty()) {
+            root = make_internal(alloc);
         } else {
-            return lookup_node->values[key & index_mask];
+            root = static_node_cast<internal_node_t>(std::move(level[0]));
         }
+        return { n, shift, std::move(root), std::move(tail), alloc };
     }
 
-    const T& nth(key_type key)
+
+    // a new leaf holding the first n items of node
+    static leaf_node copy_leaf(allocator* _allocator,
+                               const leaf_node_t& node,
+                               size_t n)
     {
-        leaf_node lookup_node =
-          std::static_pointer_cast<leaf_node_t>(node_for(key));
-        assert(lookup_node);
+        return make_node<leaf_node_t>(_allocator, node, n);
+    }
 
-        return lookup_node->values[key & index_mask];
+    static leaf_node copy_leaf(allocator* _allocator, const leaf_node& node)
+    {
+        return copy_leaf(_allocator, *node, node->count);
     }
 
-    bool key_exists(key_type key)
+    static internal_node copy_internal(allocator* _allocator,
+                                       const internal_node_t& node)
     {
-        leaf_node lookup_node =
-          std::static_pointer_cast<leaf_node_t>(node_for(key));
+        internal_node newnode = make_internal(_allocator);
+        std::copy(node.children.begin(),
+                  node.children.begin() + node.count,
+                  newnode->children.begin());
+        newnode->count = node.count;
+        newnode->sizes = node.sizes;
+        return newnode;
+    }
 
-        return static_cast<bool>(lookup_node);
+    static internal_node copy_internal(allocator* _allocator,
+                                       const internal_node& node)
+    {
+        return copy_internal(_allocator, *node);
     }
 
-    static node new_path(size_t level, node to_node, allocator* _allocator)
+    // a new table holding the first n sums of table
+    static size_table copy_sizes(allocator* _allocator,
+                                 const size_table_t& table,
+                                 size_t n)
     {
-        if (level == 0)
-            return to_node;
-        internal_node new_node = make_internal(_allocator);
-        new_node->children[0] = new_path(level - bits, to_node, _allocator);
-        return new_node;
+        size_table newtable = make_node<size_table_t>(_allocator);
+        std::copy(table.sums, table.sums + n, newtable->sums);
+        return newtable;
     }
 
-    internal_node push_tail(size_t level, internal_node parent, leaf_node tail)
+    static internal_node_t* as_internal(const node& n)
     {
-        size_t subidx = ((count - 1) >> level) & index_mask;
-        internal_node ret = copy_internal(_allocator, parent);
-        node to_insert;
-        if (level == bits) {
-            to_insert = tail;
-        } else {
-            assert(parent->type == node_type::internal);
-            internal_node child = std::static_pointer_cast<internal_node_t>(
-              parent->children[subidx]);
+        return static_cast<internal_node_t*>(n.get());
+    }
 
-            if (child) {
-                to_insert = push_tail(level - bits, child, tail);
-            } else {
-                to_insert = new_path(level - bits, tail, _allocator);
-            }
-        }
-        ret->children[subidx] = to_insert;
-        return ret;
+    // whether the transient edit may change n in place: only while it is
+    // live, and only when nothing but the node being changed holds n. A copy
+    // holds the children of what it copied, so below a shared node nothing
+    // is editable.
+    static bool editable(const node_t* n, uint64_t edit)
+    {
+        return edit != 0 && n->refs == 1;
     }
 
-    node do_assoc(size_t level, node parent, key_type key, T item)
+    // n, or a copy of it that edit may change
+    static internal_node editable_internal(allocator* _allocator,
+                                           uint64_t edit,
+                                           const internal_node_t* n)
     {
-        if (level == 0) {
-            leaf_node ret = copy_leaf(_allocator, parent);
-            ret->values[key & index_mask] = item;
-            return ret;
-        } else {
-            internal_node ret = copy_internal(_allocator, parent);
-            key_type subindex = (key >> level) & index_mask;
-            ret->children[subindex] =
-              do_assoc(level - bits,
-                       std::static_pointer_cast<internal_node_t>(parent)
-                         ->children[subindex],
-                       key,
-                       item);
-            return ret;
+        if (editable(n, edit)) {
+            return internal_node(const_cast<internal_node_t*>(n));
         }
+        return copy_internal(_allocator, *n);
     }
 
-    std::experimental::optional<pvec> assoc(key_type key, T item)
+    static leaf_node editable_leaf(allocator* _allocator,
+                                   uint64_t edit,
+                                   const leaf_node_t* n)
     {
-        if (key >= 0 && key < count) {
-            if (key >= tail_offset()) {
-                leaf_node newtail = copy_leaf(_allocator, this->tail);
-                newtail->values[key & index_mask] = item;
-
-                pvec newvec{ count, shift, this->root, newtail, _allocator };
-                return newvec;
-            } else {
-                pvec newvec{ count,
-                             shift,
-                             std::static_pointer_cast<internal_node_t>(
-                               do_assoc(shift, root, key, item)),
-                             tail,
-                             _allocator };
-                return newvec;
-            }
-        } else if (key == count) {
-            return conj(item);
-        } else {
-            return {};
+        if (editable(n, edit)) {
+            return leaf_node(const_cast<leaf_node_t*>(n));
         }
+        return copy_leaf(_allocator, *n, n->count);
     }
 
-    pvec conj(T item)
+    static leaf_node_t* as_leaf(const node& n)
     {
+        return static_cast<leaf_node_t*>(n.get());
+    }
 
-        size_t i = count;
-
-        pvec newvec{ *this };
-        // is space in tail
-        if (i - tail_offset() < width) {
-            if (!this->tail) {
-                newvec.tail = make_leaf(_allocator);
-            } else {
-                newvec.tail = copy_leaf(_allocator, this->tail);
-            }
-
-            newvec.tail->values[newvec.tail->count] = item;
-            newvec.tail->count++;
-            newvec.count++;
-
-            return newvec;
-        } else {
-            internal_node newroot;
-            size_t newshift = shift;
-            // check for root overflow
-            if ((count >> bits) > (1u << shift)) {
-                newroot = make_internal(_allocator);
+    size_t tail_offset() const { return tail ? count - tail->count : 0; }
 
-                newroot->children[0] = root;
-                newroot->children[1] = new_path(shift, tail, _allocator);
+    // * Tree shape
 
-                newshift += 5;
+    // items a node at level can hold
+    static size_t capacity(size_t level) { return width << level; }
 
-            } else {
-                newroot = push_tail(shift, root, tail);
+    // items under the node n at level
+    static size_t subtree_size(const node_t* n, size_t level)
+    {
+        size_t size = 0;
+        while (level > 0) {
+            auto internal = static_cast<const internal_node_t*>(n);
+            if (internal->count == 0) {
+                return size;
             }
-
-            leaf_node newtail = make_leaf(_allocator);
-            newtail->values[0] = item;
-            newtail->count++;
-
-            newvec.tail = newtail;
-            newvec.count++;
-
-            newvec.root = newroot;
-
-            newvec.shift = newshift;
-
-            return newvec;
+            if (internal->sizes) {
+                return size + internal->sizes->sums[internal->count - 1];
+            }
+            size += (size_t(internal->count) - 1) << level;
+            n = internal->children[internal->count - 1].get();
+            level -= bits;
         }
+        return size + n->count;
     }
 
-    pvec pop()
+    // the child of n at level holding index, which becomes the index within
+    // that child
+    static size_t child_for(const internal_node_t* n,
+                            size_t level,
+                            size_t& index)
     {
-        if (count == 0) {
-            throw std::runtime_error("Cannot pop an empty vector!");
+        if (!n->sizes) {
+            size_t slot = (index >> level) & index_mask;
+            index &= (size_t(1) << level) - 1;
+            return slot;
         }
-        if (count == 1) {
-            return { _allocator };
+        // children hold at most 1 << level items, so none before this one
+        // can hold index
+        size_t slot = index >> level;
+        const size_t* sums = n->sizes->sums;
+        while (sums[slot] <= index) {
+            ++slot;
         }
-        if (count - tail_offset() > 1) {
-            leaf_node newtail = make_leaf(_allocator);
-            std::copy(this->tail->values.begin(),
-                      this->tail->values.begin() + this->tail->count - 1,
-                      newtail->values.begin());
-            newtail->count = this->tail->count - 1;
-            return { count - 1, shift, root, newtail, _allocator };
+        if (slot > 0) {
+            index -= sums[slot - 1];
         }
-        auto newtail =
-          std::static_pointer_cast<leaf_node_t>(node_for(count - 2));
+        return slot;
+    }
 
-        internal_node newroot = pop_tail(shift, root);
-        size_t newshift = shift;
-        if (!newroot) {
-            newroot = make_internal(_allocator);
+    // Gives n, whose children are in place, a size table unless it is
+    // balanced.
+    static internal_node finish(allocator* _allocator,
+                                internal_node n,
+                                size_t level)
+    {
+        size_t child_level = level - bits;
+        size_t full = capacity(child_level);
+        bool balanced = true;
+        for (size_t i = 0; i + 1 < n->count && balanced; ++i) {
+            balanced = subtree_size(n->children[i].get(), child_level) == full;
         }
-        if (shift > bits && !newroot->children[1]) {
-            newroot =
-              std::static_pointer_cast<internal_node_t>(newroot->children[0]);
-            newshift -= bits;
+        if (balanced) {
+            n->sizes = nullptr;
+            return n;
         }
-        return { count - 1, newshift, newroot, newtail, _allocator };
+        size_table table = make_node<size_table_t>(_allocator);
+        size_t sum = 0;
+        for (size_t i = 0; i < n->count; ++i) {
+            sum += subtree_size(n->children[i].get(), child_level);
+            table->sums[i] = sum;
+        }
+        n->sizes = std::move(table);
+        return n;
     }
 
-    internal_node pop_tail(size_t level, internal_node node)
+    // * Borrowed reads
+    //
+    // Lookups walk raw node pointers. The vector holds its root and tail, and
+    // through them every node below, so nothing on the way down needs its
+    // count touched; what they return lives as long as the vector does.
+
+    // the leaf holding key and key's offset in it
+    leaf_node_t* leaf_for(key_type key, size_t& offset) const
     {
-        key_type subidx = ((count - 2) >> level) & index_mask;
-        if (level > bits) {
-            internal_node newchild =
-              pop_tail(level - bits,
-                       std::static_pointer_cast<internal_node_t>(
-                         node->children[subidx]));
-            if (!newchild && subidx == 0) {
-                return nullptr;
-            } else {
-                auto ret = copy_internal(_allocator, node);
-                ret->children[subidx] = newchild;
-                return ret;
-            }
-        } else if (subidx == 0) {
+        if (key >= count) {
             return nullptr;
-        } else {
-            auto ret = copy_internal(_allocator, node);
-            ret->children[subidx] = nullptr;
-            return ret;
         }
+        size_t tail_start = tail_offset();
+        if (key >= tail_start) {
+            offset = key - tail_start;
+            return tail.get();
+        }
+        const internal_node_t* n = root.get();
+        for (size_t level = shift; level > bits; level -= bits) {
+            n = as_internal(n->children[child_for(n, level, key)]);
+        }
+        leaf_node_t* leaf = as_leaf(n->children[child_for(n, bits, key)]);
+        offset = key;
+        return leaf;
     }
 
-    friend std::ostream& operator<<(std::ostream& stream, pvec& data)
+    const T* find(key_type key) const
     {
+        size_t offset;
+        leaf_node_t* leaf = leaf_for(key, offset);
+        return leaf ? &leaf->values()[offset] : nullptr;
+    }
 
-        stream << "[";
-        if (data.root) {
-            stream << *data.root;
-        }
+    const T& get(key_type key, const T& not_found) const
+    {
+        const T* found = find(key);
+        return found ? *found : not_found;
+    }
 
-        if (data.tail) {
-            stream << *data.tail;
-        }
+    const T& nth(key_type key, const T& not_found) const
+    {
+        return get(key, not_found);
+    }
 
-        return stream << "]";
+    const T& nth(key_type key) const
+    {
+        const T* found = find(key);
+        assert(found);
+        return *found;
     }
 
-    struct tvec
+    bool key_exists(key_type key) const { return key < count; }
+
+    // * Iteration
+    //
+    // Items sit in runs of up to width in their leaves. Iterators keep the
+    // run they are in and only walk the tree again when they leave it, and
+    // for_each_chunk hands out whole runs for loops that want plain arrays.
+
+    struct chunk
     {
+        const T* first;
         size_t count;
-        size_t shift;
-        internal_node root;
-        leaf_node tail;
 
-        allocator* _allocator;
+        const T* begin() const { return first; }
+        const T* end() const { return first + count; }
+    };
 
-        tvec(size_t count,
-             size_t shift,
-             internal_node root,
-             leaf_node tail,
-             allocator* _allocator)
-          : count(count)
-          , shift(shift)
-          , root(root)
-          , tail(tail)
-          , _allocator(_allocator)
-        {
-            enable_editing_from_current_thread(root);
+    // the items from key to the end of its leaf; empty past the end
+    chunk chunk_from(key_type key) const
+    {
+        size_t offset;
+        leaf_node_t* leaf = leaf_for(key, offset);
+        if (!leaf) {
+            return { nullptr, 0 };
         }
+        return { leaf->values() + offset, leaf->count - offset };
+    }
 
-        tvec(allocator* _allocator)
-          : tvec(0,
-                 bits,
-                 make_internal(_allocator),
-                 make_leaf(_allocator),
-                 _allocator)
-        {
+    // calls func with every leaf's run of items, in order
+    template<typename Func>
+    void for_each_chunk(Func&& func) const
+    {
+        for (key_type key = 0; key < count;) {
+            chunk run = chunk_from(key);
+            func(run);
+            key += run.count;
         }
+    }
 
-        tvec(const pvec& v)
-          : tvec(v.count,
-                 v.shift,
-                 copy_internal(v._allocator, v.root),
-                 copy_leaf(v._allocator, v.tail),
-                 v._allocator)
+    class const_iterator
+    {
+        const pvec* vec = nullptr;
+        key_type index = 0;
+        // the run index is in
+        const T* run_first = nullptr;
+        const T* run_last = nullptr;
+        const T* curr = nullptr;
+
+        void seek(key_type key)
         {
+            index = key;
+            chunk run = vec->chunk_from(key);
+            run_first = curr = run.first;
+            run_last = run.first + run.count;
         }
 
-        static void enable_editing_from_current_thread(node n)
+      public:
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
+        const_iterator() = default;
+
+        const_iterator(const pvec* vec, key_type key)
+          : vec(vec)
         {
-            // n->editing_thread = std::this_thread::get_id();
-            n->editing_thread =
-              std::hash<std::thread::id>()(std::this_thread::get_id());
+            seek(key);
         }
 
-        void ensure_editable() { ensure_editable(root); }
+        reference operator*() const { return *curr; }
+        pointer operator->() const { return curr; }
+        reference operator[](difference_type n) const { return *(*this + n); }
 
-        void ensure_editable(node n)
+        const_iterator& operator++()
         {
-            assert(n);
-            auto curthrd =
-              std::hash<std::thread::id>()(std::this_thread::get_id());
-            auto nthrd = n->editing_thread;
-            if (nthrd == 0) {
-                std::cout << "Editing for node is disabled!\n";
-                abort();
+            ++index;
+            if (++curr == run_last) {
+                seek(index);
             }
-            if (curthrd != nthrd) {
-                std::cout << "Tried editing from " << curthrd
-                          << " editing only allowed from thread: " << nthrd
-                          << "\n";
-                abort();
-            }
-            assert(n->editing_thread == curthrd);
+            return *this;
         }
 
-        void disable_edit() { root->editing_thread = 0; }
+        const_iterator operator++(int)
+        {
+            const_iterator old = *this;
+            ++*this;
+            return old;
+        }
 
-        size_t tail_offset() const
+        const_iterator& operator--()
         {
-            if (count < width) {
-                return 0;
+            if (curr != run_first) {
+                --curr;
+                --index;
+            } else {
+                seek(index - 1);
             }
-            return ((count - 1) >> bits) << 5;
+            return *this;
         }
 
-        pvec to_persistent()
+        const_iterator operator--(int)
         {
-            ensure_editable();
+            const_iterator old = *this;
+            --*this;
+            return old;
+        }
 
-            disable_edit();
-            leaf_node trimmed_tail = make_leaf(_allocator);
-            std::copy(tail->values.begin(),
-                      tail->values.begin() + (count - tail_offset()),
-                      trimmed_tail->values.begin());
-            trimmed_tail->count = tail->count;
-            return { count, shift, root, trimmed_tail, _allocator };
+        const_iterator& operator+=(difference_type n)
+        {
+            seek(index + n);
+            return *this;
         }
 
-        tvec& conj(T item)
+        const_iterator& operator-=(difference_type n)
         {
-            ensure_editable();
+            seek(index - n);
+            return *this;
+        }
 
-            size_t i = count;
+        const_iterator operator+(difference_type n) const
+        {
+            const_iterator result = *this;
+            return result += n;
+        }
 
-            // room in tail?
-            if (i - tail_offset() < width) {
-                tail->values[i & index_mask] = item;
-                ++tail->count;
-                ++this->count;
-                return *this;
-            }
+        friend const_iterator operator+(difference_type n,
+                                        const const_iterator& it)
+        {
+            return it + n;
+        }
 
-            // full tail, push into tree
-            internal_node newroot;
-            leaf_node old_tail = tail;
-            tail = make_leaf(_allocator);
-            tail->values[0] = item;
+        const_iterator operator-(difference_type n) const
+        {
+            const_iterator result = *this;
+            return result -= n;
+        }
 
-            size_t newshift = shift;
+        difference_type operator-(const const_iterator& other) const
+        {
+            return difference_type(index) - difference_type(other.index);
+        }
 
-            // check root full
-            if ((count >> bits) > (1u << shift)) {
-                newroot = make_internal(_allocator);
-                newroot->children[0] = root;
-                newroot->children[1] = new_path(shift, old_tail, _allocator);
-                newroot->count = 2;
-                newshift += 5;
-            } else {
-                newroot = push_tail(shift, root, old_tail);
-            }
-            root->editing_thread = 0;
-            root = newroot;
-            enable_editing_from_current_thread(root);
-            shift = newshift;
-            ++count;
-            return *this;
+        bool operator==(const const_iterator& other) const
+        {
+            return index == other.index;
         }
 
-        tvec& assoc(key_type key, const T& item) { return assoc_n(key, item); }
+        bool operator!=(const const_iterator& other) const
+        {
+            return index != other.index;
+        }
 
-        tvec& assoc_n(key_type i, const T& item)
+        bool operator<(const const_iterator& other) const
         {
-            if (i < count) {
-                if (i >= tail_offset()) {
-                    tail->values[i & index_mask] = item;
-                    return *this;
-                }
-                root = std::static_pointer_cast<internal_node_t>(
-                  do_assoc(shift, root, i, item));
-                return *this;
+            return index < other.index;
+        }
+
+        bool operator>(const const_iterator& other) const
+        {
+            return index > other.index;
+        }
+
+        bool operator<=(const const_iterator& other) const
+        {
+            return index <= other.index;
+        }
+
+        bool operator>=(const const_iterator& other) const
+        {
+            return index >= other.index;
+        }
+    };
+
+    const_iterator begin() const { return { this, 0 }; }
+    const_iterator end() const { return { this, count }; }
+
+    // * Parallel operations
+    //
+    // reduce walks the leaves in order on the calling thread. fold, map and
+    // filter cut the tree into pieces, whole subtrees of at most
+    // parallel_grain items plus the tail, and run them on the shared
+    // work_pool once there are more than parallel_grain items in all. Its
+    // threads read the tree through raw pointers, so no shared node's count
+    // is touched, and nodes they build come from their own pools. The
+    // functions passed in run on several threads at once.
+
+    static constexpr size_t parallel_grain = size_t(1) << 15;
+
+    struct piece
+    {
+        const node_t* n;
+        size_t level;
+    };
+
+    // items under child i of n, a node at level holding size items
+    static size_t child_size(const internal_node_t* n,
+                             size_t level,
+                             size_t size,
+                             size_t i)
+    {
+        if (n->sizes) {
+            return n->sizes->sums[i] - (i > 0 ? n->sizes->sums[i - 1] : 0);
+        }
+        // every child but the last is full
+        return i + 1 < n->count ? size_t(1) << level : size - (i << level);
+    }
+
+    // n at level, holding size items, as pieces of at most grain items
+    static void split(const node_t* n,
+                      size_t level,
+                      size_t size,
+                      size_t grain,
+                      std::vector<piece>& pieces)
+    {
+        if (level == 0 || size <= grain) {
+            pieces.push_back({ n, level });
+            return;
+        }
+        auto internal = static_cast<const internal_node_t*>(n);
+        for (size_t i = 0; i < internal->count; ++i) {
+            split(internal->children[i].get(),
+                  level - bits,
+                  child_size(internal, level, size, i),
+                  grain,
+                  pieces);
+        }
+    }
+
+    // the pieces of the tree, then the tail
+    std::vector<piece> pieces(size_t grain) const
+    {
+        std::vector<piece> result;
+        split(root.get(), shift, tail_offset(), grain, result);
+        if (tail) {
+            result.push_back({ tail.get(), 0 });
+        }
+        return result;
+    }
+
+    // calls func(i) for each of n pieces, on the pool when the vector is
+    // big enough to be worth handing to other threads
+    template<typename Func>
+    void for_each_piece(size_t n, Func&& func) const
+    {
+        if (n == 1 || count <= parallel_grain) {
+            for (size_t i = 0; i < n; ++i) {
+                func(i);
             }
-            if (i == count) {
-                return conj(item);
+            return;
+        }
+        work_pool::shared().for_range(n, 1, [&](size_t first, size_t last) {
+            for (size_t i = first; i < last; ++i) {
+                func(i);
             }
-            throw std::runtime_error("Index not found in transient vector!");
+        });
+    }
+
+    // calls func with every leaf under n at level, in order
+    template<typename Func>
+    static void each_leaf(const node_t* n, size_t level, Func& func)
+    {
+        if (level == 0) {
+            func(*static_cast<const leaf_node_t*>(n));
+            return;
         }
+        auto internal = static_cast<const internal_node_t*>(n);
+        for (size_t i = 0; i < internal->count; ++i) {
+            each_leaf(internal->children[i].get(), level - bits, func);
+        }
+    }
 
-        node do_assoc(size_t level, node node, size_t i, const T& item)
-        {
-            if (level == 0) {
-                leaf_node nodeptr = std::static_pointer_cast<leaf_node_t>(node);
-                nodeptr->values[i & index_mask] = item;
-            } else {
-                size_t subidx = (i >> level) & index_mask;
-                internal_node nodeptr =
-                  std::static_pointer_cast<internal_node_t>(node);
-                nodeptr->children[subidx] =
-                  do_assoc(level - bits, nodeptr->children[subidx], i, item);
+    // f(acc, item) over the items in order, starting from init
+    template<typename R, typename F>
+    R reduce(R init, F f) const
+    {
+        auto step = [&](const leaf_node_t& leaf) {
+            for (size_t i = 0; i < leaf.count; ++i) {
+                init = f(std::move(init), leaf.values()[i]);
             }
-            return node;
+        };
+        each_leaf(root.get(), shift, step);
+        if (tail) {
+            step(*tail);
         }
+        return init;
+    }
 
-        internal_node push_tail(size_t level,
-                                internal_node parent,
-                                leaf_node tailnode)
-        {
-            ensure_editable();
+    // Reduces the pieces side by side with reducef(acc, item), each from
+    // identity, and joins their results in order with combinef(left,
+    // right). Grouping the items differently must not change the result,
+    // as it does not for + and 0.
+    template<typename R, typename Reduce, typename Combine>
+    R fold(const R& identity, Reduce reducef, Combine combinef) const
+    {
+        std::vector<piece> parts = pieces(parallel_grain);
+        std::vector<std::experimental::optional<R>> results(parts.size());
+        for_each_piece(parts.size(), [&](size_t i) {
+            R acc = identity;
+            auto step = [&](const leaf_node_t& leaf) {
+                for (size_t j = 0; j < leaf.count; ++j) {
+                    acc = reducef(std::move(acc), leaf.values()[j]);
+                }
+            };
+            each_leaf(parts[i].n, parts[i].level, step);
+            results[i] = std::move(acc);
+        });
+        R acc = identity;
+        for (auto& result : results) {
+            acc = combinef(std::move(acc), std::move(*result));
+        }
+        return acc;
+    }
 
-            size_t subidx = ((count - 1) >> level) & index_mask;
-            internal_node ret = parent;
-            node to_insert;
-            if (level == bits) {
-                to_insert = tailnode;
-            } else {
-                assert(parent->type == node_type::internal);
-                internal_node child = std::static_pointer_cast<internal_node_t>(
-                  parent->children[subidx]);
+    // fold with f both reducing and combining, as for sums
+    template<typename F>
+    T fold(const T& identity, F f) const
+    {
+        return fold(identity, f, f);
+    }
 
-                if (child) {
-                    to_insert = push_tail(level - bits, child, tailnode);
-                } else {
-                    to_insert = new_path(level - bits, tailnode, _allocator);
+    // The vector of f(item) for every item, shaped like this one: each
+    // piece is mapped on its own, and the nodes above the pieces are copied
+    // over the results.
+    template<typename F,
+             typename U = typename std::decay<decltype(
+               std::declval<F&>()(std::declval<const T&>()))>::type>
+    pvec<U, Allocator, BITS> map(F f) const
+    {
+        typedef pvec<U, Allocator, BITS> result;
+        std::vector<piece> parts = pieces(parallel_grain);
+        std::vector<typename result::node> built(parts.size());
+        for_each_piece(parts.size(), [&](size_t i) {
+            built[i] =
+              map_node<result>(_allocator, parts[i].n, parts[i].level, f);
+        });
+
+        typename result::leaf_node newtail;
+        if (tail) {
+            newtail = static_node_cast<typename result::leaf_node_t>(
+              std::move(built.back()));
+        }
+        size_t next = 0;
+        typename result::node newroot = mirror<result>(
+          _allocator, root.get(), shift, tail_offset(), built, next);
+        return { count,
+                 shift,
+                 static_node_cast<typename result::internal_node_t>(
+                   std::move(newroot)),
+                 std::move(newtail),
+                 _allocator };
+    }
+
+    // n at level with f applied to each item, as a node of the vector R
+    template<typename R, typename F>
+    static typename R::node map_node(allocator* alloc,
+                                     const node_t* n,
+                                     size_t level,
+                                     F& f)
+    {
+        if (level == 0) {
+            auto leaf = static_cast<const leaf_node_t*>(n);
+            typename R::leaf_node out = R::make_leaf(alloc);
+            for (size_t i = 0; i < leaf->count; ++i) {
+                out->push(f(leaf->values()[i]));
+            }
+            return out;
+        }
+        auto internal = static_cast<const internal_node_t*>(n);
+        typename R::internal_node out = R::make_internal(alloc);
+        for (size_t i = 0; i < internal->count; ++i) {
+            out->children[i] =
+              map_node<R>(alloc, internal->children[i].get(), level - bits, f);
+        }
+        out->count = internal->count;
+        mirror_sizes<R>(alloc, *internal, *out);
+        return out;
+    }
+
+    // The nodes split put above the pieces of n, at level and holding size
+    // items, copied over the results for those pieces, which are taken from
+    // built in order.
+    template<typename R>
+    static typename R::node mirror(allocator* alloc,
+                                   const node_t* n,
+                                   size_t level,
+                                   size_t size,
+                                   std::vector<typename R::node>& built,
+                                   size_t& next)
+    {
+        if (level == 0 || size <= parallel_grain) {
+            return std::move(built[next++]);
+        }
+        auto internal = static_cast<const internal_node_t*>(n);
+        typename R::internal_node out = R::make_internal(alloc);
+        for (size_t i = 0; i < internal->count; ++i) {
+            out->children[i] = mirror<R>(alloc,
+                                         internal->children[i].get(),
+                                         level - bits,
+                                         child_size(internal, level, size, i),
+                                         built,
+                                         next);
+        }
+        out->count = internal->count;
+        mirror_sizes<R>(alloc, *internal, *out);
+        return out;
+    }
+
+    // gives out, whose children mirror those of n, a copy of n's sizes
+    template<typename R>
+    static void mirror_sizes(allocator* alloc,
+                             const internal_node_t& n,
+                             typename R::internal_node_t& out)
+    {
+        if (n.sizes) {
+            auto table = make_node<typename R::size_table_t>(alloc);
+            std::copy(n.sizes->sums, n.sizes->sums + n.count, table->sums);
+            out.sizes = std::move(table);
+        }
+    }
+
+    // The items pred holds for, in order. Each piece packs what it keeps
+    // into full leaves of a vector of its own, and those are concatenated.
+    template<typename Pred>
+    pvec filter(Pred pred) const
+    {
+        std::vector<piece> parts = pieces(parallel_grain);
+        std::vector<std::experimental::optional<pvec>> kept(parts.size());
+        for_each_piece(parts.size(), [&](size_t i) {
+            std::vector<node> leaves;
+            leaf_node current = make_leaf(_allocator);
+            auto step = [&](const leaf_node_t& leaf) {
+                for (size_t j = 0; j < leaf.count; ++j) {
+                    const T& item = leaf.values()[j];
+                    if (!pred(item)) {
+                        continue;
+                    }
+                    if (current->count == width) {
+                        leaves.push_back(std::move(current));
+                        current = make_leaf(_allocator);
+                    }
+                    current->push(item);
                 }
+            };
+            each_leaf(parts[i].n, parts[i].level, step);
+            kept[i] =
+              from_leaves(_allocator, std::move(leaves), std::move(current));
+        });
+        pvec out(_allocator);
+        for (auto& part : kept) {
+            out = out.concat(*part);
+        }
+        return out;
+    }
+
+
+    // * Updates
+    //
+    // Each of these copies the path down to what it changes and shares the
+    // rest of the tree with the vector it started from. Given the edit of a
+    // live transient, they change the nodes only it holds in place instead.
+
+    // a node at level over nothing but to_node
+    static node new_path(size_t level, node to_node, allocator* _allocator)
+    {
+        if (level == 0)
+            return to_node;
+        internal_node new_node = make_internal(_allocator);
+        new_node->children[0] = new_path(level - bits, to_node, _allocator);
+        new_node->count = 1;
+        return new_node;
+    }
+
+    // parent at level with leaf added after its last item, or null when
+    // there is no room for it
+    static internal_node push_tail(allocator* _allocator,
+                                   size_t level,
+                                   const internal_node_t* parent,
+                                   leaf_node leaf,
+                                   uint64_t edit = 0)
+    {
+        size_t slot = parent->count;
+        node child;
+        if (level > bits && slot > 0) {
+            // parent is only copied below, and a child held by a shared
+            // parent is shared too
+            child = push_tail(_allocator,
+                              level - bits,
+                              as_internal(parent->children[slot - 1]),
+                              leaf,
+                              editable(parent, edit) ? edit : 0);
+            if (child) {
+                --slot;
             }
-            ret->children[subidx] = to_insert;
+        }
+        if (!child) {
+            if (parent->count == width) {
+                return nullptr;
+            }
+            child = new_path(level - bits, leaf, _allocator);
+        }
+
+        // read before ret, which may be parent itself, changes
+        size_t count = parent->count;
+        bool appended = slot == count;
+        size_t old = 0;
+        if (parent->sizes) {
+            size_t before = slot > 0 ? parent->sizes->sums[slot - 1] : 0;
+            old = appended ? before : parent->sizes->sums[slot];
+        }
+
+        internal_node ret = editable_internal(_allocator, edit, parent);
+        ret->children[slot] = std::move(child);
+        if (appended) {
             ++ret->count;
+        }
+        if (ret->sizes) {
+            if (ret->sizes->refs > 1) {
+                ret->sizes = copy_sizes(_allocator, *ret->sizes, count);
+            }
+            ret->sizes->sums[slot] = old + leaf->count;
+        } else if (appended && slot > 0 &&
+                   subtree_size(ret->children[slot - 1].get(),
+                                level - bits) != capacity(level - bits)) {
+            // the child before the new one is not full
+            return finish(_allocator, std::move(ret), level);
+        }
+        return ret;
+    }
+
+    // root with leaf added after its last item, growing the tree a level
+    // when the root is out of room
+    static internal_node push_leaf(allocator* _allocator,
+                                   const internal_node& root,
+                                   size_t& shift,
+                                   leaf_node leaf,
+                                   uint64_t edit = 0)
+    {
+        internal_node newroot =
+          push_tail(_allocator, shift, root.get(), leaf, edit);
+        if (newroot) {
+            return newroot;
+        }
+        newroot = make_internal(_allocator);
+        newroot->children[0] = root;
+        newroot->children[1] = new_path(shift, std::move(leaf), _allocator);
+        newroot->count = 2;
+        shift += bits;
+        return finish(_allocator, std::move(newroot), shift);
+    }
+
+    // n at level with the leaf holding index holding item there instead
+    static node do_assoc(allocator* _allocator,
+                         size_t level,
+                         const node& n,
+                         key_type index,
+                         const T& item,
+                         uint64_t edit = 0)
+    {
+        if (level == 0) {
+            leaf_node ret = editable_leaf(_allocator, edit, as_leaf(n));
+            ret->values()[index] = item;
             return ret;
         }
+        internal_node ret = editable_internal(_allocator, edit, as_internal(n));
+        size_t slot = child_for(ret.get(), level, index);
+        ret->children[slot] = do_assoc(
+          _allocator, level - bits, ret->children[slot], index, item, edit);
+        return ret;
+    }
+
+    std::experimental::optional<pvec> assoc(key_type key, T item) const
+    {
+        if (key < count) {
+            if (key >= tail_offset()) {
+                leaf_node newtail = copy_leaf(_allocator, this->tail);
+                newtail->values()[key - tail_offset()] = item;
+
+                pvec newvec{ count, shift, this->root, newtail, _allocator };
+                return newvec;
+            } else {
+                pvec newvec{ count,
+                             shift,
+                             static_node_cast<internal_node_t>(
+                               do_assoc(_allocator, shift, root, key, item)),
+                             tail,
+                             _allocator };
+                return newvec;
+            }
+        } else if (key == count) {
+            return conj(item);
+        } else {
+            return {};
+        }
+    }
+
+    pvec conj(T item) const
+    {
+        pvec newvec{ *this };
+        // is space in tail
+        if (!this->tail || this->tail->count < width) {
+            if (!this->tail) {
+                newvec.tail = make_leaf(_allocator);
+            } else {
+                newvec.tail = copy_leaf(_allocator, this->tail);
+            }
+
+            newvec.tail->push(item);
+            newvec.count++;
+
+            return newvec;
+        } else {
+            newvec.root = push_leaf(_allocator, root, newvec.shift, tail);
+
+            leaf_node newtail = make_leaf(_allocator);
+            newtail->push(item);
+
+            newvec.tail = newtail;
+            newvec.count++;
+
+            return newvec;
+        }
+    }
+
+    pvec pop() const
+    {
+        if (count == 0) {
+            throw std::runtime_error("Cannot pop an empty vector!");
+        }
+        if (count == 1) {
+            return { _allocator };
+        }
+        if (this->tail->count > 1) {
+            leaf_node newtail =
+              copy_leaf(_allocator, *this->tail, this->tail->count - 1);
+            return { count - 1, shift, root, newtail, _allocator };
+        }
+        // the last leaf of the tree becomes the tail
+        size_t offset;
+        leaf_node newtail{ leaf_for(count - 2, offset) };
+
+        internal_node newroot =
+          pop_tail(_allocator, shift, root.get(), newtail->count);
+        size_t newshift = shift;
+        if (!newroot) {
+            newroot = make_internal(_allocator);
+            newshift = bits;
+        }
+        collapse(newroot, newshift);
+        return { count - 1, newshift, newroot, newtail, _allocator };
+    }
+
+    // n at level without its last leaf, which holds removed items, or null
+    // when that leaves it empty
+    static internal_node pop_tail(allocator* _allocator,
+                                  size_t level,
+                                  const internal_node_t* n,
+                                  size_t removed)
+    {
+        size_t last = n->count - 1;
+        internal_node child;
+        if (level > bits) {
+            child = pop_tail(_allocator,
+                             level - bits,
+                             as_internal(n->children[last]),
+                             removed);
+        }
+        if (!child && last == 0) {
+            return nullptr;
+        }
+        internal_node ret = copy_internal(_allocator, *n);
+        if (child) {
+            ret->children[last] = std::move(child);
+            if (n->sizes) {
+                ret->sizes = copy_sizes(_allocator, *n->sizes, n->count);
+                ret->sizes->sums[last] -= removed;
+            }
+        } else {
+            ret->children[last] = nullptr;
+            --ret->count;
+        }
+        return ret;
+    }
+
+    // drops roots over a single child
+    static void collapse(internal_node& root, size_t& shift)
+    {
+        while (shift > bits && root->count == 1) {
+            root = static_node_cast<internal_node_t>(root->children[0]);
+            shift -= bits;
+        }
+    }
+
+    // * Splicing
+    //
+    // Concatenation merges the right edge of one tree with the left edge of
+    // the other, level by level, and repacks only the nodes along that seam;
+    // slicing copies the paths down to its two ends. Both touch O(log n)
+    // nodes, so inserting or removing in the middle does as well.
+
+    // the items of this followed by those of other
+    pvec concat(const pvec& other) const
+    {
+        if (other.count == 0) {
+            return *this;
+        }
+        if (count == 0) {
+            return other;
+        }
+        if (other.tail_offset() == 0) {
+            // other is only a tail
+            tvec result{ *this };
+            for (const T& item : other) {
+                result.conj(item);
+            }
+            return result.to_persistent();
+        }
+
+        // the tail goes into the tree first, full or not
+        size_t lshift = shift;
+        internal_node left = push_leaf(_allocator, root, lshift, tail);
+
+        size_t newshift = std::max(lshift, other.shift) + bits;
+        internal_node newroot =
+          concat_trees(_allocator, left, lshift, other.root, other.shift);
+        collapse(newroot, newshift);
+        return {
+            count + other.count, newshift, newroot, other.tail, _allocator
+        };
+    }
+
+    // The tree over left at lshift and right at rshift, as a node one level
+    // above the higher of them.
+    static internal_node concat_trees(allocator* _allocator,
+                                      const node& left,
+                                      size_t lshift,
+                                      const node& right,
+                                      size_t rshift)
+    {
+        if (lshift > rshift) {
+            internal_node_t* l = as_internal(left);
+            internal_node center = concat_trees(_allocator,
+                                                l->children[l->count - 1],
+                                                lshift - bits,
+                                                right,
+                                                rshift);
+            return rebalance(_allocator, l, center.get(), nullptr, lshift);
+        }
+        if (lshift < rshift) {
+            internal_node_t* r = as_internal(right);
+            internal_node center = concat_trees(
+              _allocator, left, lshift, r->children[0], rshift - bits);
+            return rebalance(_allocator, nullptr, center.get(), r, rshift);
+        }
+        if (lshift == 0) {
+            // two leaves, which the level above packs together if it can
+            internal_node pair = make_internal(_allocator);
+            pair->children[0] = left;
+            pair->children[1] = right;
+            pair->count = 2;
+            return finish(_allocator, std::move(pair), bits);
+        }
+        internal_node_t* l = as_internal(left);
+        internal_node_t* r = as_internal(right);
+        internal_node center = concat_trees(_allocator,
+                                            l->children[l->count - 1],
+                                            lshift - bits,
+                                            r->children[0],
+                                            rshift - bits);
+        return rebalance(_allocator, l, center.get(), r, lshift);
+    }
+
+    // Joins the children of left but its last, of center, and of right but
+    // its first, all at level - bits, and repacks them so there are at most
+    // two more nodes than the fewest that could hold their contents. The
+    // result is a node at level + bits over one or two nodes at level.
+    static internal_node rebalance(allocator* _allocator,
+                                   const internal_node_t* left,
+                                   const internal_node_t* center,
+                                   const internal_node_t* right,
+                                   size_t level)
+    {
+        std::vector<node> all;
+        if (left) {
+            all.insert(all.end(),
+                       left->children.begin(),
+                       left->children.begin() + left->count - 1);
+        }
+        all.insert(all.end(),
+                   center->children.begin(),
+                   center->children.begin() + center->count);
+        if (right) {
+            all.insert(all.end(),
+                       right->children.begin() + 1,
+                       right->children.begin() + right->count);
+        }
+
+        std::vector<size_t> plan = concat_plan(all);
+        std::vector<node> packed =
+          repack(_allocator, all, plan, level - bits);
+
+        internal_node top = make_internal(_allocator);
+        for (size_t i = 0; i < packed.size(); i += width) {
+            internal_node parent = make_internal(_allocator);
+            size_t end = std::min(packed.size(), i + width);
+            std::move(packed.begin() + i,
+                      packed.begin() + end,
+                      parent->children.begin());
+            parent->count = end - i;
+            top->children[top->count++] =
+              finish(_allocator, std::move(parent), level);
+        }
+        return finish(_allocator, std::move(top), level + bits);
+    }
+
+    // How many items or children each node of all should end up with. Nodes
+    // close to full are left alone; the first one that is not has its
+    // contents spread over the ones after it, until the nodes are no more
+    // than two over the fewest possible.
+    static std::vector<size_t> concat_plan(const std::vector<node>& all)
+    {
+        static constexpr size_t extras = 2;
+
+        std::vector<size_t> plan;
+        size_t total = 0;
+        for (const node& n : all) {
+            plan.push_back(n->count);
+            total += n->count;
+        }
+        size_t optimal = (total + width - 1) / width;
+
+        size_t i = 0;
+        while (plan.size() > optimal + extras) {
+            while (plan[i] >= width - 1) {
+                ++i;
+            }
+            size_t remaining = plan[i];
+            do {
+                size_t fill = std::min(remaining + plan[i + 1], width);
+                plan[i] = fill;
+                remaining = remaining + plan[i + 1] - fill;
+                ++i;
+            } while (remaining > 0);
+            plan.erase(plan.begin() + i);
+            --i;
+        }
+        return plan;
+    }
+
+    // nodes at level holding the contents of all, in order, sized by plan;
+    // nodes that come out the same are reused
+    static std::vector<node> repack(allocator* _allocator,
+                                    const std::vector<node>& all,
+                                    const std::vector<size_t>& plan,
+                                    size_t level)
+    {
+        std::vector<node> packed;
+        size_t source = 0;
+        size_t offset = 0;
+        for (size_t want : plan) {
+            if (offset == 0 && all[source]->count == want) {
+                packed.push_back(all[source++]);
+                continue;
+            }
+            if (level == 0) {
+                leaf_node leaf = make_leaf(_allocator);
+                while (leaf->count < want) {
+                    leaf_node_t* from = as_leaf(all[source]);
+                    size_t take = std::min<size_t>(want - leaf->count,
+                                                   from->count - offset);
+                    leaf->append(from->values() + offset, take);
+                    offset += take;
+                    if (offset == from->count) {
+                        ++source;
+                        offset = 0;
+                    }
+                }
+                packed.push_back(std::move(leaf));
+            } else {
+                internal_node n = make_internal(_allocator);
+                while (n->count < want) {
+                    internal_node_t* from = as_internal(all[source]);
+                    size_t take =
+                      std::min<size_t>(want - n->count, from->count - offset);
+                    std::copy(from->children.begin() + offset,
+                              from->children.begin() + offset + take,
+                              n->children.begin() + n->count);
+                    n->count += take;
+                    offset += take;
+                    if (offset == from->count) {
+                        ++source;
+                        offset = 0;
+                    }
+                }
+                packed.push_back(finish(_allocator, std::move(n), level));
+            }
+        }
+        return packed;
+    }
+
+    // the items from, from + 1, ..., to - 1
+    pvec slice(key_type from, key_type to) const
+    {
+        assert(from <= to && to <= count);
+        if (from == to) {
+            return { _allocator };
+        }
+
+        // the leaf holding the last item becomes the tail
+        size_t offset = 0;
+        leaf_node_t* last = leaf_for(to - 1, offset);
+        size_t last_start = to - 1 - offset;
+        size_t first = std::max(from, last_start) - last_start;
+        leaf_node newtail = make_leaf(_allocator);
+        newtail->append(last->values() + first, offset + 1 - first);
+        if (from >= last_start) {
+            return { to - from, bits, make_internal(_allocator), newtail,
+                     _allocator };
+        }
+
+        internal_node newroot =
+          slice_right(_allocator, shift, root.get(), last_start);
+        newroot = slice_left(_allocator, shift, newroot.get(), from);
+        size_t newshift = shift;
+        collapse(newroot, newshift);
+        return { to - from, newshift, newroot, newtail, _allocator };
+    }
+
+    // n at level with only its first end items, end being a leaf boundary
+    static internal_node slice_right(allocator* _allocator,
+                                     size_t level,
+                                     const internal_node_t* n,
+                                     size_t end)
+    {
+        size_t index = end - 1;
+        size_t slot = child_for(n, level, index);
+        internal_node ret = make_internal(_allocator);
+        std::copy(n->children.begin(),
+                  n->children.begin() + slot,
+                  ret->children.begin());
+        if (level > bits) {
+            ret->children[slot] = slice_right(
+              _allocator, level - bits, as_internal(n->children[slot]),
+              index + 1);
+        } else {
+            ret->children[slot] = n->children[slot];
+        }
+        ret->count = slot + 1;
+        if (n->sizes) {
+            ret->sizes = copy_sizes(_allocator, *n->sizes, slot);
+            ret->sizes->sums[slot] =
+              (slot > 0 ? n->sizes->sums[slot - 1] : 0) + index + 1;
+        }
+        return ret;
+    }
+
+    // n at level without its first start items
+    static internal_node slice_left(allocator* _allocator,
+                                    size_t level,
+                                    internal_node_t* n,
+                                    size_t start)
+    {
+        if (start == 0) {
+            return internal_node(n);
+        }
+        size_t index = start;
+        size_t slot = child_for(n, level, index);
+        internal_node ret = make_internal(_allocator);
+        if (level > bits) {
+            ret->children[0] = slice_left(
+              _allocator, level - bits, as_internal(n->children[slot]), index);
+        } else if (index == 0) {
+            ret->children[0] = n->children[slot];
+        } else {
+            leaf_node_t* leaf = as_leaf(n->children[slot]);
+            leaf_node rest = make_leaf(_allocator);
+            rest->append(leaf->values() + index, leaf->count - index);
+            ret->children[0] = std::move(rest);
+        }
+        std::copy(n->children.begin() + slot + 1,
+                  n->children.begin() + n->count,
+                  ret->children.begin() + 1);
+        ret->count = n->count - slot;
+        return finish(_allocator, std::move(ret), level);
+    }
+
+    // this with item inserted before the item at index
+    pvec insert_at(key_type index, const T& item) const
+    {
+        assert(index <= count);
+        if (index == count) {
+            return conj(item);
+        }
+        return slice(0, index).conj(item).concat(slice(index, count));
+    }
+
+    // this without the item at index
+    pvec remove_at(key_type index) const
+    {
+        assert(index < count);
+        if (index == count - 1) {
+            return pop();
+        }
+        return slice(0, index).concat(slice(index + 1, count));
+    }
+
+    friend std::ostream& operator<<(std::ostream& stream, pvec& data)
+    {
+
+        stream << "[";
+        for (const T& item : data) {
+            stream << item << " ";
+        }
+        return stream << "]";
+    }
+
+    // A vector that is changed in place. Its nodes carry no mark of who owns
+    // them: while it is live it changes directly any node nothing else holds,
+    // and copies the ones it shares with persistent vectors the first time
+    // they change.
+    struct tvec
+    {
+        size_t count;
+        size_t shift;
+        internal_node root;
+        leaf_node tail;
+
+        allocator* _allocator;
+        uint64_t edit;
+
+        tvec(allocator* _allocator)
+          : count(0)
+          , shift(bits)
+          , _allocator(_allocator)
+          , edit(new_edit_session())
+        {
+            root = make_internal(_allocator);
+            tail = make_leaf(_allocator);
+        }
+
+        tvec(const pvec& v)
+          : count(v.count)
+          , shift(v.shift)
+          , root(v.root)
+          , _allocator(v._allocator)
+          , edit(new_edit_session())
+        {
+            tail = v.tail ? copy_leaf(_allocator, *v.tail, v.tail->count)
+                          : make_leaf(_allocator);
+        }
+
+        void ensure_editable() const
+        {
+            if (!edit) {
+                throw std::runtime_error(
+                  "Transient used after it was made persistent!");
+            }
+        }
+
+        size_t tail_offset() const { return count - tail->count; }
+
+        pvec to_persistent()
+        {
+            ensure_editable();
+            // the vector shares every node from here on
+            edit = 0;
+            // the tail only holds what was added to it, so the vector can
+            // take it over as it is
+            return { count, shift, root, tail, _allocator };
+        }
+
+        tvec& conj(T item)
+        {
+            ensure_editable();
+
+            // room in tail?
+            if (tail->count < width) {
+                tail->push(item);
+                ++this->count;
+                return *this;
+            }
+
+            // full tail, push into tree
+            root = push_leaf(_allocator, root, shift, std::move(tail), edit);
+            tail = make_leaf(_allocator);
+            tail->push(item);
+            ++count;
+            return *this;
+        }
+
+        tvec& assoc(key_type key, const T& item) { return assoc_n(key, item); }
+
+        tvec& assoc_n(key_type i, const T& item)
+        {
+            ensure_editable();
+
+            if (i < count) {
+                if (i >= tail_offset()) {
+                    tail->values()[i - tail_offset()] = item;
+                    return *this;
+                }
+                root = static_node_cast<internal_node_t>(
+                  do_assoc(_allocator, shift, root, i, item, edit));
+                return *this;
+            }
+            if (i == count) {
+                return conj(item);
+            }
+            throw std::runtime_error("Index not found in transient vector!");
+        }
+    };
+
+    tvec as_transient() const { return { *this }; }
+};
+
+// * Hash maps and sets
+//
+// pmap and pset are hash array mapped tries. Each level of the trie takes
+// bits more of a key's hash to pick one of width positions in a node, and
+// two bitmaps say which positions hold an entry inline and which a child
+// node. Only occupied positions take up room: they are packed in order, so
+// the slot for a position is the number of bits set below it. A lookup is
+// one node per level, and a level holds width times as many keys as the one
+// above it.
+//
+// Keys whose hashes are equal all the way down share a collision node at
+// the bottom, a plain array searched with Equal.
+
+template<typename Entry, typename Traits, typename Allocator>
+struct hamt
+{
+    static_assert(std::is_trivially_copyable<Entry>::value,
+                  "entries are moved around with memcpy");
+    static_assert(alignof(Entry) <= alignof(void*),
+                  "entries are stored after pointer aligned children");
+
+    typedef typename Traits::key_type key_type;
+
+    using allocator = Allocator;
+
+    static constexpr size_t bits = 5;
+    static constexpr size_t width = 1 << bits;
+    static constexpr size_t index_mask = width - 1;
+    static constexpr size_t hash_bits = std::numeric_limits<size_t>::digits;
+    // bitmap levels, then the collision level
+    static constexpr size_t max_depth = (hash_bits + bits - 1) / bits + 1;
+    static constexpr size_t npos = size_t(-1);
+
+    typedef block_classes<Allocator, 32, 48, 64, 96, 128, 192, 256, 384, 512,
+                          768>
+      blocks;
+
+    // A node keeps its children and then its entries right after itself,
+    // sized to fit them. Collision nodes have neither bitmap set and only
+    // entries.
+    struct node_t : counted_node
+    {
+        uint32_t datamap = 0;
+        uint32_t nodemap = 0;
+        uint16_t entry_count = 0;
+        uint8_t child_count = 0;
+        uint8_t size_class = 0;
+        // the transient allowed to change this node in place, or 0
+        uint64_t edit = 0;
+
+        node_t** children() { return reinterpret_cast<node_t**>(this + 1); }
+        node_t* const* children() const
+        {
+            return reinterpret_cast<node_t* const*>(this + 1);
+        }
+
+        Entry* entries()
+        {
+            return reinterpret_cast<Entry*>(children() + child_count);
+        }
+        const Entry* entries() const
+        {
+            return reinterpret_cast<const Entry*>(children() + child_count);
+        }
+
+        static void destroy(node_t* n)
+        {
+            for (size_t i = 0; i < n->child_count; ++i) {
+                release(n->children()[i]);
+            }
+            size_t cls = n->size_class;
+            size_t bytes = bytes_for(n->entry_count, n->child_count);
+            n->~node_t();
+            if (cls < blocks::count) {
+                blocks::deallocate(n, cls);
+                return;
+            }
+            char* start = reinterpret_cast<char*>(n) - sizeof(allocator*);
+            alb::block block{ start, sizeof(allocator*) + bytes };
+            (*reinterpret_cast<allocator**>(start))->deallocate(block);
+        }
+    };
+
+    typedef node_ptr<node_t> node;
+
+    node root;
+    size_t count;
+
+    allocator* _allocator;
+
+    hamt(node root, size_t count, allocator* alloc)
+      : root(std::move(root))
+      , count(count)
+      , _allocator(alloc)
+    {
+        assert(_allocator);
+    }
+
+    hamt(allocator* alloc)
+      : hamt(nullptr, 0, alloc)
+    {
+    }
+
+    // * Nodes
+    //
+    // Nodes are linked by raw pointers inside the trie, each holding one
+    // reference. The functions changing a node return what should take its
+    // place: the node itself when nothing changed or it was changed in
+    // place, otherwise a new node whose one reference goes to the caller.
+
+    static size_t bytes_for(size_t entries, size_t children)
+    {
+        return sizeof(node_t) + children * sizeof(node_t*) +
+               entries * sizeof(Entry);
+    }
+
+    static node_t* make(allocator* _allocator,
+                        uint64_t edit,
+                        size_t entries,
+                        size_t children)
+    {
+        size_t bytes = bytes_for(entries, children);
+        size_t cls = blocks::class_for(bytes);
+        void* mem;
+        if (cls < blocks::count) {
+            mem = blocks::allocate(_allocator, cls);
+        } else {
+            // too big for every class, so it is allocated on its own and
+            // keeps its allocator right before itself
+            alb::block block = _allocator->allocate(sizeof(allocator*) + bytes);
+            if (!block.ptr) {
+                throw std::bad_alloc();
+            }
+            *static_cast<allocator**>(block.ptr) = _allocator;
+            mem = static_cast<char*>(block.ptr) + sizeof(allocator*);
+        }
+        node_t* n = new (mem) node_t();
+        n->refs = 1;
+        n->entry_count = entries;
+        n->child_count = children;
+        n->size_class = cls;
+        n->edit = edit;
+        return n;
+    }
+
+    static node_t* retain(node_t* n)
+    {
+        ++n->refs;
+        return n;
+    }
+
+    static void release(node_t* n)
+    {
+        if (--n->refs == 0) {
+            node_t::destroy(n);
+        }
+    }
+
+    static bool editable(const node_t* n, uint64_t edit)
+    {
+        return edit != 0 && n->edit == edit;
+    }
+
+    // whether n has room for this many entries and children in place
+    static bool fits(const node_t* n, size_t entries, size_t children)
+    {
+        return n->size_class < blocks::count &&
+               bytes_for(entries, children) <= blocks::size(n->size_class);
+    }
+
+    static uint32_t bit_for(size_t hash, size_t shift)
+    {
+        return uint32_t(1) << ((hash >> shift) & index_mask);
+    }
+
+    static size_t index_of(uint32_t map, uint32_t bit)
+    {
+        return __builtin_popcount(map & (bit - 1));
+    }
+
+    static node_t* copy(allocator* _allocator, uint64_t edit, const node_t* n)
+    {
+        node_t* m = make(_allocator, edit, n->entry_count, n->child_count);
+        m->datamap = n->datamap;
+        m->nodemap = n->nodemap;
+        for (size_t i = 0; i < n->child_count; ++i) {
+            m->children()[i] = retain(n->children()[i]);
+        }
+        std::memcpy(
+          m->entries(), n->entries(), n->entry_count * sizeof(Entry));
+        return m;
+    }
+
+    // Copies from, leaving out the item at drop and putting add in at at in
+    // the result; npos and null mean neither.
+    template<typename Item>
+    static void splice(const Item* from,
+                       size_t n,
+                       size_t drop,
+                       Item* to,
+                       size_t at,
+                       const Item* add)
+    {
+        size_t out = 0;
+        for (size_t i = 0; i < n; ++i) {
+            if (add && out == at) {
+                to[out++] = *add;
+            }
+            if (i != drop) {
+                to[out++] = from[i];
+            }
+        }
+        if (add && out == at) {
+            to[out++] = *add;
+        }
+    }
+
+    // A new node like n with the given bitmaps, without the entry at
+    // drop_entry and the child at drop_child, and with entry and child put
+    // in at add_entry and add_child. child is taken over.
+    static node_t* rebuild(allocator* _allocator,
+                           uint64_t edit,
+                           const node_t* n,
+                           uint32_t datamap,
+                           uint32_t nodemap,
+                           size_t drop_entry,
+                           size_t add_entry,
+                           const Entry* entry,
+                           size_t drop_child,
+                           size_t add_child,
+                           node_t* child)
+    {
+        size_t entries =
+          n->entry_count - (drop_entry != npos) + (entry != nullptr);
+        size_t children =
+          n->child_count - (drop_child != npos) + (child != nullptr);
+        node_t* m = make(_allocator, edit, entries, children);
+        m->datamap = datamap;
+        m->nodemap = nodemap;
+        splice(n->entries(),
+               n->entry_count,
+               drop_entry,
+               m->entries(),
+               add_entry,
+               entry);
+        node_t* const* kept = n->children();
+        splice(kept,
+               n->child_count,
+               drop_child,
+               m->children(),
+               add_child,
+               child ? &child : nullptr);
+        for (size_t i = 0; i < children; ++i) {
+            if (!child || i != add_child) {
+                retain(m->children()[i]);
+            }
+        }
+        return m;
+    }
+
+    // a node holding just entry
+    static node_t* single(allocator* _allocator,
+                          uint64_t edit,
+                          const Entry& entry,
+                          size_t hash)
+    {
+        node_t* n = make(_allocator, edit, 1, 0);
+        n->datamap = bit_for(hash, 0);
+        n->entries()[0] = entry;
+        return n;
+    }
+
+    // a node at shift holding two entries whose keys differ
+    static node_t* pair(allocator* _allocator,
+                        uint64_t edit,
+                        const Entry& first,
+                        size_t first_hash,
+                        const Entry& second,
+                        size_t second_hash,
+                        size_t shift)
+    {
+        if (shift >= hash_bits) {
+            node_t* n = make(_allocator, edit, 2, 0);
+            n->entries()[0] = first;
+            n->entries()[1] = second;
+            return n;
+        }
+        uint32_t first_bit = bit_for(first_hash, shift);
+        uint32_t second_bit = bit_for(second_hash, shift);
+        if (first_bit == second_bit) {
+            node_t* n = make(_allocator, edit, 0, 1);
+            n->nodemap = first_bit;
+            n->children()[0] = pair(_allocator,
+                                    edit,
+                                    first,
+                                    first_hash,
+                                    second,
+                                    second_hash,
+                                    shift + bits);
+            return n;
+        }
+        node_t* n = make(_allocator, edit, 2, 0);
+        n->datamap = first_bit | second_bit;
+        bool in_order = first_bit < second_bit;
+        n->entries()[0] = in_order ? first : second;
+        n->entries()[1] = in_order ? second : first;
+        return n;
+    }
+
+    // n with its child at i replaced by child, which it takes over
+    static node_t* with_child(allocator* _allocator,
+                              uint64_t edit,
+                              node_t* n,
+                              size_t i,
+                              node_t* child)
+    {
+        node_t* m = editable(n, edit) ? n : copy(_allocator, edit, n);
+        release(m->children()[i]);
+        m->children()[i] = child;
+        return m;
+    }
+
+    // n with entry put in at i, and bit set in its datamap
+    static node_t* with_entry(allocator* _allocator,
+                              uint64_t edit,
+                              node_t* n,
+                              size_t i,
+                              uint32_t bit,
+                              const Entry& entry)
+    {
+        if (editable(n, edit) && fits(n, n->entry_count + 1, n->child_count)) {
+            Entry* entries = n->entries();
+            std::memmove(entries + i + 1,
+                         entries + i,
+                         (n->entry_count - i) * sizeof(Entry));
+            entries[i] = entry;
+            ++n->entry_count;
+            n->datamap |= bit;
+            return n;
+        }
+        return rebuild(_allocator,
+                       edit,
+                       n,
+                       n->datamap | bit,
+                       n->nodemap,
+                       npos,
+                       i,
+                       &entry,
+                       npos,
+                       npos,
+                       nullptr);
+    }
+
+    // n without its entry at i, and bit cleared in its datamap
+    static node_t* without_entry(allocator* _allocator,
+                                 uint64_t edit,
+                                 node_t* n,
+                                 size_t i,
+                                 uint32_t bit)
+    {
+        if (editable(n, edit) && fits(n, n->entry_count - 1, n->child_count)) {
+            Entry* entries = n->entries();
+            std::memmove(entries + i,
+                         entries + i + 1,
+                         (n->entry_count - i - 1) * sizeof(Entry));
+            --n->entry_count;
+            n->datamap &= ~bit;
+            return n;
+        }
+        return rebuild(_allocator,
+                       edit,
+                       n,
+                       n->datamap & ~bit,
+                       n->nodemap,
+                       i,
+                       npos,
+                       nullptr,
+                       npos,
+                       npos,
+                       nullptr);
+    }
+
+    static const Entry* lookup(const node_t* n,
+                               const key_type& key,
+                               size_t hash)
+    {
+        for (size_t shift = 0; shift < hash_bits; shift += bits) {
+            uint32_t bit = bit_for(hash, shift);
+            if (n->datamap & bit) {
+                const Entry& entry = n->entries()[index_of(n->datamap, bit)];
+                return Traits::equal(Traits::key(entry), key) ? &entry
+                                                              : nullptr;
+            }
+            if (!(n->nodemap & bit)) {
+                return nullptr;
+            }
+            n = n->children()[index_of(n->nodemap, bit)];
+        }
+        const Entry* entries = n->entries();
+        for (size_t i = 0; i < n->entry_count; ++i) {
+            if (Traits::equal(Traits::key(entries[i]), key)) {
+                return &entries[i];
+            }
+        }
+        return nullptr;
+    }
+
+    // n at shift with entry put in, keeping an entry already there for its
+    // key unless replace is set
+    static node_t* put(allocator* _allocator,
+                       uint64_t edit,
+                       node_t* n,
+                       size_t shift,
+                       const Entry& entry,
+                       size_t hash,
+                       bool replace,
+                       bool& added)
+    {
+        const key_type& key = Traits::key(entry);
+        if (shift >= hash_bits) {
+            Entry* entries = n->entries();
+            for (size_t i = 0; i < n->entry_count; ++i) {
+                if (Traits::equal(Traits::key(entries[i]), key)) {
+                    return replace ? replaced(_allocator, edit, n, i, entry)
+                                   : n;
+                }
+            }
+            added = true;
+            return with_entry(_allocator, edit, n, n->entry_count, 0, entry);
+        }
+
+        uint32_t bit = bit_for(hash, shift);
+        if (n->datamap & bit) {
+            size_t i = index_of(n->datamap, bit);
+            Entry current = n->entries()[i];
+            if (Traits::equal(Traits::key(current), key)) {
+                return replace ? replaced(_allocator, edit, n, i, entry) : n;
+            }
+            // both move down into a node of their own
+            added = true;
+            node_t* child = pair(_allocator,
+                                 edit,
+                                 current,
+                                 Traits::hash(Traits::key(current)),
+                                 entry,
+                                 hash,
+                                 shift + bits);
+            return rebuild(_allocator,
+                           edit,
+                           n,
+                           n->datamap & ~bit,
+                           n->nodemap | bit,
+                           i,
+                           npos,
+                           nullptr,
+                           npos,
+                           index_of(n->nodemap, bit),
+                           child);
+        }
+        if (n->nodemap & bit) {
+            size_t i = index_of(n->nodemap, bit);
+            node_t* child = n->children()[i];
+            node_t* result = put(_allocator,
+                                 edit,
+                                 child,
+                                 shift + bits,
+                                 entry,
+                                 hash,
+                                 replace,
+                                 added);
+            if (result == child) {
+                return n;
+            }
+            return with_child(_allocator, edit, n, i, result);
+        }
+        added = true;
+        return with_entry(
+          _allocator, edit, n, index_of(n->datamap, bit), bit, entry);
+    }
+
+    static node_t* replaced(allocator* _allocator,
+                            uint64_t edit,
+                            node_t* n,
+                            size_t i,
+                            const Entry& entry)
+    {
+        node_t* m = editable(n, edit) ? n : copy(_allocator, edit, n);
+        m->entries()[i] = entry;
+        return m;
+    }
+
+    // n at shift without the entry for key, or null when that leaves it
+    // empty
+    static node_t* remove(allocator* _allocator,
+                          uint64_t edit,
+                          node_t* n,
+                          size_t shift,
+                          const key_type& key,
+                          size_t hash,
+                          bool& removed)
+    {
+        if (shift >= hash_bits) {
+            const Entry* entries = n->entries();
+            for (size_t i = 0; i < n->entry_count; ++i) {
+                if (Traits::equal(Traits::key(entries[i]), key)) {
+                    removed = true;
+                    return n->entry_count == 1
+                             ? nullptr
+                             : without_entry(_allocator, edit, n, i, 0);
+                }
+            }
+            return n;
+        }
+
+        uint32_t bit = bit_for(hash, shift);
+        if (n->datamap & bit) {
+            size_t i = index_of(n->datamap, bit);
+            if (!Traits::equal(Traits::key(n->entries()[i]), key)) {
+                return n;
+            }
+            removed = true;
+            if (n->entry_count == 1 && n->child_count == 0) {
+                return nullptr;
+            }
+            return without_entry(_allocator, edit, n, i, bit);
+        }
+        if (!(n->nodemap & bit)) {
+            return n;
+        }
+
+        size_t i = index_of(n->nodemap, bit);
+        node_t* child = n->children()[i];
+        node_t* result =
+          remove(_allocator, edit, child, shift + bits, key, hash, removed);
+        // a child edited in place comes back as itself, and still has to
+        // move up when that left it a lone entry
+        if (!removed) {
+            return n;
+        }
+        if (!result) {
+            if (n->entry_count == 0 && n->child_count == 1) {
+                return nullptr;
+            }
+            return rebuild(_allocator,
+                           edit,
+                           n,
+                           n->datamap,
+                           n->nodemap & ~bit,
+                           npos,
+                           npos,
+                           nullptr,
+                           i,
+                           npos,
+                           nullptr);
+        }
+        if (result->entry_count == 1 && result->child_count == 0) {
+            // a lone entry moves up into n; a child edited in place goes
+            // with n's old children
+            Entry entry = result->entries()[0];
+            if (result != child) {
+                release(result);
+            }
+            return rebuild(_allocator,
+                           edit,
+                           n,
+                           n->datamap | bit,
+                           n->nodemap & ~bit,
+                           npos,
+                           index_of(n->datamap, bit),
+                           &entry,
+                           i,
+                           npos,
+                           nullptr);
+        }
+        if (result == child) {
+            return n;
+        }
+        return with_child(_allocator, edit, n, i, result);
+    }
+
+    // * Operations
+
+    const Entry* lookup(const key_type& key) const
+    {
+        return root ? lookup(root.get(), key, Traits::hash(key)) : nullptr;
+    }
+
+    hamt put(const Entry& entry, bool replace) const
+    {
+        size_t hash = Traits::hash(Traits::key(entry));
+        if (!root) {
+            return { node::adopt(single(_allocator, 0, entry, hash)),
+                     1,
+                     _allocator };
+        }
+        bool added = false;
+        node_t* result =
+          put(_allocator, 0, root.get(), 0, entry, hash, replace, added);
+        if (result == root.get()) {
+            return *this;
+        }
+        return { node::adopt(result), count + added, _allocator };
+    }
+
+    hamt remove(const key_type& key) const
+    {
+        if (!root) {
+            return *this;
+        }
+        bool removed = false;
+        node_t* result = remove(
+          _allocator, 0, root.get(), 0, key, Traits::hash(key), removed);
+        if (result == root.get()) {
+            return *this;
+        }
+        return { node::adopt(result), count - 1, _allocator };
+    }
+
+    // * Iteration
+    //
+    // Entries come out a node's inline entries first, then its children's,
+    // depth first. The order follows the hashes, not insertion.
+
+    class const_iterator
+    {
+        const node_t* path[max_depth];
+        uint8_t next_child[max_depth];
+        size_t depth = 0;
+        const Entry* item = nullptr;
+        const Entry* run_end = nullptr;
+
+        void enter(const node_t* n)
+        {
+            path[depth] = n;
+            next_child[depth] = 0;
+            ++depth;
+            item = n->entries();
+            run_end = item + n->entry_count;
+        }
+
+        // moves to the next node with entries
+        void next_run()
+        {
+            while (depth > 0) {
+                const node_t* top = path[depth - 1];
+                if (next_child[depth - 1] < top->child_count) {
+                    enter(top->children()[next_child[depth - 1]++]);
+                    if (item != run_end) {
+                        return;
+                    }
+                } else {
+                    --depth;
+                }
+            }
+            item = run_end = nullptr;
+        }
+
+      public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef Entry value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const Entry* pointer;
+        typedef const Entry& reference;
+
+        const_iterator() = default;
+
+        explicit const_iterator(const node_t* root)
+        {
+            if (root) {
+                enter(root);
+                if (item == run_end) {
+                    next_run();
+                }
+            }
+        }
+
+        reference operator*() const { return *item; }
+        pointer operator->() const { return item; }
+
+        const_iterator& operator++()
+        {
+            if (++item == run_end) {
+                next_run();
+            }
+            return *this;
+        }
+
+        const_iterator operator++(int)
+        {
+            const_iterator was = *this;
+            ++*this;
+            return was;
+        }
+
+        bool operator==(const const_iterator& other) const
+        {
+            return item == other.item;
+        }
+        bool operator!=(const const_iterator& other) const
+        {
+            return item != other.item;
+        }
+    };
+
+    const_iterator begin() const { return const_iterator(root.get()); }
+    const_iterator end() const { return {}; }
+
+    // A trie changed in place. Nodes it creates are its own and are changed
+    // directly from then on; nodes it shares with persistent tries are
+    // copied the first time they change.
+    struct transient
+    {
+        node root;
+        size_t count;
+        allocator* _allocator;
+        uint64_t edit;
+
+        transient(const hamt& from)
+          : root(from.root)
+          , count(from.count)
+          , _allocator(from._allocator)
+          , edit(new_edit_session())
+        {
+        }
+
+        void ensure_editable() const
+        {
+            if (!edit) {
+                throw std::runtime_error(
+                  "Transient used after it was made persistent!");
+            }
+        }
+
+        void put(const Entry& entry, bool replace)
+        {
+            ensure_editable();
+            size_t hash = Traits::hash(Traits::key(entry));
+            if (!root) {
+                root = node::adopt(single(_allocator, edit, entry, hash));
+                count = 1;
+                return;
+            }
+            bool added = false;
+            node_t* result = hamt::put(
+              _allocator, edit, root.get(), 0, entry, hash, replace, added);
+            if (result != root.get()) {
+                root = node::adopt(result);
+            }
+            count += added;
+        }
+
+        void remove(const key_type& key)
+        {
+            ensure_editable();
+            if (!root) {
+                return;
+            }
+            bool removed = false;
+            node_t* result = hamt::remove(
+              _allocator, edit, root.get(), 0, key, Traits::hash(key), removed);
+            if (result != root.get()) {
+                root = node::adopt(result);
+            }
+            count -= removed;
+        }
+
+        hamt to_persistent()
+        {
+            ensure_editable();
+            // nodes keep the session, but it is never handed out again
+            edit = 0;
+            return { root, count, _allocator };
+        }
+    };
+};
+
+template<typename K, typename V>
+struct map_entry
+{
+    K key;
+    V val;
+};
+
+template<typename K, typename V, typename Hash, typename Equal>
+struct map_traits
+{
+    typedef K key_type;
+
+    static const K& key(const map_entry<K, V>& entry) { return entry.key; }
+    static size_t hash(const K& key) { return Hash()(key); }
+    static bool equal(const K& a, const K& b) { return Equal()(a, b); }
+};
+
+template<typename K, typename Hash, typename Equal>
+struct set_traits
+{
+    typedef K key_type;
+
+    static const K& key(const K& entry) { return entry; }
+    static size_t hash(const K& key) { return Hash()(key); }
+    static bool equal(const K& a, const K& b) { return Equal()(a, b); }
+};
+
+template<typename K,
+         typename V,
+         typename Allocator,
+         typename Hash = std::hash<K>,
+         typename Equal = std::equal_to<K>>
+struct pmap
+  : hamt<map_entry<K, V>, map_traits<K, V, Hash, Equal>, Allocator>
+{
+    typedef map_entry<K, V> entry;
+    typedef hamt<entry, map_traits<K, V, Hash, Equal>, Allocator> trie;
+
+    using allocator = Allocator;
+
+    pmap(allocator* alloc)
+      : trie(alloc)
+    {
+    }
+
+    pmap(trie from)
+      : trie(std::move(from))
+    {
+    }
+
+    static pmap create(allocator* alloc, std::initializer_list<entry> list)
+    {
+        tmap result{ pmap{ alloc } };
+        for (const entry& item : list) {
+            result.assoc(item.key, item.val);
+        }
+        return result.to_persistent();
+    }
+
+    const V* find(const K& key) const
+    {
+        const entry* found = this->lookup(key);
+        return found ? &found->val : nullptr;
+    }
+
+    const V& get(const K& key, const V& not_found) const
+    {
+        const V* found = find(key);
+        return found ? *found : not_found;
+    }
+
+    bool contains(const K& key) const { return this->lookup(key); }
+
+    pmap assoc(const K& key, const V& val) const
+    {
+        return this->put({ key, val }, true);
+    }
+
+    pmap dissoc(const K& key) const { return this->remove(key); }
+
+    struct tmap : trie::transient
+    {
+        tmap(const pmap& from)
+          : trie::transient(from)
+        {
+        }
+
+        tmap& assoc(const K& key, const V& val)
+        {
+            this->put({ key, val }, true);
+            return *this;
+        }
+
+        tmap& dissoc(const K& key)
+        {
+            this->remove(key);
+            return *this;
+        }
+
+        pmap to_persistent() { return trie::transient::to_persistent(); }
+    };
+
+    tmap as_transient() const { return { *this }; }
+};
+
+template<typename K,
+         typename Allocator,
+         typename Hash = std::hash<K>,
+         typename Equal = std::equal_to<K>>
+struct pset : hamt<K, set_traits<K, Hash, Equal>, Allocator>
+{
+    typedef hamt<K, set_traits<K, Hash, Equal>, Allocator> trie;
+
+    using allocator = Allocator;
+
+    pset(allocator* alloc)
+      : trie(alloc)
+    {
+    }
+
+    pset(trie from)
+      : trie(std::move(from))
+    {
+    }
+
+    static pset create(allocator* alloc, std::initializer_list<K> list)
+    {
+        tset result{ pset{ alloc } };
+        for (const K& item : list) {
+            result.conj(item);
+        }
+        return result.to_persistent();
+    }
+
+    const K* find(const K& key) const { return this->lookup(key); }
+
+    bool contains(const K& key) const { return this->lookup(key); }
+
+    pset conj(const K& key) const { return this->put(key, false); }
+
+    pset disj(const K& key) const { return this->remove(key); }
+
+    struct tset : trie::transient
+    {
+        tset(const pset& from)
+          : trie::transient(from)
+        {
+        }
+
+        tset& conj(const K& key)
+        {
+            this->put(key, false);
+            return *this;
+        }
+
+        tset& disj(const K& key)
+        {
+            this->remove(key);
+            return *this;
+        }
+
+        pset to_persistent() { return trie::transient::to_persistent(); }
+    };
+
+    tset as_transient() const { return { *this }; }
+};
+
+// * Sorted maps
+//
+// psorted_map is a B+ tree. Entries live in leaves, in key order, and an
+// internal node keeps for each child a key no greater than any under it and
+// greater than any under the child before, to steer lookups. Nodes are
+// width wide, so a lookup reads a handful of nodes and an ordered scan reads
+// whole arrays of entries at a time. Changes copy the path down to the leaf
+// they touch; nodes that overflow split on the way back up, and nodes that
+// fall under half full take entries from a neighbour or merge with it.
+
+template<typename K,
+         typename V,
+         typename Allocator,
+         typename Compare = std::less<K>,
+         size_t BITS = 5>
+struct psorted_map
+{
+    static_assert(std::is_trivially_copyable<K>::value &&
+                    std::is_trivially_copyable<V>::value,
+                  "keys and values are moved around with memcpy");
+
+    typedef map_entry<K, V> entry;
+
+    using allocator = Allocator;
+
+    static constexpr size_t width = 1 << BITS;
+    static constexpr size_t min_count = width / 2;
+    // deep enough for any tree whose nodes are at least half full
+    static constexpr size_t max_height =
+      std::numeric_limits<size_t>::digits / (BITS - 1) + 1;
+
+    enum node_type_t : uint8_t
+    {
+        leaf_type,
+        internal_type
+    };
+
+    struct leaf_node_t;
+    struct internal_node_t;
+
+    struct node_t : counted_node
+    {
+        uint8_t node_type;
+        uint16_t count = 0;
+        // the transient allowed to change this node in place, or 0
+        uint64_t edit;
+
+        node_t(uint8_t node_type, uint64_t edit)
+          : node_type(node_type)
+          , edit(edit)
+        {
+        }
+
+        static void destroy(node_t* n)
+        {
+            if (n->node_type == leaf_type) {
+                free_node<Allocator>(static_cast<leaf_node_t*>(n));
+            } else {
+                free_node<Allocator>(static_cast<internal_node_t*>(n));
+            }
+        }
+    };
+
+    typedef node_ptr<node_t> node;
+
+    struct leaf_node_t : node_t
+    {
+        typename std::aligned_storage<sizeof(entry), alignof(entry)>::type
+          storage[width];
+
+        leaf_node_t(uint64_t edit)
+          : node_t(leaf_type, edit)
+        {
+        }
+
+        entry* entries() { return reinterpret_cast<entry*>(storage); }
+        const entry* entries() const
+        {
+            return reinterpret_cast<const entry*>(storage);
+        }
+    };
+
+    struct internal_node_t : node_t
+    {
+        typename std::aligned_storage<sizeof(K), alignof(K)>::type
+          key_storage[width];
+        node children[width];
+
+        internal_node_t(uint64_t edit)
+          : node_t(internal_type, edit)
+        {
+        }
+
+        // keys[i] steers lookups to children[i]; keys[0] is only read when
+        // the node splits or merges
+        K* keys() { return reinterpret_cast<K*>(key_storage); }
+        const K* keys() const
+        {
+            return reinterpret_cast<const K*>(key_storage);
+        }
+    };
+
+    typedef node_ptr<leaf_node_t> leaf_node;
+    typedef node_ptr<internal_node_t> internal_node;
+
+    node root;
+    size_t count;
+
+    allocator* _allocator;
+
+    psorted_map(node root, size_t count, allocator* alloc)
+      : root(std::move(root))
+      , count(count)
+      , _allocator(alloc)
+    {
+        assert(_allocator);
+    }
+
+    psorted_map(allocator* alloc)
+      : psorted_map(nullptr, 0, alloc)
+    {
+    }
+
+    // * Nodes
+
+    static bool less(const K& a, const K& b) { return Compare()(a, b); }
+
+    static bool is_leaf(const node_t* n) { return n->node_type == leaf_type; }
+
+    static leaf_node_t* as_leaf(const node_t* n)
+    {
+        return static_cast<leaf_node_t*>(const_cast<node_t*>(n));
+    }
+
+    static internal_node_t* as_internal(const node_t* n)
+    {
+        return static_cast<internal_node_t*>(const_cast<node_t*>(n));
+    }
+
+    static bool editable(const node_t* n, uint64_t edit)
+    {
+        return edit != 0 && n->edit == edit;
+    }
+
+    static leaf_node make_leaf(allocator* _allocator, uint64_t edit)
+    {
+        return make_node<leaf_node_t>(_allocator, edit);
+    }
+
+    static internal_node make_internal(allocator* _allocator, uint64_t edit)
+    {
+        return make_node<internal_node_t>(_allocator, edit);
+    }
+
+    // n, or a copy of it owned by edit when edit may not change n
+    static leaf_node_t* writable_leaf(allocator* _allocator,
+                                      uint64_t edit,
+                                      const node& n,
+                                      node& holder)
+    {
+        leaf_node_t* leaf = as_leaf(n.get());
+        if (editable(leaf, edit)) {
+            holder = n;
+            return leaf;
+        }
+        leaf_node copy = make_leaf(_allocator, edit);
+        std::memcpy(
+          copy->entries(), leaf->entries(), leaf->count * sizeof(entry));
+        copy->count = leaf->count;
+        holder = copy;
+        return copy.get();
+    }
+
+    static internal_node_t* writable_internal(allocator* _allocator,
+                                              uint64_t edit,
+                                              const node& n,
+                                              node& holder)
+    {
+        internal_node_t* in = as_internal(n.get());
+        if (editable(in, edit)) {
+            holder = n;
+            return in;
+        }
+        internal_node copy = make_internal(_allocator, edit);
+        std::memcpy(copy->keys(), in->keys(), in->count * sizeof(K));
+        std::copy(in->children,
+                  in->children + in->count,
+                  copy->children);
+        copy->count = in->count;
+        holder = copy;
+        return copy.get();
+    }
+
+    // the first entry of leaf whose key is not less than key
+    static size_t position_in_leaf(const leaf_node_t* leaf, const K& key)
+    {
+        const entry* first = leaf->entries();
+        return std::lower_bound(first,
+                                first + leaf->count,
+                                key,
+                                [](const entry& e, const K& k) {
+                                    return less(e.key, k);
+                                }) -
+               first;
+    }
+
+    // the child of n that key belongs under
+    static size_t position_in_internal(const internal_node_t* n, const K& key)
+    {
+        const K* keys = n->keys();
+        return std::upper_bound(keys + 1,
+                                keys + n->count,
+                                key,
+                                [](const K& k, const K& steer) {
+                                    return less(k, steer);
+                                }) -
+               keys - 1;
+    }
+
+    // a key steering lookups to n, for a parent that is about to hold it
+    static const K& first_key(const node_t* n)
+    {
+        return is_leaf(n) ? as_leaf(n)->entries()[0].key
+                          : as_internal(n)->keys()[0];
+    }
+
+    // * Lookups
+
+    static const entry* lookup(const node& root, const K& key)
+    {
+        if (!root) {
+            return nullptr;
+        }
+        const node_t* n = root.get();
+        while (!is_leaf(n)) {
+            const internal_node_t* in = as_internal(n);
+            n = in->children[position_in_internal(in, key)].get();
+        }
+        const leaf_node_t* leaf = as_leaf(n);
+        size_t i = position_in_leaf(leaf, key);
+        if (i < leaf->count && !less(key, leaf->entries()[i].key)) {
+            return &leaf->entries()[i];
+        }
+        return nullptr;
+    }
+
+    const entry* lookup(const K& key) const { return lookup(root, key); }
+
+    const V* find(const K& key) const
+    {
+        const entry* found = lookup(key);
+        return found ? &found->val : nullptr;
+    }
+
+    const V& get(const K& key, const V& not_found) const
+    {
+        const V* found = find(key);
+        return found ? *found : not_found;
+    }
+
+    bool contains(const K& key) const { return lookup(key); }
+
+    // * Updates
+
+    // n with item put in. When n overflows, the upper half comes back in
+    // split.
+    static node insert(allocator* _allocator,
+                       uint64_t edit,
+                       const node& n,
+                       const entry& item,
+                       bool& added,
+                       node& split)
+    {
+        if (is_leaf(n.get())) {
+            const leaf_node_t* leaf = as_leaf(n.get());
+            size_t i = position_in_leaf(leaf, item.key);
+            node result;
+            if (i < leaf->count && !less(item.key, leaf->entries()[i].key)) {
+                writable_leaf(_allocator, edit, n, result)->entries()[i] = item;
+                return result;
+            }
+            added = true;
+            if (leaf->count < width) {
+                leaf_node_t* m = writable_leaf(_allocator, edit, n, result);
+                entry* entries = m->entries();
+                std::memmove(entries + i + 1,
+                             entries + i,
+                             (m->count - i) * sizeof(entry));
+                entries[i] = item;
+                ++m->count;
+                return result;
+            }
+            return split_leaf(_allocator, edit, leaf, i, item, split);
+        }
+
+        const internal_node_t* in = as_internal(n.get());
+        size_t i = position_in_internal(in, item.key);
+        node child_split;
+        node child =
+          insert(_allocator, edit, in->children[i], item, added, child_split);
+        if (child.get() == in->children[i].get() && !child_split) {
+            return n;
+        }
+        node result;
+        internal_node_t* m = writable_internal(_allocator, edit, n, result);
+        m->children[i] = std::move(child);
+        if (!child_split) {
+            return result;
+        }
+        if (m->count < width) {
+            std::memmove(m->keys() + i + 2,
+                         m->keys() + i + 1,
+                         (m->count - i - 1) * sizeof(K));
+            std::move_backward(m->children + i + 1,
+                               m->children + m->count,
+                               m->children + m->count + 1);
+            m->keys()[i + 1] = first_key(child_split.get());
+            m->children[i + 1] = std::move(child_split);
+            ++m->count;
+            return result;
+        }
+        return split_internal(_allocator, edit, m, i + 1, child_split, split);
+    }
+
+    // the full leaf with item put in at i, as two halves
+    static node split_leaf(allocator* _allocator,
+                           uint64_t edit,
+                           const leaf_node_t* leaf,
+                           size_t i,
+                           const entry& item,
+                           node& split)
+    {
+        entry all[width + 1];
+        std::memcpy(all, leaf->entries(), i * sizeof(entry));
+        all[i] = item;
+        std::memcpy(
+          all + i + 1, leaf->entries() + i, (width - i) * sizeof(entry));
+
+        size_t half = (width + 1) / 2;
+        leaf_node left = make_leaf(_allocator, edit);
+        leaf_node right = make_leaf(_allocator, edit);
+        std::memcpy(left->entries(), all, half * sizeof(entry));
+        left->count = half;
+        std::memcpy(
+          right->entries(), all + half, (width + 1 - half) * sizeof(entry));
+        right->count = width + 1 - half;
+        split = std::move(right);
+        return left;
+    }
+
+    // the full internal node with child put in at i, as two halves
+    static node split_internal(allocator* _allocator,
+                               uint64_t edit,
+                               internal_node_t* n,
+                               size_t i,
+                               node& child,
+                               node& split)
+    {
+        K keys[width + 1];
+        node children[width + 1];
+        std::memcpy(keys, n->keys(), i * sizeof(K));
+        keys[i] = first_key(child.get());
+        std::memcpy(keys + i + 1, n->keys() + i, (width - i) * sizeof(K));
+        std::copy(n->children, n->children + i, children);
+        children[i] = std::move(child);
+        std::copy(n->children + i, n->children + width, children + i + 1);
+
+        size_t half = (width + 1) / 2;
+        internal_node left = make_internal(_allocator, edit);
+        internal_node right = make_internal(_allocator, edit);
+        std::memcpy(left->keys(), keys, half * sizeof(K));
+        std::move(children, children + half, left->children);
+        left->count = half;
+        std::memcpy(right->keys(), keys + half, (width + 1 - half) * sizeof(K));
+        std::move(children + half, children + width + 1, right->children);
+        right->count = width + 1 - half;
+        split = std::move(right);
+        return left;
+    }
+
+    // n without the entry for key; it may be left under half full
+    static node erase(allocator* _allocator,
+                      uint64_t edit,
+                      const node& n,
+                      const K& key,
+                      bool& removed)
+    {
+        if (is_leaf(n.get())) {
+            const leaf_node_t* leaf = as_leaf(n.get());
+            size_t i = position_in_leaf(leaf, key);
+            if (i == leaf->count || less(key, leaf->entries()[i].key)) {
+                return n;
+            }
+            removed = true;
+            node result;
+            leaf_node_t* m = writable_leaf(_allocator, edit, n, result);
+            std::memmove(m->entries() + i,
+                         m->entries() + i + 1,
+                         (m->count - i - 1) * sizeof(entry));
+            --m->count;
+            return result;
+        }
+
+        const internal_node_t* in = as_internal(n.get());
+        size_t i = position_in_internal(in, key);
+        node child = erase(_allocator, edit, in->children[i], key, removed);
+        if (child.get() == in->children[i].get() &&
+            (child->count >= min_count || in->count == 1)) {
+            return n;
+        }
+        node result;
+        internal_node_t* m = writable_internal(_allocator, edit, n, result);
+        m->children[i] = std::move(child);
+        if (m->children[i]->count < min_count && m->count > 1) {
+            rebalance(_allocator, edit, m, i);
+        }
+        return result;
+    }
+
+    // Evens out the child at i, which is under half full, with a neighbour:
+    // the two are merged when their contents fit one node, and otherwise
+    // split evenly between them.
+    static void rebalance(allocator* _allocator,
+                          uint64_t edit,
+                          internal_node_t* n,
+                          size_t i)
+    {
+        size_t left = i + 1 < n->count ? i : i - 1;
+        size_t right = left + 1;
+        const node_t* l = n->children[left].get();
+        const node_t* r = n->children[right].get();
+        size_t total = l->count + r->count;
+        size_t left_count = total <= width ? total : total / 2;
+
+        if (is_leaf(l)) {
+            entry all[2 * width];
+            std::memcpy(all, as_leaf(l)->entries(), l->count * sizeof(entry));
+            std::memcpy(all + l->count,
+                        as_leaf(r)->entries(),
+                        r->count * sizeof(entry));
+            leaf_node first = make_leaf(_allocator, edit);
+            std::memcpy(first->entries(), all, left_count * sizeof(entry));
+            first->count = left_count;
+            n->children[left] = std::move(first);
+            if (left_count < total) {
+                leaf_node second = make_leaf(_allocator, edit);
+                std::memcpy(second->entries(),
+                            all + left_count,
+                            (total - left_count) * sizeof(entry));
+                second->count = total - left_count;
+                n->keys()[right] = second->entries()[0].key;
+                n->children[right] = std::move(second);
+                return;
+            }
+        } else {
+            // the right node's first key is only good as far as n says
+            K keys[2 * width];
+            node children[2 * width];
+            std::memcpy(keys, as_internal(l)->keys(), l->count * sizeof(K));
+            std::memcpy(
+              keys + l->count, as_internal(r)->keys(), r->count * sizeof(K));
+            keys[l->count] = n->keys()[right];
+            std::copy(as_internal(l)->children,
+                      as_internal(l)->children + l->count,
+                      children);
+            std::copy(as_internal(r)->children,
+                      as_internal(r)->children + r->count,
+                      children + l->count);
+
+            internal_node first = make_internal(_allocator, edit);
+            std::memcpy(first->keys(), keys, left_count * sizeof(K));
+            std::move(children, children + left_count, first->children);
+            first->count = left_count;
+            n->children[left] = std::move(first);
+            if (left_count < total) {
+                internal_node second = make_internal(_allocator, edit);
+                std::memcpy(second->keys(),
+                            keys + left_count,
+                            (total - left_count) * sizeof(K));
+                std::move(children + left_count,
+                          children + total,
+                          second->children);
+                second->count = total - left_count;
+                n->keys()[right] = second->keys()[0];
+                n->children[right] = std::move(second);
+                return;
+            }
+        }
+
+        // merged: the right slot goes
+        std::memmove(n->keys() + right,
+                     n->keys() + right + 1,
+                     (n->count - right - 1) * sizeof(K));
+        std::move(n->children + right + 1,
+                  n->children + n->count,
+                  n->children + right);
+        n->children[--n->count] = nullptr;
+    }
+
+    // root with item put in, growing the tree when the root splits
+    static node insert_root(allocator* _allocator,
+                            uint64_t edit,
+                            const node& root,
+                            const entry& item,
+                            bool& added)
+    {
+        if (!root) {
+            leaf_node leaf = make_leaf(_allocator, edit);
+            leaf->entries()[0] = item;
+            leaf->count = 1;
+            added = true;
+            return leaf;
+        }
+        node split;
+        node result = insert(_allocator, edit, root, item, added, split);
+        if (!split) {
+            return result;
+        }
+        internal_node newroot = make_internal(_allocator, edit);
+        newroot->keys()[0] = first_key(result.get());
+        newroot->keys()[1] = first_key(split.get());
+        newroot->children[0] = std::move(result);
+        newroot->children[1] = std::move(split);
+        newroot->count = 2;
+        return newroot;
+    }
+
+    // root without the entry for key, dropping a level when the root is
+    // left with one child
+    static node erase_root(allocator* _allocator,
+                           uint64_t edit,
+                           const node& root,
+                           const K& key,
+                           bool& removed)
+    {
+        if (!root) {
+            return root;
+        }
+        node result = erase(_allocator, edit, root, key, removed);
+        if (!is_leaf(result.get()) && result->count == 1) {
+            return as_internal(result.get())->children[0];
+        }
+        if (result->count == 0) {
+            return nullptr;
+        }
+        return result;
+    }
+
+    psorted_map assoc(const K& key, const V& val) const
+    {
+        bool added = false;
+        node newroot = insert_root(_allocator, 0, root, { key, val }, added);
+        return { newroot, count + added, _allocator };
+    }
+
+    psorted_map dissoc(const K& key) const
+    {
+        // erasing copies the path down to the key and rebalances it, which
+        // is wasted on a key that is not there
+        if (!lookup(key)) {
+            return *this;
+        }
+        bool removed = false;
+        node newroot = erase_root(_allocator, 0, root, key, removed);
+        return { newroot, count - 1, _allocator };
+    }
+
+    // * Iteration
+    //
+    // Entries come out in key order. An iterator keeps the path down to its
+    // leaf and walks a leaf's array before climbing to the next one.
+
+    class const_iterator
+    {
+        friend struct psorted_map;
+
+        const internal_node_t* path[max_height];
+        uint8_t slot[max_height];
+        size_t depth = 0;
+        const leaf_node_t* leaf = nullptr;
+        size_t index = 0;
+
+        // down the left edge of n
+        void descend(const node_t* n)
+        {
+            while (!is_leaf(n)) {
+                path[depth] = as_internal(n);
+                slot[depth] = 0;
+                ++depth;
+                n = as_internal(n)->children[0].get();
+            }
+            leaf = as_leaf(n);
+            index = 0;
+        }
+
+        void next_leaf()
+        {
+            while (depth > 0) {
+                const internal_node_t* parent = path[depth - 1];
+                if (slot[depth - 1] + 1 < parent->count) {
+                    ++slot[depth - 1];
+                    descend(parent->children[slot[depth - 1]].get());
+                    return;
+                }
+                --depth;
+            }
+            leaf = nullptr;
+            index = 0;
+        }
+
+      public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef entry value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const entry* pointer;
+        typedef const entry& reference;
+
+        const_iterator() = default;
+
+        reference operator*() const { return leaf->entries()[index]; }
+        pointer operator->() const { return &leaf->entries()[index]; }
+
+        const_iterator& operator++()
+        {
+            if (++index == leaf->count) {
+                next_leaf();
+            }
+            return *this;
+        }
+
+        const_iterator operator++(int)
+        {
+            const_iterator was = *this;
+            ++*this;
+            return was;
+        }
+
+        bool operator==(const const_iterator& other) const
+        {
+            return leaf == other.leaf && index == other.index;
+        }
+        bool operator!=(const const_iterator& other) const
+        {
+            return !(*this == other);
+        }
+    };
+
+    const_iterator begin() const
+    {
+        const_iterator it;
+        if (root) {
+            it.descend(root.get());
+        }
+        return it;
+    }
+
+    const_iterator end() const { return {}; }
+
+    // the first entry whose key is not less than key
+    const_iterator lower_bound(const K& key) const
+    {
+        const_iterator it;
+        if (!root) {
+            return it;
+        }
+        const node_t* n = root.get();
+        while (!is_leaf(n)) {
+            const internal_node_t* in = as_internal(n);
+            size_t i = position_in_internal(in, key);
+            it.path[it.depth] = in;
+            it.slot[it.depth] = i;
+            ++it.depth;
+            n = in->children[i].get();
+        }
+        it.leaf = as_leaf(n);
+        it.index = position_in_leaf(it.leaf, key);
+        if (it.index == it.leaf->count) {
+            it.next_leaf();
+        }
+        return it;
+    }
+
+    // Calls func with each entry whose key is at least from and less than
+    // to, in order.
+    template<typename Func>
+    void for_each_in(const K& from, const K& to, Func&& func) const
+    {
+        for (auto it = lower_bound(from); it != end() && less(it->key, to);
+             ++it) {
+            func(*it);
+        }
+    }
+
+    // A sorted map changed in place. Nodes it creates are its own and are
+    // changed directly from then on; nodes it shares with persistent maps
+    // are copied the first time they change.
+    struct tsorted_map
+    {
+        node root;
+        size_t count;
+        allocator* _allocator;
+        uint64_t edit;
+
+        tsorted_map(const psorted_map& from)
+          : root(from.root)
+          , count(from.count)
+          , _allocator(from._allocator)
+          , edit(new_edit_session())
+        {
+        }
+
+        void ensure_editable() const
+        {
+            if (!edit) {
+                throw std::runtime_error(
+                  "Transient used after it was made persistent!");
+            }
+        }
+
+        tsorted_map& assoc(const K& key, const V& val)
+        {
+            ensure_editable();
+            bool added = false;
+            root = insert_root(_allocator, edit, root, { key, val }, added);
+            count += added;
+            return *this;
+        }
+
+        tsorted_map& dissoc(const K& key)
+        {
+            ensure_editable();
+            if (!lookup(root, key)) {
+                return *this;
+            }
+            bool removed = false;
+            root = erase_root(_allocator, edit, root, key, removed);
+            count -= removed;
+            return *this;
+        }
+
+        psorted_map to_persistent()
+        {
+            ensure_editable();
+            // nodes keep the session, but it is never handed out again
+            edit = 0;
+            return { root, count, _allocator };
+        }
     };
 
-    tvec as_transient() { return { *this }; }
+    tsorted_map as_transient() const { return { *this }; }
 };
 
 #endif
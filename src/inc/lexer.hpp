@@ -15,6 +15,7 @@ struct lexer
     const std::string::const_iterator begin, end;
     std::string::const_iterator iter;
     int curline;
+    long token_start;
 
     enum STATES
     {
@@ -35,13 +36,14 @@ struct lexer
     };
 
     STATES state;
-    const std::set<char> valid_ident_chars{ '_',  '*', '+', '!', '-', '_',
-                                            '\'', '?', '>', '<', '=' };
+    const std::set<char> valid_ident_chars{ '_', '*', '+', '!', '-', '_', '\'',
+                                            '?', '>', '<', '=', '/', '&', '.',
+                                            '^' };
     const std::set<char> valid_symbol_chars{
         '#', '(', ')', '{', '}', '[', ']'
     };
-    const std::set<std::string> valid_literals{ "true", "false", "nil",
-                                                "def",  "let",   "fn" };
+    const std::set<std::string> valid_literals{ "true", "false", "nil", "def",
+                                                "let",  "fn",    "if" };
 
     arena* _arena;
     mystr buffer;
@@ -0,0 +1,45 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <cstddef>
+#include <string>
+
+// Read-only mmap of a whole file. The mapping lives as long as the object, so
+// anything pointing into data() must not outlive it.
+struct mapped_file
+{
+    void* _data;
+    size_t _size;
+
+    mapped_file()
+      : _data(nullptr)
+      , _size(0)
+    {
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    mapped_file(mapped_file&& from);
+    mapped_file& operator=(mapped_file&& from);
+
+    ~mapped_file();
+
+    bool open(const std::string& path);
+    void close();
+
+    const char* data() const { return static_cast<const char*>(_data); }
+    size_t size() const { return _size; }
+
+    explicit operator bool() const { return _data != nullptr; }
+};
+
+// Writes the file next to its final location first and renames it into place,
+// so concurrent readers only ever see complete files.
+bool
+write_file_atomic(const std::string& path, const void* data, size_t size);
+
+bool
+make_directories(const std::string& path);
+
+#endif
@@ -1,15 +1,38 @@
 #ifndef PARSER_HPP
 #define PARSER_HPP
 
+#include <deque>
 #include <fstream>
 #include <functional>
 #include <sstream>
+#include <stdexcept>
 #include <vector>
 
+#include "ast.hpp"
 #include "mystr.hpp"
 #include "string_arena.hpp"
 #include "token.hpp"
 
+// Maps token file positions back to line numbers for error messages and line
+// tables.
+struct source_map
+{
+    std::string name;
+    std::vector<long> line_starts;
+
+    source_map(std::string name, const std::string& source);
+
+    int line_of(long filepos) const;
+};
+
+struct parse_error : std::runtime_error
+{
+    parse_error(const std::string& message)
+      : std::runtime_error(message)
+    {
+    }
+};
+
 struct parser
 {
 
@@ -17,12 +40,30 @@ struct parser
 
     arena* _arena;
 
-    parser(arena* arena, std::istream& inputstream)
-      : _arena(arena)
+    size_t pos;
+
+    // owns every form read so far, deque keeps their addresses stable
+    std::deque<form> forms;
+
+    parser(arena* arena, std::vector<token> tokens)
+      : tokens(std::move(tokens))
+      , _arena(arena)
+      , pos(0)
     {
-        tokens = std::vector<token>();
-        tokens.reserve(100); // @TODO: figure out a good number for this
     }
+
+    bool at_end() const { return pos >= tokens.size(); }
+
+    // reads the next top level form, or returns nullptr at the end of input
+    form* read();
+
+    std::vector<form*> read_all();
+
+  private:
+    form* make_form(form_type type, const token& tok);
+    form* read_seq(form_type type, token_type close, const token& open);
+    form* read_symbol(const token& tok);
+    form* read_hinted(const token& tok);
 };
 
 #endif
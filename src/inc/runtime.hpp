@@ -0,0 +1,628 @@
+#ifndef RUNTIME_HPP
+#define RUNTIME_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "affix_allocator.hpp"
+#include "lang_datastructs.hpp"
+#include "mallocator.hpp"
+#include "ratio.hpp"
+
+struct object;
+struct function_proto;
+struct vm;
+
+struct vm_error : std::runtime_error
+{
+    vm_error(const std::string& message)
+      : std::runtime_error(message)
+    {
+    }
+};
+
+// * Values
+//
+// A value is 8 bytes. Doubles are stored as themselves; everything else hides
+// in the payload of a negative quiet NaN, which no arithmetic produces once
+// NaNs are canonicalized:
+//
+//   | 1 | 11 x 1 | 1 | tag:3 | payload:48 |
+//
+// Ints that fit 48 bits, chars, booleans and nil are immediates. Wider ints,
+// ratios and collections live on the heap and are referenced by tagged
+// pointer, so arithmetic on immediates never allocates.
+
+enum value_type : uint8_t
+{
+    v_nil,
+    v_bool,
+    v_int,
+    v_decimal,
+    v_ratio,
+    v_char,
+    v_object
+};
+
+enum object_type : uint8_t
+{
+    o_int,
+    o_ratio,
+    o_string,
+    o_keyword,
+    o_vector,
+    o_list,
+    o_map,
+    o_set,
+    o_closure,
+    o_native,
+    o_box,
+    o_global,
+    o_shape,
+    o_instance,
+    o_sorted_map
+};
+
+struct value
+{
+    static constexpr uint64_t box_mask = 0xfff8000000000000;
+    static constexpr uint64_t tag_mask = 0xffff000000000000;
+    static constexpr uint64_t payload_mask = 0x0000ffffffffffff;
+
+    static constexpr uint64_t tag_object = 0xfff9000000000000;
+    static constexpr uint64_t tag_int = 0xfffa000000000000;
+    static constexpr uint64_t tag_char = 0xfffb000000000000;
+    static constexpr uint64_t tag_special = 0xfffc000000000000;
+
+    static constexpr uint64_t nil_bits = tag_special | 0;
+    static constexpr uint64_t false_bits = tag_special | 1;
+    static constexpr uint64_t true_bits = tag_special | 2;
+    // held by a global that has no value yet, never seen by programs
+    static constexpr uint64_t unbound_bits = tag_special | 3;
+
+    static constexpr uint64_t canonical_nan = 0x7ff8000000000000;
+
+    static constexpr int64_t fixnum_min = -(int64_t(1) << 47);
+    static constexpr int64_t fixnum_max = (int64_t(1) << 47) - 1;
+
+    uint64_t bits;
+
+    value()
+      : bits(nil_bits)
+    {
+    }
+
+    static value from_bits(uint64_t bits)
+    {
+        value v;
+        v.bits = bits;
+        return v;
+    }
+
+    static value nil() { return {}; }
+
+    static value boolean(bool b) { return from_bits(b ? true_bits : false_bits); }
+
+    static bool fits_fixnum(int64_t i)
+    {
+        return i >= fixnum_min && i <= fixnum_max;
+    }
+
+    // an immediate int, see gc_heap::make_int for ints of any size
+    static value fixnum(int64_t i)
+    {
+        return from_bits(tag_int | ((uint64_t)i & payload_mask));
+    }
+
+    static value decimal(double d)
+    {
+        uint64_t bits;
+        std::memcpy(&bits, &d, sizeof bits);
+        return from_bits(d != d ? canonical_nan : bits);
+    }
+
+    static value character(char c)
+    {
+        return from_bits(tag_char | (unsigned char)c);
+    }
+
+    static value obj(object* o)
+    {
+        return from_bits(tag_object | (uint64_t)(uintptr_t)o);
+    }
+
+    bool is_nil() const { return bits == nil_bits; }
+    bool is_bool() const { return bits == true_bits || bits == false_bits; }
+    bool is_fixnum() const { return (bits & tag_mask) == tag_int; }
+    bool is_decimal() const { return (bits & box_mask) != box_mask; }
+    bool is_char() const { return (bits & tag_mask) == tag_char; }
+    // true for every heap allocated value, ints and ratios included
+    bool is_object() const { return (bits & tag_mask) == tag_object; }
+    inline bool is_object(object_type t) const;
+    bool is_int() const { return is_fixnum() || is_object(o_int); }
+    bool is_ratio() const { return is_object(o_ratio); }
+    bool is_number() const
+    {
+        return is_fixnum() || is_decimal() || is_object(o_int) ||
+               is_object(o_ratio);
+    }
+
+    inline value_type type() const;
+
+    bool as_bool() const { return bits == true_bits; }
+    int64_t as_fixnum() const { return (int64_t)(bits << 16) >> 16; }
+    inline int64_t as_int() const;
+    double as_decimal() const
+    {
+        double d;
+        std::memcpy(&d, &bits, sizeof d);
+        return d;
+    }
+    inline ratio as_ratio() const;
+    char as_char() const { return (char)(bits & 0xff); }
+    object* as_object() const { return (object*)(uintptr_t)(bits & payload_mask); }
+
+    template<typename T>
+    T* as() const
+    {
+        return static_cast<T*>(as_object());
+    }
+
+    bool truthy() const { return bits != nil_bits && bits != false_bits; }
+};
+
+static_assert(sizeof(value) == 8, "values are NaN-boxed into 8 bytes");
+
+// * Heap objects
+
+using rt_allocator = alb::affix_allocator<alb::mallocator, size_t>;
+
+// every persistent collection the runtime creates uses this allocator
+extern rt_allocator runtime_allocator;
+
+using value_vec = pvec<value, rt_allocator>;
+using value_list = plist<value, rt_allocator>;
+
+// keys of maps and sets are hashed and compared with value_hash and
+// values_equal
+struct value_hasher
+{
+    size_t operator()(value v) const;
+};
+
+struct value_equal_to
+{
+    bool operator()(value a, value b) const;
+};
+
+using value_map =
+  pmap<value, value, rt_allocator, value_hasher, value_equal_to>;
+using value_set = pset<value, rt_allocator, value_hasher, value_equal_to>;
+
+// keys of sorted maps are ordered with compare_values
+struct value_less
+{
+    bool operator()(value a, value b) const;
+};
+
+using value_sorted_map = psorted_map<value, value, rt_allocator, value_less>;
+
+struct object
+{
+    object_type type;
+    bool marked;
+    object* next;
+};
+
+bool
+value::is_object(object_type t) const
+{
+    return is_object() && as_object()->type == t;
+}
+
+// ints too wide for an immediate
+struct int_obj : object
+{
+    static constexpr object_type tag = o_int;
+
+    int64_t num;
+
+    int_obj(int64_t num)
+      : num(num)
+    {
+    }
+};
+
+struct ratio_obj : object
+{
+    static constexpr object_type tag = o_ratio;
+
+    ratio num;
+
+    ratio_obj(ratio num)
+      : num(num)
+    {
+    }
+};
+
+value_type
+value::type() const
+{
+    if (is_decimal()) {
+        return v_decimal;
+    }
+    switch (bits & tag_mask) {
+        case tag_int:
+            return v_int;
+        case tag_char:
+            return v_char;
+        case tag_special:
+            return bits == nil_bits ? v_nil : v_bool;
+    }
+    switch (as_object()->type) {
+        case o_int:
+            return v_int;
+        case o_ratio:
+            return v_ratio;
+        default:
+            return v_object;
+    }
+}
+
+int64_t
+value::as_int() const
+{
+    return is_fixnum() ? as_fixnum() : as<int_obj>()->num;
+}
+
+ratio
+value::as_ratio() const
+{
+    return as<ratio_obj>()->num;
+}
+
+struct string_obj : object
+{
+    static constexpr object_type tag = o_string;
+
+    std::string str;
+
+    string_obj(std::string str)
+      : str(std::move(str))
+    {
+    }
+};
+
+struct keyword_obj : object
+{
+    static constexpr object_type tag = o_keyword;
+
+    std::string name;
+
+    keyword_obj(std::string name)
+      : name(std::move(name))
+    {
+    }
+};
+
+struct vector_obj : object
+{
+    static constexpr object_type tag = o_vector;
+
+    value_vec items;
+
+    vector_obj(value_vec items)
+      : items(items)
+    {
+    }
+};
+
+struct list_obj : object
+{
+    static constexpr object_type tag = o_list;
+
+    value_list items;
+
+    list_obj(value_list items)
+      : items(items)
+    {
+    }
+};
+
+struct map_obj : object
+{
+    static constexpr object_type tag = o_map;
+
+    value_map entries;
+
+    map_obj(value_map entries)
+      : entries(entries)
+    {
+    }
+
+    size_t count() const { return entries.count; }
+};
+
+struct set_obj : object
+{
+    static constexpr object_type tag = o_set;
+
+    value_set items;
+
+    set_obj(value_set items)
+      : items(items)
+    {
+    }
+};
+
+struct sorted_map_obj : object
+{
+    static constexpr object_type tag = o_sorted_map;
+
+    value_sorted_map entries;
+
+    sorted_map_obj(value_sorted_map entries)
+      : entries(entries)
+    {
+    }
+
+    size_t count() const { return entries.count; }
+};
+
+// A flat closure: the values it captured are copied into an array right
+// after the object, see gc_heap::make_closure.
+struct closure_obj : object
+{
+    static constexpr object_type tag = o_closure;
+
+    function_proto* proto;
+    uint32_t capture_count;
+
+    closure_obj(function_proto* proto, uint32_t capture_count)
+      : proto(proto)
+      , capture_count(capture_count)
+    {
+    }
+
+    value* captures() { return reinterpret_cast<value*>(this + 1); }
+};
+
+// A variable that closures capture and something assigns to; the closures
+// and the function declaring it share the box instead of copies.
+struct box_obj : object
+{
+    static constexpr object_type tag = o_box;
+
+    value item;
+
+    box_obj(value item)
+      : item(item)
+    {
+    }
+};
+
+// The cell of a global variable, see vm::global. Compiled code refers to the
+// cell itself, so it never looks the name up.
+struct global_obj : object
+{
+    static constexpr object_type tag = o_global;
+
+    std::string name;
+    value item;
+
+    global_obj(std::string name)
+      : name(std::move(name))
+      , item(value::from_bits(value::unbound_bits))
+    {
+    }
+
+    bool bound() const { return item.bits != value::unbound_bits; }
+};
+
+// The hidden class of struct instances: the order of their fields and their
+// methods, shared by every instance of one defstruct. Calling a shape makes an
+// instance. Shapes never change, so what an inline cache learned about one
+// stays true.
+struct shape_obj : object
+{
+    static constexpr object_type tag = o_shape;
+
+    std::string name;
+    std::vector<std::string> fields;
+    std::vector<std::string> method_names;
+    std::vector<value> methods;
+
+    shape_obj(std::string name)
+      : name(std::move(name))
+    {
+    }
+
+    // -1 if there is none
+    int field_index(const std::string& field) const;
+    int method_index(const std::string& method) const;
+};
+
+// A struct instance: its fields follow the object in one fixed-size array, in
+// the order of its shape, see gc_heap::make_instance.
+struct instance_obj : object
+{
+    static constexpr object_type tag = o_instance;
+
+    shape_obj* shape;
+
+    instance_obj(shape_obj* shape)
+      : shape(shape)
+    {
+    }
+
+    value* slots() { return reinterpret_cast<value*>(this + 1); }
+};
+
+typedef value (*native_fn)(vm& vm, value* args, int argc);
+
+struct native_obj : object
+{
+    static constexpr object_type tag = o_native;
+
+    const char* name;
+    native_fn fn;
+    int min_args;
+    int max_args; // -1 for variadic
+
+    native_obj(const char* name, native_fn fn, int min_args, int max_args)
+      : name(name)
+      , fn(fn)
+      , min_args(min_args)
+      , max_args(max_args)
+    {
+    }
+};
+
+// * Garbage collected heap
+//
+// Objects are kept in an intrusive list and collected by mark and sweep. The
+// heap never collects on its own; the vm asks should_collect() at safe points
+// and then marks its roots before calling sweep(). Function protos are not on
+// the heap, but a marked closure marks its proto, and with it the constants
+// and nested protos its code can reach.
+struct gc_heap
+{
+    object* objects;
+    size_t count;
+    size_t next_collection;
+
+    std::unordered_map<std::string, keyword_obj*> keywords;
+
+    std::vector<object*> gray;
+    std::vector<function_proto*> gray_protos;
+    // a proto is marked when its marked_in is the current collection
+    uint32_t collection;
+
+    static constexpr size_t min_collection = 1 << 16;
+
+    gc_heap();
+    ~gc_heap();
+
+    gc_heap(const gc_heap&) = delete;
+
+    template<typename T, typename... Args>
+    T* make(Args&&... args)
+    {
+        return track(new T(std::forward<Args>(args)...));
+    }
+
+    // a closure with room for captures values, all nil
+    closure_obj* make_closure(function_proto* proto, uint32_t captures);
+
+    // an instance with every field nil
+    instance_obj* make_instance(shape_obj* shape);
+
+    // an immediate when i fits, a boxed int otherwise
+    value make_int(int64_t i)
+    {
+        return value::fits_fixnum(i) ? value::fixnum(i)
+                                     : value::obj(make<int_obj>(i));
+    }
+
+    value make_string(std::string str);
+    value intern_keyword(const std::string& name);
+    value make_vector(value_vec items);
+    value make_list(value_list items);
+    value make_map(value_map entries);
+    value make_set(value_set items);
+    value make_sorted_map(value_sorted_map entries);
+
+    bool should_collect() const { return count >= next_collection; }
+
+    void mark(value v)
+    {
+        if (v.is_object()) {
+            mark(v.as_object());
+        }
+    }
+
+    void mark(object* obj)
+    {
+        if (!obj->marked) {
+            obj->marked = true;
+            gray.push_back(obj);
+        }
+    }
+
+    void mark(function_proto* proto);
+
+    // marks everything reachable from the objects marked so far
+    void trace();
+
+    // frees every unmarked object and clears the marks of the survivors
+    size_t sweep();
+
+    static void free_object(object* obj);
+
+  private:
+    template<typename T>
+    T* track(T* obj)
+    {
+        obj->type = T::tag;
+        obj->marked = false;
+        obj->next = objects;
+        objects = obj;
+        ++count;
+        return obj;
+    }
+};
+
+// * Operations on values
+
+const char*
+type_name(value v);
+
+bool
+values_equal(value a, value b);
+
+// agrees with values_equal: equal values hash the same
+size_t
+value_hash(value v);
+
+// returns <0, 0, >0; throws vm_error for values without an order
+int
+compare_values(value a, value b);
+
+// normalizes counter/divider; returns an int for whole results and a decimal
+// when the parts do not fit a ratio
+value
+make_ratio(gc_heap& heap, int64_t counter, int64_t divider);
+
+value
+value_add(gc_heap& heap, value a, value b);
+value
+value_sub(gc_heap& heap, value a, value b);
+value
+value_mul(gc_heap& heap, value a, value b);
+value
+value_div(gc_heap& heap, value a, value b);
+value
+value_neg(gc_heap& heap, value a);
+
+void
+print_value(std::ostream& stream, value v, bool readable);
+
+std::ostream&
+operator<<(std::ostream& stream, value v);
+
+// map helpers, shared by the vm and the builtins
+value
+map_get(map_obj* map, value key, value not_found);
+value
+map_assoc(gc_heap& heap, map_obj* map, value key, value val);
+bool
+set_contains(set_obj* set, value item);
+value
+set_conj(gc_heap& heap, set_obj* set, value item);
+
+#endif
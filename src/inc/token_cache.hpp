@@ -0,0 +1,82 @@
+#ifndef TOKEN_CACHE_HPP
+#define TOKEN_CACHE_HPP
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "mapped_file.hpp"
+#include "string_arena.hpp"
+#include "token.hpp"
+
+// On-disk cache of lexed sources.
+//
+// A cache file holds the token stream of one source text, keyed by a hash of
+// the text and the compiler version. Identifier, keyword and string payloads
+// are interned into one string table at the end of the file; loading maps the
+// file and points the tokens' strings straight into the mapping, so nothing is
+// re-lexed and no string data is copied.
+//
+// Layout (all little endian, native widths):
+//   cache_header
+//   cached_token[token_count]
+//   char strings[string_bytes]   every entry NUL terminated
+struct token_cache
+{
+    static constexpr uint32_t magic = 0x43544c46; // "FLTC"
+    static constexpr uint32_t format_version = 2;
+
+    struct cache_header
+    {
+        uint32_t magic;
+        uint32_t format_version;
+        uint64_t key;
+        uint64_t source_size;
+        uint64_t token_count;
+        uint64_t string_bytes;
+    };
+
+    struct cached_token
+    {
+        uint32_t type;
+        uint32_t ts;
+        int64_t filepos;
+        union
+        {
+            int32_t data_int;
+            ratio data_rat;
+            double data_decimal;
+            int64_t data_long;
+            char data_char;
+            struct
+            {
+                uint64_t offset;
+                uint64_t len;
+            } data_str;
+        };
+    };
+
+    std::string directory;
+    bool enabled;
+
+    // keeps the string data of loaded token streams alive
+    std::list<mapped_file> mappings;
+
+    token_cache(std::string directory);
+
+    static std::string default_directory();
+
+    uint64_t key_for(const std::string& source) const;
+    std::string path_for(uint64_t key) const;
+
+    bool load(const std::string& source, std::vector<token>& tokens);
+    bool store(const std::string& source, const std::vector<token>& tokens);
+};
+
+// Returns the tokens of source, from the cache when possible. On a miss the
+// source is lexed into the arena and the result written back to the cache.
+std::vector<token>
+lex_cached(token_cache* cache, arena* arena, const std::string& source);
+
+#endif
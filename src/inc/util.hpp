@@ -3,6 +3,7 @@
 
 #include "mystr.hpp"
 #include "execinfo.h"
+#include <cstdint>
 #include <string>
 
 template<typename A, typename B>
@@ -22,6 +23,11 @@ mstoi(mystr s);
 double
 mstod(mystr s);
 
+constexpr uint64_t fnv1a64_basis = 14695981039346656037ull;
+
+uint64_t
+fnv1a64(const char* data, size_t len, uint64_t seed = fnv1a64_basis);
+
 std::string get_caller();
 
 std::string get_caller(size_t levels);
@@ -0,0 +1,6 @@
+#ifndef VERSION_HPP
+#define VERSION_HPP
+
+#define FUNLANG_VERSION "0.3.0"
+
+#endif
@@ -0,0 +1,262 @@
+#ifndef VM_HPP
+#define VM_HPP
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bytecode.hpp"
+#include "jit.hpp"
+#include "runtime.hpp"
+
+// Dispatch through a table of label addresses where the compiler supports it,
+// otherwise through a switch. Build with -DFUNLANG_COMPUTED_GOTO=0 to force
+// the portable loop.
+#ifndef FUNLANG_COMPUTED_GOTO
+#if defined(__GNUC__)
+#define FUNLANG_COMPUTED_GOTO 1
+#else
+#define FUNLANG_COMPUTED_GOTO 0
+#endif
+#endif
+
+struct call_frame
+{
+    closure_obj* closure;
+    // saved program counter while this frame is not the innermost one
+    const instr* pc;
+    value* base;
+};
+
+struct vm_profile
+{
+    uint64_t executed;
+    uint64_t op_counts[op_count];
+
+    // counts of opcodes executed right after each other, indexed by
+    // first * op_count + second, and likewise for three in a row; sized on
+    // the first record
+    std::vector<uint64_t> pair_counts;
+    std::vector<uint64_t> triple_counts;
+    int previous[2];
+
+    vm_profile() { reset(); }
+
+    void reset()
+    {
+        executed = 0;
+        std::fill(op_counts, op_counts + op_count, 0);
+        pair_counts.clear();
+        triple_counts.clear();
+        previous[0] = previous[1] = -1;
+    }
+
+    void record(opcode op)
+    {
+        ++executed;
+        ++op_counts[op];
+
+        if (pair_counts.empty()) {
+            pair_counts.resize(op_count * op_count);
+            triple_counts.resize(op_count * op_count * op_count);
+        }
+        if (previous[1] >= 0) {
+            ++pair_counts[previous[1] * op_count + op];
+            if (previous[0] >= 0) {
+                ++triple_counts[(previous[0] * op_count + previous[1]) *
+                                  op_count +
+                                op];
+            }
+        }
+        previous[0] = previous[1];
+        previous[1] = op;
+    }
+
+    // prints the opcode counts and the most frequent pairs and triples
+    void dump(std::ostream& stream, size_t top = 10) const;
+};
+
+// Registers of all active frames. The whole range is reserved up front but
+// only backed by memory as deep as calls actually go, so the stack grows with
+// the call depth without ever moving and pointers into it, like the arguments
+// a native gets, stay valid.
+struct value_stack
+{
+    value* _data;
+    size_t _size;
+
+    explicit value_stack(size_t size);
+    ~value_stack();
+
+    value_stack(const value_stack&) = delete;
+    value_stack& operator=(const value_stack&) = delete;
+
+    value* data() const { return _data; }
+    size_t size() const { return _size; }
+};
+
+struct vm
+{
+    // frames overlap on call arguments
+    static constexpr size_t stack_size = 1 << 26;
+    static constexpr size_t max_frames = 1 << 22;
+
+    gc_heap heap;
+
+    // cells of global variables by name; cells are never removed, so code
+    // holding one sees every later definition
+    std::unordered_map<std::string, global_obj*> globals;
+
+    std::vector<std::unique_ptr<function_proto>> protos;
+
+    value_stack stack;
+    value* stack_top;
+
+    std::vector<call_frame> frames;
+
+    // values natives hold on to while calling back into the vm
+    std::vector<value> temp_roots;
+
+    bool profiling;
+    vm_profile profile;
+
+    // compiles hot functions to machine code; profiling runs stay in the
+    // interpreter
+    jit_compiler jit;
+
+    // Calls into the vm from C++, as when a builtin calls back a function it
+    // was given, run the interpreter on the C++ stack. They are counted, and
+    // the outermost one notes where that stack stood, so nested ones fail
+    // before using more of it than native_budget bytes.
+    size_t reentries;
+    const char* native_base;
+    size_t native_budget;
+
+    vm();
+
+    vm(const vm&) = delete;
+
+    function_proto* new_proto();
+
+    // the cell of global name, unbound when it is new
+    global_obj* global(const std::string& name);
+
+    void define_native(const char* name,
+                       native_fn fn,
+                       int min_args,
+                       int max_args);
+
+    // runs a prototype compiled from a top level form
+    value run(function_proto* proto);
+
+    value call(value fn, int argc, const value* args);
+
+    // an instance of shape with the given field values
+    value construct(shape_obj* shape, const value* args, int argc);
+
+    // a closure of proto created by a function running on registers R, as
+    // enclosing; functions capturing nothing share one closure
+    closure_obj* make_closure(function_proto* proto,
+                              const value* R,
+                              closure_obj* enclosing);
+
+    void collect_garbage();
+
+  private:
+    value execute(size_t entry_depth);
+
+    template<bool Profile>
+    value dispatch(size_t entry_depth);
+
+    [[noreturn]] void unwind(const vm_error& error,
+                             const instr* pc,
+                             size_t entry_depth);
+};
+
+// Keeps values pushed to vm::temp_roots alive until the guard goes out of
+// scope.
+struct root_guard
+{
+    vm& _vm;
+    size_t mark;
+
+    root_guard(vm& vm)
+      : _vm(vm)
+      , mark(vm.temp_roots.size())
+    {
+    }
+
+    ~root_guard() { _vm.temp_roots.resize(mark); }
+
+    void push(value v) { _vm.temp_roots.push_back(v); }
+};
+
+void
+install_builtins(vm& vm);
+
+// * Struct access
+//
+// Field and method lookups go through the inline cache of their site; the
+// slow paths resolve the name in the instance's shape, raise the error if
+// there is no such field or method and cache the result.
+
+int
+field_slot(access_site& site, value obj);
+
+int
+method_slot(access_site& site, value obj);
+
+inline value
+get_field(access_site& site, value obj)
+{
+    int slot = obj.is_object(o_instance)
+                 ? site.cache.lookup(obj.as<instance_obj>()->shape)
+                 : -1;
+    if (slot < 0) {
+        slot = field_slot(site, obj);
+    }
+    return obj.as<instance_obj>()->slots()[slot];
+}
+
+inline void
+set_field(access_site& site, value obj, value v)
+{
+    int slot = obj.is_object(o_instance)
+                 ? site.cache.lookup(obj.as<instance_obj>()->shape)
+                 : -1;
+    if (slot < 0) {
+        slot = field_slot(site, obj);
+    }
+    obj.as<instance_obj>()->slots()[slot] = v;
+}
+
+inline value
+get_method(access_site& site, value obj)
+{
+    int slot = obj.is_object(o_instance)
+                 ? site.cache.lookup(obj.as<instance_obj>()->shape)
+                 : -1;
+    if (slot < 0) {
+        slot = method_slot(site, obj);
+    }
+    return obj.as<instance_obj>()->shape->methods[slot];
+}
+
+// * Type hints
+
+[[noreturn]] void
+check_failed(value v, int type);
+
+// v, if it has type, a checked_type
+inline value
+checked(value v, int type)
+{
+    bool ok = type == checked_int ? v.is_int() : v.is_decimal();
+    if (!ok) {
+        check_failed(v, type);
+    }
+    return v;
+}
+
+#endif
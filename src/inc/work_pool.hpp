@@ -0,0 +1,77 @@
+#ifndef WORK_POOL_HPP
+#define WORK_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Threads sharing out ranges of independent work. Each thread keeps a deque
+// of ranges: it halves the range it is about to run, pushes the upper half
+// on the back and carries on with the lower one, so it mostly takes its own
+// most recent, smallest ranges back. A thread out of work steals from the
+// front of another's deque, where the oldest and largest ranges are. The
+// thread calling for_range works along until its ranges are all done.
+class work_pool
+{
+  public:
+    typedef std::function<void(size_t, size_t)> range_body;
+
+    explicit work_pool(size_t workers);
+    ~work_pool();
+
+    work_pool(const work_pool&) = delete;
+    work_pool& operator=(const work_pool&) = delete;
+
+    // the threads a for_range runs on, the calling one included
+    size_t concurrency() const { return threads.size() + 1; }
+
+    // Calls body(first, last) for consecutive ranges covering [0, n), none
+    // longer than grain, spread over the pool. Returns once all have run;
+    // when one throws, ranges not yet started are skipped and the first
+    // exception is rethrown here.
+    void for_range(size_t n, size_t grain, const range_body& body);
+
+    // One thread per core, the caller included, or FUNLANG_THREADS of
+    // them. Started on first use.
+    static work_pool& shared();
+
+  private:
+    struct job;
+
+    struct task
+    {
+        job* owner;
+        size_t first;
+        size_t last;
+    };
+
+    struct queue
+    {
+        std::mutex lock;
+        std::deque<task> tasks;
+    };
+
+    // one per worker, then one shared by threads outside the pool
+    std::vector<std::unique_ptr<queue>> queues;
+    std::vector<std::thread> threads;
+
+    std::atomic<size_t> queued{ 0 };
+    std::mutex sleep_lock;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    queue& home();
+    void push(queue& q, const task& t);
+    bool pop(queue& q, task& t);
+    bool steal(const queue& thief, task& t);
+    void run(task t, queue& q);
+    void work(size_t index);
+};
+
+#endif
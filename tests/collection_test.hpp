@@ -0,0 +1,53 @@
+#ifndef COLLECTION_TEST_HPP
+#define COLLECTION_TEST_HPP
+
+// Helpers for the randomized differential tests of the persistent
+// collections. Each test runs random operations on a collection and on a
+// standard container side by side, keeps a pool of older versions to check
+// that later operations leave them alone, and checks the tree's invariants
+// along the way. Small branching factors give deep trees from few items.
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "affix_allocator.hpp"
+#include "lang_datastructs.hpp"
+#include "mallocator.hpp"
+
+typedef alb::affix_allocator<alb::mallocator, size_t> test_allocator;
+
+static test_allocator alloc;
+
+// the test and seed running, for failure messages
+static const char* running = "";
+static unsigned running_seed = 0;
+
+static void
+check(bool ok, const char* what)
+{
+    if (!ok) {
+        fprintf(stderr,
+                "%s, seed %u: %s failed\n",
+                running,
+                running_seed,
+                what);
+        exit(1);
+    }
+}
+
+// keeps up to 12 versions, replacing random ones once full
+template<typename Version>
+static void
+keep(std::vector<Version>& pool, Version version, std::mt19937& rng)
+{
+    if (pool.size() < 12) {
+        pool.push_back(std::move(version));
+    } else {
+        pool[rng() % pool.size()] = std::move(version);
+    }
+}
+
+#endif
@@ -0,0 +1,236 @@
+// Randomized tests of hash maps and sets against the standard unordered
+// ones, with hashes that collide down to collision nodes.
+
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "collection_test.hpp"
+
+// few distinct hashes, so keys collide all the way down
+struct colliding_hash
+{
+    size_t operator()(long key) const { return key % 7; }
+};
+
+struct mixing_hash
+{
+    size_t operator()(long key) const
+    {
+        uint64_t x = key;
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdull;
+        x ^= x >> 33;
+        return x;
+    }
+};
+
+template<typename Hash>
+struct hash_test
+{
+    typedef pmap<long, long, test_allocator, Hash> map;
+    typedef pset<long, test_allocator, Hash> set;
+    typedef std::unordered_map<long, long> map_model;
+    typedef std::unordered_set<long> set_model;
+
+    // Whether a and b are laid out alike. The trie's shape only depends on
+    // what it holds, however it was built; only entries with equal hashes
+    // keep the order they came in.
+    template<typename Trie>
+    static bool same_shape(const typename Trie::node_t* a,
+                           const typename Trie::node_t* b)
+    {
+        if (a->datamap != b->datamap || a->nodemap != b->nodemap ||
+            a->entry_count != b->entry_count ||
+            a->child_count != b->child_count) {
+            return false;
+        }
+        for (size_t i = 0; i < a->child_count; ++i) {
+            if (!same_shape<Trie>(a->children()[i], b->children()[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // checks that no node below the root is a lone entry, which belongs in
+    // its parent
+    template<typename Trie>
+    static void check_node(const typename Trie::node_t* n, bool root)
+    {
+        if (!root) {
+            check(n->entry_count + n->child_count > 0, "hash node empty");
+            check(n->entry_count != 1 || n->child_count != 0,
+                  "hash lone entry left in a child");
+        }
+        for (size_t i = 0; i < n->child_count; ++i) {
+            check_node<Trie>(n->children()[i], false);
+        }
+    }
+
+    template<typename Trie>
+    static void check_layout(const Trie& built, const Trie& fresh)
+    {
+        check(!built.root == !fresh.root, "hash root");
+        if (built.root) {
+            check_node<Trie>(built.root.get(), true);
+            check(same_shape<Trie>(built.root.get(), fresh.root.get()),
+                  "hash layout independent of history");
+        }
+    }
+
+    static void same(const map& v, const map_model& m, std::mt19937& rng)
+    {
+        check(v.count == m.size(), "map count");
+        size_t seen = 0;
+        for (auto& entry : v) {
+            auto found = m.find(entry.key);
+            check(found != m.end() && found->second == entry.val,
+                  "map iteration");
+            ++seen;
+        }
+        check(seen == m.size(), "map iteration count");
+        map fresh{ &alloc };
+        for (auto& entry : m) {
+            const long* val = v.find(entry.first);
+            check(val && *val == entry.second, "map find");
+            fresh = fresh.assoc(entry.first, entry.second);
+        }
+        check_layout(v, fresh);
+        for (int i = 0; i < 20; ++i) {
+            long key = rng() % 3000;
+            check(v.contains(key) == (m.count(key) > 0), "map contains");
+        }
+    }
+
+    static void same(const set& v, const set_model& m)
+    {
+        check(v.count == m.size(), "set count");
+        size_t seen = 0;
+        for (long key : v) {
+            check(m.count(key) > 0, "set iteration");
+            ++seen;
+        }
+        check(seen == m.size(), "set iteration count");
+        set fresh{ &alloc };
+        for (long key : m) {
+            check(v.contains(key), "set contains");
+            fresh = fresh.conj(key);
+        }
+        check_layout(v, fresh);
+    }
+
+    static void run(unsigned seed, int steps, long range)
+    {
+        running_seed = seed;
+        std::mt19937 rng(seed);
+        std::vector<std::pair<map, map_model>> maps{ { map{ &alloc }, {} } };
+        std::vector<std::pair<set, set_model>> sets{ { set{ &alloc }, {} } };
+
+        for (int step = 0; step < steps; ++step) {
+            auto& from = maps[rng() % maps.size()];
+            map v = from.first;
+            map_model m = from.second;
+            switch (rng() % 4) {
+                case 0:
+                    for (int n = rng() % 50; n > 0; --n) {
+                        long key = rng() % range;
+                        long val = rng();
+                        v = v.assoc(key, val);
+                        m[key] = val;
+                    }
+                    break;
+                case 1:
+                    for (int n = rng() % 50; n > 0; --n) {
+                        long key = rng() % range;
+                        map removed = v.dissoc(key);
+                        if (!m.count(key)) {
+                            check(removed.root.get() == v.root.get(),
+                                  "map dissoc of a missing key");
+                        }
+                        v = removed;
+                        m.erase(key);
+                    }
+                    break;
+                case 2: {
+                    auto t = v.as_transient();
+                    for (int n = rng() % 300; n > 0; --n) {
+                        long key = rng() % range;
+                        if (rng() % 3) {
+                            long val = rng();
+                            t.assoc(key, val);
+                            m[key] = val;
+                        } else {
+                            t.dissoc(key);
+                            m.erase(key);
+                        }
+                    }
+                    v = t.to_persistent();
+                    same(from.first, from.second, rng);
+                } break;
+                case 3: {
+                    // removes most entries in place
+                    auto t = v.as_transient();
+                    for (auto it = m.begin(); it != m.end();) {
+                        if (rng() % 4) {
+                            t.dissoc(it->first);
+                            it = m.erase(it);
+                        } else {
+                            ++it;
+                        }
+                    }
+                    v = t.to_persistent();
+                } break;
+            }
+            same(v, m, rng);
+            keep(maps, { v, m }, rng);
+
+            auto& set_from = sets[rng() % sets.size()];
+            set s = set_from.first;
+            set_model sm = set_from.second;
+            if (rng() % 2) {
+                auto t = s.as_transient();
+                for (int n = 0; n < 100; ++n) {
+                    long key = rng() % range;
+                    if (rng() % 3) {
+                        t.conj(key);
+                        sm.insert(key);
+                    } else {
+                        t.disj(key);
+                        sm.erase(key);
+                    }
+                }
+                s = t.to_persistent();
+            } else {
+                for (int n = 0; n < 30; ++n) {
+                    long key = rng() % range;
+                    if (rng() % 3) {
+                        s = s.conj(key);
+                        sm.insert(key);
+                    } else {
+                        s = s.disj(key);
+                        sm.erase(key);
+                    }
+                }
+            }
+            same(s, sm);
+            keep(sets, { s, sm }, rng);
+        }
+    }
+};
+
+int
+main()
+{
+    for (unsigned seed = 1; seed <= 3; ++seed) {
+        running = "hash map, colliding hash";
+        hash_test<colliding_hash>::run(seed, 300, 200);
+        running = "hash map, mixing hash";
+        hash_test<mixing_hash>::run(seed, 300, 1000);
+        running = "hash map, std::hash";
+        hash_test<std::hash<long>>::run(seed, 150, 100000);
+    }
+    puts("ok");
+    return 0;
+}
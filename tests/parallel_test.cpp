@@ -0,0 +1,197 @@
+// Randomized tests of the parallel vector operations against sequential
+// loops over std::vector, on balanced and relaxed trees.
+
+#include <atomic>
+#include <numeric>
+#include <stdexcept>
+#include <thread>
+
+#include "collection_test.hpp"
+
+template<size_t Bits>
+struct parallel_test
+{
+    typedef pvec<long, test_allocator, Bits> vec;
+    typedef std::vector<long> model;
+
+    static void same(const vec& v, const model& m)
+    {
+        check(v.count == m.size(), "parallel count");
+        size_t i = 0;
+        for (long item : v) {
+            check(item == m[i++], "parallel items");
+        }
+    }
+
+    static void check_all(const vec& v, const model& m)
+    {
+        same(v, m);
+
+        // reduce runs in order on one thread
+        auto step = [](long acc, long x) {
+            return (long)((unsigned long)acc * 3 + (unsigned long)x);
+        };
+        long expected = 0;
+        for (long x : m) {
+            expected = step(expected, x);
+        }
+        check(v.reduce(0L, step) == expected, "reduce");
+
+        check(v.fold(0L, [](long a, long b) { return a + b; }) ==
+                std::accumulate(m.begin(), m.end(), 0L),
+              "fold");
+
+        // an associative fold that is not commutative: the pieces have to be
+        // combined in order. A pair is a count and a polynomial hash.
+        typedef std::pair<long, unsigned long> hashed;
+        auto add = [](hashed acc, long x) {
+            return hashed{ acc.first + 1,
+                           acc.second * 1000003ul + (unsigned long)x };
+        };
+        auto combine = [](hashed left, hashed right) {
+            unsigned long scale = 1;
+            for (long i = 0; i < right.first; ++i) {
+                scale *= 1000003ul;
+            }
+            return hashed{ left.first + right.first,
+                           left.second * scale + right.second };
+        };
+        hashed folded = v.fold(hashed{ 0, 0 }, add, combine);
+        hashed in_order{ 0, 0 };
+        for (long x : m) {
+            in_order = add(in_order, x);
+        }
+        check(folded == in_order, "fold order");
+
+        vec mapped = v.map([](long x) { return x * 2 + 1; });
+        model mapped_model;
+        for (long x : m) {
+            mapped_model.push_back(x * 2 + 1);
+        }
+        same(mapped, mapped_model);
+        mapped_model.push_back(5);
+        same(mapped.conj(5), mapped_model);
+
+        auto halves = v.map([](long x) { return double(x) / 2; });
+        size_t i = 0;
+        for (double half : halves) {
+            check(half == double(m[i++]) / 2, "map to another type");
+        }
+
+        vec kept = v.filter([](long x) { return x % 3 == 0; });
+        model kept_model;
+        for (long x : m) {
+            if (x % 3 == 0) {
+                kept_model.push_back(x);
+            }
+        }
+        same(kept, kept_model);
+        same(kept.conj(7).pop(), kept_model);
+        for (size_t k = 0; k < kept_model.size(); k += 97) {
+            check(kept.nth(k) == kept_model[k], "filter nth");
+        }
+        check(v.filter([](long) { return false; }).count == 0, "filter none");
+        same(v.filter([](long) { return true; }), m);
+
+        if (!m.empty()) {
+            long middle = m[m.size() / 2];
+            bool threw = false;
+            try {
+                v.map([&](long x) {
+                    if (x == middle) {
+                        throw std::runtime_error("from map");
+                    }
+                    return x;
+                });
+            } catch (std::runtime_error&) {
+                threw = true;
+            }
+            check(threw, "map passes exceptions on");
+        }
+    }
+
+    // vectors of up to parallel_grain items are not worth other threads,
+    // even when they have a tree and a tail to split
+    static void check_sequential(std::mt19937& rng)
+    {
+        std::thread::id caller = std::this_thread::get_id();
+        std::atomic<bool> elsewhere{ false };
+        auto note = [&] {
+            if (std::this_thread::get_id() != caller) {
+                elsewhere = true;
+            }
+        };
+        auto add = [&](long a, long b) {
+            note();
+            return a + b;
+        };
+        auto same = [&](long x) {
+            note();
+            return x;
+        };
+        auto all = [&](long) {
+            note();
+            return true;
+        };
+        size_t sizes[] = { 40, rng() % 5000, vec::parallel_grain };
+        for (size_t n : sizes) {
+            model m(n);
+            std::iota(m.begin(), m.end(), 0L);
+            vec v = vec::from_range(&alloc, m.begin(), m.end());
+            vec relaxed = v.slice(n / 3, n).concat(v.slice(0, n / 3));
+            for (const vec& each : { v, relaxed }) {
+                long sum = std::accumulate(m.begin(), m.end(), 0L);
+                check(each.fold(0L, add) == sum, "sequential fold");
+                check(each.map(same).count == n, "sequential map");
+                check(each.filter(all).count == n, "sequential filter");
+            }
+        }
+        check(!elsewhere, "small vectors stay on the calling thread");
+    }
+
+    static void run(unsigned seed)
+    {
+        running_seed = seed;
+        std::mt19937 rng(seed);
+        check_sequential(rng);
+        long next = 0;
+        for (int round = 0; round < 6; ++round) {
+            size_t n = rng() % (round < 3 ? 2000 : 200000);
+            model m;
+            typename vec::tvec t{ &alloc };
+            for (size_t i = 0; i < n; ++i) {
+                t.conj(next);
+                m.push_back(next++);
+            }
+            vec v = t.to_persistent();
+            check_all(v, m);
+
+            // relaxed trees, from concat and slice
+            vec relaxed = v.concat(v).slice(n / 3, n + n / 2);
+            model doubled = m;
+            doubled.insert(doubled.end(), m.begin(), m.end());
+            model relaxed_model(doubled.begin() + n / 3,
+                                doubled.begin() + n + n / 2);
+            check_all(relaxed, relaxed_model);
+
+            relaxed = relaxed.concat(
+              vec::from_range(&alloc, m.begin(), m.begin() + n / 7));
+            relaxed_model.insert(
+              relaxed_model.end(), m.begin(), m.begin() + n / 7);
+            check_all(relaxed, relaxed_model);
+        }
+    }
+};
+
+int
+main()
+{
+    for (unsigned seed = 1; seed <= 3; ++seed) {
+        running = "parallel, 2 bits";
+        parallel_test<2>::run(seed);
+        running = "parallel, 5 bits";
+        parallel_test<5>::run(seed);
+    }
+    puts("ok");
+    return 0;
+}
@@ -0,0 +1,178 @@
+// Randomized tests of vectors against std::vector: concat, slice,
+// insert_at, remove_at and transients on relaxed radix balanced trees.
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "collection_test.hpp"
+
+template<size_t Bits>
+struct vector_test
+{
+    typedef pvec<long, test_allocator, Bits> vec;
+    typedef std::vector<long> model;
+
+    // items under n at level, checking the size tables and that nodes
+    // without one are full
+    static size_t check_node(const typename vec::node_t* n, size_t level)
+    {
+        if (level == 0) {
+            return n->count;
+        }
+        auto in = static_cast<const typename vec::internal_node_t*>(n);
+        check(in->count <= vec::width, "vector node width");
+        size_t total = 0;
+        for (size_t i = 0; i < in->count; ++i) {
+            size_t items = check_node(in->children[i].get(), level - Bits);
+            total += items;
+            if (in->sizes) {
+                check(in->sizes->sums[i] == total, "vector size table");
+            } else if (i + 1 < in->count) {
+                check(items == vec::capacity(level - Bits),
+                      "vector balanced node");
+            }
+        }
+        return total;
+    }
+
+    static void same(const vec& v, const model& m)
+    {
+        check(v.count == m.size(), "vector count");
+        check(check_node(v.root.get(), v.shift) == v.tail_offset(),
+              "vector tree size");
+        for (size_t i = 0; i < m.size(); ++i) {
+            check(v.nth(i) == m[i], "vector nth");
+        }
+        size_t i = 0;
+        for (long item : v) {
+            check(item == m[i++], "vector iteration");
+        }
+        i = 0;
+        v.for_each_chunk([&](const typename vec::chunk& c) {
+            for (const long* item = c.begin(); item != c.end(); ++item) {
+                check(*item == m[i++], "vector chunks");
+            }
+        });
+    }
+
+    static void run(unsigned seed, int steps)
+    {
+        running_seed = seed;
+        std::mt19937 rng(seed);
+        std::vector<std::pair<vec, model>> pool{ { vec{ &alloc }, {} } };
+        long next = 0;
+
+        for (int step = 0; step < steps; ++step) {
+            auto& from = pool[rng() % pool.size()];
+            vec v = from.first;
+            model m = from.second;
+            size_t size = m.size();
+
+            switch (rng() % 9) {
+                case 0: {
+                    size_t n = rng() % (rng() % 2 ? 40 : 3000);
+                    for (size_t i = 0; i < n; ++i) {
+                        v = v.conj(next);
+                        m.push_back(next++);
+                    }
+                } break;
+                case 1: {
+                    auto& other = pool[rng() % pool.size()];
+                    v = v.concat(other.first);
+                    m.insert(m.end(), other.second.begin(), other.second.end());
+                } break;
+                case 2: {
+                    auto& other = pool[rng() % pool.size()];
+                    v = other.first.concat(v);
+                    m.insert(
+                      m.begin(), other.second.begin(), other.second.end());
+                } break;
+                case 3: {
+                    size_t first = rng() % (size + 1);
+                    size_t last = rng() % (size + 1);
+                    if (first > last) {
+                        std::swap(first, last);
+                    }
+                    v = v.slice(first, last);
+                    m = model(m.begin() + first, m.begin() + last);
+                } break;
+                case 4: {
+                    size_t i = rng() % (size + 1);
+                    v = v.insert_at(i, next);
+                    m.insert(m.begin() + i, next++);
+                } break;
+                case 5:
+                    if (size > 0) {
+                        size_t i = rng() % size;
+                        v = v.remove_at(i);
+                        m.erase(m.begin() + i);
+                    }
+                    break;
+                case 6: {
+                    size_t n = std::min<size_t>(size, rng() % 70 + 1);
+                    for (size_t i = 0; i < n; ++i) {
+                        v = v.pop();
+                        m.pop_back();
+                    }
+                } break;
+                case 7:
+                    if (size > 0) {
+                        size_t i = rng() % size;
+                        v = *v.assoc(i, -next);
+                        m[i] = -next++;
+                    }
+                    break;
+                case 8: {
+                    // from a const vector, which has to stay as it was
+                    const vec& source = v;
+                    auto t = source.as_transient();
+                    size_t n = rng() % 400;
+                    for (size_t i = 0; i < n; ++i) {
+                        if (rng() % 3 == 0 || m.empty()) {
+                            t.conj(next);
+                            m.push_back(next++);
+                        } else {
+                            size_t at = rng() % m.size();
+                            t.assoc_n(at, -next);
+                            m[at] = -next++;
+                        }
+                    }
+                    vec built = t.to_persistent();
+                    same(v, from.second);
+                    v = built;
+                    bool threw = false;
+                    try {
+                        t.conj(0);
+                    } catch (std::runtime_error&) {
+                        threw = true;
+                    }
+                    check(threw, "vector transient used after persistent");
+                } break;
+            }
+            if (m.size() > 200000) {
+                v = v.slice(0, 1000);
+                m.resize(1000);
+            }
+            same(v, m);
+            keep(pool, { v, m }, rng);
+            for (auto& version : pool) {
+                if (rng() % 50 == 0) {
+                    same(version.first, version.second);
+                }
+            }
+        }
+    }
+};
+
+int
+main()
+{
+    for (unsigned seed = 1; seed <= 3; ++seed) {
+        running = "vector, 2 bits";
+        vector_test<2>::run(seed, 1500);
+        running = "vector, 5 bits";
+        vector_test<5>::run(seed, 600);
+    }
+    puts("ok");
+    return 0;
+}
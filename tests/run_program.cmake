@@ -0,0 +1,48 @@
+# Runs one test program and compares what it prints with the files next to
+# it:
+#
+#   cmake -DFUNLANG=<exe> -DPROGRAM=<dir/name.fl> -DFLAGS=<options>
+#         -DRUNS=<n> -DCACHE_DIR=<dir> -P run_program.cmake
+#
+# name.out is the expected standard output. A program meant to fail has a
+# name.err holding its expected error output; any other has to exit with 0.
+# The program runs RUNS times against a cache directory that starts out
+# empty, so the later runs load what the first one cached.
+
+get_filename_component(dir "${PROGRAM}" DIRECTORY)
+get_filename_component(file "${PROGRAM}" NAME)
+get_filename_component(name "${PROGRAM}" NAME_WE)
+separate_arguments(flags UNIX_COMMAND "${FLAGS}")
+
+file(READ "${dir}/${name}.out" expected_out)
+set(expected_err "")
+if(EXISTS "${dir}/${name}.err")
+  file(READ "${dir}/${name}.err" expected_err)
+endif()
+
+file(REMOVE_RECURSE "${CACHE_DIR}")
+set(ENV{FUNLANG_CACHE_DIR} "${CACHE_DIR}")
+
+foreach(run RANGE 1 ${RUNS})
+  # run from the program's directory so traces name it the same everywhere
+  execute_process(COMMAND "${FUNLANG}" ${flags} "${file}"
+    WORKING_DIRECTORY "${dir}"
+    RESULT_VARIABLE status
+    OUTPUT_VARIABLE out
+    ERROR_VARIABLE err)
+
+  if(NOT out STREQUAL expected_out)
+    message(FATAL_ERROR "run ${run} of ${file} ${FLAGS} printed\n${out}\n"
+      "instead of\n${expected_out}\nwith errors\n${err}")
+  endif()
+  if(NOT err STREQUAL expected_err)
+    message(FATAL_ERROR "run ${run} of ${file} ${FLAGS} reported\n${err}\n"
+      "instead of\n${expected_err}")
+  endif()
+  if(expected_err STREQUAL "" AND NOT status EQUAL 0)
+    message(FATAL_ERROR "run ${run} of ${file} ${FLAGS} exited with ${status}")
+  endif()
+  if(NOT expected_err STREQUAL "" AND status EQUAL 0)
+    message(FATAL_ERROR "run ${run} of ${file} ${FLAGS} did not fail")
+  endif()
+endforeach()
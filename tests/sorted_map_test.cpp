@@ -0,0 +1,185 @@
+// Randomized tests of sorted maps against std::map, checking the B+ tree
+// stays balanced and filled through assoc, dissoc and transients.
+
+#include <functional>
+#include <map>
+
+#include "collection_test.hpp"
+
+template<size_t Bits>
+struct sorted_test
+{
+    typedef psorted_map<long, long, test_allocator, std::less<long>, Bits>
+      map;
+    typedef std::map<long, long> model;
+
+    // Checks the subtree under n, whose keys have to be in [low, high) where
+    // those are given, and returns its depth. Adds its entries to total.
+    static int check_node(const typename map::node_t* n,
+                          bool root,
+                          const long* low,
+                          const long* high,
+                          size_t& total)
+    {
+        check(n->count > 0 && n->count <= map::width, "sorted node count");
+        check(root || n->count >= map::min_count, "sorted node underfull");
+        if (map::is_leaf(n)) {
+            auto leaf = map::as_leaf(n);
+            for (size_t i = 0; i < n->count; ++i) {
+                long key = leaf->entries()[i].key;
+                check(!low || key >= *low, "sorted key above low bound");
+                check(!high || key < *high, "sorted key below high bound");
+                check(i == 0 || leaf->entries()[i - 1].key < key,
+                      "sorted leaf order");
+            }
+            total += n->count;
+            return 0;
+        }
+        auto in = map::as_internal(n);
+        check(!root || n->count >= 2, "sorted root with one child");
+        int depth = -1;
+        for (size_t i = 0; i < n->count; ++i) {
+            const long* child_low = i > 0 ? &in->keys()[i] : low;
+            const long* child_high = i + 1 < n->count ? &in->keys()[i + 1] : high;
+            if (i > 0 && i + 1 < n->count) {
+                check(in->keys()[i] < in->keys()[i + 1], "sorted key order");
+            }
+            int child = check_node(
+              in->children[i].get(), false, child_low, child_high, total);
+            check(depth < 0 || child == depth, "sorted leaves at one depth");
+            depth = child;
+        }
+        return depth + 1;
+    }
+
+    static void same(const map& v, const model& m)
+    {
+        size_t total = 0;
+        if (v.root) {
+            check_node(v.root.get(), true, nullptr, nullptr, total);
+        }
+        check(total == m.size() && v.count == m.size(), "sorted count");
+        auto it = m.begin();
+        for (auto& entry : v) {
+            check(it != m.end() && it->first == entry.key &&
+                    it->second == entry.val,
+                  "sorted iteration");
+            ++it;
+        }
+        check(it == m.end(), "sorted iteration count");
+    }
+
+    static void run(unsigned seed, int steps, long range)
+    {
+        running_seed = seed;
+        std::mt19937 rng(seed);
+        std::vector<std::pair<map, model>> pool{ { map{ &alloc }, {} } };
+
+        for (int step = 0; step < steps; ++step) {
+            auto& from = pool[rng() % pool.size()];
+            map v = from.first;
+            model m = from.second;
+            switch (rng() % 4) {
+                case 0:
+                    for (int n = rng() % 60; n > 0; --n) {
+                        long key = rng() % range;
+                        long val = rng();
+                        v = v.assoc(key, val);
+                        m[key] = val;
+                    }
+                    break;
+                case 1:
+                    for (int n = rng() % 60; n > 0; --n) {
+                        long key = rng() % range;
+                        map removed = v.dissoc(key);
+                        if (!m.count(key)) {
+                            check(removed.root.get() == v.root.get(),
+                                  "sorted dissoc of a missing key");
+                        }
+                        v = removed;
+                        m.erase(key);
+                    }
+                    break;
+                case 2: {
+                    auto t = v.as_transient();
+                    for (int n = rng() % 400; n > 0; --n) {
+                        long key = rng() % range;
+                        if (rng() % 3) {
+                            long val = rng();
+                            t.assoc(key, val);
+                            m[key] = val;
+                        } else {
+                            t.dissoc(key);
+                            m.erase(key);
+                        }
+                    }
+                    v = t.to_persistent();
+                } break;
+                case 3: {
+                    auto t = v.as_transient();
+                    for (auto it = m.begin(); it != m.end();) {
+                        if (rng() % 4) {
+                            t.dissoc(it->first);
+                            it = m.erase(it);
+                        } else {
+                            ++it;
+                        }
+                    }
+                    v = t.to_persistent();
+                } break;
+            }
+            same(v, m);
+            for (auto& version : pool) {
+                same(version.first, version.second);
+            }
+
+            for (int i = 0; i < 20; ++i) {
+                long key = rng() % (range + 2) - 1;
+                const long* val = v.find(key);
+                auto found = m.find(key);
+                check((val != nullptr) == (found != m.end()) &&
+                        (!val || *val == found->second),
+                      "sorted find");
+
+                auto at = v.lower_bound(key);
+                auto model_at = m.lower_bound(key);
+                for (int k = 0; k < 10 && model_at != m.end(); ++k) {
+                    check(at != v.end() && at->key == model_at->first,
+                          "sorted lower_bound");
+                    ++at;
+                    ++model_at;
+                }
+                check(model_at != m.end() || at == v.end(),
+                      "sorted lower_bound end");
+
+                long last = key + rng() % 20;
+                size_t in_range = 0;
+                v.for_each_in(key, last, [&](const typename map::entry& e) {
+                    check(e.key >= key && e.key < last, "sorted range bounds");
+                    ++in_range;
+                });
+                size_t model_in_range = 0;
+                for (auto it = m.lower_bound(key);
+                     it != m.end() && it->first < last;
+                     ++it) {
+                    ++model_in_range;
+                }
+                check(in_range == model_in_range, "sorted range count");
+            }
+            keep(pool, { v, m }, rng);
+        }
+    }
+};
+
+int
+main()
+{
+    for (unsigned seed = 1; seed <= 3; ++seed) {
+        running = "sorted map, 2 bits";
+        sorted_test<2>::run(seed, 800, 300);
+        running = "sorted map, 5 bits";
+        sorted_test<5>::run(seed, 300, 3000);
+    }
+    puts("ok");
+    return 0;
+}